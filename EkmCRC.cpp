@@ -58,6 +58,28 @@ static const uint16_t crcLUTforEkmMeters[256] = {
     0x8201, 0x42c0, 0x4380, 0x8341, 0x4100, 0x81c1, 0x8081, 0x4040
 };
 
+/*!
+ * \brief updateEkmCrc -- Add one byte to a CRC being computed as the bytes arrive.
+ * \param crc   CRC so far; EkmCrcInit before the first byte.
+ * \param byte  The next byte.
+ * \return The updated CRC.
+ */
+uint16_t updateEkmCrc(uint16_t crc, uint8_t byte)
+{
+    return (crc >> 8) ^ crcLUTforEkmMeters[(crc ^ byte) & 0xff];
+}
+
+/*!
+ * \brief finishEkmCrc -- Put a CRC computed by updateEkmCrc in the form sent by the meter.
+ * \param crc   CRC of all the bytes.
+ * \return The CRC as it appears in the message.
+ */
+uint16_t finishEkmCrc(uint16_t crc)
+{
+    crc = (crc << 8) | (crc >> 8);  // swap the bytes
+    return crc & 0x7f7f;
+}
+
 /*!
  * \brief computeEkmCrc
  * \param dat   Pointer to beginning of data over which to compute the CRC.
@@ -72,12 +94,11 @@ uint16_t computeEkmCrc(const uint8_t *dat, uint16_t len)
 
     while (len--)
     {
-        crc = (crc >> 8) ^ crcLUTforEkmMeters[(crc ^ *dat) & 0xff];
+        crc = updateEkmCrc(crc, *dat);
         dat++;
     }
 
-    crc = (crc << 8) | (crc >> 8);  // swap the bytes
-    crc &= 0x7f7f;
+    crc = finishEkmCrc(crc);
 
     qDebug("Return %04x", crc);
     return crc;
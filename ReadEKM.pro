@@ -21,7 +21,7 @@
 #
 #-------------------------------------------------
 
-QT       += core sql serialport
+QT       += core sql serialport network
 
 QT       -= gui
 
@@ -35,11 +35,62 @@ TEMPLATE = app
 SOURCES += main.cpp \
     ../SupportRoutines/supportfunctions.cpp \
     messages.cpp \
-    EkmCRC.cpp
+    EkmCRC.cpp \
+    fleetconfig.cpp \
+    clockskew.cpp \
+    capturetime.cpp \
+    framearchive.cpp \
+    storagesink.cpp \
+    mysqlsink.cpp \
+    sqlitesink.cpp \
+    meterfields.cpp \
+    publisher.cpp \
+    dbpool.cpp \
+    retention.cpp \
+    debuglog.cpp \
+    linestats.cpp \
+    frameparser.cpp \
+    serialparams.cpp \
+    transaction.cpp \
+    wiretrace.cpp \
+    handoff.cpp \
+    counters.cpp \
+    tcpgateway.cpp \
+    framecodec.cpp \
+    exporter.cpp \
+    tracer.cpp \
+    virtualclock.cpp \
+    simulator.cpp \
+    batchdecode.cpp
 
 HEADERS += \
     ../SupportRoutines/supportfunctions.h \
-    messages.h
+    messages.h \
+    fleetconfig.h \
+    clockskew.h \
+    capturetime.h \
+    framearchive.h \
+    meterreading.h \
+    storagesink.h \
+    meterfields.h \
+    publisher.h \
+    dbpool.h \
+    retention.h \
+    debuglog.h \
+    linestats.h \
+    frameparser.h \
+    serialparams.h \
+    transaction.h \
+    wiretrace.h \
+    handoff.h \
+    counters.h \
+    tcpgateway.h \
+    framecodec.h \
+    exporter.h \
+    tracer.h \
+    virtualclock.h \
+    simulator.h \
+    batchdecode.h
 
 DISTFILES += \
     DoLink.sh \
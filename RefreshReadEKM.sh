@@ -1,7 +1,7 @@
 #!/bin/bash
 #
 #
-#    GetArchiveTag.sh -- Shell script to kill and restart ReadEKM program every day at 0705.
+#    RefreshReadEKM.sh -- Shell script to restart ReadEKM program every day at 0705.
 #    Copyright (C) 2015  Thomas A. DeMay
 #
 #    This program is free software; you can redistribute it and/or modify
@@ -21,35 +21,23 @@
 # */
 #
 #  This script creates a special file in the user's home directory that the
-# program looks for.  When found, the program quits gracefully.
+# program looks for.  When found, right after its next read, the program
+# hands its state over to a fresh copy of the executable it was started as
+# (see handoff.h), so a new version is picked up without missing a reading.
+# If the program is not running, it is started.
 #
 #    Script is run in the source directory.
 #
 
-declare -i waitCount=20     #  Will cause us to give up clean quit after 200 seconds.
 # Get pid of ReadEKM process -- look for "ReadEKM" surrounded by word breaks.
 #         Not just "ReadEKM" because that could be in some other process.
 # wpid is NOT empty if the ReadEKM application is running, and the status is true.
 if wpid=$(ps -AcU"tom" | grep "\<ReadEKM\>")
 then
-    touch $HOME/.CloseReadEKM       # Create .CloseReadEKM file if not exist.
-    while wpid=$(ps -AcU"tom" | grep "\<ReadEKM\>")
-    do      ##  Wait for ReadEKM program to see .CloseReadEKM file and quit.
-        sleep 10
-        ## But don't wait forever.
-        if [ $((--waitCount)) -lt 0 ]; then break; fi
-    done
-fi
-
-# if wpid is not empty, clean termination above did not work.
-if [ -n "$wpid" ]; then
-    wpid=$(echo $wpid | cut -d" " -f1)  # Extract the pid
-    kill $wpid                          # kill the process
-    rm $HOME/.CloseReadEKM    # remove the .CloseReadEKM file
-                                        # so it won't kill the process
-                                        # immediately after starting.
-    # sleep for 10 seconds
-    sleep 10
+    touch $HOME/.RestartReadEKM     # Create .RestartReadEKM file if not exist.
+    # Reschedule this script to run at 0705 tomorrow.
+    at -fRefreshReadEKM.sh 0705 >/dev/null 2>&1
+    exit 0
 fi
 
 #  Sleep till 1 sec after the next minute.
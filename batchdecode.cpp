@@ -0,0 +1,418 @@
+/*!
+@file
+@brief Batch decoder of the numeric fields of many responses at once.
+
+@author Thomas A. DeMay
+@date 2015
+@par    Copyright (C) 2015  Thomas A. DeMay
+@par
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    any later version.
+@par
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+@par
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include "batchdecode.h"
+#include "frameparser.h"
+#include <string.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define BATCH_DECODE_X86
+#include <immintrin.h>
+#endif
+
+static const int BatchWindow = 8;       //!< Bytes read for each field; no numeric field is longer.
+
+typedef struct
+{
+    int offset;         //!< Index of the first character of the field in the response.
+    int length;         //!< Number of characters in the field.
+    int window;         //!< Index of the BatchWindow bytes ending with the field's last character.
+    quint64 keepMask;   //!< The bytes of the window that are the field, in memory order.
+} KernelField;
+
+typedef void (*KernelFunction)(const uint8_t *const *frames, const int first, const int count
+                               , const KernelField *fields, const int fieldCount
+                               , qint32 *const *digits, quint8 *const *valid);
+
+/*!
+ * \brief DecodeScalar -- Decode fields a character at a time, as MeterFieldNumber() does.
+ * \param frames        The responses.
+ * \param first         First to decode.
+ * \param count         Number of responses.
+ * \param fields        The fields to decode.
+ * \param fieldCount    Number of fields.
+ * \param digits        Column of each field to receive the digits.
+ * \param valid         Column of each field to receive whether the field was all digits.
+ */
+static void DecodeScalar(const uint8_t *const *frames, const int first, const int count
+                         , const KernelField *fields, const int fieldCount
+                         , qint32 *const *digits, quint8 *const *valid)
+{
+    for (int r = first; r < count; r++)
+    {
+        for (int f = 0; f < fieldCount; f++)
+        {
+            const uint8_t *p = frames[r] + fields[f].offset;
+            qint32 value = 0;
+            quint8 ok = 1;
+            for (int i = 0; i < fields[f].length; i++)
+            {
+                if ((p[i] < '0') || (p[i] > '9'))
+                {
+                    ok = 0;
+                    value = 0;
+                    break;
+                }
+                value = value * 10 + (p[i] - '0');
+            }
+            digits[f][r] = value;
+            valid[f][r] = ok;
+        }
+    }
+}
+
+#ifdef BATCH_DECODE_X86
+/*!
+ * \brief LoadWindow -- The BatchWindow bytes of a field.
+ * \param frame     The response.
+ * \param field     The field.
+ * \return The bytes, the first in the low byte.
+ */
+static inline long long LoadWindow(const uint8_t *frame, const KernelField &field)
+{
+    long long window;
+    memcpy(&window, frame + field.window, sizeof(window));
+    return window;
+}
+
+/*!
+ * \brief DecodeSse41 -- Decode fields of two responses at a time with SSE4.1; see DecodeScalar().
+ *
+ * The low half of a register holds the window of one response, the high half
+ * the other's.  Leftover responses are decoded by DecodeScalar().
+ */
+__attribute__((target("sse4.1")))
+static void DecodeSse41(const uint8_t *const *frames, const int first, const int count
+                        , const KernelField *fields, const int fieldCount
+                        , qint32 *const *digits, quint8 *const *valid)
+{
+    const __m128i zeros = _mm_set1_epi8('0');
+    const __m128i nines = _mm_set1_epi8(9);
+    const __m128i tens = _mm_set1_epi16(0x010a);           // Bytes 10, 1: pairs of digits.
+    const __m128i hundreds = _mm_set1_epi32(0x00010064);   // Words 100, 1: groups of four.
+    const __m128i tenThousands = _mm_set1_epi32(0x00012710);   // Words 10000, 1: groups of eight.
+    int r = first;
+    for (; (r + 2) <= count; r += 2)
+    {
+        for (int f = 0; f < fieldCount; f++)
+        {
+            const KernelField &field = fields[f];
+            __m128i bytes = _mm_set_epi64x(LoadWindow(frames[r + 1], field), LoadWindow(frames[r], field));
+            __m128i values = _mm_and_si128(_mm_sub_epi8(bytes, zeros), _mm_set1_epi64x((long long)field.keepMask));
+            int digitBits = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_min_epu8(values, nines), values));
+            values = _mm_maddubs_epi16(values, tens);
+            values = _mm_madd_epi16(values, hundreds);
+            values = _mm_packus_epi32(values, values);
+            values = _mm_madd_epi16(values, tenThousands);
+            bool ok0 = ((digitBits & 0x00ff) == 0x00ff);
+            bool ok1 = ((digitBits & 0xff00) == 0xff00);
+            digits[f][r] = ok0 ? _mm_cvtsi128_si32(values) : 0;
+            digits[f][r + 1] = ok1 ? _mm_extract_epi32(values, 1) : 0;
+            valid[f][r] = ok0;
+            valid[f][r + 1] = ok1;
+        }
+    }
+    DecodeScalar(frames, r, count, fields, fieldCount, digits, valid);
+}
+
+/*!
+ * \brief DecodeAvx2 -- Decode fields of four responses at a time with AVX2; see DecodeScalar().
+ *
+ * Each 128 bit lane works as DecodeSse41() does on two responses.
+ * Leftover responses are decoded by DecodeScalar().
+ */
+__attribute__((target("avx2")))
+static void DecodeAvx2(const uint8_t *const *frames, const int first, const int count
+                       , const KernelField *fields, const int fieldCount
+                       , qint32 *const *digits, quint8 *const *valid)
+{
+    const __m256i zeros = _mm256_set1_epi8('0');
+    const __m256i nines = _mm256_set1_epi8(9);
+    const __m256i tens = _mm256_set1_epi16(0x010a);
+    const __m256i hundreds = _mm256_set1_epi32(0x00010064);
+    const __m256i tenThousands = _mm256_set1_epi32(0x00012710);
+    int r = first;
+    qint32 lanes[8];
+    for (; (r + 4) <= count; r += 4)
+    {
+        for (int f = 0; f < fieldCount; f++)
+        {
+            const KernelField &field = fields[f];
+            __m256i bytes = _mm256_set_epi64x(LoadWindow(frames[r + 3], field), LoadWindow(frames[r + 2], field)
+                                              , LoadWindow(frames[r + 1], field), LoadWindow(frames[r], field));
+            __m256i values = _mm256_and_si256(_mm256_sub_epi8(bytes, zeros), _mm256_set1_epi64x((long long)field.keepMask));
+            unsigned int digitBits = (unsigned int)_mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_min_epu8(values, nines), values));
+            values = _mm256_maddubs_epi16(values, tens);
+            values = _mm256_madd_epi16(values, hundreds);
+            values = _mm256_packus_epi32(values, values);
+            values = _mm256_madd_epi16(values, tenThousands);
+            _mm256_storeu_si256((__m256i *)lanes, values);
+            static const int lane[4] = {0, 1, 4, 5};
+            for (int k = 0; k < 4; k++)
+            {
+                bool ok = (((digitBits >> (8 * k)) & 0xff) == 0xff);
+                digits[f][r + k] = ok ? lanes[lane[k]] : 0;
+                valid[f][r + k] = ok;
+            }
+        }
+    }
+    DecodeScalar(frames, r, count, fields, fieldCount, digits, valid);
+}
+#endif
+
+/*!
+ * \brief BestBatchKernel -- The fastest kernel the processor has.
+ * \return The kernel.
+ */
+BatchKernel BestBatchKernel()
+{
+#ifdef BATCH_DECODE_X86
+    static const BatchKernel best = __builtin_cpu_supports("avx2") ? BatchKernelAvx2
+                                  : (__builtin_cpu_supports("sse4.1") ? BatchKernelSse41 : BatchKernelScalar);
+    return best;
+#else
+    return BatchKernelScalar;
+#endif
+}
+
+/*!
+ * \brief BatchKernelName -- Name of a kernel, for the log.
+ * \param kernel    The kernel.
+ * \return The name.
+ */
+const char *BatchKernelName(const BatchKernel kernel)
+{
+    switch (kernel)
+    {
+    case BatchKernelSse41:
+        return "sse4.1";
+    case BatchKernelAvx2:
+        return "avx2";
+    case BatchKernelBest:
+        return BatchKernelName(BestBatchKernel());
+    default:
+        return "scalar";
+    }
+}
+
+FrameBatchDecoder::FrameBatchDecoder()
+    : fields(NULL)
+    , fieldCount(0)
+{
+}
+
+/*!
+ * \brief FrameBatchDecoder::FrameBatchDecoder -- A decoder of some of the numeric fields of a data type.
+ * \param dataType      '3' for v.3 response, 'A' or 'B' for v.4 responses.
+ * \param fieldIndexes  Fields to decode, by index in the MeterFieldTable(); all the numeric fields if empty.
+ *                      Text fields are left out.
+ */
+FrameBatchDecoder::FrameBatchDecoder(const uint8_t dataType, const QVector<int> &fieldIndexes)
+{
+    fields = MeterFieldTable(dataType, &fieldCount);
+    for (int i = 0; i < fieldCount; i++)
+    {
+        if ((fields[i].kind == FieldText) || (!fieldIndexes.isEmpty() && !fieldIndexes.contains(i)))
+            continue;
+        Q_ASSERT((fields[i].length <= BatchWindow) && ((fields[i].sqlOffset - 1 + fields[i].length) >= BatchWindow));
+        decoded.append(i);
+    }
+}
+
+/*!
+ * \brief FrameBatchDecoder::decode -- Decode the fields of a batch of responses.
+ *
+ * The responses are taken a few at a time, and all the fields of those decoded
+ * before going on, so each response is read once.
+ *
+ * \param frames    The responses, all of the decoder's data type.
+ * \param columns   Receives the columns; those of fields not decoded are empty.
+ * \param kernel    Kernel to use; one the processor doesn't have falls back to the best it has.
+ */
+void FrameBatchDecoder::decode(const QVector<const uint8_t *> &frames, DecodedColumns *columns, BatchKernel kernel) const
+{
+    const int count = frames.size();
+    columns->rows = count;
+    columns->digits.resize(fieldCount);
+    columns->valid.resize(fieldCount);
+    QVector<KernelField> kernelFields(decoded.size());
+    QVector<qint32 *> digits(decoded.size());
+    QVector<quint8 *> valid(decoded.size());
+    for (int f = 0; f < decoded.size(); f++)
+    {
+        const MeterField &field = fields[decoded[f]];
+        KernelField &kernelField = kernelFields[f];
+        kernelField.offset = field.sqlOffset - 1;
+        kernelField.length = field.length;
+        kernelField.window = kernelField.offset + field.length - BatchWindow;
+        kernelField.keepMask = ~0ull << (8 * (BatchWindow - field.length));
+        columns->digits[decoded[f]].resize(count);
+        columns->valid[decoded[f]].resize(count);
+        digits[f] = columns->digits[decoded[f]].data();
+        valid[f] = columns->valid[decoded[f]].data();
+    }
+    if ((kernel == BatchKernelBest) || (kernel > BestBatchKernel()))
+        kernel = BestBatchKernel();
+    KernelFunction function = DecodeScalar;
+#ifdef BATCH_DECODE_X86
+    if (kernel == BatchKernelAvx2)
+        function = DecodeAvx2;
+    else if (kernel == BatchKernelSse41)
+        function = DecodeSse41;
+#endif
+    function(frames.constData(), 0, count, kernelFields.constData(), kernelFields.size(), digits.data(), valid.data());
+}
+
+/*!
+ * \brief BatchFieldNumber -- Value of a decoded numeric field; the same as MeterFieldNumber() gives.
+ * \param columns       The decoded columns.
+ * \param fields        Field table of the data type.
+ * \param field         The field, by index in fields; must have been decoded.
+ * \param row           The response, by index in the batch.
+ * \param kwhDecimals   Decimal places of FieldKwh fields; see KwhDecimals().
+ * \return The value; NaN if the field has anything but digits.
+ */
+double BatchFieldNumber(const DecodedColumns &columns, const MeterField *fields, const int field, const int row, const int kwhDecimals)
+{
+    if (!columns.valid[field][row])
+        return qQNaN();
+    qint64 digits = columns.digits[field][row];
+    static const double scale[] = {1.0, 10.0, 100.0, 1000.0};
+    return digits / scale[(fields[field].kind == FieldKwh) ? kwhDecimals : fields[field].decimals];
+}
+
+/*!
+ * \brief SameValue -- Whether two values are the same to the bit, NaN being the same as NaN.
+ * \param a     One value.
+ * \param b     The other.
+ * \return true if they are.
+ */
+static bool SameValue(const double a, const double b)
+{
+    if (qIsNaN(a) || qIsNaN(b))
+        return qIsNaN(a) && qIsNaN(b);
+    return memcmp(&a, &b, sizeof(a)) == 0;
+}
+
+/*!
+ * \brief BenchmarkBatchDecode -- Check and time the kernels on made up responses; report on stdout.
+ *
+ * The responses are random digits, with a stray character in one field of
+ * about one in a hundred, and a random kWh decimal places in A responses.
+ *
+ * \param frames    Responses of each data type.
+ * \return Program exit status: 0 if every kernel matched the reference, 1 otherwise.
+ */
+int BenchmarkBatchDecode(const int frames)
+{
+    qDebug("Begin");
+    static const uint8_t dataTypes[] = {'3', 'A', 'B'};
+    static const qint64 minimumNSecs = 200000000;      // Repeat each timing for at least this long.
+    QTextStream out(stdout);
+    QList<BatchKernel> kernels;
+    for (int k = BatchKernelScalar; k <= BestBatchKernel(); k++)
+        kernels << (BatchKernel)k;
+    out << QString("Decoding %1 made up responses of each data type; best kernel is %2.\n")
+           .arg(frames).arg(BatchKernelName(BatchKernelBest));
+    qsrand(1);
+    bool allSame = true;
+    for (unsigned int t = 0; t < sizeof(dataTypes); t++)
+    {
+        const uint8_t dataType = dataTypes[t];
+        FrameBatchDecoder decoder(dataType);
+        int fieldCount;
+        const MeterField *fields = MeterFieldTable(dataType, &fieldCount);
+        QByteArray buffer(frames * FrameSize, '0');
+        QVector<const uint8_t *> pointers(frames);
+        for (int r = 0; r < frames; r++)
+        {
+            uint8_t *frame = (uint8_t *)buffer.data() + r * FrameSize;
+            for (int i = 0; i < FrameSize; i++)
+                frame[i] = '0' + (qrand() % 10);
+            if (dataType == 'A')
+                ((ResponseV4AData *)frame)->kwhDecimals[0] = '0' + (qrand() % 3);
+            if ((qrand() % 100) == 0)
+            {
+                const MeterField &field = fields[decoder.decodedFields()[qrand() % decoder.decodedFields().size()]];
+                frame[field.sqlOffset - 1 + (qrand() % field.length)] = " .-:"[qrand() % 4];
+            }
+            pointers[r] = frame;
+        }
+
+        /* The reference kernel against MeterFieldNumber(). */
+        DecodedColumns reference;
+        decoder.decode(pointers, &reference, BatchKernelScalar);
+        qint64 mismatches = 0;
+        for (int r = 0; r < frames; r++)
+        {
+            int kwhDecimals = KwhDecimals(dataType, pointers[r]);
+            foreach (int field, decoder.decodedFields())
+                if (!SameValue(BatchFieldNumber(reference, fields, field, r, kwhDecimals)
+                               , MeterFieldNumber(pointers[r], fields[field], kwhDecimals)))
+                    mismatches++;
+        }
+        allSame = allSame && (mismatches == 0);
+        out << QString("%1: %2 numeric fields; scalar kernel %3 MeterFieldNumber().\n")
+               .arg(DataTypeName(dataType)).arg(decoder.decodedFields().size())
+               .arg(mismatches ? QString("differs in %1 fields from").arg(mismatches) : QString("matches"));
+
+        /* What reading the responses costs at best. */
+        QByteArray copy(buffer.size(), '\0');
+        QElapsedTimer timer;
+        int passes = 0;
+        timer.start();
+        do
+        {
+            memcpy(copy.data(), buffer.constData(), buffer.size());
+            passes++;
+        } while (timer.nsecsElapsed() < minimumNSecs);
+        const double copyMBPerSec = (double)buffer.size() * passes / (timer.nsecsElapsed() / 1e9) / 1e6;
+        out << QString("    memcpy   %1 MB/s\n").arg(copyMBPerSec, 0, 'f', 0);
+
+        foreach (BatchKernel kernel, kernels)
+        {
+            DecodedColumns columns;
+            passes = 0;
+            timer.start();
+            do
+            {
+                decoder.decode(pointers, &columns, kernel);
+                passes++;
+            } while (timer.nsecsElapsed() < minimumNSecs);
+            const double seconds = timer.nsecsElapsed() / 1e9;
+            bool same = true;
+            foreach (int field, decoder.decodedFields())
+                same = same && (columns.digits[field] == reference.digits[field]) && (columns.valid[field] == reference.valid[field]);
+            allSame = allSame && same;
+            out << QString("    %1 %2 MB/s, %3 M responses/s, %4 M fields/s; %5\n")
+                   .arg(QString(BatchKernelName(kernel)), -8)
+                   .arg((double)buffer.size() * passes / seconds / 1e6, 0, 'f', 0)
+                   .arg(frames * (double)passes / seconds / 1e6, 0, 'f', 2)
+                   .arg(frames * (double)passes * decoder.decodedFields().size() / seconds / 1e6, 0, 'f', 1)
+                   .arg(same ? "identical to scalar" : "DIFFERS from scalar");
+        }
+    }
+    out.flush();
+    qDebug("Return %d", allSame ? 0 : 1);
+    return allSame ? 0 : 1;
+}
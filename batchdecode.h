@@ -0,0 +1,106 @@
+/*!
+@file
+@brief Header file describing the batch decoder of the numeric fields of many responses at once.
+
+Exporting, backfilling and checking stored responses turns millions of
+fixed width decimal fields (totalKwh[8], volts1[4], amps1[5], watts1[7],
+pulseCount1[8], ...) into numbers.  Done a field at a time by
+MeterFieldNumber() that is a loop, a test and a multiply per character.
+A FrameBatchDecoder does it for a batch of responses of one data type in
+one pass over them, into a column of integers for each field decoded
+(structure of arrays), checking the characters are digits as it goes.
+
+Every numeric field is at most 8 characters, so each is read as the 8
+bytes ending with its last character, the bytes before it masked off.  The
+work is done by a kernel chosen when the program runs:
+
+    avx2        four responses at a time, on x86 processors with AVX2
+    sse4.1      two responses at a time, on x86 processors with SSE4.1
+    scalar      a character at a time, as MeterFieldNumber() does; the
+                reference the others must match, and the fallback elsewhere
+
+The vector kernels subtract '0' from all the bytes at once, check each is at
+most 9, and combine the digits pairwise by multiplying and adding (10, 100,
+then 10000), so an 8 digit field takes three multiply-adds instead of eight
+steps.
+
+The columns hold the digits of each field as an integer, and whether the
+field was all digits; BatchFieldNumber() scales them as MeterFieldNumber()
+does, so the values are the same to the bit.  --benchmark-decode <count>
+decodes that many made up responses of each data type with each kernel the
+processor has, checks the results are identical to the scalar kernel's and
+the scalar kernel's to MeterFieldNumber(), and reports the speed of each
+against that of copying the responses.
+
+@author Thomas A. DeMay
+@date 2015
+@par    Copyright (C) 2015  Thomas A. DeMay
+@par
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    any later version.
+@par
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+@par
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#ifndef BATCHDECODE_H
+#define BATCHDECODE_H
+#include <QtCore>
+#include "meterfields.h"
+
+static const int BatchDefaultBenchmarkFrames = 200000;     //!< Default responses of each data type for --benchmark-decode.
+
+typedef enum
+{
+    BatchKernelScalar,      //!< A character at a time; the reference.
+    BatchKernelSse41,       //!< Two responses at a time with SSE4.1.
+    BatchKernelAvx2,        //!< Four responses at a time with AVX2.
+    BatchKernelBest         //!< The fastest the processor has.
+} BatchKernel;
+
+/*!
+ * \brief The DecodedColumns class -- Numeric fields of a batch of responses, a column per field.
+ *
+ * Columns are indexed by the field's index in its MeterFieldTable(); those of
+ * fields not decoded are empty.
+ */
+class DecodedColumns
+{
+public:
+    int rows;                           //!< Responses decoded.
+    QVector<QVector<qint32> > digits;   //!< Digits of the field as an integer, by row; 0 if not all digits.
+    QVector<QVector<quint8> > valid;    //!< 1 if the field was all digits, by row.
+};
+
+/*!
+ * \brief The FrameBatchDecoder class -- Decodes the numeric fields of batches of responses of one data type.
+ */
+class FrameBatchDecoder
+{
+public:
+    FrameBatchDecoder();
+    FrameBatchDecoder(const uint8_t dataType, const QVector<int> &fieldIndexes = QVector<int>());
+
+    void decode(const QVector<const uint8_t *> &frames, DecodedColumns *columns, BatchKernel kernel = BatchKernelBest) const;
+    const QVector<int> &decodedFields() const { return decoded; }
+
+private:
+    const MeterField *fields;   //!< Field table of the data type.
+    int fieldCount;             //!< Entries in it.
+    QVector<int> decoded;       //!< Numeric fields decoded, by index in fields.
+};
+
+BatchKernel BestBatchKernel();
+const char *BatchKernelName(const BatchKernel kernel);
+double BatchFieldNumber(const DecodedColumns &columns, const MeterField *fields, const int field, const int row, const int kwhDecimals);
+int BenchmarkBatchDecode(const int frames);
+
+#endif // BATCHDECODE_H
@@ -0,0 +1,88 @@
+/*!
+@file
+@brief Take and format response capture time stamps.
+
+@author Thomas A. DeMay
+@date 2015
+@par    Copyright (C) 2015  Thomas A. DeMay
+@par
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    any later version.
+@par
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+@par
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include "capturetime.h"
+#include <time.h>
+#include "virtualclock.h"
+
+/*!
+ * \brief CaptureTimeNow -- Read the monotonic and wall clocks.
+ *
+ * Both are read from the virtual clock (virtualclock.h) while it is active.
+ *
+ * \return The current time on both clocks.
+ */
+CaptureTime CaptureTimeNow()
+{
+    if (SimClock.isActive())
+        return SimClock.captureTime();
+    struct timespec ts;
+    CaptureTime captureTime;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    captureTime.monotonicNSecs = ts.tv_sec * 1000000000ll + ts.tv_nsec;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    captureTime.wallUSecs = ts.tv_sec * 1000000ll + ts.tv_nsec / 1000;
+    return captureTime;
+}
+
+/*!
+ * \brief CaptureTimeToSql -- Format the wall clock time for use as FROM_UNIXTIME() argument.
+ *
+ * Formatted as a decimal string so that no precision is lost to floating point.
+ *
+ * \param captureTime   The time stamp.
+ * \return Seconds since the epoch with six decimal places.
+ */
+QString CaptureTimeToSql(const CaptureTime &captureTime)
+{
+    return QString("%1.%2")
+            .arg(captureTime.wallUSecs / 1000000ll)
+            .arg(captureTime.wallUSecs % 1000000ll, 6, 10, QChar('0'));
+}
+
+/*!
+ * \brief CaptureTimeToUtcText -- Format the wall clock time as UTC date and time text.
+ *
+ * Suitable for DATETIME(6) columns and SQLite text columns.
+ *
+ * \param captureTime   The time stamp.
+ * \return UTC time as "yyyy-MM-dd HH:mm:ss.uuuuuu".
+ */
+QString CaptureTimeToUtcText(const CaptureTime &captureTime)
+{
+    return QDateTime::fromMSecsSinceEpoch(captureTime.wallUSecs / 1000ll, Qt::UTC).toString("yyyy-MM-dd HH:mm:ss")
+            + QString(".%1").arg(captureTime.wallUSecs % 1000000ll, 6, 10, QChar('0'));
+}
+
+/*!
+ * \brief CaptureTimeToDateTime -- Convert the wall clock time to a QDateTime.
+ *
+ * QDateTime only has millisecond precision.
+ *
+ * \param captureTime   The time stamp.
+ * \return The wall clock time.
+ */
+QDateTime CaptureTimeToDateTime(const CaptureTime &captureTime)
+{
+    return QDateTime::fromMSecsSinceEpoch(captureTime.wallUSecs / 1000ll);
+}
@@ -0,0 +1,43 @@
+/*!
+@file
+@brief Header file describing the time stamp taken when a response is captured.
+
+The time stamp is taken when the last byte of a response arrives, and travels
+with the response so that rates computed from successive responses do not
+depend on how long it took to store them.
+
+@author Thomas A. DeMay
+@date 2015
+@par    Copyright (C) 2015  Thomas A. DeMay
+@par
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    any later version.
+@par
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+@par
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#ifndef CAPTURETIME_H
+#define CAPTURETIME_H
+#include <QtCore>
+
+typedef struct
+{
+    qint64 monotonicNSecs;      //!< Nanoseconds on the monotonic clock; for intervals within this process.
+    qint64 wallUSecs;           //!< Microseconds since the epoch on the wall clock.
+} CaptureTime;
+
+CaptureTime CaptureTimeNow();
+QString CaptureTimeToSql(const CaptureTime &captureTime);
+QString CaptureTimeToUtcText(const CaptureTime &captureTime);
+QDateTime CaptureTimeToDateTime(const CaptureTime &captureTime);
+
+#endif // CAPTURETIME_H
@@ -0,0 +1,178 @@
+/*!
+@file
+@brief Estimate the skew and drift of meter clocks.
+
+@author Thomas A. DeMay
+@date 2015
+@par    Copyright (C) 2015  Thomas A. DeMay
+@par
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    any later version.
+@par
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+@par
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include "clockskew.h"
+
+extern QTimeZone LocalStandardTimeZone;
+
+double MaxClockSkew = 10.0;
+const double ClockSkewEstimator::decay = 0.99;
+
+/*!
+ * \brief MeterTimeToDateTime -- Convert the date and time in a meter response.
+ *
+ * Meters are kept on local standard time.
+ *
+ * \param dateTime  Date and time from the meter response.
+ * \return The meter's date and time.
+ */
+QDateTime MeterTimeToDateTime(const meterDateTime &dateTime)
+{
+    return QDateTime(
+                QDate(  QByteArray((char *)dateTime.year, 2).toInt() + 2000
+                        , QByteArray((char *)dateTime.month, 2).toInt()
+                        , QByteArray((char *)dateTime.day, 2).toInt())
+                , QTime(QByteArray((char *)dateTime.hour, 2).toInt()
+                        , QByteArray((char *)dateTime.minute, 2).toInt()
+                        , QByteArray((char *)dateTime.second, 2).toInt())
+                , LocalStandardTimeZone);
+}
+
+ClockSkewEstimator::ClockSkewEstimator()
+    : referenceMSecs(0)
+    , sumW(0), sumWT(0), sumWS(0), sumWTT(0), sumWTS(0)
+    , priorDriftRate(0)
+    , lastSampleSkew(0)
+    , numSamples(0)
+    , numTimeSets(0)
+{
+}
+
+/*!
+ * \brief ClockSkewEstimator::addSample -- Add a meter time observation.
+ *
+ * The meter reports whole seconds, so half a second is added to its time
+ * to remove the bias of truncation.
+ *
+ * \param captureMSecs  Computer time (msec since epoch) when the response was captured.
+ * \param meterMSecs    Meter time (msec since epoch) from the response.
+ */
+void ClockSkewEstimator::addSample(const qint64 captureMSecs, const qint64 meterMSecs)
+{
+    if ((numSamples == 0) && (referenceMSecs == 0))
+        referenceMSecs = captureMSecs;
+    double t = (captureMSecs - referenceMSecs) / 1000.0;
+    double skew = ((meterMSecs + 500) - captureMSecs) / 1000.0;
+
+    sumW = sumW * decay + 1.0;
+    sumWT = sumWT * decay + t;
+    sumWS = sumWS * decay + skew;
+    sumWTT = sumWTT * decay + t * t;
+    sumWTS = sumWTS * decay + t * skew;
+    lastSampleSkew = skew;
+    numSamples++;
+}
+
+/*!
+ * \brief ClockSkewEstimator::clockWasSet -- Note that the meter clock was just set.
+ *
+ * The skew starts over from zero; the drift rate is remembered.
+ *
+ * \param setMSecs  Computer time (msec since epoch) when the clock was set.
+ */
+void ClockSkewEstimator::clockWasSet(const qint64 setMSecs)
+{
+    priorDriftRate = driftRate();
+    referenceMSecs = setMSecs;
+    sumW = sumWT = sumWS = sumWTT = sumWTS = 0;
+    lastSampleSkew = 0;
+    numSamples = 0;
+    numTimeSets++;
+}
+
+/*!
+ * \brief ClockSkewEstimator::driftRate -- Rate the meter clock gains on the computer clock.
+ *
+ * Until the samples span enough time to give a meaningful slope,
+ * the rate from before the last time set is used.
+ *
+ * \return Drift rate in seconds per second; positive if the meter clock is fast.
+ */
+double ClockSkewEstimator::driftRate() const
+{
+    /* The meter only reports whole seconds; require the samples to have a
+     * standard deviation in time of at least 15 minutes before trusting the slope. */
+    static const double minTimeVariance = 900.0 * 900.0;
+    if (numSamples < 10)
+        return priorDriftRate;
+    double meanT = sumWT / sumW;
+    double varT = sumWTT / sumW - meanT * meanT;
+    if (varT < minTimeVariance)
+        return priorDriftRate;
+    return (sumWTS / sumW - meanT * (sumWS / sumW)) / varT;
+}
+
+/*!
+ * \brief ClockSkewEstimator::predictedSkew -- Predict the skew of the meter clock at a given time.
+ * \param atMSecs   Computer time (msec since epoch) for which to predict.
+ * \return Predicted skew in seconds; positive if the meter clock is ahead.
+ */
+double ClockSkewEstimator::predictedSkew(const qint64 atMSecs) const
+{
+    double t = (atMSecs - referenceMSecs) / 1000.0;
+    double rate = driftRate();
+    if (numSamples == 0)
+        return rate * t;
+    double meanT = sumWT / sumW;
+    double meanS = sumWS / sumW;
+    return meanS + rate * (t - meanT);
+}
+
+/*!
+ * \brief ClockSkewEstimator::saveState -- The estimate, for the restart state file.
+ * \return The estimate as a JSON object.
+ */
+QJsonObject ClockSkewEstimator::saveState() const
+{
+    QJsonObject state;
+    state.insert("referenceMSecs", QString::number(referenceMSecs));
+    QJsonArray sums;
+    sums << sumW << sumWT << sumWS << sumWTT << sumWTS;
+    state.insert("sums", sums);
+    state.insert("priorDriftRate", priorDriftRate);
+    state.insert("lastSampleSkew", lastSampleSkew);
+    state.insert("numSamples", numSamples);
+    state.insert("numTimeSets", numTimeSets);
+    return state;
+}
+
+/*!
+ * \brief ClockSkewEstimator::restoreState -- Take back an estimate made by saveState().
+ * \param state     The estimate.
+ */
+void ClockSkewEstimator::restoreState(const QJsonObject &state)
+{
+    QJsonArray sums = state.value("sums").toArray();
+    if (sums.size() != 5)
+        return;
+    referenceMSecs = state.value("referenceMSecs").toString().toLongLong();
+    sumW = sums.at(0).toDouble();
+    sumWT = sums.at(1).toDouble();
+    sumWS = sums.at(2).toDouble();
+    sumWTT = sums.at(3).toDouble();
+    sumWTS = sums.at(4).toDouble();
+    priorDriftRate = state.value("priorDriftRate").toDouble();
+    lastSampleSkew = state.value("lastSampleSkew").toDouble();
+    numSamples = state.value("numSamples").toInt();
+    numTimeSets = state.value("numTimeSets").toInt();
+}
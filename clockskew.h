@@ -0,0 +1,67 @@
+/*!
+@file
+@brief Header file describing the meter clock skew estimator.
+
+@author Thomas A. DeMay
+@date 2015
+@par    Copyright (C) 2015  Thomas A. DeMay
+@par
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    any later version.
+@par
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+@par
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#ifndef CLOCKSKEW_H
+#define CLOCKSKEW_H
+#include <QtCore>
+#include "messages.h"
+
+/*!
+ * \brief The ClockSkewEstimator class -- Track the offset and drift rate of a meter's clock.
+ *
+ * Each sample is the difference between the time in a meter response and the
+ * computer's time when the response was captured.  A straight line is fit to
+ * the samples by exponentially weighted least squares, so the estimate follows
+ * slow changes in drift (temperature) without keeping a history of samples.
+ */
+class ClockSkewEstimator
+{
+public:
+    ClockSkewEstimator();
+
+    void addSample(const qint64 captureMSecs, const qint64 meterMSecs);
+    void clockWasSet(const qint64 setMSecs);
+    double predictedSkew(const qint64 atMSecs) const;
+    double driftRate() const;
+    int sampleCount() const { return numSamples; }
+    double lastSkew() const { return lastSampleSkew; }
+    int timeSetCount() const { return numTimeSets; }
+
+    QJsonObject saveState() const;
+    void restoreState(const QJsonObject &state);
+
+private:
+    static const double decay;      //!< Weight of older samples is multiplied by this for each new sample.
+    qint64 referenceMSecs;          //!< Sample times are measured from here to preserve precision.
+    double sumW, sumWT, sumWS, sumWTT, sumWTS;  //!< Weighted sums for least squares fit of skew vs time.
+    double priorDriftRate;          //!< Drift rate from before the last time set; used till there are enough samples.
+    double lastSampleSkew;          //!< Skew of the most recent sample in seconds.
+    int numSamples;                 //!< Number of samples since the clock was last set.
+    int numTimeSets;                //!< Number of times the meter clock has been set.
+};
+
+extern double MaxClockSkew;         //!< Meter time is set when predicted skew exceeds this many seconds.
+
+QDateTime MeterTimeToDateTime(const meterDateTime &dateTime);
+
+#endif // CLOCKSKEW_H
@@ -0,0 +1,236 @@
+/*!
+@file
+@brief Accumulated counters: meter totals that never wrap.
+
+@author Thomas A. DeMay
+@date 2015
+@par    Copyright (C) 2015  Thomas A. DeMay
+@par
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    any later version.
+@par
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+@par
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include "counters.h"
+#include "meterfields.h"
+
+CounterAccumulator Counters;
+
+static const char *CounterNames[CounterCount] = {"totalKwh", "pulseCount1", "pulseCount2", "pulseCount3"};
+
+/*!
+ * \brief CounterValue -- Value of a counter in a reading, in accumulated units.
+ * \param reading   The reading.
+ * \param counter   The counter; a CounterIndex.
+ * \param value     Receives the value.
+ * \param range     Receives the value at which the counter wraps to zero.
+ * \return true if the reading has the counter, false otherwise.
+ */
+static bool CounterValue(const MeterReading &reading, const int counter, qint64 *value, qint64 *range)
+{
+    int fieldCount;
+    const MeterField *fields = MeterFieldTable(reading.dataType, &fieldCount);
+    for (int i = 0; i < fieldCount; i++)
+    {
+        if (strcmp(fields[i].name, CounterNames[counter]) != 0)
+            continue;
+        int decimals = (fields[i].kind == FieldKwh) ? KwhDecimals(reading.dataType, reading.frame) : fields[i].decimals;
+        double number = MeterFieldNumber(reading.frame, fields[i], decimals);
+        if (qIsNaN(number))
+            return false;
+        /* kWh are kept in hundredths, so a change of the meter's kWh decimals doesn't change the units. */
+        double units = (fields[i].kind == FieldKwh) ? 100.0 : 1.0;
+        *value = qRound64(number * units);
+        double wrapsAt = units;
+        for (int digit = decimals; digit < fields[i].length; digit++)
+            wrapsAt *= 10.0;
+        *range = qRound64(wrapsAt);
+        return true;
+    }
+    return false;
+}
+
+CounterAccumulator::CounterAccumulator()
+    : changed(false)
+{
+}
+
+/*!
+ * \brief CounterAccumulator::accumulate -- Add a reading to its meter's totals.
+ *
+ * Readings of a meter must be given in the order they were captured.
+ * Readings with a bad CRC, and v.4 B readings, which have no counters, are
+ * left without totals.
+ *
+ * \param reading   The reading; receives the totals.
+ * \return true if the reading has totals, false otherwise.
+ */
+bool CounterAccumulator::accumulate(MeterReading *reading)
+{
+    reading->countersValid = false;
+    if (!reading->crcValid || (reading->dataType == 'B'))
+        return false;
+    qint64 values[CounterCount];
+    qint64 ranges[CounterCount];
+    for (int i = 0; i < CounterCount; i++)
+    {
+        if (!CounterValue(*reading, i, &values[i], &ranges[i]))
+        {
+            qDebug("Reading of meter %s has no %s; no totals.", qUtf8Printable(reading->meterId), CounterNames[i]);
+            return false;
+        }
+    }
+
+    bool firstReading = !meters.contains(reading->meterId);
+    MeterCounters &meter = meters[reading->meterId];
+    for (int i = 0; i < CounterCount; i++)
+    {
+        Counter &counter = meter.counter[i];
+        if (firstReading)
+        {
+            counter.total = values[i];
+            counter.wraps = 0;
+            counter.resets = 0;
+        }
+        else if (values[i] >= counter.lastRaw)
+            counter.total += values[i] - counter.lastRaw;
+        else if ((counter.lastRaw - values[i]) > (ranges[i] / 2))
+        {
+            counter.total += values[i] + ranges[i] - counter.lastRaw;
+            counter.wraps++;
+            qInfo("%s of meter %s wrapped from %lld to %lld; total %lld."
+                  , CounterNames[i], qUtf8Printable(reading->meterId), counter.lastRaw, values[i], counter.total);
+        }
+        else
+        {
+            counter.total += values[i];
+            counter.resets++;
+            qWarning("%s of meter %s went back from %lld to %lld; taken as a reset of the meter; total %lld."
+                     , CounterNames[i], qUtf8Printable(reading->meterId), counter.lastRaw, values[i], counter.total);
+        }
+        counter.lastRaw = values[i];
+        reading->counters[i] = counter.total;
+    }
+    reading->countersValid = true;
+    changed = true;
+    return true;
+}
+
+/*!
+ * \brief CounterAccumulator::load -- Read the totals saved by save().
+ *
+ * A missing file is not an error; the totals start afresh.
+ *
+ * \param fileName  The counters file.
+ * \return true if successful, false otherwise.
+ */
+bool CounterAccumulator::load(const QString &fileName)
+{
+    qDebug("Begin");
+    meters.clear();
+    changed = false;
+    QFile file(fileName);
+    if (!file.exists())
+    {
+        qInfo("No counters file %s; totals start afresh.", qUtf8Printable(fileName));
+        qDebug("Return true");
+        return true;
+    }
+    if (!file.open(QIODevice::ReadOnly))
+    {
+        qCritical("Unable to read counters from %s:  %s", qUtf8Printable(fileName), qUtf8Printable(file.errorString()));
+        qDebug("Return false");
+        return false;
+    }
+    QJsonObject state = QJsonDocument::fromJson(file.readAll()).object();
+    if (state.value("version").toInt() != CountersStateVersion)
+    {
+        qCritical("Counters in %s not recognized.", qUtf8Printable(fileName));
+        qDebug("Return false");
+        return false;
+    }
+    QJsonObject savedMeters = state.value("meters").toObject();
+    foreach (QString meterId, savedMeters.keys())
+    {
+        QJsonObject savedMeter = savedMeters.value(meterId).toObject();
+        MeterCounters meter;
+        bool complete = true;
+        for (int i = 0; i < CounterCount; i++)
+        {
+            complete = complete && savedMeter.contains(CounterNames[i]);
+            /* 64 bit values are kept as text; a JSON number is a double. */
+            QJsonObject saved = savedMeter.value(CounterNames[i]).toObject();
+            meter.counter[i].lastRaw = saved.value("lastRaw").toString().toLongLong();
+            meter.counter[i].total = saved.value("total").toString().toLongLong();
+            meter.counter[i].wraps = saved.value("wraps").toString().toLongLong();
+            meter.counter[i].resets = saved.value("resets").toString().toLongLong();
+        }
+        if (complete)
+            meters.insert(meterId, meter);
+        else
+            qWarning("Counters of meter %s in %s incomplete; its totals start afresh.", qUtf8Printable(meterId), qUtf8Printable(fileName));
+    }
+    qDebug("Return true; totals of %d meters loaded.", meters.size());
+    return true;
+}
+
+/*!
+ * \brief CounterAccumulator::save -- Write the totals, if they changed since last written.
+ * \param fileName  The counters file; replaced whole, so a crash leaves the old one.
+ * \return true if successful, false otherwise.
+ */
+bool CounterAccumulator::save(const QString &fileName)
+{
+    if (!changed)
+        return true;
+    QJsonObject savedMeters;
+    foreach (QString meterId, meters.keys())
+    {
+        const MeterCounters &meter = meters[meterId];
+        QJsonObject savedMeter;
+        for (int i = 0; i < CounterCount; i++)
+        {
+            QJsonObject saved;
+            saved.insert("lastRaw", QString::number(meter.counter[i].lastRaw));
+            saved.insert("total", QString::number(meter.counter[i].total));
+            saved.insert("wraps", QString::number(meter.counter[i].wraps));
+            saved.insert("resets", QString::number(meter.counter[i].resets));
+            savedMeter.insert(CounterNames[i], saved);
+        }
+        savedMeters.insert(meterId, savedMeter);
+    }
+    QJsonObject state;
+    state.insert("version", CountersStateVersion);
+    state.insert("meters", savedMeters);
+
+    QSaveFile file(fileName);
+    if (!file.open(QIODevice::WriteOnly)
+            || (file.write(QJsonDocument(state).toJson()) < 0)
+            || !file.commit())
+    {
+        qCritical("Unable to write counters to %s:  %s", qUtf8Printable(fileName), qUtf8Printable(file.errorString()));
+        return false;
+    }
+    changed = false;
+    return true;
+}
+
+/*!
+ * \brief CounterAccumulator::counterName -- Name of a counter, as the field it accumulates.
+ * \param counter   The counter; a CounterIndex.
+ * \return The name.
+ */
+const char *CounterAccumulator::counterName(const int counter)
+{
+    return ((counter >= 0) && (counter < CounterCount)) ? CounterNames[counter] : "";
+}
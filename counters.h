@@ -0,0 +1,92 @@
+/*!
+@file
+@brief Header file describing the accumulated counters: meter totals that never wrap.
+
+The totalKwh and pulseCount1..3 fields of a response have 8 digits, so they
+wrap to zero after 99999999 units, and a meter that is replaced or cleared
+starts again from zero.  Differences of the raw fields are wrong across
+either event.
+
+A CounterAccumulator keeps, for each meter, a 64 bit total of each of those
+counters which only ever goes up.  Each v.3 or v.4 A reading with a valid
+CRC is compared with the meter's previous one:
+
+ - a counter that went up adds the difference;
+ - a counter that went down by more than half its range wrapped, and adds
+   the difference plus the range;
+ - a counter that went down by less was reset, and adds its new value.
+
+The totals are put in the reading (MeterReading::counters) and stored with
+it in the MeterCounters table, so the total over any period is the
+difference of two rows.  totalKwh is accumulated in hundredths of a kWh
+whatever the meter's kWh decimals; the pulse counts in pulses.
+The first reading of a meter starts its totals at the raw values.
+
+The last raw value and the total of each counter are kept in
+CountersStateFile in the home directory, written after each pass over the
+meters, so the totals carry on across restarts.  A reading missed while the
+program was not running only matters if a counter wrapped more than once,
+or wrapped and passed its old value, meanwhile.
+
+@author Thomas A. DeMay
+@date 2015
+@par    Copyright (C) 2015  Thomas A. DeMay
+@par
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    any later version.
+@par
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+@par
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#ifndef COUNTERS_H
+#define COUNTERS_H
+#include <QtCore>
+#include "meterreading.h"
+
+static const char CountersStateFile[] = ".ReadEKMCounters.json";  //!< Accumulated counters, in the home directory.
+static const int CountersStateVersion = 1;                          //!< Format of the counters file.
+
+/*!
+ * \brief The CounterAccumulator class -- Totals of the meter counters that never wrap.
+ */
+class CounterAccumulator
+{
+public:
+    CounterAccumulator();
+
+    bool accumulate(MeterReading *reading);
+    bool load(const QString &fileName);
+    bool save(const QString &fileName);
+
+    static const char *counterName(const int counter);
+
+private:
+    typedef struct
+    {
+        qint64 lastRaw;         //!< Raw value in the last reading, in accumulated units.
+        qint64 total;           //!< Accumulated value.
+        qint64 wraps;           //!< Times the counter wrapped.
+        qint64 resets;          //!< Times the counter was reset.
+    } Counter;
+
+    typedef struct
+    {
+        Counter counter[CounterCount];  //!< By CounterIndex.
+    } MeterCounters;
+
+    QMap<QString, MeterCounters> meters;    //!< Counters of each meter, by meter id.
+    bool changed;                           //!< Accumulated since last saved.
+};
+
+extern CounterAccumulator Counters;     //!< Accumulated counters of all the meters.
+
+#endif // COUNTERS_H
@@ -0,0 +1,262 @@
+/*!
+@file
+@brief Pool of database connections, one per thread, with reconnect.
+
+@author Thomas A. DeMay
+@date 2015
+@par    Copyright (C) 2015  Thomas A. DeMay
+@par
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    any later version.
+@par
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+@par
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include "dbpool.h"
+
+DatabasePool *DbPool = NULL;
+
+/*!
+ * \brief ConnectionParametersOf -- The parameters of a connection.
+ *
+ * Must be called on the thread that made the connection.
+ *
+ * \param connectionName    Name of the Qt connection.
+ * \return The parameters.
+ */
+ConnectionParameters ConnectionParametersOf(const QString &connectionName)
+{
+    QSqlDatabase db = QSqlDatabase::database(connectionName, false);
+    ConnectionParameters params;
+    params.driverName = db.driverName();
+    params.hostName = db.hostName();
+    params.port = db.port();
+    params.databaseName = db.databaseName();
+    params.userName = db.userName();
+    params.password = db.password();
+    params.connectOptions = db.connectOptions();
+    params.precisionPolicy = db.numericalPrecisionPolicy();
+    return params;
+}
+
+/*!
+ * \brief AddConnectionWith -- Make a connection, not opened, for the calling thread.
+ * \param params            Parameters from ConnectionParametersOf().
+ * \param connectionName    Name of the new Qt connection.
+ * \return The connection.
+ */
+QSqlDatabase AddConnectionWith(const ConnectionParameters &params, const QString &connectionName)
+{
+    QSqlDatabase db = QSqlDatabase::addDatabase(params.driverName, connectionName);
+    db.setHostName(params.hostName);
+    db.setPort(params.port);
+    db.setDatabaseName(params.databaseName);
+    db.setUserName(params.userName);
+    db.setPassword(params.password);
+    db.setConnectOptions(params.connectOptions);
+    db.setNumericalPrecisionPolicy(params.precisionPolicy);
+    return db;
+}
+
+/*!
+ * \brief DatabasePool::DatabasePool -- A pool based on a connection; must be made on the thread that made it.
+ * \param baseConnectionName    Connection made by addConnectionFromString().
+ */
+DatabasePool::DatabasePool(const QString &baseConnectionName)
+    : baseName(baseConnectionName)
+    , baseParameters(ConnectionParametersOf(baseConnectionName))
+    , ownerThread(QThread::currentThreadId())
+{
+}
+
+/*!
+ * \brief DatabasePool::threadState -- State of the calling thread's connection, created if needed.
+ *
+ * The thread that created the pool uses the base connection itself;
+ * other threads get a connection made from its parameters.  The seed of
+ * qrand() is per thread, so each thread's is set here, from the time and the
+ * thread, for its reconnection backoff to be jittered apart from the others'.
+ *
+ * \return The state.
+ */
+DatabasePool::ConnectionState *DatabasePool::threadState()
+{
+    QMutexLocker locker(&mutex);
+    Qt::HANDLE thread = QThread::currentThreadId();
+    ConnectionState *state = states.value(thread, NULL);
+    if (state == NULL)
+    {
+        state = new ConnectionState;
+        state->name = (thread == ownerThread) ? baseName : QString("%1/%2").arg(baseName).arg(states.size() + 1);
+        state->lastUsedMSecs = 0;
+        state->nextAttemptMSecs = 0;
+        state->failures = 0;
+        state->reconnect = false;
+        state->queries = state->errors = state->reconnects = 0;
+        state->totalNSecs = state->maxNSecs = 0;
+        states.insert(thread, state);
+        qsrand((uint)QDateTime::currentMSecsSinceEpoch() ^ qHash((quint64)(quintptr)thread));
+    }
+    return state;
+}
+
+/*!
+ * \brief DatabasePool::reopen -- Close and reopen a connection, unless it is too soon to try again.
+ *
+ * After each failure the wait before the next attempt doubles, up to
+ * DbMaxBackoffMSecs, and is jittered by up to half so that several
+ * connections don't retry in lock step.
+ *
+ * \param db        The connection.
+ * \param state     Its state.
+ * \return true if the connection is open, false otherwise.
+ */
+bool DatabasePool::reopen(QSqlDatabase &db, ConnectionState *state)
+{
+    qint64 now = QDateTime::currentMSecsSinceEpoch();
+    if (now < state->nextAttemptMSecs)
+        return false;
+    db.close();
+    if (db.open())
+    {
+        if (state->failures > 0)
+            qInfo("Database connection %s reopened after %d attempts.", qUtf8Printable(state->name), state->failures + 1);
+        QMutexLocker locker(&mutex);
+        state->failures = 0;
+        state->reconnect = false;
+        state->lastUsedMSecs = now;
+        state->reconnects++;
+        return true;
+    }
+    qint64 backoff = qMin(DbMaxBackoffMSecs, DbMinBackoffMSecs << qMin(state->failures, 16));
+    backoff = backoff / 2 + (qrand() % (backoff / 2 + 1));
+    state->failures++;
+    state->nextAttemptMSecs = now + backoff;
+    qWarning("Unable to open database connection %s (attempt %d): %s; next attempt in %lld msec."
+             , qUtf8Printable(state->name), state->failures, qUtf8Printable(db.lastError().text()), backoff);
+    return false;
+}
+
+/*!
+ * \brief DatabasePool::connection -- The calling thread's database connection, checked and open if possible.
+ *
+ * A connection idle for more than DbKeepaliveMSecs is checked with a trivial
+ * query before being returned.  If the connection is down and it is too soon
+ * to try again, the closed connection is returned right away; callers treat
+ * it as any other unopened database.
+ *
+ * \return The connection.
+ */
+QSqlDatabase DatabasePool::connection()
+{
+    ConnectionState *state = threadState();
+    QSqlDatabase db = QSqlDatabase::database(state->name, false);
+    if (!db.isValid())
+    {
+        db = AddConnectionWith(baseParameters, state->name);
+        state->reconnect = true;
+    }
+    if (!state->reconnect && db.isOpen()
+            && ((QDateTime::currentMSecsSinceEpoch() - state->lastUsedMSecs) > DbKeepaliveMSecs))
+    {
+        QSqlQuery ping(db);
+        if (ping.exec("SELECT 1"))
+            state->lastUsedMSecs = QDateTime::currentMSecsSinceEpoch();
+        else
+        {
+            qWarning("Database connection %s failed its health check: %s", qUtf8Printable(state->name), qUtf8Printable(ping.lastError().text()));
+            state->reconnect = true;
+        }
+    }
+    if (state->reconnect || !db.isOpen())
+        reopen(db, state);
+    return db;
+}
+
+/*!
+ * \brief DatabasePool::exec -- Execute a query, keeping latency statistics for the connection.
+ *
+ * A failure due to the connection marks the connection to be reopened
+ * before it is next used.
+ *
+ * \param query     Query on a connection from connection().
+ * \param queryText Text of the query; if empty the query must have been prepared.
+ * \return true if successful, false otherwise.
+ */
+bool DatabasePool::exec(QSqlQuery &query, const QString &queryText)
+{
+    ConnectionState *state = threadState();
+    QElapsedTimer timer;
+    timer.start();
+    bool success = queryText.isEmpty() ? query.exec() : query.exec(queryText);
+    qint64 nsecs = timer.nsecsElapsed();
+    {
+        QMutexLocker locker(&mutex);
+        state->queries++;
+        state->totalNSecs += nsecs;
+        state->maxNSecs = qMax(state->maxNSecs, nsecs);
+        if (success)
+            state->lastUsedMSecs = QDateTime::currentMSecsSinceEpoch();
+        else
+            state->errors++;
+    }
+    if (!success)
+        connectionFailed(query.lastError());
+    return success;
+}
+
+/*!
+ * \brief DatabasePool::connectionFailed -- Note an error on the calling thread's connection.
+ * \param error     The error; only connection errors cause a reconnect.
+ */
+void DatabasePool::connectionFailed(const QSqlError &error)
+{
+    if (isConnectionError(error))
+        threadState()->reconnect = true;
+}
+
+/*!
+ * \brief DatabasePool::isConnectionError -- Was an error due to losing the connection?
+ *
+ * MySQL reports a lost connection as 2006 (server has gone away) or
+ * 2013 (lost connection during query), and a refused one as 2002 or 2003.
+ *
+ * \param error     The error.
+ * \return true if the connection should be reopened.
+ */
+bool DatabasePool::isConnectionError(const QSqlError &error)
+{
+    static const QStringList lostConnectionCodes = QStringList() << "2002" << "2003" << "2006" << "2013";
+    return (error.type() == QSqlError::ConnectionError)
+            || lostConnectionCodes.contains(error.nativeErrorCode());
+}
+
+/*!
+ * \brief DatabasePool::statistics -- Describe the use of each connection.
+ * \return One line per connection.
+ */
+QStringList DatabasePool::statistics() const
+{
+    QMutexLocker locker(&mutex);
+    QStringList lines;
+    foreach (const ConnectionState *state, states)
+    {
+        lines << QString("Database connection %1: %2 queries, %3 errors, %4 reconnects, mean %5 msec, max %6 msec.")
+                 .arg(state->name)
+                 .arg(state->queries)
+                 .arg(state->errors)
+                 .arg(state->reconnects)
+                 .arg((state->queries > 0) ? (state->totalNSecs / state->queries) / 1.0e6 : 0.0, 0, 'f', 2)
+                 .arg(state->maxNSecs / 1.0e6, 0, 'f', 2);
+    }
+    return lines;
+}
@@ -0,0 +1,103 @@
+/*!
+@file
+@brief Header file describing the pool of database connections.
+
+Qt database connections may only be used by the thread that opened them,
+so each thread that writes the database gets its own connection, cloned
+from the connection made by addConnectionFromString().  Connections are
+checked before use when they have been idle, and are reopened after a
+failure, with a jittered exponential backoff so that a database restart
+doesn't stall reading the meters or swamp the server with reconnects.
+
+@author Thomas A. DeMay
+@date 2015
+@par    Copyright (C) 2015  Thomas A. DeMay
+@par
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    any later version.
+@par
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+@par
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#ifndef DBPOOL_H
+#define DBPOOL_H
+#include <QtCore>
+#include <QtSql>
+
+static const qint64 DbKeepaliveMSecs = 60000;          //!< Check a connection idle this long before using it.
+static const qint64 DbMinBackoffMSecs = 500;           //!< First delay before reconnecting.
+static const qint64 DbMaxBackoffMSecs = 60000;         //!< Longest delay between reconnect attempts.
+
+/*!
+ * \brief The ConnectionParameters struct -- What it takes to make a connection like another.
+ *
+ * QSqlDatabase::database() and cloneDatabase() may be used only on the
+ * thread that made the connection; these parameters are taken there, and a
+ * connection can be made from them on any thread.
+ */
+typedef struct
+{
+    QString driverName;         //!< Qt SQL driver, e.g. QMYSQL.
+    QString hostName;           //!< Server host.
+    int port;                   //!< Server port; -1 for the default.
+    QString databaseName;       //!< Schema.
+    QString userName;           //!< User.
+    QString password;           //!< Password.
+    QString connectOptions;     //!< Driver connect options.
+    QSql::NumericalPrecisionPolicy precisionPolicy;     //!< How numbers are returned.
+} ConnectionParameters;
+
+ConnectionParameters ConnectionParametersOf(const QString &connectionName);
+QSqlDatabase AddConnectionWith(const ConnectionParameters &params, const QString &connectionName);
+
+/*!
+ * \brief The DatabasePool class -- One healthy database connection per thread.
+ */
+class DatabasePool
+{
+public:
+    DatabasePool(const QString &baseConnectionName);
+
+    QSqlDatabase connection();
+    bool exec(QSqlQuery &query, const QString &queryText = QString());
+    void connectionFailed(const QSqlError &error);
+    static bool isConnectionError(const QSqlError &error);
+    QStringList statistics() const;
+
+private:
+    typedef struct
+    {
+        QString name;               //!< Name of the Qt connection.
+        qint64 lastUsedMSecs;       //!< When the connection was last known good.
+        qint64 nextAttemptMSecs;    //!< Don't try to reconnect before this.
+        int failures;               //!< Consecutive failed connection attempts.
+        bool reconnect;             //!< The connection must be reopened before use.
+        qint64 queries;             //!< Number of queries executed.
+        qint64 errors;              //!< Number of queries that failed.
+        qint64 reconnects;          //!< Number of times the connection was reopened.
+        qint64 totalNSecs;          //!< Total time spent executing queries.
+        qint64 maxNSecs;            //!< Longest time spent executing a query.
+    } ConnectionState;
+
+    ConnectionState *threadState();
+    bool reopen(QSqlDatabase &db, ConnectionState *state);
+
+    QString baseName;                               //!< Connection made by addConnectionFromString().
+    ConnectionParameters baseParameters;            //!< Its parameters, for making the other threads' connections.
+    Qt::HANDLE ownerThread;                         //!< Thread that made the pool; the only one to use the base connection.
+    mutable QMutex mutex;                           //!< Guards states and their statistics.
+    QHash<Qt::HANDLE, ConnectionState *> states;    //!< State of each thread's connection; never removed.
+};
+
+extern DatabasePool *DbPool;        //!< Pool of connections to the meter database; NULL if not using it.
+
+#endif // DBPOOL_H
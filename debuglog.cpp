@@ -0,0 +1,360 @@
+/*!
+@file
+@brief Structured, rate limited debug logging to the debug database.
+
+@author Thomas A. DeMay
+@date 2015
+@par    Copyright (C) 2015  Thomas A. DeMay
+@par
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    any later version.
+@par
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+@par
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include "debuglog.h"
+#include "../SupportRoutines/supportfunctions.h"
+#include <stdio.h>
+
+Q_LOGGING_CATEGORY(SerialLog, "ekm.serial")
+Q_LOGGING_CATEGORY(FrameLog, "ekm.frame")
+
+DebugLogWriter *DebugLog = NULL;
+
+static QString LogRulesFileName;            //!< File of logging rules; empty if none.
+static QDateTime LogRulesLastModified;      //!< Modification time of the rules file when last loaded.
+
+/*!
+ * \brief SeverityName -- Name of a message type as stored in the Severity column.
+ * \param type  The message type.
+ * \return The name.
+ */
+static QString SeverityName(const QtMsgType type)
+{
+    switch (type)
+    {
+    case QtDebugMsg:
+        return "Debug";
+    case QtInfoMsg:
+        return "Info";
+    case QtWarningMsg:
+        return "Warning";
+    case QtCriticalMsg:
+        return "Critical";
+    default:
+        return "Fatal";
+    }
+}
+
+DebugLogWriter::DebugLogWriter(const QString &debugConnectionName, const QString &archiveTag)
+    : baseConnectionName(debugConnectionName)
+    , baseParameters(ConnectionParametersOf(debugConnectionName))
+    , tag(archiveTag)
+    , stopping(false)
+    , writtenCount(0)
+    , suppressedCount(0)
+    , droppedCount(0)
+{
+}
+
+/*!
+ * \brief DebugLogWriter::~DebugLogWriter -- Write the records still queued and stop the background thread.
+ */
+DebugLogWriter::~DebugLogWriter()
+{
+    {
+        QMutexLocker locker(&mutex);
+        stopping = true;
+        wake.wakeAll();
+    }
+    wait();
+}
+
+/*!
+ * \brief DebugLogWriter::admit -- Apply rate limiting to a message.
+ *
+ * Messages are counted per source line.  Warnings and worse are always
+ * admitted.  Called with the mutex locked.
+ *
+ * \param type      The message type.
+ * \param context   Where the message came from.
+ * \param prefix    Set to a note to put before a sampled message.
+ * \return true if the message is to be kept, false otherwise.
+ */
+bool DebugLogWriter::admit(QtMsgType type, const QMessageLogContext &context, QString *prefix)
+{
+    if ((type != QtDebugMsg) && (type != QtInfoMsg))
+        return true;
+    QString key = QString("%1:%2").arg(context.file).arg(context.line);
+    qint64 now = QDateTime::currentMSecsSinceEpoch();
+    SiteState &site = sites[key];
+    if ((site.windowStartMSecs == 0) || ((now - site.windowStartMSecs) >= DebugLogWindowMSecs))
+    {
+        if (site.suppressed > 0)
+        {
+            LogRecord summary;
+            summary.time = QDateTime::currentDateTime();
+            summary.severity = SeverityName(QtInfoMsg);
+            summary.functionName = site.functionName;
+            summary.sourceLineNo = site.sourceLineNo;
+            summary.message = QString("%1 messages from here suppressed in the last %2 sec.")
+                    .arg(site.suppressed).arg((now - site.windowStartMSecs) / 1000);
+            enqueue(summary);
+        }
+        site.windowStartMSecs = now;
+        site.count = 0;
+        site.suppressed = 0;
+        site.functionName = context.function;
+        site.sourceLineNo = context.line;
+    }
+    site.count++;
+    if (site.count <= DebugLogBurst)
+        return true;
+    if (((site.count - DebugLogBurst) % DebugLogSampleEvery) == 0)
+    {
+        *prefix = QString("[1 of %1 sampled] ").arg(DebugLogSampleEvery);
+        return true;
+    }
+    site.suppressed++;
+    suppressedCount++;
+    return false;
+}
+
+/*!
+ * \brief DebugLogWriter::enqueue -- Queue a record for the background thread.  Called with the mutex locked.
+ * \param record    The record.
+ */
+void DebugLogWriter::enqueue(const LogRecord &record)
+{
+    if (queue.size() >= DebugLogMaxQueue)
+    {
+        droppedCount++;
+        return;
+    }
+    queue.append(record);
+    if (queue.size() >= DebugLogBatchRows)
+        wake.wakeAll();
+}
+
+/*!
+ * \brief DebugLogWriter::record -- Turn a message into a record and queue it.
+ *
+ * Cheap enough to call from the serial reading code; the database is only
+ * touched by the background thread.  Messages from the background thread
+ * itself go to stderr so that a failing insert can't feed itself; the thread
+ * is known by this object, which is fixed before it starts, so no thread id
+ * is shared between threads.
+ *
+ * \param type      The message type.
+ * \param context   Where the message came from.
+ * \param msg       The message.
+ */
+void DebugLogWriter::record(QtMsgType type, const QMessageLogContext &context, const QString &msg)
+{
+    if (QThread::currentThread() == this)
+    {
+        fprintf(stderr, "%s\n", qUtf8Printable(qFormatLogMessage(type, context, msg)));
+        return;
+    }
+    QMutexLocker locker(&mutex);
+    QString prefix;
+    if (!admit(type, context, &prefix))
+        return;
+    LogRecord record;
+    record.time = QDateTime::currentDateTime();
+    record.severity = SeverityName(type);
+    record.functionName = context.function;
+    record.sourceLineNo = context.line;
+    if ((context.category != NULL) && (qstrcmp(context.category, "default") != 0))
+        prefix = QString("[%1] ").arg(context.category) + prefix;
+    record.message = prefix + msg;
+    enqueue(record);
+}
+
+/*!
+ * \brief DebugLogWriter::run -- Write queued records every DebugLogFlushMSecs, or sooner when a batch is ready.
+ */
+void DebugLogWriter::run()
+{
+    QString connectionName = baseConnectionName + "/log";
+    {
+        QSqlDatabase db = AddConnectionWith(baseParameters, connectionName);
+        bool done = false;
+        while (!done)
+        {
+            QList<LogRecord> records;
+            {
+                QMutexLocker locker(&mutex);
+                if (!stopping && (queue.size() < DebugLogBatchRows))
+                    wake.wait(&mutex, DebugLogFlushMSecs);
+                records.swap(queue);
+                done = stopping;
+            }
+            if (records.isEmpty())
+                continue;
+            if (!db.isOpen() && !db.open())
+                fprintf(stderr, "Unable to open debug database: %s\n", qUtf8Printable(db.lastError().text()));
+            for (int i = 0; i < records.size(); i += DebugLogBatchRows)
+            {
+                QList<LogRecord> batch = records.mid(i, DebugLogBatchRows);
+                bool written = db.isOpen() && writeBatch(db, batch);
+                QMutexLocker locker(&mutex);
+                if (written)
+                    writtenCount += batch.size();
+                else
+                    droppedCount += batch.size();
+            }
+        }
+        db.close();
+    }
+    QSqlDatabase::removeDatabase(connectionName);
+}
+
+/*!
+ * \brief DebugLogWriter::writeBatch -- Insert records into DebugInfo with one statement.
+ * \param db        Open connection to the debug database.
+ * \param records   The records.
+ * \return true if successful, false otherwise.
+ */
+bool DebugLogWriter::writeBatch(QSqlDatabase &db, const QList<LogRecord> &records)
+{
+    QStringList rows;
+    for (int i = 0; i < records.size(); i++)
+        rows << "(?, ?, ?, ?, ?, ?)";
+    QSqlQuery query(db);
+    query.prepare("INSERT INTO DebugInfo (Time, ArchiveTag, Severity, FunctionName, SourceLineNo, Message) VALUES "
+                  + rows.join(", "));
+    foreach (const LogRecord &record, records)
+    {
+        query.addBindValue(record.time);
+        query.addBindValue(tag);
+        query.addBindValue(record.severity);
+        query.addBindValue(record.functionName);
+        query.addBindValue(record.sourceLineNo);
+        query.addBindValue(record.message);
+    }
+    if (DontActuallyWriteDatabase)
+        return true;
+    if (!query.exec())
+    {
+        fprintf(stderr, "Unable to write %d debug records: %s\n", records.size(), qUtf8Printable(query.lastError().text()));
+        return false;
+    }
+    return true;
+}
+
+/*!
+ * \brief DebugLogWriter::statistics -- Describe what has been logged.
+ * \return One line.
+ */
+QString DebugLogWriter::statistics() const
+{
+    QMutexLocker locker(&mutex);
+    return QString("Debug log: %1 records written, %2 suppressed by rate limiting, %3 dropped, %4 waiting.")
+            .arg(writtenCount).arg(suppressedCount).arg(droppedCount).arg(queue.size());
+}
+
+/*!
+ * \brief DebugLogOutput -- Message handler that queues messages for the debug database.
+ * \param type      The message type.
+ * \param context   Where the message came from.
+ * \param msg       The message.
+ */
+void DebugLogOutput(QtMsgType type, const QMessageLogContext &context, const QString &msg)
+{
+    if (DebugLog != NULL)
+        DebugLog->record(type, context, msg);
+    else
+        saveMessageOutput(type, context, msg);
+}
+
+/*!
+ * \brief DebugLogTerminalOutput -- Message handler that queues messages for the debug database and shows them.
+ * \param type      The message type.
+ * \param context   Where the message came from.
+ * \param msg       The message.
+ */
+void DebugLogTerminalOutput(QtMsgType type, const QMessageLogContext &context, const QString &msg)
+{
+    if (DebugLog != NULL)
+        DebugLog->record(type, context, msg);
+    terminalMessageOutput(type, context, msg);
+}
+
+/*!
+ * \brief BackgroundMessageOutput -- Message handler for code that mustn't wait on the terminal.
+ * \return DebugLogOutput if debug info goes to the debug log, saveMessageOutput otherwise.
+ */
+QtMessageHandler BackgroundMessageOutput()
+{
+    return (DebugLog != NULL) ? DebugLogOutput : saveMessageOutput;
+}
+
+/*!
+ * \brief LogArchiveTag -- Git commit ReadEKM was built from, as written by GetArchiveTag.sh.
+ * \return The commit hash, or "notset" if unknown.
+ */
+QString LogArchiveTag()
+{
+#ifdef SOURCE_DIR
+    QFile tagFile(QString(SOURCE_DIR) + "/ArchiveTag.txt");
+    if (tagFile.open(QIODevice::ReadOnly))
+    {
+        QString tag = QString(tagFile.readAll()).trimmed();
+        if (!tag.isEmpty())
+            return tag;
+    }
+#endif
+    return "notset";
+}
+
+/*!
+ * \brief LoadLogRules -- Set logging category levels from a file of QLoggingCategory rules.
+ * \param fileName  Name of the rules file; if empty, DefaultLogRules are used.
+ * \return true if successful, false otherwise.
+ */
+bool LoadLogRules(const QString &fileName)
+{
+    qDebug("Begin");
+    LogRulesFileName = fileName;
+    if (fileName.isEmpty())
+    {
+        QLoggingCategory::setFilterRules(DefaultLogRules);
+        qDebug("Return true");
+        return true;
+    }
+    QFile rulesFile(fileName);
+    if (!rulesFile.open(QIODevice::ReadOnly | QIODevice::Text))
+    {
+        qCritical("Unable to open logging rules file %s.", qUtf8Printable(fileName));
+        qDebug("Return false");
+        return false;
+    }
+    LogRulesLastModified = QFileInfo(fileName).lastModified();
+    QString rules = QString(rulesFile.readAll());
+    QLoggingCategory::setFilterRules(rules);
+    qInfo("Logging rules from %s: %s", qUtf8Printable(fileName), qUtf8Printable(rules.simplified()));
+    qDebug("Return true");
+    return true;
+}
+
+/*!
+ * \brief ReloadLogRulesIfChanged -- Reload the logging rules file if it has been modified.
+ */
+void ReloadLogRulesIfChanged()
+{
+    if (LogRulesFileName.isEmpty())
+        return;
+    QFileInfo fileInfo(LogRulesFileName);
+    if (fileInfo.exists() && (fileInfo.lastModified() != LogRulesLastModified))
+        LoadLogRules(LogRulesFileName);
+}
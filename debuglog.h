@@ -0,0 +1,121 @@
+/*!
+@file
+@brief Header file describing structured, rate limited debug logging to the debug database.
+
+Every qDebug line used to go into the DebugInfo table, including hex dumps
+of each response, which at high meter counts is more writing than the meter
+data.  Instead, with a debug database (-B), messages become records that are
+queued and written by a background thread with multi-row inserts.
+
+Messages are in logging categories (ekm.serial, ekm.frame, and Qt's default
+for the rest) whose levels are set by QLoggingCategory rules, e.g.
+
+    ekm.frame.debug=false
+    ekm.serial.debug=true
+
+read from the --log-rules file, which is reread when it changes so levels can
+be changed while ReadEKM runs.  Hex dumps of responses are ekm.frame debug
+messages and are off by default.
+
+Debug and info messages from any one place in the code are rate limited:
+after DebugLogBurst in a minute only one in DebugLogSampleEvery is kept, and
+the number suppressed is logged when the minute is up.  Warnings and worse
+are always kept.
+
+@author Thomas A. DeMay
+@date 2015
+@par    Copyright (C) 2015  Thomas A. DeMay
+@par
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    any later version.
+@par
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+@par
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#ifndef DEBUGLOG_H
+#define DEBUGLOG_H
+#include <QtCore>
+#include <QtSql>
+#include "dbpool.h"
+
+Q_DECLARE_LOGGING_CATEGORY(SerialLog)       //!< Serial port activity.
+Q_DECLARE_LOGGING_CATEGORY(FrameLog)        //!< Hex dumps of messages and responses.
+
+static const char DefaultLogRules[] = "ekm.frame.debug=false";   //!< Rules used when there is no rules file.
+static const int DebugLogBurst = 20;                //!< Messages kept from one place each window before sampling.
+static const int DebugLogSampleEvery = 50;          //!< After the burst keep one message in this many.
+static const qint64 DebugLogWindowMSecs = 60000;    //!< Rate limiting window.
+static const int DebugLogBatchRows = 200;           //!< Most rows in one insert.
+static const unsigned long DebugLogFlushMSecs = 5000;   //!< Longest a record waits to be written.
+static const int DebugLogMaxQueue = 20000;          //!< Records waiting beyond this are dropped.
+
+/*!
+ * \brief The DebugLogWriter class -- Queue log records and write them to DebugInfo in batches.
+ */
+class DebugLogWriter : public QThread
+{
+public:
+    DebugLogWriter(const QString &debugConnectionName, const QString &archiveTag);
+    ~DebugLogWriter();
+
+    void record(QtMsgType type, const QMessageLogContext &context, const QString &msg);
+    QString statistics() const;
+
+protected:
+    void run();
+
+private:
+    typedef struct
+    {
+        QDateTime time;             //!< When the message was logged.
+        QString severity;           //!< "Debug", "Info", "Warning", "Critical" or "Fatal".
+        QString functionName;       //!< Function that logged it.
+        int sourceLineNo;           //!< Line that logged it.
+        QString message;            //!< The message, prefixed by its category if not the default.
+    } LogRecord;
+
+    typedef struct
+    {
+        qint64 windowStartMSecs;    //!< When the current window started.
+        int count;                  //!< Messages from the site this window.
+        int suppressed;             //!< Messages from the site not kept this window.
+        QString functionName;       //!< Function of the site, for the suppression summary.
+        int sourceLineNo;           //!< Line of the site, for the suppression summary.
+    } SiteState;
+
+    bool admit(QtMsgType type, const QMessageLogContext &context, QString *prefix);
+    void enqueue(const LogRecord &record);
+    bool writeBatch(QSqlDatabase &db, const QList<LogRecord> &records);
+
+    QString baseConnectionName;     //!< Connection made by addConnectionFromString() for debug info.
+    ConnectionParameters baseParameters;    //!< Its parameters, for making the background thread's connection.
+    QString tag;                    //!< Value of the ArchiveTag column.
+    mutable QMutex mutex;           //!< Guards everything below.
+    QWaitCondition wake;            //!< Wakes the background thread.
+    QList<LogRecord> queue;         //!< Records waiting to be written.
+    QHash<QString, SiteState> sites;    //!< Rate limiting state of each place messages come from.
+    bool stopping;                  //!< The background thread should write what's left and quit.
+    qint64 writtenCount;            //!< Records written.
+    qint64 suppressedCount;         //!< Messages not kept by rate limiting.
+    qint64 droppedCount;            //!< Records dropped because the queue was full or a write failed.
+};
+
+extern DebugLogWriter *DebugLog;    //!< Writes debug info to the debug database; NULL if not writing it.
+
+void DebugLogOutput(QtMsgType type, const QMessageLogContext &context, const QString &msg);
+void DebugLogTerminalOutput(QtMsgType type, const QMessageLogContext &context, const QString &msg);
+QtMessageHandler BackgroundMessageOutput();
+QString LogArchiveTag();
+bool LoadLogRules(const QString &fileName);
+void ReloadLogRulesIfChanged();
+
+#endif // DEBUGLOG_H
@@ -0,0 +1,742 @@
+/*!
+@file
+@brief Export of stored responses as columns of decoded fields.
+
+@author Thomas A. DeMay
+@date 2015
+@par    Copyright (C) 2015  Thomas A. DeMay
+@par
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    any later version.
+@par
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+@par
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include <QtSql>
+#include "exporter.h"
+#include "framearchive.h"
+#include "framecodec.h"
+#include "meterfields.h"
+#include "batchdecode.h"
+#include "storagesink.h"
+#include "dbpool.h"
+
+/* Defined in EkmCRC.cpp. */
+uint16_t computeEkmCrc(const uint8_t *dat, uint16_t len);
+
+static const char ExportConnectionName[] = "ExportSqlite";     //!< Connection to an SQLite source.
+static const int ExportRateCount = 4;                           //!< Rates derived from counters.
+static const char *const ExportRateSources[ExportRateCount] = {"totalKwh", "pulseCount1", "pulseCount2", "pulseCount3"};
+static const char *const ExportRateNames[ExportRateCount] = {"kW", "pulseRate1", "pulseRate2", "pulseRate3"};
+static const double ExportRateUSecs[ExportRateCount] = {3600e6, 60e6, 60e6, 60e6};  //!< Per hour for kWh, per minute for pulses.
+
+typedef struct
+{
+    qint64 captureUSecs;        //!< Wall clock time (usec since epoch) the response was captured.
+    uint8_t dataType;           //!< '3' for v.3 response, 'A' or 'B' for v.4 responses.
+    bool crcValid;              //!< The response CRC was valid.
+    uint8_t frame[FrameSize];   //!< The response.
+} ExportFrame;
+
+typedef struct
+{
+    qint64 captureUSecs;                //!< Capture time of the response.
+    uint8_t dataType;                   //!< Data type of the response.
+    bool crcValid;                      //!< The response CRC was valid.
+    double rateSource[ExportRateCount]; //!< Counters rates are derived from; NaN if not in the response.
+    QByteArray cells;                   //!< The row up to the rates, ready to write.
+} ExportRow;
+
+typedef struct
+{
+    const MeterField *fields;           //!< Field table of the data type.
+    QVector<int> columns;               //!< Fields written, by index in fields.
+    int rateField[ExportRateCount];     //!< Index in fields of each rate's counter; -1 if not in the data type.
+    FrameBatchDecoder decoder;          //!< Decodes the numeric fields written and the rates' counters.
+} ExportLayout;
+
+/*!
+ * \brief ExportLayoutFor -- Work out the columns of a data type.
+ * \param dataType  '3' for v.3 response, 'A' or 'B' for v.4 responses.
+ * \param selected  Fields to write; empty for all.
+ * \return The layout.
+ */
+static ExportLayout ExportLayoutFor(const uint8_t dataType, const QStringList &selected)
+{
+    ExportLayout layout;
+    int fieldCount;
+    layout.fields = MeterFieldTable(dataType, &fieldCount);
+    for (int i = 0; i < fieldCount; i++)
+        if (selected.isEmpty() || selected.contains(layout.fields[i].name))
+            layout.columns.append(i);
+    QVector<int> numbers = layout.columns;
+    for (int r = 0; r < ExportRateCount; r++)
+    {
+        layout.rateField[r] = -1;
+        for (int i = 0; i < fieldCount; i++)
+            if (strcmp(layout.fields[i].name, ExportRateSources[r]) == 0)
+                layout.rateField[r] = i;
+        if (layout.rateField[r] >= 0)
+            numbers.append(layout.rateField[r]);
+    }
+    layout.decoder = FrameBatchDecoder(dataType, numbers);
+    return layout;
+}
+
+/*!
+ * \brief ExportHeader -- Header line of the CSV files of a data type.
+ * \param layout    Layout of the data type.
+ * \return The line, with its newline.
+ */
+static QByteArray ExportHeader(const ExportLayout &layout)
+{
+    QByteArray header("captureTime,crcValid");
+    foreach (int column, layout.columns)
+        header.append(',').append(layout.fields[column].name);
+    for (int r = 0; r < ExportRateCount; r++)
+        if (layout.rateField[r] >= 0)
+            header.append(',').append(ExportRateNames[r]);
+    header.append('\n');
+    return header;
+}
+
+/*!
+ * \brief DecodeExportFrame -- Decode a response into a row.
+ * \param frame     The response.
+ * \param layout    Layout of its data type.
+ * \param columns   Numeric fields of the batch the response is in, from layout.decoder.
+ * \param index     Index of the response in the batch.
+ * \param row       Receives the row.
+ */
+static void DecodeExportFrame(const ExportFrame &frame, const ExportLayout &layout, const DecodedColumns &columns, const int index, ExportRow *row)
+{
+    row->captureUSecs = frame.captureUSecs;
+    row->dataType = frame.dataType;
+    row->crcValid = frame.crcValid;
+    int kwhDecimals = KwhDecimals(frame.dataType, frame.frame);
+    row->cells = CaptureTimeToUtcText(CaptureTime{0, frame.captureUSecs}).toLatin1();
+    row->cells.append(frame.crcValid ? ",1" : ",0");
+    foreach (int column, layout.columns)
+    {
+        const MeterField &field = layout.fields[column];
+        row->cells.append(',');
+        if (field.kind == FieldText)
+        {
+            QByteArray text = MeterFieldText(frame.frame, field).toLatin1();
+            row->cells.append('"').append(text.replace("\"", "\"\"")).append('"');
+            continue;
+        }
+        double value = BatchFieldNumber(columns, layout.fields, column, index, kwhDecimals);
+        if (!qIsNaN(value))
+            row->cells.append(QByteArray::number(value, 'f', (field.kind == FieldKwh) ? kwhDecimals : field.decimals));
+    }
+    for (int r = 0; r < ExportRateCount; r++)
+        row->rateSource[r] = (layout.rateField[r] >= 0)
+                ? BatchFieldNumber(columns, layout.fields, layout.rateField[r], index, kwhDecimals) : qQNaN();
+}
+
+/*!
+ * \brief The ExportDecoder class -- Decode a chunk of responses on a pool thread.
+ *
+ * The numeric fields of the responses of each data type in the chunk are
+ * decoded together by the layout's FrameBatchDecoder, then the rows made.
+ */
+class ExportDecoder : public QRunnable
+{
+public:
+    ExportDecoder(const QVector<ExportFrame> *chunk, const QHash<int, ExportLayout> *dataTypeLayouts, QVector<ExportRow> *decoded)
+        : frames(chunk), layouts(dataTypeLayouts), rows(decoded) {}
+    void run()
+    {
+        rows->resize(frames->size());
+        QMap<int, QVector<int> > indexes;
+        for (int i = 0; i < frames->size(); i++)
+            indexes[frames->at(i).dataType].append(i);
+        for (QMap<int, QVector<int> >::const_iterator it = indexes.constBegin(); it != indexes.constEnd(); ++it)
+        {
+            const ExportLayout &layout = *layouts->constFind(it.key());
+            const QVector<int> &batch = it.value();
+            QVector<const uint8_t *> batchFrames(batch.size());
+            for (int j = 0; j < batch.size(); j++)
+                batchFrames[j] = frames->at(batch[j]).frame;
+            DecodedColumns columns;
+            layout.decoder.decode(batchFrames, &columns);
+            for (int j = 0; j < batch.size(); j++)
+                DecodeExportFrame(frames->at(batch[j]), layout, columns, j, &(*rows)[batch[j]]);
+        }
+    }
+
+private:
+    const QVector<ExportFrame> *frames;         //!< The responses.
+    const QHash<int, ExportLayout> *layouts;    //!< Layout of each data type; not changed while decoding.
+    QVector<ExportRow> *rows;                   //!< Receives a row for each response.
+};
+
+/*!
+ * \brief The ExportFile class -- The CSV files of one meter and data type.
+ */
+class ExportFile
+{
+public:
+    ExportFile(const QString &outputDir, const QString &meterId, const uint8_t dataType, const ExportLayout &dataTypeLayout, const int maxRows)
+        : directory(outputDir)
+        , baseName(meterId + "_" + DataTypeName(dataType))
+        , layout(dataTypeLayout)
+        , fileRows(maxRows)
+        , rowsInFile(0)
+        , files(0)
+        , rows(0)
+        , havePrevious(false)
+        , previousUSecs(0)
+    {
+        for (int r = 0; r < ExportRateCount; r++)
+            previous[r] = 0;
+    }
+
+    bool write(const ExportRow &row);
+    bool close();
+
+    qint64 rowCount() const { return rows; }
+    int fileCount() const { return files; }
+
+private:
+    bool openNext();
+
+    QString directory;                      //!< Directory the files go in.
+    QString baseName;                       //!< File names less the file number.
+    ExportLayout layout;                    //!< Layout of the data type.
+    int fileRows;                           //!< Most rows in one file.
+    QFile file;                             //!< File being written.
+    int rowsInFile;                         //!< Rows written to it.
+    int files;                              //!< Files written.
+    qint64 rows;                            //!< Rows written to all the files.
+    bool havePrevious;                      //!< previous holds the counters of a good response.
+    qint64 previousUSecs;                   //!< Capture time of that response.
+    double previous[ExportRateCount];       //!< Its counters.
+};
+
+/*!
+ * \brief ExportFile::openNext -- Close the file being written, if any, and start the next.
+ * \return true if successful, false otherwise.
+ */
+bool ExportFile::openNext()
+{
+    if (!close())
+        return false;
+    file.setFileName(QDir(directory).filePath(QString("%1_%2.csv").arg(baseName).arg(files, 5, 10, QChar('0'))));
+    if (!file.open(QIODevice::WriteOnly | QIODevice::Truncate))
+    {
+        qCritical("Unable to create %s: %s", qUtf8Printable(file.fileName()), qUtf8Printable(file.errorString()));
+        return false;
+    }
+    files++;
+    rowsInFile = 0;
+    return file.write(ExportHeader(layout)) > 0;
+}
+
+/*!
+ * \brief ExportFile::write -- Write a row, with the rates since the previous good row.
+ * \param row   The row.
+ * \return true if successful, false otherwise.
+ */
+bool ExportFile::write(const ExportRow &row)
+{
+    if ((!file.isOpen() || (rowsInFile >= fileRows)) && !openNext())
+        return false;
+    QByteArray line = row.cells;
+    bool good = row.crcValid;
+    qint64 usecs = row.captureUSecs - previousUSecs;
+    for (int r = 0; r < ExportRateCount; r++)
+    {
+        if (layout.rateField[r] < 0)
+            continue;
+        line.append(',');
+        double delta = row.rateSource[r] - previous[r];
+        if (qIsNaN(row.rateSource[r]))
+            good = false;
+        else if (havePrevious && row.crcValid && (usecs > 0) && (delta >= 0))
+            line.append(QByteArray::number(delta * ExportRateUSecs[r] / usecs, 'f', 3));
+    }
+    line.append('\n');
+    if (file.write(line) != line.size())
+    {
+        qCritical("Unable to write %s: %s", qUtf8Printable(file.fileName()), qUtf8Printable(file.errorString()));
+        return false;
+    }
+    rowsInFile++;
+    rows++;
+    havePrevious = good;
+    if (good)
+    {
+        previousUSecs = row.captureUSecs;
+        for (int r = 0; r < ExportRateCount; r++)
+            previous[r] = row.rateSource[r];
+    }
+    return true;
+}
+
+bool ExportFile::close()
+{
+    if (!file.isOpen())
+        return true;
+    bool success = file.flush();
+    file.close();
+    return success;
+}
+
+/*!
+ * \brief The ExportPipeline class -- Decode responses in chunks on a thread pool and write their rows in order.
+ */
+class ExportPipeline
+{
+public:
+    ExportPipeline(const ExportOptions &exportOptions);
+    ~ExportPipeline();
+
+    bool beginMeter(const QString &meterId);
+    bool add(const qint64 captureUSecs, const uint8_t dataType, const bool crcValid, const uint8_t *frame);
+    bool endMeter();
+
+private:
+    bool drain();
+
+    const ExportOptions &options;           //!< What to export.
+    QThreadPool pool;                       //!< Decoding threads.
+    int maxPending;                         //!< Chunks decoded at a time.
+    QHash<int, ExportLayout> layouts;       //!< Layout of each data type.
+    QList<QVector<ExportFrame> > pending;   //!< Chunks read and not yet decoded; the last is being filled.
+    QString meter;                          //!< Meter being exported.
+    QMap<int, ExportFile *> files;          //!< Files of the meter, by data type.
+    bool failed;                            //!< A file of the meter couldn't be written.
+};
+
+ExportPipeline::ExportPipeline(const ExportOptions &exportOptions)
+    : options(exportOptions)
+    , failed(false)
+{
+    int threads = (options.threads > 0) ? options.threads : QThread::idealThreadCount();
+    pool.setMaxThreadCount(qMax(1, threads));
+    maxPending = 2 * qMax(1, threads);
+    const uint8_t dataTypes[] = {'3', 'A', 'B'};
+    for (uint i = 0; i < sizeof(dataTypes); i++)
+        layouts.insert(dataTypes[i], ExportLayoutFor(dataTypes[i], options.fields));
+}
+
+ExportPipeline::~ExportPipeline()
+{
+    pool.waitForDone();
+    qDeleteAll(files);
+}
+
+bool ExportPipeline::beginMeter(const QString &meterId)
+{
+    meter = meterId;
+    failed = false;
+    return true;
+}
+
+/*!
+ * \brief ExportPipeline::add -- Add a response of the meter; responses of a data type must come in time order.
+ * \param captureUSecs  Wall clock time (usec since epoch) the response was captured.
+ * \param dataType      '3' for v.3 response, 'A' or 'B' for v.4 responses.
+ * \param crcValid      The response CRC was valid.
+ * \param frame         The response.
+ * \return true if successful, false if writing failed.
+ */
+bool ExportPipeline::add(const qint64 captureUSecs, const uint8_t dataType, const bool crcValid, const uint8_t *frame)
+{
+    if (!layouts.contains(dataType))
+        return true;
+    if (pending.isEmpty() || (pending.last().size() >= ExportChunkFrames))
+    {
+        if ((pending.size() >= maxPending) && !drain())
+            return false;
+        pending.append(QVector<ExportFrame>());
+        pending.last().reserve(ExportChunkFrames);
+    }
+    pending.last().resize(pending.last().size() + 1);
+    ExportFrame &added = pending.last().last();
+    added.captureUSecs = captureUSecs;
+    added.dataType = dataType;
+    added.crcValid = crcValid;
+    memcpy(added.frame, frame, FrameSize);
+    return true;
+}
+
+/*!
+ * \brief ExportPipeline::drain -- Decode the chunks read so far and write their rows.
+ * \return true if successful, false otherwise.
+ */
+bool ExportPipeline::drain()
+{
+    QVector<QVector<ExportRow> > decoded(pending.size());
+    for (int i = 0; i < pending.size(); i++)
+        pool.start(new ExportDecoder(&pending[i], &layouts, &decoded[i]));
+    pool.waitForDone();
+    pending.clear();
+    for (int i = 0; (i < decoded.size()) && !failed; i++)
+    {
+        foreach (const ExportRow &row, decoded[i])
+        {
+            ExportFile *&file = files[row.dataType];
+            if (file == NULL)
+                file = new ExportFile(options.outputDir, meter, row.dataType, layouts[row.dataType], options.fileRows);
+            if (!file->write(row))
+            {
+                failed = true;
+                break;
+            }
+        }
+    }
+    return !failed;
+}
+
+/*!
+ * \brief ExportPipeline::endMeter -- Write what is left of the meter and close its files.
+ * \return true if successful, false otherwise.
+ */
+bool ExportPipeline::endMeter()
+{
+    QTextStream out(stdout);
+    bool success = drain();
+    qint64 rows = 0;
+    int fileCount = 0;
+    foreach (ExportFile *file, files)
+    {
+        success = file->close() && success;
+        rows += file->rowCount();
+        fileCount += file->fileCount();
+    }
+    qDeleteAll(files);
+    files.clear();
+    out << "Meter " << meter << ": " << rows << " rows in " << fileCount << " files." << endl;
+    return success;
+}
+
+/*!
+ * \brief CrcValid -- Whether the CRC of a response read from a database is valid.
+ * \param frame     The response.
+ * \return true if it is.
+ */
+static bool CrcValid(const uint8_t *frame)
+{
+    return computeEkmCrc(frame + 1, FrameSize - 3) == ((frame[FrameSize - 2] << 8) | frame[FrameSize - 1]);
+}
+
+/*!
+ * \brief UtcTextToUSecs -- Convert text written by CaptureTimeToUtcText() back to usec since the epoch.
+ * \param text  "yyyy-MM-dd HH:mm:ss.uuuuuu", fraction optional.
+ * \return The time; 0 if not valid.
+ */
+static qint64 UtcTextToUSecs(const QString &text)
+{
+    QDateTime dateTime = QDateTime::fromString(text.left(19), "yyyy-MM-dd HH:mm:ss");
+    if (!dateTime.isValid())
+        return 0;
+    dateTime.setTimeSpec(Qt::UTC);
+    QString fraction = text.mid(20, 6).leftJustified(6, '0');
+    return dateTime.toMSecsSinceEpoch() * 1000ll + fraction.toLongLong();
+}
+
+/*!
+ * \brief ExportTableBaseName -- The name a meter's per meter tables start with.
+ * \param options   What to export.
+ * \param meterId   The meter, expanded to 12 digits.
+ * \return The table base name from the fleet config, or the meter id.
+ */
+static QString ExportTableBaseName(const ExportOptions &options, const QString &meterId)
+{
+    return options.tableBaseNames.value(meterId, meterId);
+}
+
+/*!
+ * \brief ExportFromArchive -- Read the responses of a meter from the archive.
+ * \param options   What to export.
+ * \param meterId   The meter, expanded to 12 digits.
+ * \param pipeline  Receives the responses.
+ * \return true if successful, false otherwise.
+ */
+static bool ExportFromArchive(const ExportOptions &options, const QString &meterId, ExportPipeline *pipeline)
+{
+    ArchiveReader reader(options.archiveDir, meterId);
+    if (!reader.seek(options.from.toMSecsSinceEpoch() * 1000ll, options.to.toMSecsSinceEpoch() * 1000ll))
+    {
+        qWarning("No archive segments for meter %s in %s in the time range.", qUtf8Printable(meterId), qUtf8Printable(options.archiveDir));
+        return true;
+    }
+    const ArchiveRecord *record;
+    while ((record = reader.next()) != NULL)
+        if (!pipeline->add(record->captureUSecs, record->dataType, (record->flags & ArchiveFlagCrcValid) != 0, record->frame))
+            return false;
+    return true;
+}
+
+/*!
+ * \brief ExportFromMySql -- Read the responses of a meter from the MySQL database.
+ * \param options       What to export.
+ * \param meterId       The meter, expanded to 12 digits.
+ * \param partitioned   Read the partitioned table instead of the meter's tables.
+ * \param pipeline      Receives the responses.
+ * \return true if successful, false otherwise.
+ */
+static bool ExportFromMySql(const ExportOptions &options, const QString &meterId, const bool partitioned, ExportPipeline *pipeline)
+{
+    QSqlQuery query(DbPool->connection());
+    query.setForwardOnly(true);
+    CaptureTime from = {0, options.from.toMSecsSinceEpoch() * 1000ll};
+    CaptureTime to = {0, options.to.toMSecsSinceEpoch() * 1000ll};
+    if (partitioned)
+    {
+        query.prepare(QString("SELECT DataType, DATE_FORMAT(CaptureTime, '%Y-%m-%d %H:%i:%s.%f'), MeterData FROM %1"
+                              " WHERE MeterId = ? AND CaptureTime >= ? AND CaptureTime < ? ORDER BY DataType, CaptureTime")
+                      .arg(PartitionedTableName));
+        query.bindValue(0, meterId);
+        query.bindValue(1, CaptureTimeToUtcText(from));
+        query.bindValue(2, CaptureTimeToUtcText(to));
+        if (!DbPool->exec(query))
+        {
+            qCritical("Unable to read %s: %s", PartitionedTableName, qUtf8Printable(query.lastError().text()));
+            return false;
+        }
+        while (query.next())
+        {
+            QByteArray frame = query.value(2).toByteArray();
+            QByteArray dataTypeName = query.value(0).toString().toLatin1();
+            if ((frame.size() != FrameSize) || dataTypeName.isEmpty())
+                continue;
+            uint8_t dataType = (uint8_t)dataTypeName.at(dataTypeName.size() - 1);
+            if (!pipeline->add(UtcTextToUSecs(query.value(1).toString()), dataType, CrcValid((const uint8_t *)frame.constData())
+                               , (const uint8_t *)frame.constData()))
+                return false;
+        }
+        return true;
+    }
+
+    const QString tableBaseName = ExportTableBaseName(options, meterId);
+    int tablesFound = 0;
+    const uint8_t dataTypes[] = {'3', 'A', 'B'};
+    for (uint i = 0; i < sizeof(dataTypes); i++)
+    {
+        QString tableName = tableBaseName + DataKind(dataTypes[i]) + "_RawMeterData";
+        query.prepare("SELECT COUNT(*) FROM INFORMATION_SCHEMA.TABLES WHERE TABLE_SCHEMA = DATABASE() AND TABLE_NAME = ?");
+        query.bindValue(0, tableName);
+        if (!DbPool->exec(query) || !query.next())
+        {
+            qCritical("Unable to look for table %s: %s", qUtf8Printable(tableName), qUtf8Printable(query.lastError().text()));
+            return false;
+        }
+        if (query.value(0).toInt() == 0)
+            continue;
+        tablesFound++;
+        query.prepare(QString("SELECT CAST(UNIX_TIMESTAMP(ComputerTime) * 1000000 AS SIGNED), MeterData FROM `%1`"
+                              " WHERE ComputerTime >= FROM_UNIXTIME(CAST(? AS DECIMAL(17,6)))"
+                              " AND ComputerTime < FROM_UNIXTIME(CAST(? AS DECIMAL(17,6))) ORDER BY ComputerTime").arg(tableName));
+        query.bindValue(0, CaptureTimeToSql(from));
+        query.bindValue(1, CaptureTimeToSql(to));
+        if (!DbPool->exec(query))
+        {
+            qCritical("Unable to read %s: %s", qUtf8Printable(tableName), qUtf8Printable(query.lastError().text()));
+            return false;
+        }
+        while (query.next())
+        {
+            QByteArray frame = query.value(1).toByteArray();
+            if (frame.size() != FrameSize)
+                continue;
+            if (!pipeline->add(query.value(0).toLongLong(), dataTypes[i], CrcValid((const uint8_t *)frame.constData())
+                               , (const uint8_t *)frame.constData()))
+                return false;
+        }
+    }
+    if (tablesFound == 0)
+        qWarning("No tables named %s<V3|V4A|V4B>_RawMeterData for meter %s; nothing exported for it."
+                 , qUtf8Printable(tableBaseName), qUtf8Printable(meterId));
+    return true;
+}
+
+/*!
+ * \brief ExportFromSqlite -- Read the responses of a meter from a local SQLite database.
+ *
+ * Packed responses are read from the last keyframe at or before the time
+ * range, so the first in the range can be unpacked.
+ *
+ * \param options   What to export.
+ * \param meterId   The meter, expanded to 12 digits.
+ * \param packed    The database holds packed responses.
+ * \param pipeline  Receives the responses.
+ * \return true if successful, false otherwise.
+ */
+static bool ExportFromSqlite(const ExportOptions &options, const QString &meterId, const bool packed, ExportPipeline *pipeline)
+{
+    QSqlQuery query(QSqlDatabase::database(ExportConnectionName));
+    query.setForwardOnly(true);
+    qint64 fromUSecs = options.from.toMSecsSinceEpoch() * 1000ll;
+    QString from = CaptureTimeToUtcText(CaptureTime{0, fromUSecs});
+    QString to = CaptureTimeToUtcText(CaptureTime{0, options.to.toMSecsSinceEpoch() * 1000ll});
+    const QString tableBaseName = ExportTableBaseName(options, meterId);
+    const char *tableSuffix = packed ? "_PackedMeterData" : "_RawMeterData";
+    int tablesFound = 0;
+    const uint8_t dataTypes[] = {'3', 'A', 'B'};
+    for (uint i = 0; i < sizeof(dataTypes); i++)
+    {
+        QString tableName = tableBaseName + DataKind(dataTypes[i]) + tableSuffix;
+        query.prepare("SELECT COUNT(*) FROM sqlite_master WHERE type = 'table' AND name = ?");
+        query.bindValue(0, tableName);
+        if (!query.exec() || !query.next())
+        {
+            qCritical("Unable to look for table %s: %s", qUtf8Printable(tableName), qUtf8Printable(query.lastError().text()));
+            return false;
+        }
+        if (query.value(0).toInt() == 0)
+            continue;
+        tablesFound++;
+        if (packed)
+        {
+            query.prepare(QString("SELECT ComputerTime, PackedData FROM \"%1\" WHERE idRawMeterData >= COALESCE("
+                                  "(SELECT MAX(idRawMeterData) FROM \"%1\" WHERE KeyFrame = 1 AND ComputerTime <= ?), 0)"
+                                  " AND ComputerTime < ? ORDER BY idRawMeterData").arg(tableName));
+        }
+        else
+        {
+            query.prepare(QString("SELECT ComputerTime, MeterData FROM \"%1\""
+                                  " WHERE ComputerTime >= ? AND ComputerTime < ? ORDER BY idRawMeterData").arg(tableName));
+        }
+        query.bindValue(0, from);
+        query.bindValue(1, to);
+        if (!query.exec())
+        {
+            qCritical("Unable to read %s: %s", qUtf8Printable(tableName), qUtf8Printable(query.lastError().text()));
+            return false;
+        }
+        FrameCodec codec;
+        qint64 damaged = 0;
+        while (query.next())
+        {
+            QByteArray data = query.value(1).toByteArray();
+            uint8_t frame[FrameSize];
+            if (packed)
+            {
+                if (!codec.unpack(dataTypes[i], (const uint8_t *)data.constData(), data.size(), frame))
+                {
+                    damaged++;
+                    continue;
+                }
+            }
+            else if (data.size() == FrameSize)
+                memcpy(frame, data.constData(), FrameSize);
+            else
+                continue;
+            qint64 captureUSecs = UtcTextToUSecs(query.value(0).toString());
+            if (captureUSecs < fromUSecs)
+                continue;
+            if (!pipeline->add(captureUSecs, dataTypes[i], CrcValid(frame), frame))
+                return false;
+        }
+        if (damaged > 0)
+            qWarning("%lld packed responses in %s could not be unpacked.", damaged, qUtf8Printable(tableName));
+    }
+    if (tablesFound == 0)
+        qWarning("No tables named %s<V3|V4A|V4B>%s for meter %s; nothing exported for it."
+                 , qUtf8Printable(tableBaseName), tableSuffix, qUtf8Printable(meterId));
+    return true;
+}
+
+/*!
+ * \brief ExportReadings -- Export the stored responses of a set of meters as CSV files.
+ *
+ * The MySQL connection (DbPool) must be made first for the mysql sources.
+ *
+ * \param options   What to export.
+ * \return Program exit status.
+ */
+int ExportReadings(const ExportOptions &options)
+{
+    qDebug("Begin");
+    QTextStream out(stdout);
+    QString source = options.source;
+    bool packed = false;
+    if (source.startsWith("sqlite:packed:"))
+        packed = true;
+    bool partitioned = (source == "mysql:partitioned");
+    if ((source != "archive") && (source != "mysql") && !partitioned && !source.startsWith("sqlite:"))
+    {
+        qCritical("Unknown export source \"%s\".  Return 1", qUtf8Printable(source));
+        return 1;
+    }
+    if (source.startsWith("mysql") && (DbPool == NULL))
+    {
+        qCritical("No database connection for export.  Return 1");
+        return 1;
+    }
+    if (source.startsWith("sqlite:"))
+    {
+        QString fileName = source.mid(packed ? sizeof("sqlite:packed:") - 1 : sizeof("sqlite:") - 1);
+        QSqlDatabase dbConn = QSqlDatabase::addDatabase("QSQLITE", ExportConnectionName);
+        dbConn.setDatabaseName(fileName);
+        dbConn.setConnectOptions("QSQLITE_OPEN_READONLY");
+        if (!dbConn.open())
+        {
+            qCritical("Unable to open SQLite database %s: %s  Return 1", qUtf8Printable(fileName), qUtf8Printable(dbConn.lastError().text()));
+            return 1;
+        }
+    }
+    if (options.fields.size() > 0)
+    {
+        QStringList known;
+        const uint8_t dataTypes[] = {'3', 'A', 'B'};
+        for (uint i = 0; i < sizeof(dataTypes); i++)
+        {
+            int fieldCount;
+            const MeterField *fields = MeterFieldTable(dataTypes[i], &fieldCount);
+            for (int f = 0; f < fieldCount; f++)
+                known << fields[f].name;
+        }
+        foreach (QString field, options.fields)
+        {
+            if (!known.contains(field))
+            {
+                qCritical("No field \"%s\" in any response.  Return 1", qUtf8Printable(field));
+                return 1;
+            }
+        }
+    }
+    if (!QDir().mkpath(options.outputDir))
+    {
+        qCritical("Unable to create directory %s.  Return 1", qUtf8Printable(options.outputDir));
+        return 1;
+    }
+
+    QElapsedTimer timer;
+    timer.start();
+    bool success = true;
+    {
+        ExportPipeline pipeline(options);
+        foreach (QString meterId, options.meterIds)
+        {
+            QString fullMeterId = meterId.trimmed().rightJustified(sizeof(RequestMsgV4.meterId), '0', true);
+            pipeline.beginMeter(fullMeterId);
+            bool read;
+            if (source == "archive")
+                read = ExportFromArchive(options, fullMeterId, &pipeline);
+            else if (source.startsWith("mysql"))
+                read = ExportFromMySql(options, fullMeterId, partitioned, &pipeline);
+            else
+                read = ExportFromSqlite(options, fullMeterId, packed, &pipeline);
+            success = pipeline.endMeter() && read && success;
+        }
+    }
+    if (source.startsWith("sqlite:"))
+        QSqlDatabase::removeDatabase(ExportConnectionName);
+    out << "Exported in " << (timer.nsecsElapsed() / 1000000) << " msec." << endl;
+    qDebug("Return %d", success ? 0 : 1);
+    return success ? 0 : 1;
+}
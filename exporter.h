@@ -0,0 +1,85 @@
+/*!
+@file
+@brief Header file describing the export of stored responses as columns of decoded fields.
+
+--export reads the responses of a set of meters in a time range (--from,
+--to) from the archive or a database, decodes them, and writes them as CSV
+files of columns for analysis elsewhere.  The source is one of
+
+    archive             the response archive in --archive-dir (framearchive.h)
+    mysql               the per meter tables in the MySQL database
+    mysql:partitioned   the partitioned table in the MySQL database
+    sqlite:<file>       the per meter tables of a local SQLite database
+    sqlite:packed:<file>  the same, holding packed responses (framecodec.h)
+
+Per meter tables are looked for under the table base name the fleet config
+(--fleet-config) gives the meter with table=, or else under the meter id
+expanded to 12 digits.  A meter with none of its tables is warned of.
+
+Reading a source is sequential, and is usually the cheaper part; decoding
+is spread over a thread pool.  The responses are read in chunks of
+ExportChunkFrames; up to twice as many chunks as there are threads are
+decoded at a time, and their rows written in order when all are done, so
+memory use stays bounded however long the time range.  Within a chunk the
+numeric fields are decoded a data type at a time by a FrameBatchDecoder
+(batchdecode.h).
+
+Each meter and data type has its own files, named
+<meter id>_<V3|V4A|V4B>_<nnnnn>.csv, each with a header line and at most
+--export-rows rows.  A row is the capture time (UTC), whether the response
+CRC was valid, the selected fields (--export-fields, default all the fields
+of the data type), and the rates derived from the counters in the data type:
+
+    kW              from totalKwh over the time since the previous row
+    pulseRate1..3   pulses per minute, from pulseCount1..3
+
+A rate is left empty on the first row of a meter and data type, and after a
+response with a bad CRC or a counter that went down.  Numbers that are not
+all digits in the response are left empty too.
+
+Arrow IPC output would need a library this program doesn't otherwise use;
+the CSV chunks load directly into Arrow, pandas or a database instead.
+
+@author Thomas A. DeMay
+@date 2015
+@par    Copyright (C) 2015  Thomas A. DeMay
+@par
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    any later version.
+@par
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+@par
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#ifndef EXPORTER_H
+#define EXPORTER_H
+#include <QtCore>
+
+static const int ExportChunkFrames = 4096;      //!< Responses decoded by one thread at a time.
+static const int ExportFileRows = 1000000;      //!< Default most rows in one CSV file.
+
+typedef struct
+{
+    QStringList meterIds;       //!< Meters to export.
+    QHash<QString, QString> tableBaseNames; //!< Table base names from the fleet config, by 12 digit meter id.
+    QString source;             //!< Where to read the responses; see above.
+    QString archiveDir;         //!< Archive directory, for the archive source.
+    QDateTime from;             //!< Beginning of time range.
+    QDateTime to;               //!< End of time range.
+    QString outputDir;          //!< Directory to write the CSV files in.
+    QStringList fields;         //!< Fields to write; empty for all.
+    int fileRows;               //!< Most rows in one CSV file.
+    int threads;                //!< Decoding threads; 0 for one per core.
+} ExportOptions;
+
+int ExportReadings(const ExportOptions &options);
+
+#endif // EXPORTER_H
@@ -0,0 +1,238 @@
+/*!
+@file
+@brief Read the description of the fleet of meters.
+
+@author Thomas A. DeMay
+@date 2015
+@par    Copyright (C) 2015  Thomas A. DeMay
+@par
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    any later version.
+@par
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+@par
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include "fleetconfig.h"
+#include "messages.h"
+#include "../SupportRoutines/supportfunctions.h"
+
+QString FleetConfigFileName;
+static QDateTime FleetConfigLastModified;       //!< Modification time of fleet config file when last loaded.
+
+bool MeterConfig::operator==(const MeterConfig &other) const
+{
+    return (meterId == other.meterId)
+            && (protocolVersion == other.protocolVersion)
+            && (portName == other.portName)
+            && (aToBRatio == other.aToBRatio)
+            && (tableBaseName == other.tableBaseName)
+            && (output1File == other.output1File)
+            && (output2File == other.output2File);
+}
+
+/*!
+ * \brief GuessProtocolVersion -- Guess meter protocol version from its serial number.
+ *
+ * v.4 Omnimeters have serial numbers of 300000000 and above.
+ *
+ * \param fullMeterId   Meter serial number expanded to 12 characters.
+ * \return 4 for a v.4 meter, otherwise 3.
+ */
+int GuessProtocolVersion(const QString &fullMeterId)
+{
+    return (fullMeterId.toLongLong() >= 300000000) ? 4 : 3;
+}
+
+/*!
+ * \brief InitialADataCount -- Compute the A read count so that B reads happen at the same
+ * wall clock times no matter when the program is started.
+ * \param interval      Minutes between reads.
+ * \param aToBRatio     Number of A reads before a B read.
+ * \return The starting value for the A read count.
+ */
+int InitialADataCount(const int interval, const int aToBRatio)
+{
+    if ((interval <= 0) || (aToBRatio <= 0))
+        return 0;
+    qint64 t = QDateTime::currentMSecsSinceEpoch() / 60000;     // number of min since epoch
+    t = t / interval;                                           // number of intervals since epoch
+    t = t % aToBRatio;                              // number of intervals till next B read.
+    return t - 1;
+}
+
+/*!
+ * \brief FleetFromArgs -- Build the fleet description from meter ids on the command line.
+ *
+ * Every v.4 meter gets its output 2 bound to the ".WeatherWet" file.
+ *
+ * \param args          Meter ids from the command line.
+ * \param portName      Serial device all the meters are connected to.
+ * \param aToBRatio     Number of A reads before a B read.
+ * \return List of meter configurations.
+ */
+QList<MeterConfig> FleetFromArgs(const QStringList &args, const QString &portName, const int aToBRatio)
+{
+    QList<MeterConfig> configs;
+    foreach (QString meterId, args)
+    {
+        MeterConfig config;
+        config.meterId = meterId.rightJustified(sizeof(RequestMsgV4.meterId), '0', true);
+        config.protocolVersion = GuessProtocolVersion(config.meterId);
+        config.portName = portName;
+        config.aToBRatio = aToBRatio;
+        config.tableBaseName = config.meterId;
+        if (config.protocolVersion == 4)
+            config.output2File = ".WeatherWet";
+        configs.append(config);
+    }
+    return configs;
+}
+
+/*!
+ * \brief LoadFleetConfig -- Read the fleet configuration file.
+ *
+ * The file is in ini format.  Each group is named for a meter id; keys
+ * within the group are all optional:
+ *
+ *     [300002570]
+ *     protocol=4                      ; 3 or 4; guessed from meter id if absent.
+ *     port=cu.usbserial-AH034Y93      ; serial device; -s option value if absent.
+ *     aToBRatio=15                    ; -n option value if absent; 0 => never read B.
+ *     table=000300002570              ; table name prefix; the 12 digit meter id if absent.
+ *     output1File=                    ; output 1 ON while ~/<file> exists.
+ *     output2File=.WeatherWet         ; output 2 ON while ~/<file> exists.
+ *     enabled=true                    ; false to leave the meter out of the fleet.
+ *
+ * \param fileName          Name of the configuration file.
+ * \param defaultPortName   Serial device to use for meters without a port key.
+ * \param defaultAToBRatio  A to B ratio to use for meters without an aToBRatio key.
+ * \param configs           Pointer to list to receive the meter configurations.
+ * \return true if successful, false otherwise.
+ */
+bool LoadFleetConfig(const QString &fileName, const QString &defaultPortName, const int defaultAToBRatio, QList<MeterConfig> *configs)
+{
+    qDebug("Begin");
+    QFileInfo fileInfo(fileName);
+    if (!fileInfo.exists())
+    {
+        qCritical("Fleet configuration file %s does not exist.", qUtf8Printable(fileName));
+        qDebug("Return false");
+        return false;
+    }
+    QSettings settings(fileName, QSettings::IniFormat);
+    if (settings.status() != QSettings::NoError)
+    {
+        qCritical("Fleet configuration file %s could not be parsed.", qUtf8Printable(fileName));
+        qDebug("Return false");
+        return false;
+    }
+    FleetConfigLastModified = fileInfo.lastModified();
+
+    QList<MeterConfig> newConfigs;
+    foreach (QString group, settings.childGroups())
+    {
+        settings.beginGroup(group);
+        if (!settings.value("enabled", true).toBool())
+        {
+            qInfo("Meter %s is disabled in fleet configuration.", qUtf8Printable(group));
+            settings.endGroup();
+            continue;
+        }
+        MeterConfig config;
+        config.meterId = group.rightJustified(sizeof(RequestMsgV4.meterId), '0', true);
+        config.protocolVersion = settings.value("protocol", GuessProtocolVersion(config.meterId)).toInt();
+        config.portName = settings.value("port", defaultPortName).toString();
+        config.aToBRatio = settings.value("aToBRatio", defaultAToBRatio).toInt();
+        config.tableBaseName = settings.value("table", config.meterId).toString();
+        config.output1File = settings.value("output1File").toString();
+        config.output2File = settings.value("output2File").toString();
+        settings.endGroup();
+        if ((config.protocolVersion != 3) && (config.protocolVersion != 4))
+        {
+            qWarning("Meter %s has unknown protocol version %d; ignored."
+                     , qUtf8Printable(config.meterId), config.protocolVersion);
+            continue;
+        }
+        qDebug("Meter %s: protocol %d, port %s, aToBRatio %d, table %s"
+               , qUtf8Printable(config.meterId)
+               , config.protocolVersion
+               , qUtf8Printable(config.portName)
+               , config.aToBRatio
+               , qUtf8Printable(config.tableBaseName));
+        newConfigs.append(config);
+    }
+    *configs = newConfigs;
+    qDebug("Return true; %d meters configured.", newConfigs.size());
+    return true;
+}
+
+/*!
+ * \brief FleetConfigChanged -- Check whether the fleet configuration should be reloaded.
+ *
+ * The configuration is reloaded if the file has been modified since it was
+ * last loaded, or if the magic file ".ReloadReadEKM" exists in the home directory.
+ * The magic file is removed.
+ *
+ * \return true if the fleet configuration should be reloaded.
+ */
+bool FleetConfigChanged()
+{
+    if (FleetConfigFileName.isEmpty())
+        return false;
+    bool changed = false;
+    if (QFile::exists(QDir::homePath() + "/.ReloadReadEKM"))
+    {
+        qDebug("Reload fleet configuration because magic file \".ReloadReadEKM\" seen.");
+        QFile::remove(QDir::homePath() + "/.ReloadReadEKM");
+        changed = true;
+    }
+    QFileInfo fileInfo(FleetConfigFileName);
+    if (fileInfo.exists() && (fileInfo.lastModified() != FleetConfigLastModified))
+    {
+        qDebug("Fleet configuration file %s has been modified.", qUtf8Printable(FleetConfigFileName));
+        changed = true;
+    }
+    return changed;
+}
+
+/*!
+ * \brief FleetPortNames -- List the distinct serial devices used by the fleet.
+ * \param fleet     The fleet.
+ * \return Names of serial devices.
+ */
+QStringList FleetPortNames(const QList<MeterEntry> &fleet)
+{
+    QStringList portNames;
+    foreach (const MeterEntry &entry, fleet)
+    {
+        if (!portNames.contains(entry.config.portName))
+            portNames.append(entry.config.portName);
+    }
+    return portNames;
+}
+
+/*!
+ * \brief FirstMeterOnPort -- The first meter in the fleet connected to a serial device.
+ * \param fleet     The fleet.
+ * \param portName  Name of the serial device.
+ * \return The meter's configuration, or NULL if no meter is on the device.
+ */
+const MeterConfig *FirstMeterOnPort(const QList<MeterEntry> &fleet, const QString &portName)
+{
+    /* Not foreach; it iterates over a copy of the list. */
+    for (int i = 0; i < fleet.size(); i++)
+    {
+        if (fleet[i].config.portName == portName)
+            return &fleet[i].config;
+    }
+    return NULL;
+}
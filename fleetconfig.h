@@ -0,0 +1,76 @@
+/*!
+@file
+@brief Header file describing the fleet of meters to be read.
+
+The fleet is normally described by a configuration file (QSettings ini format)
+with one group per meter.  For compatibility, a fleet can also be built from
+meter ids given on the command line.
+
+@author Thomas A. DeMay
+@date 2015
+@par    Copyright (C) 2015  Thomas A. DeMay
+@par
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    any later version.
+@par
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+@par
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#ifndef FLEETCONFIG_H
+#define FLEETCONFIG_H
+#include <QtCore>
+#include "clockskew.h"
+
+/*!
+ * \brief The MeterConfig class -- Static description of one meter in the fleet.
+ */
+class MeterConfig
+{
+public:
+    QString meterId;            //!< Meter serial number expanded to 12 characters.
+    int protocolVersion;        //!< Either 3 or 4.
+    QString portName;           //!< Name of the serial device the meter is connected to, or tcp:<host>:<port>; see tcpgateway.h.
+    int aToBRatio;              //!< Number of A reads before a B read; zero means never read B.
+    QString tableBaseName;      //!< Tables are named <tableBaseName><dataKind>_RawMeterData.
+    QString output1File;        //!< Output 1 is ON while this file (relative to home) exists; empty => not controlled.
+    QString output2File;        //!< Output 2 is ON while this file (relative to home) exists; empty => not controlled.
+
+    bool operator==(const MeterConfig &other) const;
+    bool operator!=(const MeterConfig &other) const { return !(*this == other); }
+};
+
+/*!
+ * \brief The MeterEntry class -- A meter in the fleet along with its run time state.
+ *
+ * Run time state is preserved when the fleet configuration is reloaded
+ * so long as the meter remains in the fleet.
+ */
+class MeterEntry
+{
+public:
+    MeterConfig config;         //!< Configuration of the meter.
+    int aDataCount;             //!< Number of A reads since the last B read.
+    bool timeSetPending;        //!< Meter time should be set at the next opportunity.
+    ClockSkewEstimator clockSkew;   //!< Tracks how far the meter clock is from the computer clock.
+};
+
+extern QString FleetConfigFileName;         //!< Name of the fleet configuration file; empty if none.
+
+int GuessProtocolVersion(const QString &fullMeterId);
+int InitialADataCount(const int interval, const int aToBRatio);
+QList<MeterConfig> FleetFromArgs(const QStringList &args, const QString &portName, const int aToBRatio);
+bool LoadFleetConfig(const QString &fileName, const QString &defaultPortName, const int defaultAToBRatio, QList<MeterConfig> *configs);
+bool FleetConfigChanged();
+QStringList FleetPortNames(const QList<MeterEntry> &fleet);
+const MeterConfig *FirstMeterOnPort(const QList<MeterEntry> &fleet, const QString &portName);
+
+#endif // FLEETCONFIG_H
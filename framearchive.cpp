@@ -0,0 +1,585 @@
+/*!
+@file
+@brief Write and read the binary archive of meter responses.
+
+@author Thomas A. DeMay
+@date 2015
+@par    Copyright (C) 2015  Thomas A. DeMay
+@par
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    any later version.
+@par
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+@par
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include "framearchive.h"
+
+static const char ArchiveMagic[8] = {'E', 'K', 'M', 'A', 'R', 'C', 'V', '1'};
+static const char ArchivePackedMagic[8] = {'E', 'K', 'M', 'A', 'R', 'C', 'P', '1'};
+
+/*!
+ * \brief ArchiveDay -- Name of the day segment that holds a capture time.
+ * \param usecs     Wall clock time (usec since epoch).
+ * \return UTC date as yyyyMMdd.
+ */
+QString ArchiveDay(const qint64 usecs)
+{
+    return QDateTime::fromMSecsSinceEpoch(usecs / 1000, Qt::UTC).toString("yyyyMMdd");
+}
+
+/*!
+ * \brief SegmentSuffix -- Ending of the names of segment files.
+ * \param packed    Packed segments.
+ * \return ".ekmp" if packed, ".ekma" otherwise.
+ */
+static QString SegmentSuffix(const bool packed)
+{
+    return packed ? ".ekmp" : ".ekma";
+}
+
+/*!
+ * \brief IndexSuffix -- Ending of the names of segment index files.
+ * \param packed    Index of packed segments.
+ * \return ".ekpi" if packed, ".ekmi" otherwise.
+ */
+static QString IndexSuffix(const bool packed)
+{
+    return packed ? ".ekpi" : ".ekmi";
+}
+
+/*!
+ * \brief ParsePackedRecord -- Pick apart a record of a packed segment.
+ * \param in        Start of the record; advanced past it if successful.
+ * \param end       End of the segment.
+ * \param usecs     Receives the capture time as written.
+ * \param dataType  Receives the data type.
+ * \param flags     Receives the flags.
+ * \param packed    Receives the start of the packed response.
+ * \param size      Receives the bytes in the packed response.
+ * \return true if the whole record is there, false otherwise.
+ */
+static bool ParsePackedRecord(const uint8_t *&in, const uint8_t *end, qint64 *usecs, uint8_t *dataType, uint8_t *flags
+                              , const uint8_t **packed, int *size)
+{
+    const uint8_t *p = in;
+    quint64 packedSize, time;
+    if (!GetVarint(p, end, &packedSize) || !GetVarint(p, end, &time) || ((end - p) < 2)
+            || (packedSize > (quint64)(end - p - 2)))
+        return false;
+    *usecs = (qint64)time;
+    *dataType = *p++;
+    *flags = *p++;
+    *packed = p;
+    *size = (int)packedSize;
+    in = p + packedSize;
+    return true;
+}
+
+ArchiveWriter::ArchiveWriter(const QString &archiveDir, const bool packedSegments)
+    : directory(archiveDir)
+    , packed(packedSegments)
+{
+    qDebug("Archive directory is %s%s", qUtf8Printable(directory), packed ? "; segments are packed" : "");
+}
+
+ArchiveWriter::~ArchiveWriter()
+{
+    close();
+}
+
+/*!
+ * \brief ArchiveWriter::close -- Close all open segments.
+ */
+void ArchiveWriter::close()
+{
+    foreach (OpenSegment segment, segments)
+    {
+        segment.file->close();
+        delete segment.file;
+    }
+    segments.clear();
+}
+
+/*!
+ * \brief ArchiveWriter::openSegment -- Open (creating if needed) the segment for a meter and day.
+ *
+ * A partial record left at the end of the segment (program killed while writing)
+ * is removed.
+ *
+ * \param meterId   Meter serial number expanded to 12 characters.
+ * \param day       yyyyMMdd of the segment.
+ * \param segment   Receives the open segment.
+ * \return true if successful, false otherwise.
+ */
+bool ArchiveWriter::openSegment(const QString &meterId, const QString &day, OpenSegment *segment)
+{
+    qDebug("Begin");
+    QString meterDirectory = directory + "/" + meterId;
+    if (!QDir().mkpath(meterDirectory))
+    {
+        qCritical("Unable to create archive directory %s", qUtf8Printable(meterDirectory));
+        qDebug("Return false");
+        return false;
+    }
+    QFile *file = new QFile(meterDirectory + "/" + day + SegmentSuffix(packed));
+    if (!file->open(QIODevice::ReadWrite))
+    {
+        qCritical("Unable to open archive segment %s: %s", qUtf8Printable(file->fileName()), qUtf8Printable(file->errorString()));
+        delete file;
+        qDebug("Return false");
+        return false;
+    }
+    ArchiveSegmentHeader header;
+    if (file->size() == 0)
+    {
+        memset(&header, 0, sizeof(header));
+        memcpy(header.magic, packed ? ArchivePackedMagic : ArchiveMagic, sizeof(header.magic));
+        header.headerSize = sizeof(ArchiveSegmentHeader);
+        header.recordSize = packed ? 0 : sizeof(ArchiveRecord);
+        memcpy(header.meterId, qPrintable(meterId), sizeof(header.meterId));
+        header.indexStride = ArchiveIndexStride;
+        if (file->write((const char *)&header, sizeof(header)) != sizeof(header))
+        {
+            qCritical("Unable to write archive segment header %s", qUtf8Printable(file->fileName()));
+            file->close();
+            delete file;
+            qDebug("Return false");
+            return false;
+        }
+    }
+    else if ((file->read((char *)&header, sizeof(header)) != sizeof(header))
+             || (memcmp(header.magic, packed ? ArchivePackedMagic : ArchiveMagic, sizeof(header.magic)) != 0)
+             || (header.recordSize != (packed ? 0 : sizeof(ArchiveRecord))))
+    {
+        qCritical("Archive segment %s is not a version 1 archive segment; not appending to it.", qUtf8Printable(file->fileName()));
+        file->close();
+        delete file;
+        qDebug("Return false");
+        return false;
+    }
+    segment->file = file;
+    segment->day = day;
+    segment->codec.reset();
+    segment->lastUSecs = 0;
+    if (packed)
+        return scanPackedSegment(file, header.headerSize, segment);
+    segment->recordCount = (file->size() - header.headerSize) / header.recordSize;
+    qint64 endOfRecords = header.headerSize + segment->recordCount * header.recordSize;
+    if (file->size() != endOfRecords)
+    {
+        qWarning("Archive segment %s has a partial record at the end; removed.", qUtf8Printable(file->fileName()));
+        file->resize(endOfRecords);
+    }
+    file->seek(endOfRecords);
+    qDebug("Return true; segment %s has %lld records.", qUtf8Printable(file->fileName()), segment->recordCount);
+    return true;
+}
+
+/*!
+ * \brief ArchiveWriter::scanPackedSegment -- Count the records of a packed segment and go to its end.
+ *
+ * A partial record left at the end of the segment (program killed while writing)
+ * is removed.
+ *
+ * \param file          The open segment file.
+ * \param headerSize    Size of the segment header.
+ * \param segment       Receives the record count.
+ * \return true.
+ */
+bool ArchiveWriter::scanPackedSegment(QFile *file, const qint64 headerSize, OpenSegment *segment)
+{
+    file->seek(headerSize);
+    QByteArray records = file->readAll();
+    const uint8_t *in = (const uint8_t *)records.constData();
+    const uint8_t *end = in + records.size();
+    qint64 usecs;
+    uint8_t dataType, flags;
+    const uint8_t *packedFrame;
+    int size;
+    segment->recordCount = 0;
+    while ((in < end) && ParsePackedRecord(in, end, &usecs, &dataType, &flags, &packedFrame, &size))
+        segment->recordCount++;
+    qint64 endOfRecords = headerSize + (in - (const uint8_t *)records.constData());
+    if (file->size() != endOfRecords)
+    {
+        qWarning("Archive segment %s has a partial record at the end; removed.", qUtf8Printable(file->fileName()));
+        file->resize(endOfRecords);
+    }
+    file->seek(endOfRecords);
+    qDebug("Return true; packed segment %s has %lld records.", qUtf8Printable(file->fileName()), segment->recordCount);
+    return true;
+}
+
+/*!
+ * \brief ArchiveWriter::append -- Append a response to the archive.
+ * \param meterId       Meter serial number expanded to 12 characters.
+ * \param dataType      '3' for v.3 response, 'A' or 'B' for v.4 responses.
+ * \param frame         The 255 byte response.
+ * \param captureTime   When the response was captured.
+ * \param crcValid      Whether the response CRC was valid.
+ * \return true if successful, false otherwise.
+ */
+bool ArchiveWriter::append(const QString &meterId, const uint8_t dataType, const uint8_t *frame, const CaptureTime &captureTime, const bool crcValid)
+{
+    QString day = ArchiveDay(captureTime.wallUSecs);
+    if (segments.contains(meterId) && (segments.value(meterId).day != day))
+    {
+        OpenSegment segment = segments.take(meterId);
+        segment.file->close();
+        delete segment.file;
+    }
+    if (!segments.contains(meterId))
+    {
+        OpenSegment segment;
+        if (!openSegment(meterId, day, &segment))
+            return false;
+        segments.insert(meterId, segment);
+    }
+    OpenSegment &segment = segments[meterId];
+
+    if ((segment.recordCount % ArchiveIndexStride) == 0)
+    {
+        /* Reading a packed segment can start here. */
+        segment.codec.reset();
+        segment.lastUSecs = 0;
+        QFile indexFile(directory + "/" + meterId + "/" + day + IndexSuffix(packed));
+        ArchiveIndexEntry indexEntry;
+        indexEntry.captureUSecs = captureTime.wallUSecs;
+        indexEntry.recordNumber = packed ? segment.file->pos() : segment.recordCount;
+        if (!indexFile.open(QIODevice::WriteOnly | QIODevice::Append)
+                || (indexFile.write((const char *)&indexEntry, sizeof(indexEntry)) != sizeof(indexEntry)))
+            qWarning("Unable to write archive index %s; readers will scan from the start of the day.", qUtf8Printable(indexFile.fileName()));
+    }
+
+    QByteArray data;
+    uint8_t flags = crcValid ? ArchiveFlagCrcValid : 0;
+    if (packed)
+    {
+        QByteArray packedFrame = segment.codec.pack(dataType, frame);
+        qint64 usecs = captureTime.wallUSecs - segment.lastUSecs;
+        if ((segment.lastUSecs == 0) || (usecs < 0))
+        {
+            flags |= ArchiveFlagTimeBase;
+            usecs = captureTime.wallUSecs;
+        }
+        PutVarint(data, packedFrame.size());
+        PutVarint(data, usecs);
+        data.append((char)dataType);
+        data.append((char)flags);
+        data.append(packedFrame);
+        segment.lastUSecs = captureTime.wallUSecs;
+    }
+    else
+    {
+        ArchiveRecord record;
+        memset(&record, 0, sizeof(record));
+        record.captureUSecs = captureTime.wallUSecs;
+        record.dataType = dataType;
+        record.flags = flags;
+        memcpy(record.frame, frame, sizeof(record.frame));
+        data = QByteArray((const char *)&record, sizeof(record));
+    }
+
+    qint64 recordStart = segment.file->pos();
+    if (segment.file->write(data) != data.size())
+    {
+        qCritical("Unable to write archive segment %s: %s", qUtf8Printable(segment.file->fileName()), qUtf8Printable(segment.file->errorString()));
+        /* Leave no partial record; the next packed record must not depend on this one. */
+        segment.file->resize(recordStart);
+        segment.file->seek(recordStart);
+        segment.codec.reset();
+        segment.lastUSecs = 0;
+        return false;
+    }
+    segment.file->flush();
+    segment.recordCount++;
+    return true;
+}
+
+ArchiveReader::ArchiveReader(const QString &archiveDir, const QString &meterId)
+    : meterDirectory(archiveDir + "/" + meterId)
+    , startUSecs(0)
+    , endUSecs(0)
+    , file(NULL)
+    , mapped(NULL)
+    , records(NULL)
+    , recordCount(0)
+    , recordIndex(0)
+    , packedSegment(false)
+    , segmentSize(0)
+    , packedOffset(0)
+    , lastUSecs(0)
+{
+}
+
+ArchiveReader::~ArchiveReader()
+{
+    unmapSegment();
+}
+
+/*!
+ * \brief ArchiveReader::segmentFiles -- List all the segments of the meter in time order.
+ *
+ * Packed and unpacked segments are both listed; a day with both has its
+ * unpacked segment first.
+ *
+ * \return Segment file names.
+ */
+QStringList ArchiveReader::segmentFiles() const
+{
+    return QDir(meterDirectory).entryList(QStringList() << "*.ekma" << "*.ekmp", QDir::Files, QDir::Name);
+}
+
+/*!
+ * \brief ArchiveReader::seek -- Set the time range that next() returns records from.
+ * \param fromUSecs     Beginning of range (usec since epoch).
+ * \param toUSecs       End of range, exclusive (usec since epoch).
+ * \return true if there is at least one segment in the range.
+ */
+bool ArchiveReader::seek(const qint64 fromUSecs, const qint64 toUSecs)
+{
+    unmapSegment();
+    startUSecs = fromUSecs;
+    endUSecs = toUSecs;
+    pending.clear();
+    QString fromDay = ArchiveDay(fromUSecs);
+    QString toDay = ArchiveDay(toUSecs - 1);
+    foreach (QString fileName, segmentFiles())
+    {
+        QString day = fileName.left(8);
+        if ((day >= fromDay) && (day <= toDay))
+            pending.append(fileName);
+    }
+    return !pending.isEmpty();
+}
+
+/*!
+ * \brief ArchiveReader::next -- Get the next record in the time range.
+ *
+ * The record points into the memory mapped segment, and is valid till the
+ * next call of next() or seek().
+ *
+ * \return Pointer to the record, NULL if there are no more.
+ */
+const ArchiveRecord *ArchiveReader::next()
+{
+    while (true)
+    {
+        const ArchiveRecord *record;
+        while ((record = nextInSegment()) != NULL)
+        {
+            if (record->captureUSecs >= endUSecs)
+            {
+                // Records are in time order; nothing more in range.
+                pending.clear();
+                break;
+            }
+            if (record->captureUSecs >= startUSecs)
+                return record;
+        }
+        unmapSegment();
+        if (pending.isEmpty())
+            return NULL;
+        QString fileName = pending.takeFirst();
+        if (mapSegment(fileName))
+        {
+            if (packedSegment)
+                packedOffset = qMax(packedOffset, firstRecordAtOrAfter(fileName, startUSecs));
+            else
+                recordIndex = firstRecordAtOrAfter(fileName, startUSecs);
+        }
+    }
+}
+
+/*!
+ * \brief ArchiveReader::nextInSegment -- Get the next record of the current segment.
+ *
+ * A packed record is unpacked into a record of the fixed layout.  Packed
+ * records that can't be unpacked are passed over with a warning.
+ *
+ * \return Pointer to the record, NULL at the end of the segment.
+ */
+const ArchiveRecord *ArchiveReader::nextInSegment()
+{
+    if (!packedSegment)
+        return (recordIndex < recordCount) ? &records[recordIndex++] : NULL;
+    const uint8_t *end = mapped + segmentSize;
+    while (packedOffset < segmentSize)
+    {
+        const uint8_t *in = mapped + packedOffset;
+        qint64 usecs;
+        uint8_t dataType, flags;
+        const uint8_t *packedFrame;
+        int size;
+        if (!ParsePackedRecord(in, end, &usecs, &dataType, &flags, &packedFrame, &size))
+        {
+            qWarning("Archive segment %s ends with a partial record.", qUtf8Printable(file->fileName()));
+            break;
+        }
+        packedOffset = in - mapped;
+        lastUSecs = ((flags & ArchiveFlagTimeBase) != 0) ? usecs : lastUSecs + usecs;
+        if (!codec.unpack(dataType, packedFrame, size, unpacked.frame))
+        {
+            qWarning("Unable to unpack a %c record of archive segment %s; passed over.", dataType, qUtf8Printable(file->fileName()));
+            continue;
+        }
+        unpacked.captureUSecs = lastUSecs;
+        unpacked.dataType = dataType;
+        unpacked.flags = flags & ArchiveFlagCrcValid;
+        return &unpacked;
+    }
+    packedOffset = segmentSize;
+    return NULL;
+}
+
+/*!
+ * \brief ArchiveReader::mapSegment -- Memory map a segment.
+ * \param fileName  Name of segment file within the meter directory.
+ * \return true if successful, false otherwise.
+ */
+bool ArchiveReader::mapSegment(const QString &fileName)
+{
+    file = new QFile(meterDirectory + "/" + fileName);
+    if (!file->open(QIODevice::ReadOnly) || (file->size() < (qint64)sizeof(ArchiveSegmentHeader)))
+    {
+        qWarning("Unable to read archive segment %s", qUtf8Printable(file->fileName()));
+        unmapSegment();
+        return false;
+    }
+    mapped = file->map(0, file->size());
+    if (mapped == NULL)
+    {
+        qWarning("Unable to map archive segment %s: %s", qUtf8Printable(file->fileName()), qUtf8Printable(file->errorString()));
+        unmapSegment();
+        return false;
+    }
+    const ArchiveSegmentHeader *header = (const ArchiveSegmentHeader *)mapped;
+    packedSegment = fileName.endsWith(SegmentSuffix(true));
+    if ((memcmp(header->magic, packedSegment ? ArchivePackedMagic : ArchiveMagic, sizeof(header->magic)) != 0)
+            || (header->recordSize != (packedSegment ? 0 : sizeof(ArchiveRecord))))
+    {
+        qWarning("Archive segment %s is not a version 1 archive segment.", qUtf8Printable(file->fileName()));
+        unmapSegment();
+        return false;
+    }
+    if (packedSegment)
+    {
+        segmentSize = file->size();
+        packedOffset = header->headerSize;
+        lastUSecs = 0;
+        codec.reset();
+        memset(&unpacked, 0, sizeof(unpacked));
+        return true;
+    }
+    records = (const ArchiveRecord *)(mapped + header->headerSize);
+    recordCount = (file->size() - header->headerSize) / header->recordSize;
+    recordIndex = 0;
+    return true;
+}
+
+/*!
+ * \brief ArchiveReader::unmapSegment -- Release the current segment.
+ */
+void ArchiveReader::unmapSegment()
+{
+    if (file != NULL)
+    {
+        if (mapped != NULL)
+            file->unmap(mapped);
+        file->close();
+        delete file;
+    }
+    file = NULL;
+    mapped = NULL;
+    records = NULL;
+    recordCount = 0;
+    recordIndex = 0;
+    packedSegment = false;
+    segmentSize = 0;
+    packedOffset = 0;
+}
+
+/*!
+ * \brief ArchiveReader::firstRecordAtOrAfter -- Use the sparse index to skip records before a time.
+ * \param fileName  Name of segment file within the meter directory.
+ * \param usecs     Time wanted (usec since epoch).
+ * \return Number of a record at or before the first record at or after usecs;
+ *         for a packed segment, the offset of a record where reading can start.
+ */
+qint64 ArchiveReader::firstRecordAtOrAfter(const QString &fileName, const qint64 usecs) const
+{
+    QFile indexFile(meterDirectory + "/" + fileName.left(8) + IndexSuffix(packedSegment));
+    if (!indexFile.open(QIODevice::ReadOnly))
+        return 0;
+    QByteArray indexData = indexFile.readAll();
+    const ArchiveIndexEntry *entries = (const ArchiveIndexEntry *)indexData.constData();
+    int numEntries = indexData.size() / sizeof(ArchiveIndexEntry);
+    qint64 recordNumber = 0;
+    for (int i = 0; (i < numEntries) && (entries[i].captureUSecs < usecs); i++)
+        recordNumber = entries[i].recordNumber;
+    return packedSegment ? qMin(recordNumber, segmentSize) : qMin(recordNumber, recordCount);
+}
+
+/*!
+ * \brief ScanArchive -- Read the archived responses of a meter in a time range.
+ *
+ * Prints a summary of what was found and how long it took; optionally
+ * prints each record.
+ *
+ * \param archiveDir    Archive directory.
+ * \param meterId       Meter serial number.
+ * \param from          Beginning of time range.
+ * \param to            End of time range.
+ * \param printRecords  Print each record as well as the summary.
+ * \return Program exit status.
+ */
+int ScanArchive(const QString &archiveDir, const QString &meterId, const QDateTime &from, const QDateTime &to, const bool printRecords)
+{
+    QTextStream out(stdout);
+    QString fullMeterId = meterId.rightJustified(sizeof(RequestMsgV4.meterId), '0', true);
+    ArchiveReader reader(archiveDir, fullMeterId);
+    QElapsedTimer timer;
+    timer.start();
+    qint64 counts[3] = {0, 0, 0};
+    qint64 badCrcCount = 0, firstUSecs = 0, lastUSecs = 0;
+    if (!reader.seek(from.toMSecsSinceEpoch() * 1000ll, to.toMSecsSinceEpoch() * 1000ll))
+    {
+        out << "No archive segments for meter " << fullMeterId << " in " << archiveDir << " in the time range." << endl;
+        return 1;
+    }
+    const ArchiveRecord *record;
+    while ((record = reader.next()) != NULL)
+    {
+        if (firstUSecs == 0)
+            firstUSecs = record->captureUSecs;
+        lastUSecs = record->captureUSecs;
+        counts[(record->dataType == 'A') ? 0 : ((record->dataType == 'B') ? 1 : 2)]++;
+        if ((record->flags & ArchiveFlagCrcValid) == 0)
+            badCrcCount++;
+        if (printRecords)
+        {
+            out << CaptureTimeToDateTime(CaptureTime{0, record->captureUSecs}).toString("yyyy-MM-dd HH:mm:ss.zzz")
+                << " " << (char)record->dataType
+                << " " << (((record->flags & ArchiveFlagCrcValid) != 0) ? "ok " : "bad")
+                << " " << QByteArray((const char *)record->frame, sizeof(record->frame)).toHex()
+                << endl;
+        }
+    }
+    qint64 nsecs = timer.nsecsElapsed();
+    out << "Meter " << fullMeterId << ": " << counts[0] << " A, " << counts[1] << " B, " << counts[2] << " v.3 records"
+        << ", " << badCrcCount << " with bad CRC." << endl;
+    if (firstUSecs != 0)
+        out << "First " << CaptureTimeToDateTime(CaptureTime{0, firstUSecs}).toString(Qt::ISODate)
+            << "  last " << CaptureTimeToDateTime(CaptureTime{0, lastUSecs}).toString(Qt::ISODate) << endl;
+    out << "Scanned in " << (nsecs / 1000) << " usec." << endl;
+    return 0;
+}
@@ -0,0 +1,159 @@
+/*!
+@file
+@brief Header file describing the binary archive of meter responses.
+
+The archive is a directory with a subdirectory for each meter.  Each meter
+subdirectory has a segment file for each (UTC) day, named yyyyMMdd.ekma,
+holding fixed size records of capture time plus the exact 255 byte response.
+Records are appended in capture time order.  Alongside each segment is a
+sparse index, yyyyMMdd.ekmi, with the capture time of every
+ArchiveIndexStride'th record.
+
+Segments are read by memory mapping them, so scanning long time ranges
+costs little more than touching the pages.
+
+A packed archive (raw:packed:<dir>) has segments named yyyyMMdd.ekmp, with
+index yyyyMMdd.ekpi, whose responses are packed by a FrameCodec (see
+framecodec.h).  Each record is
+
+    varint      bytes in the packed response
+    varint      capture time, usec since the previous record's, or since
+                the epoch if ArchiveFlagTimeBase
+    quint8      data type
+    quint8      flags
+    ...         the packed response
+
+At each index entry, whose recordNumber is the offset of the record in the
+segment, and when a segment is reopened for appending, the codec is reset
+and the time is given since the epoch, so reading can start there.
+
+@author Thomas A. DeMay
+@date 2015
+@par    Copyright (C) 2015  Thomas A. DeMay
+@par
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    any later version.
+@par
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+@par
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#ifndef FRAMEARCHIVE_H
+#define FRAMEARCHIVE_H
+#include <QtCore>
+#include "messages.h"
+#include "capturetime.h"
+#include "framecodec.h"
+
+static const int ArchiveIndexStride = 64;       //!< One index entry for this many records.
+
+typedef struct
+{
+    char magic[8];              //!< "EKMARCV1"
+    quint32 headerSize;         //!< sizeof(ArchiveSegmentHeader)
+    quint32 recordSize;         //!< sizeof(ArchiveRecord)
+    char meterId[12];           //!< Meter serial number expanded to 12 characters.
+    quint32 indexStride;        //!< Records per index entry.
+    char reserved[32];
+} ArchiveSegmentHeader;
+
+typedef struct
+{
+    qint64 captureUSecs;        //!< Wall clock time (usec since epoch) the response was captured.
+    uint8_t dataType;           //!< '3' for v.3 response, 'A' or 'B' for v.4 responses.
+    uint8_t flags;              //!< ArchiveFlagCrcValid if the response CRC was valid.
+    uint8_t reserved[6];
+    uint8_t frame[255];         //!< Exact copy of the response.
+    uint8_t pad[1];
+} ArchiveRecord;
+
+typedef struct
+{
+    qint64 captureUSecs;        //!< Capture time of the indexed record.
+    qint64 recordNumber;        //!< Number of the record within its segment.
+} ArchiveIndexEntry;
+
+static const uint8_t ArchiveFlagCrcValid = 0x01;
+static const uint8_t ArchiveFlagTimeBase = 0x02;   //!< Packed record time is since the epoch.
+
+STATIC_ASSERT((sizeof(ArchiveSegmentHeader) == 64));
+STATIC_ASSERT((sizeof(ArchiveRecord) == 272));
+
+/*!
+ * \brief The ArchiveWriter class -- Append responses to the archive.
+ */
+class ArchiveWriter
+{
+public:
+    ArchiveWriter(const QString &archiveDir, const bool packedSegments = false);
+    ~ArchiveWriter();
+
+    bool append(const QString &meterId, const uint8_t dataType, const uint8_t *frame, const CaptureTime &captureTime, const bool crcValid);
+    void close();
+
+private:
+    typedef struct
+    {
+        QFile *file;            //!< Open segment file.
+        QString day;            //!< yyyyMMdd of the segment.
+        qint64 recordCount;     //!< Number of records in the segment.
+        FrameCodec codec;       //!< Packs the responses of a packed segment.
+        qint64 lastUSecs;       //!< Capture time of the last record of a packed segment; 0 after a reset.
+    } OpenSegment;
+
+    bool openSegment(const QString &meterId, const QString &day, OpenSegment *segment);
+    bool scanPackedSegment(QFile *file, const qint64 headerSize, OpenSegment *segment);
+
+    QString directory;                      //!< Archive directory.
+    bool packed;                            //!< Write packed segments.
+    QMap<QString, OpenSegment> segments;    //!< Open segment for each meter.
+};
+
+/*!
+ * \brief The ArchiveReader class -- Iterate over the archived responses of one meter in a time range.
+ */
+class ArchiveReader
+{
+public:
+    ArchiveReader(const QString &archiveDir, const QString &meterId);
+    ~ArchiveReader();
+
+    bool seek(const qint64 fromUSecs, const qint64 toUSecs);
+    const ArchiveRecord *next();
+    QStringList segmentFiles() const;
+
+private:
+    bool mapSegment(const QString &fileName);
+    void unmapSegment();
+    qint64 firstRecordAtOrAfter(const QString &fileName, const qint64 usecs) const;
+    const ArchiveRecord *nextInSegment();
+
+    QString meterDirectory;     //!< Directory holding the meter's segments.
+    QStringList pending;        //!< Segments still to be read.
+    qint64 startUSecs;          //!< Beginning of time range.
+    qint64 endUSecs;            //!< End of time range (exclusive).
+    QFile *file;                //!< Currently mapped segment file.
+    uchar *mapped;              //!< Mapping of current segment.
+    const ArchiveRecord *records;   //!< First record of current segment.
+    qint64 recordCount;         //!< Number of records in current segment.
+    qint64 recordIndex;         //!< Next record to return from current segment.
+    bool packedSegment;         //!< Current segment is packed.
+    qint64 segmentSize;         //!< Bytes in the current segment.
+    qint64 packedOffset;        //!< Offset of the next record of a packed segment.
+    qint64 lastUSecs;           //!< Capture time of the last packed record read.
+    FrameCodec codec;           //!< Unpacks the responses of a packed segment.
+    ArchiveRecord unpacked;     //!< Last packed record read.
+};
+
+QString ArchiveDay(const qint64 usecs);
+int ScanArchive(const QString &archiveDir, const QString &meterId, const QDateTime &from, const QDateTime &to, const bool printRecords);
+
+#endif // FRAMEARCHIVE_H
@@ -0,0 +1,297 @@
+/*!
+@file
+@brief Packed encoding of meter responses.
+
+@author Thomas A. DeMay
+@date 2015
+@par    Copyright (C) 2015  Thomas A. DeMay
+@par
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    any later version.
+@par
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+@par
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include "framecodec.h"
+#include "meterfields.h"
+
+/* Defined in EkmCRC.cpp. */
+uint16_t computeEkmCrc(const uint8_t *dat, uint16_t len);
+
+static const int CrcOffset = FrameSize - 2;     //!< 0 based offset of the CRC.
+static const int MaxDigitSpan = 18;             //!< Longest span of digits that fits a qint64.
+
+typedef struct
+{
+    int offset;         //!< 0 based offset of the span.
+    int length;         //!< Bytes in the span.
+} FrameSpan;
+
+/*!
+ * \brief FrameSpans -- The spans a response of a data type is cut into.
+ * \param dataType  '3' for v.3 response, 'A' or 'B' for v.4 responses.
+ * \return The fields of the response, and the runs of bytes between them, in order; the CRC left out.
+ */
+static const QVector<FrameSpan> &FrameSpans(const uint8_t dataType)
+{
+    static QHash<int, QVector<FrameSpan> > spansByType;
+    if (spansByType.contains(dataType))
+        return spansByType[dataType];
+    QVector<FrameSpan> spans;
+    int fieldCount;
+    const MeterField *fields = MeterFieldTable(dataType, &fieldCount);
+    int position = 0;
+    for (int i = 0; i < fieldCount; i++)
+    {
+        int offset = fields[i].sqlOffset - 1;
+        if ((offset < position) || (offset + fields[i].length > CrcOffset))
+            continue;
+        if (offset > position)
+            spans.append(FrameSpan{position, offset - position});
+        spans.append(FrameSpan{offset, fields[i].length});
+        position = offset + fields[i].length;
+    }
+    if (position < CrcOffset)
+        spans.append(FrameSpan{position, CrcOffset - position});
+    spansByType.insert(dataType, spans);
+    return spansByType[dataType];
+}
+
+/*!
+ * \brief SpanDigits -- Value of a span of digits.
+ * \param bytes     The span.
+ * \param length    Bytes in the span.
+ * \param value     Receives the value.
+ * \return true if the span has nothing but digits and is short enough, false otherwise.
+ */
+static bool SpanDigits(const uint8_t *bytes, const int length, qint64 *value)
+{
+    if (length > MaxDigitSpan)
+        return false;
+    qint64 digits = 0;
+    for (int i = 0; i < length; i++)
+    {
+        if ((bytes[i] < '0') || (bytes[i] > '9'))
+            return false;
+        digits = digits * 10 + (bytes[i] - '0');
+    }
+    *value = digits;
+    return true;
+}
+
+/*!
+ * \brief PutVarint -- Append a varint.
+ * \param out       Receives the varint.
+ * \param value     The value.
+ */
+void PutVarint(QByteArray &out, quint64 value)
+{
+    while (value >= 0x80)
+    {
+        out.append((char)((value & 0x7f) | 0x80));
+        value >>= 7;
+    }
+    out.append((char)value);
+}
+
+/*!
+ * \brief GetVarint -- Read a varint.
+ * \param in        Next byte to read; advanced past the varint.
+ * \param end       End of the bytes.
+ * \param value     Receives the value.
+ * \return true if successful, false if the bytes end first or it is too long.
+ */
+bool GetVarint(const uint8_t *&in, const uint8_t *end, quint64 *value)
+{
+    quint64 result = 0;
+    for (int shift = 0; (shift < 64) && (in < end); shift += 7)
+    {
+        uint8_t byte = *in++;
+        result |= (quint64)(byte & 0x7f) << shift;
+        if ((byte & 0x80) == 0)
+        {
+            *value = result;
+            return true;
+        }
+    }
+    return false;
+}
+
+static bool CrcValid(const uint8_t *frame)
+{
+    return computeEkmCrc(frame + 1, CrcOffset - 1) == ((frame[CrcOffset] << 8) | frame[CrcOffset + 1]);
+}
+
+FrameCodec::FrameCodec(const int keyframeInterval)
+    : interval(qMax(1, keyframeInterval))
+{
+}
+
+/*!
+ * \brief FrameCodec::reset -- Forget the previous responses; the next of each data type is a keyframe.
+ */
+void FrameCodec::reset()
+{
+    previous.clear();
+}
+
+/*!
+ * \brief FrameCodec::isKeyframe -- Whether a packed response can be unpacked without the ones before it.
+ * \param packed    The packed response.
+ * \return true if it is a keyframe.
+ */
+bool FrameCodec::isKeyframe(const QByteArray &packed)
+{
+    return !packed.isEmpty() && ((packed[0] & FramePackKeyframe) != 0);
+}
+
+/*!
+ * \brief FrameCodec::pack -- Pack a response against the previous one of its data type.
+ * \param dataType  '3' for v.3 response, 'A' or 'B' for v.4 responses.
+ * \param frame     The 255 byte response.
+ * \return The packed response.
+ */
+QByteArray FrameCodec::pack(const uint8_t dataType, const uint8_t *frame)
+{
+    QByteArray packed;
+    uint8_t flags = CrcValid(frame) ? FramePackCrcComputed : 0;
+    bool keyframe = !previous.contains(dataType) || (previous[dataType].sinceKeyframe >= interval);
+    Previous &last = previous[dataType];
+    if (keyframe)
+    {
+        packed.append((char)(flags | FramePackKeyframe));
+        packed.append((const char *)frame, CrcOffset);
+        last.sinceKeyframe = 0;
+    }
+    else
+    {
+        packed.append((char)flags);
+        const QVector<FrameSpan> &spans = FrameSpans(dataType);
+        QByteArray changes;
+        int changed = 0;
+        int lastChanged = -1;
+        for (int i = 0; i < spans.size(); i++)
+        {
+            const uint8_t *now = frame + spans[i].offset;
+            const uint8_t *before = last.frame + spans[i].offset;
+            if (memcmp(now, before, spans[i].length) == 0)
+                continue;
+            PutVarint(changes, i - lastChanged - 1);
+            lastChanged = i;
+            changed++;
+            qint64 nowValue, beforeValue;
+            if (SpanDigits(now, spans[i].length, &nowValue) && SpanDigits(before, spans[i].length, &beforeValue))
+            {
+                qint64 delta = nowValue - beforeValue;
+                quint64 zigzag = (delta < 0) ? ((quint64)(-delta) * 2 - 1) : ((quint64)delta * 2);
+                PutVarint(changes, zigzag << 1);
+            }
+            else
+            {
+                PutVarint(changes, 1);
+                changes.append((const char *)now, spans[i].length);
+            }
+        }
+        PutVarint(packed, changed);
+        packed.append(changes);
+    }
+    if ((flags & FramePackCrcComputed) == 0)
+        packed.append((const char *)frame + CrcOffset, 2);
+    memcpy(last.frame, frame, FrameSize);
+    last.sinceKeyframe++;
+    return packed;
+}
+
+/*!
+ * \brief FrameCodec::unpack -- Unpack a response packed by pack().
+ * \param dataType  '3' for v.3 response, 'A' or 'B' for v.4 responses.
+ * \param packed    The packed response.
+ * \param size      Bytes in the packed response.
+ * \param frame     Receives the 255 byte response.
+ * \return true if successful, false if the packed response is damaged or its previous response is missing.
+ */
+bool FrameCodec::unpack(const uint8_t dataType, const uint8_t *packed, const int size, uint8_t *frame)
+{
+    const uint8_t *in = packed;
+    const uint8_t *end = packed + size;
+    if (size < 1)
+        return false;
+    uint8_t flags = *in++;
+    uint8_t result[FrameSize];
+    if ((flags & FramePackKeyframe) != 0)
+    {
+        if ((end - in) < CrcOffset)
+            return false;
+        memcpy(result, in, CrcOffset);
+        in += CrcOffset;
+    }
+    else
+    {
+        if (!previous.contains(dataType))
+            return false;
+        memcpy(result, previous[dataType].frame, CrcOffset);
+        const QVector<FrameSpan> &spans = FrameSpans(dataType);
+        quint64 changed;
+        if (!GetVarint(in, end, &changed))
+            return false;
+        int span = -1;
+        for (quint64 n = 0; n < changed; n++)
+        {
+            quint64 skipped, code;
+            if (!GetVarint(in, end, &skipped) || (skipped >= (quint64)spans.size())
+                    || ((span += (int)skipped + 1) >= spans.size()) || !GetVarint(in, end, &code))
+                return false;
+            uint8_t *bytes = result + spans[span].offset;
+            const int length = spans[span].length;
+            if ((code & 1) != 0)
+            {
+                if ((code != 1) || ((end - in) < length))
+                    return false;
+                memcpy(bytes, in, length);
+                in += length;
+                continue;
+            }
+            qint64 value;
+            if (!SpanDigits(bytes, length, &value))
+                return false;
+            quint64 zigzag = code >> 1;
+            value += ((zigzag & 1) != 0) ? -(qint64)((zigzag + 1) / 2) : (qint64)(zigzag / 2);
+            if (value < 0)
+                return false;
+            for (int i = length - 1; i >= 0; i--, value /= 10)
+                bytes[i] = (uint8_t)('0' + (value % 10));
+            if (value != 0)
+                return false;
+        }
+    }
+    if ((flags & FramePackCrcComputed) != 0)
+    {
+        uint16_t crc = computeEkmCrc(result + 1, CrcOffset - 1);
+        result[CrcOffset] = (uint8_t)(crc >> 8);
+        result[CrcOffset + 1] = (uint8_t)crc;
+    }
+    else
+    {
+        if ((end - in) < 2)
+            return false;
+        memcpy(result + CrcOffset, in, 2);
+        in += 2;
+    }
+    if (in != end)
+        return false;
+
+    Previous &last = previous[dataType];
+    memcpy(last.frame, result, FrameSize);
+    last.sinceKeyframe = ((flags & FramePackKeyframe) != 0) ? 1 : last.sinceKeyframe + 1;
+    memcpy(frame, result, FrameSize);
+    return true;
+}
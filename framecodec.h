@@ -0,0 +1,98 @@
+/*!
+@file
+@brief Header file describing the packed encoding of meter responses.
+
+A 255 byte response is mostly the same from one reading of a meter to the
+next: the fixed bytes, model, meter id, ratios and padding don't change, and
+the readings change by small amounts.  A FrameCodec packs a response against
+the previous response of the same data type that it packed, and unpacks it
+again exactly, CRC included.
+
+The response is cut into spans: one for each field in the field tables
+(meterfields.h), and one for each run of bytes between fields, e.g. the
+meter id or the date and time.  The CRC is not a span.  A packed response
+is
+
+    quint8      flags: FramePackKeyframe, FramePackCrcComputed
+
+then for a keyframe the first 253 bytes of the response as they are, or
+otherwise
+
+    varint      number of spans that changed
+    for each:
+      varint    spans skipped since the last span that changed
+      varint    (zigzag(new value - old value) << 1) for a span of digits,
+                1 followed by the bytes of the span otherwise
+
+then, unless FramePackCrcComputed, the 2 CRC bytes.  A span is written as
+digits if it has nothing but digits, now and before, and no more than 18 of
+them.  The CRC is left out when it is valid, and computed again when the
+response is unpacked.  varints are unsigned LEB128.
+
+A response is a keyframe if there is no previous response of its data type,
+or every FrameKeyframeInterval'th response of the data type, so a reader
+never has far to go back to start unpacking.  A reader must unpack the
+responses in the order they were packed, starting at a keyframe of each
+data type; reset() forgets the previous responses, so the next one of each
+data type is a keyframe.
+
+A keyframe packs to 254 bytes (256 if its CRC is bad); a reading most of whose fields
+change by small amounts, to a few dozen.
+
+@author Thomas A. DeMay
+@date 2015
+@par    Copyright (C) 2015  Thomas A. DeMay
+@par
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    any later version.
+@par
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+@par
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#ifndef FRAMECODEC_H
+#define FRAMECODEC_H
+#include <QtCore>
+#include "frameparser.h"
+
+static const int FrameKeyframeInterval = 64;        //!< Responses of a data type from one keyframe to the next.
+static const uint8_t FramePackKeyframe = 0x01;      //!< The response is packed whole.
+static const uint8_t FramePackCrcComputed = 0x02;   //!< The CRC is valid and left out.
+
+/*!
+ * \brief The FrameCodec class -- Packs responses against the previous one of their data type, and unpacks them.
+ */
+class FrameCodec
+{
+public:
+    FrameCodec(const int keyframeInterval = FrameKeyframeInterval);
+
+    QByteArray pack(const uint8_t dataType, const uint8_t *frame);
+    bool unpack(const uint8_t dataType, const uint8_t *packed, const int size, uint8_t *frame);
+    void reset();
+
+    static bool isKeyframe(const QByteArray &packed);
+
+private:
+    typedef struct
+    {
+        uint8_t frame[FrameSize];   //!< Last response of the data type.
+        int sinceKeyframe;          //!< Responses since the last keyframe, including it.
+    } Previous;
+
+    QHash<int, Previous> previous;  //!< By data type.
+    int interval;                   //!< Responses of a data type from one keyframe to the next.
+};
+
+void PutVarint(QByteArray &out, quint64 value);
+bool GetVarint(const uint8_t *&in, const uint8_t *end, quint64 *value);
+
+#endif // FRAMECODEC_H
@@ -0,0 +1,135 @@
+/*!
+@file
+@brief Incremental parser of meter data responses.
+
+@author Thomas A. DeMay
+@date 2015
+@par    Copyright (C) 2015  Thomas A. DeMay
+@par
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    any later version.
+@par
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+@par
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include "frameparser.h"
+
+/* Offsets in a response; SQL offsets in messages.h less one. */
+static const int MeterIdBegin = 4;                      //!< First byte of the meter id.
+static const int MeterIdEnd = MeterIdBegin + 12;        //!< Byte after the meter id.
+static const int FixedEndBegin = FrameSize - 6;         //!< First byte of "!\r\n\x03".
+static const int CrcBegin = FrameSize - 2;              //!< First byte of the CRC.
+static const uint8_t FixedEnd[4] = {'!', '\r', '\n', '\x03'};
+
+FrameParser::FrameParser(const QString &expectedMeterId)
+    : discardedBytes(0)
+    , wrongMeters(0)
+    , badEnds(0)
+    , resyncs(0)
+    , meterId(expectedMeterId.toLatin1())
+    , length(0)
+    , crc(EkmCrcInit)
+    , complete(false)
+    , crcOk(false)
+{
+}
+
+/*!
+ * \brief FrameParser::feed -- Parse bytes received.
+ * \param data  The bytes.
+ * \param size  Number of bytes.
+ * \return Number of bytes used; less than size if the response completed before the end of data.
+ */
+int FrameParser::feed(const uint8_t *data, const int size)
+{
+    int used = 0;
+    while ((used < size) && !complete)
+        process(data[used++]);
+    return used;
+}
+
+/*!
+ * \brief FrameParser::process -- Parse one byte.
+ * \param byte  The byte.
+ */
+void FrameParser::process(const uint8_t byte)
+{
+    if (length == 0)
+    {
+        if (byte != 0x02)
+        {
+            discardedBytes++;
+            return;
+        }
+        buffer[length++] = byte;
+        crc = EkmCrcInit;
+        return;
+    }
+    int position = length;
+    buffer[length++] = byte;
+    if (position < CrcBegin)
+        crc = updateEkmCrc(crc, byte);
+    if ((position >= MeterIdBegin) && (position < MeterIdEnd) && (meterId.size() == (MeterIdEnd - MeterIdBegin))
+            && (byte != (uint8_t)meterId[position - MeterIdBegin]))
+    {
+        wrongMeters++;
+        resync();
+        return;
+    }
+    if ((position >= FixedEndBegin) && (position < CrcBegin) && (byte != FixedEnd[position - FixedEndBegin]))
+    {
+        badEnds++;
+        resync();
+        return;
+    }
+    if (length == FrameSize)
+    {
+        complete = true;
+        crcOk = (finishEkmCrc(crc) == ((buffer[CrcBegin] << 8) | buffer[CrcBegin + 1]));
+    }
+}
+
+/*!
+ * \brief FrameParser::resync -- Drop the STX the response started with and rescan the rest for another.
+ */
+void FrameParser::resync()
+{
+    resyncs++;
+    discardedBytes++;
+    QByteArray rest((const char *)buffer + 1, length - 1);
+    length = 0;
+    feed((const uint8_t *)rest.constData(), rest.size());
+}
+
+bool FrameParser::isComplete() const
+{
+    return complete;
+}
+
+/*!
+ * \brief FrameParser::bytesWanted -- Fewest bytes that could complete the response.
+ * \return The number of bytes.
+ */
+int FrameParser::bytesWanted() const
+{
+    return complete ? 0 : (FrameSize - length);
+}
+
+const uint8_t *FrameParser::frame() const
+{
+    return buffer;
+}
+
+bool FrameParser::crcValid() const
+{
+    return crcOk;
+}
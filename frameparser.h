@@ -0,0 +1,74 @@
+/*!
+@file
+@brief Header file describing the incremental parser of meter data responses.
+
+The parser is fed bytes as they arrive.  It skips anything before the STX
+(0x02) that starts a response, checks the meter id and the fixedEnd
+"!\r\n\x03" as those bytes arrive, and computes the CRC a byte at a time,
+so that it is known as soon as the last byte is in.  When the meter id or
+fixedEnd is wrong, the STX was a stray byte or the start of someone else's
+response; the parser drops it and rescans what it has for the next STX,
+so a misaligned response is salvaged without another request.
+
+@author Thomas A. DeMay
+@date 2015
+@par    Copyright (C) 2015  Thomas A. DeMay
+@par
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    any later version.
+@par
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+@par
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#ifndef FRAMEPARSER_H
+#define FRAMEPARSER_H
+#include <QtCore>
+#include "messages.h"
+
+static const uint16_t EkmCrcInit = 0xffff;      //!< CRC before any bytes.
+static const int FrameSize = 255;               //!< Size of every data response.
+
+uint16_t updateEkmCrc(uint16_t crc, uint8_t byte);
+uint16_t finishEkmCrc(uint16_t crc);
+
+/*!
+ * \brief The FrameParser class -- Find, check and collect a data response from a stream of bytes.
+ */
+class FrameParser
+{
+public:
+    FrameParser(const QString &expectedMeterId);
+
+    int feed(const uint8_t *data, const int size);
+    bool isComplete() const;
+    int bytesWanted() const;
+    const uint8_t *frame() const;
+    bool crcValid() const;
+
+    int discardedBytes;     //!< Bytes skipped looking for an STX.
+    int wrongMeters;        //!< Responses dropped because their meter id was wrong.
+    int badEnds;            //!< Responses dropped because their fixedEnd was wrong.
+    int resyncs;            //!< Times the parser rescanned for an STX.
+
+private:
+    void process(const uint8_t byte);
+    void resync();
+
+    QByteArray meterId;         //!< Meter id the response must have; if empty any is accepted.
+    uint8_t buffer[FrameSize];  //!< The response so far.
+    int length;                 //!< Bytes in buffer; 0 while looking for an STX.
+    uint16_t crc;               //!< CRC of buffer[1] through buffer[length - 1], up to the CRC bytes.
+    bool complete;              //!< buffer holds a whole response.
+    bool crcOk;                 //!< The complete response's CRC matched.
+};
+
+#endif // FRAMEPARSER_H
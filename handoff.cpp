@@ -0,0 +1,234 @@
+/*!
+@file
+@brief Restart of the program without missing a reading.
+
+@author Thomas A. DeMay
+@date 2015
+@par    Copyright (C) 2015  Thomas A. DeMay
+@par
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    any later version.
+@par
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+@par
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include "handoff.h"
+#include "storagesink.h"
+
+static QHash<QString, int> InheritedPortFds;        //!< Descriptor of each serial port handed over, by device name.
+static QHash<QString, qint32> InheritedBaudRates;   //!< Baud rate of each serial port handed over, by device name.
+
+/*!
+ * \brief HandOffState -- Write the state file and let go of the serial ports.
+ *
+ * If the state file can't be written, nothing is let go of and the program
+ * carries on as it was.
+ *
+ * \param fileName      The state file.
+ * \param fleet         The meters.
+ * \param serialPorts   Open serial ports indexed by device name; closed if successful.
+ * \param repeatCount   Reads of the meters still to do.
+ * \return true if successful, false otherwise.
+ */
+bool HandOffState(const QString &fileName, const QList<MeterEntry> &fleet, QMap<QString, QSerialPort *> &serialPorts
+                  , const int repeatCount)
+{
+    qInfo("Begin");
+    QJsonObject state;
+    state.insert("version", HandoffStateVersion);
+    state.insert("savedMSecs", QString::number(QDateTime::currentMSecsSinceEpoch()));
+    state.insert("repeatCount", repeatCount);
+
+    QJsonObject meters;
+    foreach (const MeterEntry &entry, fleet)
+    {
+        QJsonObject meter;
+        meter.insert("aDataCount", entry.aDataCount);
+        meter.insert("timeSetPending", entry.timeSetPending);
+        meter.insert("clockSkew", entry.clockSkew.saveState());
+        meters.insert(entry.config.meterId, meter);
+    }
+    state.insert("meters", meters);
+
+    /* Duplicates of the port descriptors don't have close-on-exec set, so they live through the exec. */
+    QJsonObject ports;
+    QList<int> fds;
+    foreach (QString portName, serialPorts.keys())
+    {
+        QSerialPort *serialPort = serialPorts.value(portName);
+        QJsonObject port;
+        port.insert("baudRate", serialPort->baudRate());
+        int fd = (serialPort->handle() >= 0) ? dup(serialPort->handle()) : -1;
+        if (fd >= 0)
+            fds << fd;
+        port.insert("fd", fd);
+        ports.insert(portName, port);
+    }
+    state.insert("ports", ports);
+
+    QJsonObject sinks;
+    if (Storage != NULL)
+    {
+        Storage->flush();
+        Storage->saveState(&sinks);
+    }
+    state.insert("sinks", sinks);
+
+    QSaveFile file(fileName);
+    if (!file.open(QIODevice::WriteOnly)
+            || (file.write(QJsonDocument(state).toJson()) < 0)
+            || !file.commit())
+    {
+        qCritical("Unable to write restart state to %s:  %s", qUtf8Printable(fileName), qUtf8Printable(file.errorString()));
+        foreach (int fd, fds)
+            close(fd);
+        if (Storage != NULL)
+            Storage->restoreState(sinks);
+        qInfo("Return false");
+        return false;
+    }
+    foreach (QString portName, serialPorts.keys())
+    {
+        QSerialPort *serialPort = serialPorts.take(portName);
+        serialPort->setSettingsRestoredOnClose(false);
+        serialPort->close();
+        delete serialPort;
+    }
+    qInfo("Return true; state of %d meters and %d ports handed over in %s.", meters.size(), ports.size(), qUtf8Printable(fileName));
+    return true;
+}
+
+/*!
+ * \brief ExecHandoff -- Replace this program with a fresh copy that resumes from the state file.
+ *
+ * The executable is the one the program was started as (arguments[0]), so a
+ * new version installed there since is the one run.
+ *
+ * \param arguments     The program's arguments, from QCoreApplication::arguments().
+ * \param stateFileName The state file written by HandOffState().
+ * \return false; only returns if the exec failed.
+ */
+bool ExecHandoff(const QStringList &arguments, const QString &stateFileName)
+{
+    QStringList newArguments;
+    for (int i = 0; i < arguments.size(); i++)
+    {
+        /* Drop the --resume of an earlier restart. */
+        if ((arguments[i] == "--resume") && (i + 1 < arguments.size()))
+            i++;
+        else if (!arguments[i].startsWith("--resume="))
+            newArguments << arguments[i];
+    }
+    newArguments << "--resume" << stateFileName;
+    QList<QByteArray> encoded;
+    foreach (QString argument, newArguments)
+        encoded << QFile::encodeName(argument);
+    QVector<char *> argv;
+    for (int i = 0; i < encoded.size(); i++)
+        argv << encoded[i].data();
+    argv << NULL;
+    qInfo("Restarting as %s.", qUtf8Printable(newArguments.join(' ')));
+    fflush(stdout);
+    fflush(stderr);
+    execvp(argv[0], argv.data());
+    qCritical("Unable to restart %s:  %s", argv[0], strerror(errno));
+    return false;
+}
+
+/*!
+ * \brief ResumeState -- Take back the state handed over by the program this one replaced.
+ *
+ * Meters are matched by meter id; meters new to the fleet start afresh.
+ * The state file is removed, so it is used only once.
+ *
+ * \param fileName      The state file.
+ * \param fleet         The meters; receives their state.
+ * \param repeatCount   Receives the reads of the meters still to do.
+ * \return true if successful, false otherwise.
+ */
+bool ResumeState(const QString &fileName, QList<MeterEntry> &fleet, int *repeatCount)
+{
+    qInfo("Begin");
+    QFile file(fileName);
+    if (!file.open(QIODevice::ReadOnly))
+    {
+        qCritical("Unable to read restart state from %s:  %s", qUtf8Printable(fileName), qUtf8Printable(file.errorString()));
+        qInfo("Return false");
+        return false;
+    }
+    QJsonObject state = QJsonDocument::fromJson(file.readAll()).object();
+    file.close();
+    file.remove();
+    if (state.value("version").toInt() != HandoffStateVersion)
+    {
+        qCritical("Restart state in %s not recognized.", qUtf8Printable(fileName));
+        qInfo("Return false");
+        return false;
+    }
+    *repeatCount = state.value("repeatCount").toInt();
+
+    QJsonObject meters = state.value("meters").toObject();
+    for (int i = 0; i < fleet.size(); i++)
+    {
+        MeterEntry &entry = fleet[i];
+        if (!meters.contains(entry.config.meterId))
+            continue;
+        QJsonObject meter = meters.value(entry.config.meterId).toObject();
+        entry.aDataCount = meter.value("aDataCount").toInt();
+        entry.timeSetPending = meter.value("timeSetPending").toBool();
+        entry.clockSkew.restoreState(meter.value("clockSkew").toObject());
+    }
+
+    QJsonObject ports = state.value("ports").toObject();
+    foreach (QString portName, ports.keys())
+    {
+        QJsonObject port = ports.value(portName).toObject();
+        InheritedBaudRates.insert(portName, port.value("baudRate").toInt());
+        if (port.value("fd").toInt(-1) >= 0)
+            InheritedPortFds.insert(portName, port.value("fd").toInt());
+    }
+
+    if (Storage != NULL)
+        Storage->restoreState(state.value("sinks").toObject());
+    qint64 savedMSecs = state.value("savedMSecs").toString().toLongLong();
+    qInfo("Return true; resumed %d meters and %d ports handed over %lld msec ago."
+          , meters.size(), ports.size(), QDateTime::currentMSecsSinceEpoch() - savedMSecs);
+    return true;
+}
+
+/*!
+ * \brief HandedOverBaudRate -- Baud rate a serial port was at when handed over.
+ * \param portName  Name of the serial device.
+ * \return The rate, or 0 if the port wasn't handed over.
+ */
+qint32 HandedOverBaudRate(const QString &portName)
+{
+    return InheritedBaudRates.value(portName, 0);
+}
+
+/*!
+ * \brief ReleaseHandedOverPorts -- Close the inherited serial port descriptors.
+ *
+ * Called once the serial ports have been opened again.
+ */
+void ReleaseHandedOverPorts()
+{
+    foreach (QString portName, InheritedPortFds.keys())
+    {
+        qDebug("Closing inherited descriptor %d of %s.", InheritedPortFds.value(portName), qUtf8Printable(portName));
+        close(InheritedPortFds.value(portName));
+    }
+    InheritedPortFds.clear();
+}
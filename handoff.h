@@ -0,0 +1,63 @@
+/*!
+@file
+@brief Header file describing the restart of the program without missing a reading.
+
+When the file .RestartReadEKM appears in the home directory, the program,
+right after reading the meters, hands itself over to a fresh copy of its
+executable (e.g. a newly installed one) instead of quitting:
+
+ - the state worth keeping is written to HandoffStateFile in the home
+   directory: the remaining repeat count; for each meter its A read count
+   (the A/B phase), whether a time set is pending and its clock skew
+   estimate; the readings waiting to be retried by the database sink and
+   the last readings of the change-only sinks; and for each serial port
+   its baud rate and an open file descriptor;
+ - the serial ports are closed, after duplicating their descriptors, without
+   restoring their settings, so the device is never fully closed and its
+   modem lines don't drop;
+ - the program shuts down as usual, then execs itself with the same
+   arguments plus --resume <state file>.
+
+The resumed program takes back the state, opens the serial ports again
+(QSerialPort cannot adopt an open descriptor, so it opens the device anew
+while the inherited descriptor still holds it open, then closes the
+inherited one), does not probe baud rates or check the meters' tables
+again, and sleeps till the next read, so the handoff costs no reading.
+
+@author Thomas A. DeMay
+@date 2015
+@par    Copyright (C) 2015  Thomas A. DeMay
+@par
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    any later version.
+@par
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+@par
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#ifndef HANDOFF_H
+#define HANDOFF_H
+#include <QtCore>
+#include <QtSerialPort>
+#include "fleetconfig.h"
+
+static const char HandoffMagicFile[] = ".RestartReadEKM";       //!< Restart when this appears in the home directory.
+static const char HandoffStateFile[] = ".ReadEKMHandoff.json";  //!< State handed to the restarted program, in the home directory.
+static const int HandoffStateVersion = 1;                       //!< Format of the state file.
+
+bool HandOffState(const QString &fileName, const QList<MeterEntry> &fleet, QMap<QString, QSerialPort *> &serialPorts
+                  , const int repeatCount);
+bool ExecHandoff(const QStringList &arguments, const QString &stateFileName);
+bool ResumeState(const QString &fileName, QList<MeterEntry> &fleet, int *repeatCount);
+qint32 HandedOverBaudRate(const QString &portName);
+void ReleaseHandedOverPorts();
+
+#endif // HANDOFF_H
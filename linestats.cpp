@@ -0,0 +1,157 @@
+/*!
+@file
+@brief Statistics of the serial line and the classification of its errors.
+
+@author Thomas A. DeMay
+@date 2015
+@par    Copyright (C) 2015  Thomas A. DeMay
+@par
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    any later version.
+@par
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+@par
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include "linestats.h"
+
+LineStatistics LineStats;
+
+LineStatistics::LineStatistics()
+    : lastReportMSecs(QDateTime::currentMSecsSinceEpoch())
+{
+}
+
+/*!
+ * \brief LineStatistics::setMeter -- Attribute the following events to a meter.
+ * \param meterId   The meter being talked to.
+ */
+void LineStatistics::setMeter(const QString &meterId)
+{
+    currentMeter = meterId;
+}
+
+/*!
+ * \brief LineStatistics::counters -- Counters for a port or meter, created if needed.
+ * \param table     Counters of the ports or of the meters.
+ * \param key       Port name or meter id.
+ * \return The counters.
+ */
+LineCounters &LineStatistics::counters(QHash<QString, LineCounters> &table, const QString &key)
+{
+    if (!table.contains(key))
+    {
+        LineCounters zero;
+        memset(&zero, 0, sizeof(zero));
+        table.insert(key, zero);
+    }
+    return table[key];
+}
+
+void LineStatistics::note(const QString &portName, const LineEvent event, const int count)
+{
+    if (count <= 0)
+        return;
+    counters(ports, portName).events[event] += count;
+    if (!currentMeter.isEmpty())
+        counters(meters, currentMeter).events[event] += count;
+    if (event != LineFrameOk)
+        qDebug("Line event %s (%d) on %s, meter %s.", eventName(event), count, qUtf8Printable(portName), qUtf8Printable(currentMeter));
+}
+
+void LineStatistics::noteBytes(const QString &portName, const qint64 count)
+{
+    counters(ports, portName).bytes += count;
+    if (!currentMeter.isEmpty())
+        counters(meters, currentMeter).bytes += count;
+}
+
+void LineStatistics::noteDiscarded(const QString &portName, const qint64 count)
+{
+    counters(ports, portName).discardedBytes += count;
+    if (!currentMeter.isEmpty())
+        counters(meters, currentMeter).discardedBytes += count;
+}
+
+void LineStatistics::noteGap(const QString &portName, const qint64 usecs)
+{
+    note(portName, LineGap);
+    LineCounters &port = counters(ports, portName);
+    port.maxGapUSecs = qMax(port.maxGapUSecs, usecs);
+    if (!currentMeter.isEmpty())
+    {
+        LineCounters &meter = counters(meters, currentMeter);
+        meter.maxGapUSecs = qMax(meter.maxGapUSecs, usecs);
+    }
+}
+
+/*!
+ * \brief LineStatistics::classify -- Kind of event a serial port error is.
+ * \param error     The error.
+ * \return LineParityError, LineFramingError, LineTimeout or LineSerialError.
+ */
+LineEvent LineStatistics::classify(const QSerialPort::SerialPortError error)
+{
+    switch (error)
+    {
+    case QSerialPort::ParityError:
+        return LineParityError;
+    case QSerialPort::FramingError:
+    case QSerialPort::BreakConditionError:
+        return LineFramingError;
+    case QSerialPort::TimeoutError:
+        return LineTimeout;
+    default:
+        return LineSerialError;
+    }
+}
+
+const char *LineStatistics::eventName(const LineEvent event)
+{
+    static const char *names[LineEventKinds] = {"frames", "timeouts", "partial", "parity", "framing", "serial errors"
+                                                , "gaps", "bad start", "wrong meter", "bad end", "bad CRC", "resyncs"};
+    return names[event];
+}
+
+/*!
+ * \brief LineStatistics::describe -- One line describing a set of counters.
+ * \param what      The port or meter.
+ * \param counters  Its counters.
+ * \return The description.
+ */
+QString LineStatistics::describe(const QString &what, const LineCounters &counters)
+{
+    QStringList parts;
+    for (int event = 0; event < LineEventKinds; event++)
+    {
+        if ((event == LineFrameOk) || (counters.events[event] > 0))
+            parts << QString("%1 %2").arg(counters.events[event]).arg(eventName((LineEvent)event));
+    }
+    return QString("%1: %2; %3 bytes, %4 discarded, longest gap %5 msec.")
+            .arg(what).arg(parts.join(", ")).arg(counters.bytes).arg(counters.discardedBytes)
+            .arg(counters.maxGapUSecs / 1000.0, 0, 'f', 1);
+}
+
+/*!
+ * \brief LineStatistics::reportIfDue -- Log the statistics if LineReportMSecs have passed since last logged.
+ * \param now   Log them regardless.
+ */
+void LineStatistics::reportIfDue(const bool now)
+{
+    qint64 msecs = QDateTime::currentMSecsSinceEpoch();
+    if (!now && ((msecs - lastReportMSecs) < LineReportMSecs))
+        return;
+    lastReportMSecs = msecs;
+    foreach (QString port, ports.keys())
+        qInfo("%s", qUtf8Printable(describe("Serial port " + port, ports[port])));
+    foreach (QString meter, meters.keys())
+        qInfo("%s", qUtf8Printable(describe("Meter " + meter, meters[meter])));
+}
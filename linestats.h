@@ -0,0 +1,99 @@
+/*!
+@file
+@brief Header file describing statistics of the serial line and the classification of its errors.
+
+Each thing that goes wrong receiving a response is counted, per port and per
+meter, so that a noisy RS-485 run or a flaky meter can be told apart from
+a meter that is simply not answering:
+
+ - timeouts with nothing received, and partial frames;
+ - parity, framing and other errors reported by the serial port;
+ - gaps between bytes longer than LineGapChars character times;
+ - frames that don't start with STX (0x02), are from the wrong meter,
+   don't end with "!\r\n\x03", or fail the CRC check;
+ - resyncs, where the frame parser dropped a bad start and rescanned for
+   the next STX, and the bytes discarded doing so.
+
+@author Thomas A. DeMay
+@date 2015
+@par    Copyright (C) 2015  Thomas A. DeMay
+@par
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    any later version.
+@par
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+@par
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#ifndef LINESTATS_H
+#define LINESTATS_H
+#include <QtCore>
+#include <QtSerialPort>
+
+static const int LineGapChars = 20;                     //!< Idle time, in character times, counted as a gap.
+static const qint64 LineReportMSecs = 3600000;          //!< Log the statistics this often.
+
+typedef enum
+{
+    LineFrameOk,            //!< Frame received whole and correct.
+    LineTimeout,            //!< Nothing received.
+    LinePartialFrame,       //!< Some but not all of the frame received.
+    LineParityError,        //!< Serial port reported a parity error.
+    LineFramingError,       //!< Serial port reported a framing error or break.
+    LineSerialError,        //!< Serial port reported some other error.
+    LineGap,                //!< Line went idle in the middle of a frame.
+    LineBadStart,           //!< Frame doesn't start with STX.
+    LineWrongMeter,         //!< Frame is from some other meter.
+    LineBadEnd,             //!< Frame doesn't end with "!\r\n\x03".
+    LineBadCrc,             //!< Frame CRC doesn't match.
+    LineResync,             //!< Parser rescanned for an STX.
+    LineEventKinds          //!< Number of kinds of event.
+} LineEvent;
+
+typedef struct
+{
+    qint64 events[LineEventKinds];  //!< Count of each kind of event.
+    qint64 bytes;                   //!< Bytes received.
+    qint64 discardedBytes;          //!< Bytes thrown away resyncing.
+    qint64 maxGapUSecs;             //!< Longest gap seen.
+} LineCounters;
+
+/*!
+ * \brief The LineStatistics class -- Counts of serial line events per port and per meter.
+ */
+class LineStatistics
+{
+public:
+    LineStatistics();
+
+    void setMeter(const QString &meterId);
+    void note(const QString &portName, const LineEvent event, const int count = 1);
+    void noteBytes(const QString &portName, const qint64 count);
+    void noteDiscarded(const QString &portName, const qint64 count);
+    void noteGap(const QString &portName, const qint64 usecs);
+    void reportIfDue(const bool now = false);
+
+    static LineEvent classify(const QSerialPort::SerialPortError error);
+    static const char *eventName(const LineEvent event);
+
+private:
+    LineCounters &counters(QHash<QString, LineCounters> &table, const QString &key);
+    static QString describe(const QString &what, const LineCounters &counters);
+
+    QString currentMeter;                   //!< Meter of the exchange in progress.
+    QHash<QString, LineCounters> ports;     //!< Counters of each port.
+    QHash<QString, LineCounters> meters;    //!< Counters of each meter.
+    qint64 lastReportMSecs;                 //!< When the statistics were last logged.
+};
+
+extern LineStatistics LineStats;            //!< Statistics of the serial lines.
+
+#endif // LINESTATS_H
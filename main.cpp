@@ -32,177 +32,295 @@
 
 #include "../SupportRoutines/supportfunctions.h"
 #include "messages.h"
+#include "fleetconfig.h"
+#include "capturetime.h"
+#include "framearchive.h"
+#include "storagesink.h"
+#include "publisher.h"
+#include "dbpool.h"
+#include "retention.h"
+#include "debuglog.h"
+#include "linestats.h"
+#include "frameparser.h"
+#include "serialparams.h"
+#include "transaction.h"
+#include "wiretrace.h"
+#include "handoff.h"
+#include "counters.h"
+#include "tcpgateway.h"
+#include "exporter.h"
+#include "tracer.h"
+#include "virtualclock.h"
+#include "simulator.h"
+#include "batchdecode.h"
 
 /* ********  Global variable declarations  ***************/
 QTimeZone LocalTimeZone = QTimeZone(QTimeZone::systemTimeZoneId()); //!< The local timezone, either Standard time or Daylight time.
 QTimeZone LocalStandardTimeZone = QTimeZone(LocalTimeZone.standardTimeOffset(QDateTime::currentDateTime())); //!< Timezone for Local Standard time.
+QList<MeterEntry> Fleet;                        //!< The meters to read, in the order to read them.
+QMap<QString, QSerialPort *> SerialPorts;       //!< Open serial ports indexed by device name.
+QByteArray SerialLeftover;                      //!< Bytes read past the end of the last response; kept for a resync.
+CaptureTime SerialLeftoverTime;                 //!< When the bytes in SerialLeftover were read.
+int ResponseTimeoutMSecs = 10000;               //!< Wait this long for a response to start.
+qint64 TimeSetIntervalMSecs = 0;                //!< Time from one chance to set meter times to the next: the read interval.
+TransactionQueue Transactions;                  //!< Meter writes waiting for time on the bus.
 
 
 /* ********  Global function declarations  ***************/
-bool ConnectSerial(const QString &serialDeviceName, QSerialPort **serialPortPtr);
-bool SaveV3ResponseToDatabase(const ResponseV3Data &responseData);
-bool SaveV4ResponseToDatabase(const uint8_t responseType, const ResponseV4Generic &response);
-bool GetMeterV4Data(QSerialPort *serialPort, const QString meterId, const uint8_t requestType, ResponseV4Generic *response);
-bool GetMeterV3Data(QSerialPort *serialPort, const QString meterId, ResponseV3Data *response);
-bool ReadResponse(QSerialPort *serialPort, qint8 *msg, const qint64 msgSize);
+bool ConnectSerial(const QString &serialDeviceName, QSerialPort **serialPortPtr, const MeterConfig *probeMeter = NULL);
+bool ProbeBaudRate(QSerialPort *serialPort, const MeterConfig &meter);
+bool GetMeterV4Data(QSerialPort *serialPort, const QString meterId, const uint8_t requestType, ResponseV4Generic *response, CaptureTime *captureTime = NULL);
+bool GetMeterV3Data(QSerialPort *serialPort, const QString meterId, ResponseV3Data *response, CaptureTime *captureTime = NULL);
+bool ReadResponse(QSerialPort *serialPort, qint8 *msg, const qint64 msgSize, CaptureTime *captureTime = NULL);
+bool ReadFrame(QSerialPort *serialPort, const QString &meterId, qint8 *msg, const qint64 msgSize, CaptureTime *captureTime = NULL);
 bool WriteSerialMsg(QSerialPort *serialPort, const char *msg, const qint64 msgSize);
 bool ValidateCRC(const uint8_t *msg, int numBytes);
-bool SendControl(QSerialPort *serialPort, QString &meterId, OutputControlDef *ctrlMsg, const int msgSize);
-bool SetMeterTime(QSerialPort *serialPort, QString &meterId);
-bool InitializeMeters(QSerialPort *serialPort, const QStringList &args);
-void VerifyDatabaseTable(QSqlQuery &query, const QString fullMeterId, const QString dataKind);
+bool SendControl(QSerialPort *serialPort, const MeterConfig &config, OutputControlDef *ctrlMsg, const int msgSize);
+bool SetMeterTime(QSerialPort *serialPort, const MeterConfig &config);
+QByteArray SetTimeMessage();
+MeterTransaction *SetTimeTransaction(const QString &meterId, const QString &portName, const qint64 timeoutMSecs);
+bool InitializeMeters(QList<MeterEntry> &fleet, const bool resumed = false);
+bool ApplyFleetConfig(const QList<MeterConfig> &configs, QList<MeterEntry> &fleet, const int interval);
+void ServicePendingTimeSets(QList<MeterEntry> &fleet, const qint64 deadline);
+void TrackClockSkew(MeterEntry &entry, const CaptureTime &captureTime, const meterDateTime &meterTime);
+void ApplyOutputControls(QSerialPort *serialPort, MeterEntry &entry, const ResponseV4AData &responseA);
+QList<MeterReading> PollMeter(MeterEntry &entry, QSerialPort *serialPort);
 uint16_t computeEkmCrc(const uint8_t *dat, uint16_t len);
 
 /* **********  Global function definitions   *************/
 
 /*!
- * \brief VerifyDatabaseTable -- Create meter data table if it doesn't exist.
+ * \brief InitializeMeters -- Once per program execution actions.
+ *
+ * Opens the storage sinks.
  *
- * Returns without doing anything if the dataKind is unrecognized.
+ * For each meter in the fleet, make sure each storage sink has a place
+ * (e.g. a database table) for the responses from the meter.
  *
- * Query the INFORMATION_SCHEMA for the existence of the desired table.
- * If errors accessing INFORMATION_SCHEMA, assume the table exists.
- * If the INFORMATION_SCHEMA query returns a result, the table exists.
- * Otherwise, try to create the table.  Assume success, we will fail later
- * if the table could not be created.
+ * Meter times are not set here; each v.4 meter has its time set to the local
+ * standard time when TrackClockSkew() finds it has drifted too far.
  *
- * \param query         QSqlQuery opened on the database.
- * \param fullMeterId   Meter serial number expanded to 12 characters.
- * \param dataKind      Kind of table to check.  Must be one of: "_A", "_B" or "".
+ * \param fleet     The meters to initialize.
+ * \param resumed   Resuming after a restart (see handoff.h); the places were checked before it.
+ * \return true if successful, false otherwise.
  */
-void VerifyDatabaseTable(QSqlQuery &query, const QString fullMeterId, const QString dataKind)
+bool InitializeMeters(QList<MeterEntry> &fleet, const bool resumed)
 {
-    /* dataKind must be one of: "_A", "_B" or "". */
     qDebug("Begin");
-    if ((dataKind != "_A") && (dataKind != "_B") && (dataKind != ""))
+    if (!Storage->open())
     {
-        qWarning("dataKind argument is not a legal value.  Should be one of \"_A\", \"_B\", or \"\".  Was \"%s\"."
-                 , qUtf8Printable(dataKind));
-       qDebug("Return");
-       return;
+        qCritical() << "Unable to open storage for meter data.";
+        qInfo() << "Return false";
+        return false;
     }
-    if (!query.exec(QString("SELECT TABLE_NAME FROM INFORMATION_SCHEMA.TABLES WHERE TABLE_NAME = '%1%2_RawMeterData'")
-                    .arg(fullMeterId)
-                    .arg(dataKind)))
+
+    if (resumed)
     {
-        qCritical("Unable to access INFORMATION_SCHEMA; assume data tables exist.");
-        qInfo("    Query was: %s", qUtf8Printable(query.lastQuery()));
-        qInfo("    Error was: %s", qUtf8Printable(query.lastError().text()));
+        qDebug("Return true; resumed, so meter storage not checked.");
+        return true;
     }
-    else
+
+    /*! Do meter initialization tasks for each meter.  */
+    for (int i = 0; i < fleet.size(); i++)
     {
-        qDebug("Successfully accessed INFORMATION_SCHEMA for query about existence of data table.");
-        if (!query.next())
+        MeterEntry &entry = fleet[i];
+
+        //! Check for the existence of places in which to store meter data.
+        // Don't try to set meter time for v.3 meter since I don't know how to do it.
+        Storage->ensureSchema(entry.config);
+    }
+    qDebug("Return true");
+    return true;
+}
+
+/*!
+ * \brief ServicePendingTimeSets -- Set the time of meters that need it, in the time available.
+ *
+ * Meter time setting is a low priority task; it is done after all the meters
+ * have been read, and only while there is time left before the next read.
+ * A time set transaction is queued for each meter that needs one, and the
+ * queue is run till the deadline.  Meters not serviced remain pending till
+ * the next opportunity.
+ *
+ * \param fleet     The meters.
+ * \param deadline  Msec since epoch by which time setting must stop; zero for no limit.
+ */
+void ServicePendingTimeSets(QList<MeterEntry> &fleet, const qint64 deadline)
+{
+    qDebug("Begin");
+    /* A time set session takes about a second on the bus when all goes well;
+     * allow for some retries. */
+    static const qint64 timeSetAllowance = 5000;
+    QList<MeterEntry> *fleetPtr = &fleet;
+    for (int i = 0; i < fleet.size(); i++)
+    {
+        MeterEntry &entry = fleet[i];
+        if (!entry.timeSetPending || Transactions.contains(entry.config.meterId, "time set"))
+            continue;
+        if (entry.config.protocolVersion != 4)
+        {
+            qDebug("I only know how to set time to v.4 Omnimeters; %s ignored.", qUtf8Printable(entry.config.meterId));
+            entry.timeSetPending = false;
+            continue;
+        }
+        MeterTransaction *transaction = SetTimeTransaction(entry.config.meterId, entry.config.portName, timeSetAllowance);
+        transaction->onDone([fleetPtr](const MeterTransaction &t)
         {
-            // the query returned no results => table does not exist.  Create it.
-            QString queryText = QString("CREATE TABLE `%1%2_RawMeterData` ("
-                                        "`idRawMeterData` int(11) NOT NULL AUTO_INCREMENT,"
-                                        "`ComputerTime` timestamp(6) NOT NULL DEFAULT CURRENT_TIMESTAMP(6) COMMENT 'Time that record written to database.',"
-                                        "`MeterTime` datetime DEFAULT NULL COMMENT 'Meter time from response message.',"
-                                        "`MeterId` varchar(12) DEFAULT NULL COMMENT 'Meter ID (Serial number) from response.',"
-                                        "`MeterType` varchar(4) DEFAULT NULL,"
-                                        "`DataType` varchar(4) DEFAULT NULL COMMENT 'Either \"V3\", \"V4A\" or \"V4B\"',"
-                                        "`MeterData` binary(255) NOT NULL COMMENT 'Exact copy of entire response data from meter.',"
-                                        "PRIMARY KEY (`idRawMeterData`),"
-                                        "UNIQUE KEY `idRawMeterData_UNIQUE` (`idRawMeterData`)"
-                                        ") ENGINE=InnoDB AUTO_INCREMENT=8281 DEFAULT CHARSET=utf8")
-                    .arg(fullMeterId)
-                    .arg(dataKind);
-            if (!DontActuallyWriteDatabase)
+            for (int j = 0; j < fleetPtr->size(); j++)
             {
-                if (!query.exec(queryText))
+                MeterEntry &done = (*fleetPtr)[j];
+                if (done.config.meterId != t.meterId())
+                    continue;
+                if (t.state() == TransactionSucceeded)
                 {
-                    qCritical("Unable to create RawMeterData %s table for %s meter.  Assume table already exists."
-                              , qUtf8Printable(dataKind)
-                              , qUtf8Printable(fullMeterId));
-                    qInfo("    Query was: %s", qUtf8Printable(query.lastQuery()));
-                    qInfo("    Error was: %s", qUtf8Printable(query.lastError().text()));
+                    done.timeSetPending = false;
+                    done.clockSkew.clockWasSet(ClockMSecs());
                 }
                 else
-                {
-                    qInfo("Successfully created Table %s%s_RawMeterData"
-                          , qUtf8Printable(fullMeterId)
-                          , qUtf8Printable(dataKind));
-                }
-            }
-            else
-            {
-                qInfo() << "Didn't actually create database table.  Command was:";
-                qInfo() << queryText;
+                    qWarning("Unable to set meter time for meter %s.", qUtf8Printable(t.meterId()));
             }
-        }
-        qDebug("Table %s%s_RawMeterData exists.", qUtf8Printable(fullMeterId), qUtf8Printable(dataKind));
+        });
+        Transactions.submit(transaction);
     }
+    Transactions.runUntil(SerialPorts, deadline);
     qDebug("Return");
-    return;
 }
 
 /*!
- * \brief InitializeMeters -- Once per program execution actions.
+ * \brief TrackClockSkew -- Update the clock skew estimate of a meter; queue a time set if needed.
  *
- * Opens a connection to the database.
+ * Meter times are set after a pass over the meters.  If the skew predicted
+ * for the next chance after this one, TimeSetIntervalMSecs from now, exceeds
+ * MaxClockSkew, the time is set now so it never drifts past MaxClockSkew.
  *
- * For each meter in the args list, check to see if there is a table in the
- * database for the response from the meter.  If not, create the table.
+ * \param entry         The meter.
+ * \param captureTime   When the response was captured.
+ * \param meterTime     Date and time from the meter response.
+ */
+void TrackClockSkew(MeterEntry &entry, const CaptureTime &captureTime, const meterDateTime &meterTime)
+{
+    QDateTime meterDateTime = MeterTimeToDateTime(meterTime);
+    if (!meterDateTime.isValid())
+    {
+        qWarning("Meter %s reported an invalid time.", qUtf8Printable(entry.config.meterId));
+        return;
+    }
+    entry.clockSkew.addSample(captureTime.wallUSecs / 1000, meterDateTime.toMSecsSinceEpoch());
+    double predicted = entry.clockSkew.predictedSkew(ClockMSecs() + TimeSetIntervalMSecs);
+    qDebug("Meter %s clock skew %.1f sec, predicted %.1f sec, drift %.2f sec/day, %d samples, %d time sets."
+          , qUtf8Printable(entry.config.meterId)
+          , entry.clockSkew.lastSkew()
+          , predicted
+          , entry.clockSkew.driftRate() * 86400.0
+          , entry.clockSkew.sampleCount()
+          , entry.clockSkew.timeSetCount());
+    if (!entry.timeSetPending && (qAbs(predicted) > MaxClockSkew))
+    {
+        qInfo("Meter %s clock skew exceeds %.1f sec; time set queued.", qUtf8Printable(entry.config.meterId), MaxClockSkew);
+        entry.timeSetPending = true;
+    }
+}
+
+/*!
+ * \brief ApplyFleetConfig -- Bring the fleet in line with a new fleet configuration.
  *
- * Each meter has its time set to the local standard time.
+ * Meters no longer configured are dropped from the fleet.  Meters that remain
+ * keep their run time state (A read count), even if their configuration changed.
+ * New meters have their storage prepared; their clocks are set if
+ * needed once their skew has been measured.
+ * Polling of existing meters is not interrupted.
+ * Serial ports needed by the new configuration are opened; ports no longer
+ * used are closed.
  *
- * \param serialPort    Pointer to serial port for communication with meter.
- * \param args  List of meter ids from command line.
+ * \param configs   The new fleet configuration.
+ * \param fleet     The fleet to update.
+ * \param interval  Minutes between reads; used to phase the A read count of new meters.
  * \return true if successful, false otherwise.
  */
-bool InitializeMeters(QSerialPort *serialPort, const QStringList &args)
+bool ApplyFleetConfig(const QList<MeterConfig> &configs, QList<MeterEntry> &fleet, const int interval)
 {
     qDebug("Begin");
-    QSqlDatabase dbConn = QSqlDatabase::database(ConnectionName);
-
-    if (!dbConn.isOpen())
+    QList<MeterEntry> newFleet;
+    foreach (const MeterConfig &config, configs)
     {
-        qCritical() << "Unable to open database for meter data.";
-        qInfo() << "Return false";
-        return false;
-    }
-    QSqlQuery query(dbConn);
-
-    /*! Do meter initialization tasks for each meter.  */
-    foreach (QString meterId, args)
-    {
-        //! Expand meter id to all 12 characters.
-        QString fullMeterId = meterId.rightJustified(sizeof(RequestMsgV4.meterId), '0', true);
-
-        //! Check for the existence of database tables in which to store meter data.
-
-        if (fullMeterId.toLongLong() >= 300000000)
+        bool found = false;
+        foreach (const MeterEntry &oldEntry, fleet)
         {
-            // Is a v.4 meter.
-            //!  Set the time in the meter to the computer's idea of the local standard time.
-            if (!SetMeterTime(serialPort, fullMeterId))
+            if (oldEntry.config.meterId == config.meterId)
             {
-                qWarning("Unable to set meter time for meter %s.", qUtf8Printable(fullMeterId));
+                MeterEntry entry = oldEntry;
+                if (entry.config != config)
+                {
+                    qInfo("Configuration of meter %s changed.", qUtf8Printable(config.meterId));
+                    if ((entry.config.tableBaseName != config.tableBaseName)
+                            || (entry.config.protocolVersion != config.protocolVersion))
+                        Storage->ensureSchema(config);
+                    entry.config = config;
+                }
+                newFleet.append(entry);
+                found = true;
+                break;
             }
+        }
+        if (!found)
+        {
+            qInfo("Meter %s added to fleet.", qUtf8Printable(config.meterId));
+            MeterEntry entry;
+            entry.config = config;
+            entry.aDataCount = InitialADataCount(interval, config.aToBRatio);
+            entry.timeSetPending = false;
+            Storage->ensureSchema(config);
+            newFleet.append(entry);
+        }
+    }
+    foreach (const MeterEntry &oldEntry, fleet)
+    {
+        bool found = false;
+        foreach (const MeterEntry &entry, newFleet)
+            found = found || (entry.config.meterId == oldEntry.config.meterId);
+        if (!found)
+        {
+            qInfo("Meter %s removed from fleet.", qUtf8Printable(oldEntry.config.meterId));
+            Transactions.cancelMeter(oldEntry.config.meterId);
+        }
+    }
 
-            // Create the tables if they don't exist.
-            VerifyDatabaseTable(query, fullMeterId, "_A");
-            VerifyDatabaseTable(query, fullMeterId, "_B");
+    /*! Open serial ports that are newly needed, close those no longer needed. */
+    QStringList portNames = FleetPortNames(newFleet);
+    foreach (QString portName, portNames)
+    {
+        if (!SerialPorts.contains(portName))
+        {
+            QSerialPort *serialPort = NULL;
+            if (ConnectSerial(portName, &serialPort, FirstMeterOnPort(newFleet, portName)))
+                SerialPorts.insert(portName, serialPort);
+            else
+                qCritical("Could not connect serial device %s.", qUtf8Printable(portName));
         }
-        else
+    }
+    foreach (QString portName, SerialPorts.keys())
+    {
+        if (!portNames.contains(portName))
         {
-            // Is a v.3 meter.
-            // Don't try to set meter time for v.3 meter since I don't know how to do it.
-            // Create the table if it doesn't exist.
-            VerifyDatabaseTable(query, fullMeterId, "");
+            qInfo("Serial device %s no longer used; closing it.", qUtf8Printable(portName));
+            QSerialPort *serialPort = SerialPorts.take(portName);
+            serialPort->close();
+            delete serialPort;
         }
     }
+
+    fleet = newFleet;
+    qDebug("Return true; fleet has %d meters.", fleet.size());
     return true;
 }
 
 /*!
  * \brief ConnectSerial -- Create connection to serial device.
- * \param serialDeviceName  Name of serial device.
+ * \param serialDeviceName  Name of serial device, or tcp:<host>:<port> for a serial to TCP gateway.
  * \param serialPortPtr     Pointer to pointer to serial port.
  * \return true if successful, false otherwise.
  */
-bool ConnectSerial(const QString &serialDeviceName, QSerialPort **serialPortPtr)
+bool ConnectSerial(const QString &serialDeviceName, QSerialPort **serialPortPtr, const MeterConfig *probeMeter)
 {
     qInfo("Begin");
     if (serialPortPtr == NULL)
@@ -223,6 +341,45 @@ bool ConnectSerial(const QString &serialDeviceName, QSerialPort **serialPortPtr)
         serialPort = NULL;
         *serialPortPtr = serialPort;
     }
+    /*! When replaying a trace, the port plays back its traffic instead of opening the device. */
+    if (WireReplayActive())
+    {
+        serialPort = NewReplayPort(serialDeviceName);
+        if (serialPort == NULL)
+        {
+            qInfo() << "Return false";
+            return false;
+        }
+        SerialParameters params = SerialParametersFor(serialDeviceName);
+        ApplySerialParameters(serialPort, params);
+        serialPort->open(QIODevice::ReadWrite);
+        *serialPortPtr = serialPort;
+        if (params.probe && (probeMeter != NULL))
+            ProbeBaudRate(serialPort, *probeMeter);
+        qInfo("%s is replayed at %s.", qUtf8Printable(serialDeviceName), qUtf8Printable(DescribeSerialPort(serialPort)));
+        qInfo() << "Return true";
+        return true;
+    }
+    /*! A port reached through a serial to TCP gateway has no local device. */
+    if (IsTcpGatewayName(serialDeviceName))
+    {
+        serialPort = NewTcpGatewayPort(serialDeviceName);
+        if (serialPort == NULL)
+        {
+            qInfo() << "Return false";
+            return false;
+        }
+        SerialParameters params = SerialParametersFor(serialDeviceName);
+        if (params.probe)
+            qWarning("Baud rate of %s can't be probed through the gateway; give it with --serial-settings."
+                     , qUtf8Printable(serialDeviceName));
+        ApplySerialParameters(serialPort, params);
+        serialPort->open(QIODevice::ReadWrite);
+        *serialPortPtr = serialPort;
+        qInfo("%s is reached over TCP at %s.", qUtf8Printable(serialDeviceName), qUtf8Printable(DescribeSerialPort(serialPort)));
+        qInfo() << "Return true";
+        return true;
+    }
     /*! Get information about the serial device. */
     const QSerialPortInfo info(serialDeviceName);
     if (info.isNull())
@@ -268,12 +425,9 @@ bool ConnectSerial(const QString &serialDeviceName, QSerialPort **serialPortPtr)
             + "    stop bits:  " + QString::number(serialPort->stopBits())
             ;
     qDebug() << (s);
-    /*! Set the serial port characteristics to EKM specs. */
-    serialPort->setFlowControl(QSerialPort::NoFlowControl);
-    serialPort->setBaudRate(9600);
-    serialPort->setDataBits(QSerialPort::Data7);
-    serialPort->setParity(QSerialPort::EvenParity);
-    serialPort->setStopBits(QSerialPort::OneStop);
+    /*! Set the serial port characteristics to those given for the port; EKM specs by default. */
+    SerialParameters params = SerialParametersFor(serialDeviceName);
+    ApplySerialParameters(serialPort, params);
     if (!serialPort->open(QIODevice::ReadWrite))
     {
         qCritical("Could not open %s:  %s", qPrintable(info.portName()), qPrintable(serialPort->errorString()));
@@ -294,144 +448,67 @@ bool ConnectSerial(const QString &serialDeviceName, QSerialPort **serialPortPtr)
                 ;
         qDebug() << (s);
         *serialPortPtr = serialPort;
-    }
-    qInfo() << "Return" << serialPort->isOpen();
-    return serialPort->isOpen();
-}
-
-/*!
- * \brief SaveV3ResponseToDatabase -- Store a v.3 meter response in its database table.
- * \param responseData  Data from v.3 meter to save.
- * \return true if successful, false otherwise.
- */
-bool SaveV3ResponseToDatabase(const ResponseV3Data &responseData)
-{
-    /*
-     *  Assumes responseData is valid ResponseV3Data.
-     */
-    /*! Extract critical pieces of info from response. */
-    QVariant meterTime = QDateTime(
-                QDate(  QByteArray((char *)responseData.dateTime.year, 2).toInt() + 2000
-                        , QByteArray((char *)responseData.dateTime.month, 2).toInt()
-                        , QByteArray((char *)responseData.dateTime.day, 2).toInt())
-                , QTime(QByteArray((char *)responseData.dateTime.hour, 2).toInt()
-                        , QByteArray((char *)responseData.dateTime.minute, 2).toInt()
-                        , QByteArray((char *)responseData.dateTime.second, 2).toInt()));
-    QVariant meterId = QString(QByteArray((char *)responseData.meterId, sizeof(responseData.meterId)));
-    QVariant meterType = QString(QByteArray((char *)responseData.model, 2).toHex());
-    QVariant meterData = QByteArray((char *)responseData.fixed02, sizeof(responseData)); //!< Gets the response into a byte array.
-    QVariant dataType = "V3";
-
-    QSqlDatabase dbConn = QSqlDatabase::database(ConnectionName);
-
-    if (!dbConn.isOpen())
-    {
-        qCritical() << "Unable to open database to save solar data.";
-        qInfo() << "Return false";
-        return false;
-    }
-    QSqlQuery query(dbConn);
-
-    query.prepare("INSERT INTO RawMeterData (MeterTime, MeterId, DataType, MeterType, MeterData) VALUES (?, ?, ?, ?, ?)");
-    query.bindValue(0, meterTime);
-    query.bindValue(1, meterId);
-    query.bindValue(2, meterType);
-    query.bindValue(3, dataType);
-    query.bindValue(4, meterData);
-    if (!DontActuallyWriteDatabase)
-    {
-        if (!query.exec())
+        if (params.probe && (HandedOverBaudRate(serialDeviceName) > 0))
+            serialPort->setBaudRate(HandedOverBaudRate(serialDeviceName));
+        else if (params.probe)
         {
-            qCritical() << "Error inserting raw meter data record in database: " << query.lastError() << "\nQuery: " << query.lastQuery();
-            qInfo() << "Return false";
-            return false;
+            if (probeMeter != NULL)
+                ProbeBaudRate(serialPort, *probeMeter);
+            else
+                qWarning("No meter on %s to probe its baud rate with.", qUtf8Printable(serialDeviceName));
         }
-        else
-            qDebug() << "Inserting raw meter data was successful.";
+        qInfo("%s is at %s.", qUtf8Printable(serialDeviceName), qUtf8Printable(DescribeSerialPort(serialPort)));
     }
-    else
-    {
-        qDebug() << "Did not execute " << query.lastQuery();
-    }
-    qInfo() << "Return true";
-    return true;
+    qInfo() << "Return" << serialPort->isOpen();
+    return serialPort->isOpen();
 }
 
 /*!
- * \brief SaveV4ResponseToDatabase
- * \param responseType x30 if response A, otherwise B.
- * \param response      Data from meter.
- * \return true if successful, false otherwise.
+ * \brief ProbeBaudRate -- Find the fastest rate at which a meter answers reliably.
+ *
+ * Each rate in SerialProbeRates, fastest first, is tried by reading the
+ * meter's data SerialProbeReads times; the first rate at which every
+ * response has a good CRC is kept.  If none does, the port is left at
+ * 9600 baud.  Responses are waited for only SerialProbeTimeoutMSecs so
+ * that rates the meter can't do are passed over quickly.
+ *
+ * \param serialPort    Open serial port.
+ * \param meter         A meter on the port.
+ * \return true if a rate was found, false otherwise.
  */
-bool SaveV4ResponseToDatabase(const uint8_t responseType, const ResponseV4Generic &response)
+bool ProbeBaudRate(QSerialPort *serialPort, const MeterConfig &meter)
 {
-    /*
-     *  Assumes responseData is valid ResponseV4Data.
-     */
-    QString meterTable;
-    QVariant dataType;
-    QVariant meterTime = QDateTime(
-                QDate(  QByteArray((char *)response.responseV4Generic.dateTime.year, 2).toInt() + 2000
-                        , QByteArray((char *)response.responseV4Generic.dateTime.month, 2).toInt()
-                        , QByteArray((char *)response.responseV4Generic.dateTime.day, 2).toInt())
-                , QTime(QByteArray((char *)response.responseV4Generic.dateTime.hour, 2).toInt()
-                        , QByteArray((char *)response.responseV4Generic.dateTime.minute, 2).toInt()
-                        , QByteArray((char *)response.responseV4Generic.dateTime.second, 2).toInt()));
-    QVariant meterId = QString(QByteArray((char *)response.responseV4Generic.meterId, sizeof(response.responseV4Generic.meterId)));
-    QVariant meterType = QString(QByteArray((char *)response.responseV4Generic.model, 2).toHex());
-    QVariant meterData = QByteArray((char *)response.responseV4Generic.fixed02, sizeof(response));
-    if (responseType == '\x30')
-    {
-        meterTable = meterId.toString() + "_A_RawMeterData";
-        dataType = "V4A";
-    }
-    else
-    {
-        meterTable = meterId.toString() + "_B_RawMeterData";
-        dataType = "V4B";
-    }
-    qDebug("Response meterTime %s, meterId %s, meterType %s, dataType %s"
-           , qUtf8Printable(meterTime.toString())
-           , qUtf8Printable(meterId.toString())
-           , qUtf8Printable(meterType.toString())
-           , qUtf8Printable(dataType.toString()));
-
-    QSqlDatabase dbConn = QSqlDatabase::database(ConnectionName);
-
-    if (!dbConn.isOpen())
-    {
-        qCritical() << "Unable to open database to save solar data.";
-        qInfo() << "Return false";
-        return false;
-    }
-    QSqlQuery query(dbConn);
-
-    query.prepare(QString("INSERT INTO %1 (MeterTime, MeterId, MeterType, DataType, MeterData) VALUES (?, ?, ?, ?, ?)").arg(meterTable));
-    query.bindValue(0, meterTime);
-    query.bindValue(1, meterId);
-    query.bindValue(2, meterType);
-    query.bindValue(3, dataType);
-    query.bindValue(4, meterData);
-    if (!DontActuallyWriteDatabase)
+    qInfo("Begin");
+    int savedTimeout = ResponseTimeoutMSecs;
+    ResponseTimeoutMSecs = SerialProbeTimeoutMSecs;
+    bool found = false;
+    for (unsigned int i = 0; !found && (i < (sizeof(SerialProbeRates) / sizeof(SerialProbeRates[0]))); i++)
     {
-        if (!query.exec())
+        serialPort->setBaudRate(SerialProbeRates[i]);
+        serialPort->clear();
+        serialPort->clearError();
+        LineStats.setMeter(meter.meterId);
+        int goodReads = 0;
+        while (goodReads < SerialProbeReads)
         {
-            qCritical("Error inserting raw meter %02x data record in database: %s\n Query:  %s"
-                      , responseType
-                      , qUtf8Printable(query.lastError().text())
-                      , qUtf8Printable(query.lastQuery()));
-            qInfo() << "Return false";
-            return false;
+            ResponseV4Generic response;
+            QByteArray request = (meter.protocolVersion == 4) ? RequestV4Message(meter.meterId, '\x30') : RequestV3Message(meter.meterId);
+            WriteSerialMsg(serialPort, request.constData(), request.size());
+            bool good = ReadFrame(serialPort, meter.meterId, (qint8 *)&response, sizeof(response))
+                    && ValidateCRC(((uint8_t *)(response.responseV4Generic.fixed02) + 1), 252);
+            WriteSerialMsg(serialPort, (const char *)CloseString, sizeof(CloseString));
+            if (!good)
+                break;
+            goodReads++;
         }
-        else
-            qDebug("Inserting raw meter %s data was successful.", qUtf8Printable(dataType.toString()));
-    }
-    else
-    {
-        qDebug() << "Did not execute " << query.lastQuery();
+        found = (goodReads == SerialProbeReads);
+        qInfo("Meter %s %s at %d baud.", qUtf8Printable(meter.meterId), found ? "answers reliably" : "does not answer reliably", SerialProbeRates[i]);
     }
-    qInfo() << "Return true";
-    return true;
+    if (!found)
+        serialPort->setBaudRate(9600);
+    ResponseTimeoutMSecs = savedTimeout;
+    qInfo("Return %s", found ? "true" : "false");
+    return found;
 }
 
 /*!
@@ -444,9 +521,17 @@ bool SaveV4ResponseToDatabase(const uint8_t responseType, const ResponseV4Generi
 bool WriteSerialMsg(QSerialPort *serialPort, const char *msg, const qint64 msgSize)
 {
     qDebug() << "Begin";
+    TraceSpan span("write");
     qint64 bytesWritten = 0;
-    qInfo("msg is: %s", qUtf8Printable(QByteArray(msg, msgSize).toHex()));
+    if (!SerialLeftover.isEmpty())
+    {
+        /* Anything left over from the last response is stale once a new message is sent. */
+        LineStats.noteDiscarded(serialPort->portName(), SerialLeftover.size());
+        SerialLeftover.clear();
+    }
+    qCInfo(FrameLog, "msg is: %s", qUtf8Printable(QByteArray(msg, msgSize).toHex()));
     bytesWritten = serialPort->write(msg, msgSize);
+    WireCap.record(WireSent, serialPort->portName(), msg, bytesWritten);
 
     qDebug() << bytesWritten << "of" << msgSize << "bytes of msg written.";
     bool writeSuccess = serialPort->waitForBytesWritten(10000);
@@ -471,86 +556,134 @@ bool WriteSerialMsg(QSerialPort *serialPort, const char *msg, const qint64 msgSi
  * \param msg   Pointer to character array in which to put response.
  * \param msgSize   Expected size of response.
  *   msg array must be large enough to accomodate this many characters.
+ * \param captureTime   If not NULL, receives the time the read that completed the response returned.
  * \return true if successful, false otherwise.
+ *
+ * Bytes read beyond msgSize are kept in SerialLeftover and used first by
+ * the next call, so that a frame realigned by ReadFrame() can be completed.
+ * Timeouts, partial responses, serial port errors and gaps in the middle of
+ * a response are counted in LineStats.
  */
-bool ReadResponse(QSerialPort *serialPort, qint8 *msg, const qint64 msgSize)
+bool ReadResponse(QSerialPort *serialPort, qint8 *msg, const qint64 msgSize, CaptureTime *captureTime)
 {
     FlushDiagnostics();
-    /* Install the saveMessageOutput message handler so that timing considerations
+    /* Install a message handler that doesn't write the terminal so that timing considerations
      * will not be impacted by terminal output.  Restore message handler before returning.
      */
-    QtMessageHandler prevMsgHandler = qInstallMessageHandler(saveMessageOutput);
+    QtMessageHandler prevMsgHandler = qInstallMessageHandler(BackgroundMessageOutput());
     qDebug() << "Begin";
-    qDebug() << serialPort;
-    qDebug() << "The message address is" << msg;
-    qDebug() << msgSize << "is the size the response.";
+    TraceSpan span("receive");
+    qCDebug(SerialLog) << serialPort;
+    qCDebug(SerialLog) << "The message address is" << msg;
+    qCDebug(SerialLog) << msgSize << "is the size the response.";
     static const int maxTries = 10;
     qint64 bytesRead = 0, bytesThisRead = 0, prevBytesAvail = 0, bytesAvail = 0;
     QByteArray readData;
     int tryReadCount = 0;
+    QElapsedTimer sinceLastRead;
+    const qint64 charUSecs = SerialCharUSecs(serialPort);
+    if (!SerialLeftover.isEmpty())
+    {
+        bytesRead = qMin((qint64)SerialLeftover.size(), msgSize);
+        qCDebug(SerialLog, "Using %lld bytes left over from the last read.", bytesRead);
+        memcpy(msg, SerialLeftover.constData(), bytesRead);
+        SerialLeftover.remove(0, bytesRead);
+        /* The last byte of the response was read along with the one before it, not now. */
+        if ((bytesRead >= msgSize) && (captureTime != NULL))
+            *captureTime = SerialLeftoverTime;
+        sinceLastRead.start();
+    }
     while (bytesRead < msgSize)
     {
-        qDebug() << "Wait for ready read 10 sec.";
-        if (!serialPort->waitForReadyRead(10000))
+        qCDebug(SerialLog) << "Wait for ready read" << ResponseTimeoutMSecs << "msec.";
+        bool ready;
+        {
+            TraceSpan wait((bytesRead == 0) ? "first byte" : "wait bytes");
+            ready = serialPort->waitForReadyRead(ResponseTimeoutMSecs);
+        }
+        if (!ready)
         {
             qWarning() << "Read timeout waiting for message";
+            LineStats.note(serialPort->portName(), (bytesRead > 0) ? LinePartialFrame : LineTimeout);
             qInstallMessageHandler(prevMsgHandler);
             qDebug() << "Return false";
             return false;
         }
-        qDebug() << "waitForReadyRead(10000) returned true.";
+        qCDebug(SerialLog) << "waitForReadyRead returned true.";
         bytesAvail = serialPort->bytesAvailable();
         while ((bytesAvail < msgSize) && (bytesAvail > prevBytesAvail))
         {
             /*! Compute the number of microsec to wait to get the rest of the message.
              *  Some extra time in the form of 12 extra characters is allowed.
-             *  960 = characters per second at 9600 baud. (1 start bit, 7 data bits, 1 parity bit, 1 stop bit)
-             *  Do arithmetic as indicated to preserve significance.
+             *  The time of a character follows the port's settings;
+             *  1042 usec at 9600 baud. (1 start bit, 7 data bits, 1 parity bit, 1 stop bit)
              */
-            useconds_t usec = (((msgSize - bytesAvail + 12ll) * 1000000ll) / 960ll);
-            qDebug("Waiting for %u usec to get %lld = (%lld - %lld) more bytes."
+            useconds_t usec = (msgSize - bytesAvail + 12ll) * charUSecs;
+            qCDebug(SerialLog, "Waiting for %u usec to get %lld = (%lld - %lld) more bytes."
                    , usec
                    , (msgSize - bytesAvail)
                    , msgSize
                    , bytesAvail);
-            usleep(usec);
+            {
+                TraceSpan pace("pace");
+                PauseSerialUSecs(serialPort, usec);
+            }
             prevBytesAvail = bytesAvail;
-            qDebug() << "Wait again for ready read 10 msec.";
+            qCDebug(SerialLog) << "Wait again for ready read 10 msec.";
             // bytesAvailable doesn't seem to update unless waitForReadyRead is called.
             if (!serialPort->waitForReadyRead(10))
                 qWarning() << "Read timeout waiting for more bytes.  Continue.";
             else
-                qDebug() << "waitForReadyRead(10) returned true.";
-            qDebug() << "  Now get the count again.";
+                qCDebug(SerialLog) << "waitForReadyRead(10) returned true.";
+            qCDebug(SerialLog) << "  Now get the count again.";
             bytesAvail = serialPort->bytesAvailable();
-            qDebug("Now there are %lld bytes available.", bytesAvail);
+            qCDebug(SerialLog, "Now there are %lld bytes available.", bytesAvail);
         }
-        qDebug() << "Now read the data.";
+        qCDebug(SerialLog) << "Now read the data.";
         readData = serialPort->readAll();       // Read into QByteArray.
+        CaptureTime readTime = CaptureTimeNow();
         bytesThisRead = readData.size();
+        WireCap.record(WireReceived, serialPort->portName(), readData.constData(), bytesThisRead);
         if (serialPort->error() != QSerialPort::NoError)
         {
-            qDebug("Data was ready for reading, but an error occurred trying to read.  We read %lld bytes.", bytesThisRead);
-            qDebug() << "Error code is: " << serialPort->error() << "Error was: " << serialPort->errorString();
+            qCDebug(SerialLog, "Data was ready for reading, but an error occurred trying to read.  We read %lld bytes.", bytesThisRead);
+            qCDebug(SerialLog) << "Error code is: " << serialPort->error() << "Error was: " << serialPort->errorString();
+            LineStats.note(serialPort->portName(), LineStatistics::classify(serialPort->error()));
             qInstallMessageHandler(prevMsgHandler);
             qDebug() << "Return false";
             return false;
         }
         else if ((bytesThisRead == 0) && (tryReadCount < maxTries))
         {
-            qDebug() << "Data was ready for reading, but no bytes were read.  Try reading again.";
+            qCDebug(SerialLog) << "Data was ready for reading, but no bytes were read.  Try reading again.";
             tryReadCount++;
             continue;
         }
-        qDebug("%lld bytes read are: %s", bytesThisRead, qUtf8Printable(readData.toHex()));
-        qDebug("Copying %lld bytes read to msg at %p"
+        qCDebug(FrameLog, "%lld bytes read are: %s", bytesThisRead, qUtf8Printable(readData.toHex()));
+        LineStats.noteBytes(serialPort->portName(), bytesThisRead);
+        if (sinceLastRead.isValid())
+        {
+            /* Time the line was idle: the time since the last read less the time these bytes took to arrive. */
+            qint64 idleUSecs = sinceLastRead.nsecsElapsed() / 1000 - bytesThisRead * charUSecs;
+            if (idleUSecs > (LineGapChars * charUSecs))
+                LineStats.noteGap(serialPort->portName(), idleUSecs);
+        }
+        sinceLastRead.start();
+        qCDebug(SerialLog, "Copying %lld bytes read to msg at %p"
                , qMax(qMin(bytesThisRead, (msgSize - bytesRead)), 0ll)
                , (void *)((qint8 *)msg + bytesRead));
         memcpy(((qint8 *)msg + bytesRead)
                , readData.constData()
                , qMax(qMin(bytesThisRead, (msgSize - bytesRead)), 0ll));
+        if (bytesThisRead > (msgSize - bytesRead))
+        {
+            SerialLeftover = readData.mid(msgSize - bytesRead);
+            SerialLeftoverTime = readTime;
+        }
         bytesRead += qMax(qMin(bytesThisRead, (msgSize - bytesRead)), 0ll);
-        qDebug("%lld bytes of Msg is now: %s\n", bytesRead, qUtf8Printable(QByteArray((char *)msg, bytesRead).toHex()));
+        if ((bytesRead >= msgSize) && (captureTime != NULL))
+            *captureTime = readTime;
+        qCDebug(FrameLog, "%lld bytes of Msg is now: %s\n", bytesRead, qUtf8Printable(QByteArray((char *)msg, bytesRead).toHex()));
     }
 
     qInstallMessageHandler(prevMsgHandler);
@@ -558,21 +691,76 @@ bool ReadResponse(QSerialPort *serialPort, qint8 *msg, const qint64 msgSize)
     return true;
 }
 
+/*!
+ * \brief ReadFrame -- Read a 255 byte data response with the incremental frame parser.
+ *
+ * Bytes are read only as fast as the parser can use them.  Stray bytes
+ * before the response, or the start of some other meter's response, are
+ * dropped by the parser, which then asks for just enough bytes to complete
+ * the response, instead of the whole request being retried.  A response
+ * that is aligned but fails its CRC is returned as it is; its CRC is checked
+ * again when it is stored.
+ *
+ * \param serialPort  Serial port to read.
+ * \param meterId   Full 12 character serial number of the meter the response must come from.
+ * \param msg   Pointer to character array in which to put response.
+ * \param msgSize   Size of the response; must be FrameSize.
+ * \param captureTime   If not NULL, receives the time the response was captured.
+ * \return true if successful, false otherwise.
+ */
+bool ReadFrame(QSerialPort *serialPort, const QString &meterId, qint8 *msg, const qint64 msgSize, CaptureTime *captureTime)
+{
+    qDebug() << "Begin";
+    Q_ASSERT(msgSize == FrameSize);
+    FrameParser parser(meterId);
+    uint8_t chunk[FrameSize];
+    bool success = true;
+    while (success && !parser.isComplete())
+    {
+        if (parser.discardedBytes > FrameSize)
+        {
+            qWarning("Gave up looking for a response from meter %s in %d bytes.", qUtf8Printable(meterId), parser.discardedBytes);
+            success = false;
+            break;
+        }
+        int wanted = parser.bytesWanted();
+        success = ReadResponse(serialPort, (qint8 *)chunk, wanted, captureTime);
+        if (success)
+            parser.feed(chunk, wanted);
+    }
+    QString portName = serialPort->portName();
+    if (parser.discardedBytes > parser.resyncs)
+        LineStats.note(portName, LineBadStart);
+    LineStats.note(portName, LineWrongMeter, parser.wrongMeters);
+    LineStats.note(portName, LineBadEnd, parser.badEnds);
+    LineStats.note(portName, LineResync, parser.resyncs);
+    LineStats.noteDiscarded(portName, parser.discardedBytes);
+    if (!success)
+    {
+        qDebug() << "Return false";
+        return false;
+    }
+    LineStats.note(portName, parser.crcValid() ? LineFrameOk : LineBadCrc);
+    memcpy(msg, parser.frame(), msgSize);
+    qDebug() << "Return true";
+    return true;
+}
+
 /*!
  * \brief SendControl -- Send a control message to meter with interaction.
  *
- * Send request for "A" response to establish communication with a particular
- * meter.  Read response, send password message, read response,
- * send this message, read response, send close message.
+ * Runs a write transaction (see transaction.h) that requests "A" data to
+ * establish communication with the meter, sends the password, then this
+ * message, checking each is acknowledged, then closes the meter.
  * \param serialPort
- * \param meterId   Full 12 character serial number of meter.
+ * \param config    The meter; only v.4 meters take controls.
  * \param ctrlMsg   The message to send.
  * \param msgSize   The size of the message.
  * \return true if successful, false otherwise.
  */
-bool SendControl(QSerialPort *serialPort, QString &meterId, OutputControlDef *ctrlMsg, const int msgSize)
+bool SendControl(QSerialPort *serialPort, const MeterConfig &config, OutputControlDef *ctrlMsg, const int msgSize)
 {
-    if (meterId.toLongLong() < 300000000)
+    if (config.protocolVersion != 4)
     {
         qDebug() << "I only know how to send controls to v.4 Omnimeters.";
         qDebug() << "Return false";
@@ -584,171 +772,79 @@ bool SendControl(QSerialPort *serialPort, QString &meterId, OutputControlDef *ct
         qDebug() << "Return false";
         return false;
     }
-    {
-        qint8 ackResponse[1];
-        ResponseV4AData responseA;
-        qInfo() << "Begin";
-        static const int maxTries = 10;
-        memcpy(RequestMsgV4.meterId, qPrintable(meterId), sizeof(RequestMsgV4.meterId));
-        RequestMsgV4.reqType[1] = '\x30';       // \x30 to get A data
-
-        qInfo("RequestMsgV4 is: %s", qUtf8Printable(QByteArray((const char *)RequestMsgV4.fixedBegin, sizeof(RequestMsgV4)).toHex()));
-
-        int tryCount = 0;
-        while (tryCount++ < maxTries)
-        {
-            qDebug() << "Started trying to get data.";
-            WriteSerialMsg(serialPort, (const char *)RequestMsgV4.fixedBegin, sizeof(RequestMsgV4));
-            if (ReadResponse(serialPort, (qint8 *)(&responseA), sizeof(responseA)))
-                break;
-        }
-        if (tryCount >= maxTries)
-        {
-            qDebug() << "Could not get responseA from V4 meter" << meterId;
-            qDebug() << "Return false";
-            return false;
-        }
+    qInfo() << "Begin";
+    QScopedPointer<MeterTransaction> transaction(NewWriteTransaction("output control", config.meterId, serialPort->portName(), TransactionHigh));
+    transaction->send(MessageBytes(ctrlMsg->SOH, msgSize), "control message")
+            .expectAck("control");
+    bool retVal = (transaction->run(serialPort) == TransactionSucceeded);
+    qDebug() << "Return" << retVal;
+    return retVal;
+}
 
-        // Send the control message.
-        if (WriteSerialMsg(serialPort, (const char *)PasswordMsg, sizeof(PasswordMsg)))
-        {
-            qDebug() << "Wrote Password message ok.";
-            if (ReadResponse(serialPort, ackResponse, sizeof(ackResponse)))
-            {
-                if (ackResponse[0] == ResponseAck[0])
-                {
-                    qDebug() << "Got ACK from password";
-                    if (WriteSerialMsg(serialPort, (const char *)ctrlMsg->SOH, msgSize))
-                    {
-                        qDebug() << "Wrote control message ok.";
-                        if (ReadResponse(serialPort, ackResponse, sizeof(ackResponse)))
-                        {
-                            if (ackResponse[0] == ResponseAck[0])
-                                qDebug() << "Got ACK from control";
-                            else
-                                qDebug() << "ack response wasn't ACK.";
-                        }
-                        else
-                            qDebug() << "Could not get ack response.";
-                    }
-                    else
-                        qDebug() << "Failed to write control message.";
-                }
-                else
-                    qDebug() << "ack response wasn't ACK.";
-            }
-            else
-                qDebug() << "Could not get ack response.";
-        }
-        else
-            qDebug() << "Failed to write password message.";
-    }
+/*!
+ * \brief SetTimeMessage -- Make the message setting a meter to this computer's idea of local standard time.
+ *
+ * Made as it is sent, so the time is current.
+ *
+ * \return The message.
+ */
+QByteArray SetTimeMessage()
+{
+    SetTimeMsgDef setTime = SetTimeMsg;
+    QDateTime timeNow = QDateTime::fromMSecsSinceEpoch(ClockMSecs());
+    qInfo() << "The current time is:  " << timeNow;
+    memcpy((void *)&(setTime.dateTime), qPrintable(
+               timeNow.toTimeZone(LocalStandardTimeZone)
+               .toString("yyMMdd00HHmmss")), sizeof(setTime.dateTime));
+    int dow = (timeNow.date().dayOfWeek() % 7) + 1;  // Convert Qt's week day number to EKM's.
+    setTime.dateTime.weekday[0] = (dow / 256) + 48;
+    setTime.dateTime.weekday[1] = (dow % 256) + 48;
+
+    uint16_t crc = computeEkmCrc((uint8_t *)(setTime.SOH) + 1, sizeof(SetTimeMsgDef) - 3);
+    setTime.crc[0] = (crc >> 8) & 0x7f;
+    setTime.crc[1] = crc & 0x7f;
+    if (ValidateCRC((const uint8_t *)(&setTime.SOH) + 1,  sizeof(SetTimeMsgDef) - 3))
+        qDebug("We think the CRC is OK.");
+    else
+        qDebug("We think the CRC is NOT OK.");
+    return MessageBytes(setTime.SOH, sizeof(SetTimeMsgDef));
+}
 
-    WriteSerialMsg(serialPort, (const char *)CloseString, sizeof(CloseString));
-    qDebug() << "Return true";
-    return true;
+/*!
+ * \brief SetTimeTransaction -- A transaction setting a v.4 meter to local standard time.
+ * \param meterId       Full 12 character serial number of meter.
+ * \param portName      Serial device of the meter.
+ * \param timeoutMSecs  Time limit.
+ * \return The transaction; the caller owns it.
+ */
+MeterTransaction *SetTimeTransaction(const QString &meterId, const QString &portName, const qint64 timeoutMSecs)
+{
+    MeterTransaction *transaction = NewWriteTransaction("time set", meterId, portName, TransactionLow, timeoutMSecs);
+    transaction->send(SetTimeMessage, "set time message")
+            .expectAck("setting time");
+    return transaction;
 }
 
 /*!
  * \brief SetMeterTime -- Set the meter to this computer's idea of local standard time.
  *
- * Similar to SendControl() function.  Time message must be computed before sending.
+ * Similar to SendControl() function.  Time message is made as it is sent.
  *
  * \param serialPort
- * \param meterId   Full 12 character serial number of meter.
+ * \param config    The meter; only v.4 meters have their time set.
  * \return true if successful, false otherwise.
  */
-bool SetMeterTime(QSerialPort *serialPort, QString &meterId)
+bool SetMeterTime(QSerialPort *serialPort, const MeterConfig &config)
 {
-    bool retVal = false;
-    if (meterId.toLongLong() < 300000000)
+    if (config.protocolVersion != 4)
     {
         qDebug() << "I only know how to set time to v.4 Omnimeters; others ignored.";
         qDebug() << "Return true";
         return true;
     }
-    {
-        qint8 ackResponse[1];
-        ResponseV4AData responseA;
-        qInfo() << "Begin";
-        static const int maxTries = 10;
-        memcpy(RequestMsgV4.meterId, qPrintable(meterId), sizeof(RequestMsgV4.meterId));
-        RequestMsgV4.reqType[1] = '\x30';       // \x30 to get A data
-
-        qInfo("RequestMsgV4 is: %s", qUtf8Printable(QByteArray((const char *)RequestMsgV4.fixedBegin, sizeof(RequestMsgV4)).toHex()));
-
-        int tryCount = 0;
-        while (tryCount++ < maxTries)
-        {
-            qDebug() << "Started trying to get data.";
-            WriteSerialMsg(serialPort, (const char *)RequestMsgV4.fixedBegin, sizeof(RequestMsgV4));
-            if (ReadResponse(serialPort, (qint8 *)(&responseA), sizeof(responseA)))
-                break;
-        }
-        if (tryCount >= maxTries)
-        {
-            qDebug() << "Could not get responseA from V4 meter" << meterId;
-            qDebug() << "Return false";
-            return false;
-        }
-
-        // Send the control message.
-        if (WriteSerialMsg(serialPort, (const char *)PasswordMsg, sizeof(PasswordMsg)))
-        {
-            qDebug() << "Wrote Password message ok.";
-            if (ReadResponse(serialPort, ackResponse, sizeof(ackResponse)))
-            {
-                if (ackResponse[0] == ResponseAck[0])
-                {
-                    qDebug() << "Got ACK from password";
-                    SetTimeMsgDef setTime = SetTimeMsg;
-                    QDateTime timeNow = QDateTime::currentDateTime();
-                    qInfo() << "The current time is:  " << timeNow;
-                    memcpy((void *)&(setTime.dateTime), qPrintable(
-                               timeNow.toTimeZone(LocalStandardTimeZone)
-                               .toString("yyMMdd00HHmmss")), sizeof(setTime.dateTime));
-                    int dow = (timeNow.date().dayOfWeek() % 7) + 1;  // Convert Qt's week day number to EKM's.
-                    setTime.dateTime.weekday[0] = (dow / 256) + 48;
-                    setTime.dateTime.weekday[1] = (dow % 256) + 48;
-
-                    uint16_t crc = computeEkmCrc((uint8_t *)(setTime.SOH) + 1, sizeof(SetTimeMsgDef) - 3);
-                    setTime.crc[0] = (crc >> 8) & 0x7f;
-                    setTime.crc[1] = crc & 0x7f;
-                    qInfo("setTime after CRC: %s", qUtf8Printable(QByteArray((const char *)&setTime, sizeof(setTime)).toHex()));
-                    if (ValidateCRC((const uint8_t *)(&setTime.SOH) + 1,  sizeof(SetTimeMsgDef) - 3))
-                        qDebug("We think the CRC is OK.");
-                    else
-                        qDebug("We think the CRC is NOT OK.");
-                    if (WriteSerialMsg(serialPort, (const char *)setTime.SOH, sizeof(SetTimeMsgDef)))
-                    {
-                        qDebug() << "Wrote set time message ok.";
-                        if (ReadResponse(serialPort, ackResponse, sizeof(ackResponse)))
-                        {
-                            if (ackResponse[0] == ResponseAck[0])
-                            {
-                                qDebug() << "Got ACK from setting time";
-                                retVal = true;
-                            }
-                            else
-                                qDebug() << "ack response wasn't ACK.";
-                        }
-                        else
-                            qDebug() << "Could not get ack response.";
-                    }
-                    else
-                        qDebug() << "Failed to write set time message.";
-                }
-                else
-                    qDebug() << "ack response wasn't ACK.";
-            }
-            else
-                qDebug() << "Could not get ack response.";
-        }
-        else
-            qDebug() << "Failed to write password message.";
-    }
-
-    WriteSerialMsg(serialPort, (const char *)CloseString, sizeof(CloseString));
+    qInfo() << "Begin";
+    QScopedPointer<MeterTransaction> transaction(SetTimeTransaction(config.meterId, serialPort->portName(), TransactionDefaultTimeoutMSecs));
+    bool retVal = (transaction->run(serialPort) == TransactionSucceeded);
     qDebug() << "Return" << retVal;
     return retVal;
 }
@@ -763,31 +859,37 @@ bool SetMeterTime(QSerialPort *serialPort, QString &meterId)
  * \param meterId   Full 12 character serial number of meter.
  * \param requestType   Either x30 for "A" data or x31 for "B" data.
  * \param response  Pointer to response data.
+ * \param captureTime   If not NULL, receives the time the response was captured.
  * \return true if successful, false otherwise.
  */
 bool GetMeterV4Data(QSerialPort *serialPort
                     , const QString meterId
                     , const uint8_t requestType
-                    , ResponseV4Generic *response)
+                    , ResponseV4Generic *response
+                    , CaptureTime *captureTime)
 {
     qInfo() << "Begin";
+    LineStats.setMeter(meterId);
     static const int maxTries = 10;
-    memcpy(RequestMsgV4.meterId, qPrintable(meterId), sizeof(RequestMsgV4.meterId));
-    RequestMsgV4.reqType[1] = requestType;       // \x30 to get A data
+    QByteArray request = RequestV4Message(meterId, requestType);       // \x30 to get A data
 
-    qInfo("RequestMsgV4 is: %s", qUtf8Printable(QByteArray((const char *)RequestMsgV4.fixedBegin, sizeof(RequestMsgV4)).toHex()));
+    qCInfo(FrameLog, "RequestMsgV4 is: %s", qUtf8Printable(request.toHex()));
 
     int tryCount = 0;
     while (tryCount++ < maxTries)
     {
-        if (serialPort->clear())
+        if (IsTcpGatewayName(serialPort->portName()))
+            qDebug("Stale bytes from the gateway are discarded when the request is written.");
+        else if (IsReplayPort(serialPort))
+            qDebug("Replayed bytes not read are passed over when the request is written.");
+        else if (serialPort->clear())
             qDebug("Cleared serial port data.");
         else
             qWarning("Clearing serial port data had error:  %s", qUtf8Printable(serialPort->errorString()));
         serialPort->clearError();
         qDebug() << "Started trying to get data.";
-        WriteSerialMsg(serialPort, (const char *)RequestMsgV4.fixedBegin, sizeof(RequestMsgV4));
-        if (ReadResponse(serialPort, (qint8 *)response, sizeof(*response)))
+        WriteSerialMsg(serialPort, request.constData(), request.size());
+        if (ReadFrame(serialPort, meterId, (qint8 *)response, sizeof(*response), captureTime))
             break;
     }
     if (tryCount >= maxTries)
@@ -807,23 +909,25 @@ bool GetMeterV4Data(QSerialPort *serialPort
  * \param serialPort
  * \param meterId   Full 12 character serial number of meter.
  * \param response
+ * \param captureTime   If not NULL, receives the time the response was captured.
  * \return true if successful, false otherwise.
  */
-bool GetMeterV3Data(QSerialPort *serialPort, const QString meterId, ResponseV3Data *response)
+bool GetMeterV3Data(QSerialPort *serialPort, const QString meterId, ResponseV3Data *response, CaptureTime *captureTime)
 {
     qInfo() << "Begin";
+    LineStats.setMeter(meterId);
     static const int maxTries = 10;
-    memcpy(RequestMsgV3.meterId, qPrintable(meterId), sizeof(RequestMsgV3.meterId));
+    QByteArray request = RequestV3Message(meterId);
 
-    qInfo("RequestMsgV3 is: %s", qUtf8Printable(QByteArray((const char *)RequestMsgV3.fixedBegin, sizeof(RequestMsgV3)).toHex()));
+    qCInfo(FrameLog, "RequestMsgV3 is: %s", qUtf8Printable(request.toHex()));
 
     int tryCount = 0;
     while (tryCount++ < maxTries)
     {
         serialPort->clearError();
         qDebug() << "Started trying to get data.";
-        WriteSerialMsg(serialPort, (const char *)RequestMsgV3.fixedBegin, sizeof(RequestMsgV3));
-        if (ReadResponse(serialPort, (qint8 *)response, sizeof(*response)))
+        WriteSerialMsg(serialPort, request.constData(), request.size());
+        if (ReadFrame(serialPort, meterId, (qint8 *)response, sizeof(*response), captureTime))
             break;
     }
     if (tryCount >= maxTries)
@@ -847,6 +951,7 @@ bool ValidateCRC(const uint8_t *msg, int numBytes)
 {
     // Compute CRC from msg for numBytes; then compare to the next two bytes.
     qDebug() << "Begin";
+    TraceSpan span("crc");
     uint16_t crc = computeEkmCrc(msg, numBytes);
     qDebug("Computed CRC is %04x", crc);
     uint16_t msgCrc = msg[numBytes] * 256 + msg[numBytes + 1];
@@ -856,6 +961,131 @@ bool ValidateCRC(const uint8_t *msg, int numBytes)
     return (crc == msgCrc);
 }
 
+/*!
+ * \brief ApplyOutputControls -- Make the meter outputs match their bound files.
+ *
+ * Each output bound to a file is turned ON while the file exists in the home
+ * directory, and OFF otherwise.
+ *
+ * For example, output 2 is assumed connected to a relay that controls the
+ * sprinkler controller "Rain Sensor", such that if the relay
+ * is CLOSED, watering is enabled.  If the relay is OPEN,
+ * watering is disabled.  Output 2 is bound to ".WeatherWet" which the
+ * weather program creates when it is WET out there.
+ *
+ * \param serialPort    Serial port the meter is connected to.
+ * \param entry         The meter.
+ * \param responseA     Most recent A response from the meter; has the output states.
+ */
+void ApplyOutputControls(QSerialPort *serialPort, MeterEntry &entry, const ResponseV4AData &responseA)
+{
+    /* outState is '1' + bits:  bit 1 => output 1 ON, bit 0 => output 2 ON. */
+    int outBits = responseA.outState[0] - 0x31;
+    qDebug("Current output state is 0x%02x (-0x31 = 0x%02x)", responseA.outState[0], outBits);
+    if (!entry.config.output1File.isEmpty())
+    {
+        bool wantOn = QFileInfo::exists(QDir::homePath() + "/" + entry.config.output1File);
+        bool isOn = ((outBits & 2) == 2);
+        qDebug("Make sure output 1 is %s.", wantOn ? "ON" : "OFF");
+        if (wantOn && !isOn)
+            SendControl(serialPort, entry.config, &Output1OnMsg, sizeof(Output1OnMsg));
+        else if (!wantOn && isOn)
+            SendControl(serialPort, entry.config, &Output1OffMsg, sizeof(Output1OffMsg));
+    }
+    if (!entry.config.output2File.isEmpty())
+    {
+        bool wantOn = QFileInfo::exists(QDir::homePath() + "/" + entry.config.output2File);
+        bool isOn = ((outBits & 1) == 1);
+        qDebug("Make sure output 2 is %s.", wantOn ? "ON" : "OFF");
+        if (wantOn && !isOn)
+            SendControl(serialPort, entry.config, &Output2OnMsg, sizeof(Output2OnMsg));
+        else if (!wantOn && isOn)
+            SendControl(serialPort, entry.config, &Output2OffMsg, sizeof(Output2OffMsg));
+    }
+}
+
+/*!
+ * \brief PollMeter -- Read a meter once.
+ *
+ * A v.4 meter is asked for its A response, and its B response when due by
+ * its A to B ratio, then closed; its output controls are then applied.  A
+ * v.3 meter is asked for its response.  The clock skew is tracked from each
+ * response with a valid CRC.
+ *
+ * \param entry       The meter.
+ * \param serialPort  Serial port of the meter.
+ * \return The readings; empty if the meter didn't respond.
+ */
+QList<MeterReading> PollMeter(MeterEntry &entry, QSerialPort *serialPort)
+{
+    const QString &fullMeterId = entry.config.meterId;
+    QList<MeterReading> readings;
+    if (entry.config.protocolVersion == 4)
+    {
+        qInfo() << "The meter is a v.4 meter.";
+        ResponseV4Generic responseA;
+        ResponseV4Generic responseB;
+        CaptureTime captureTimeA, captureTimeB;
+        bool gotResponseA = GetMeterV4Data(serialPort, fullMeterId, '\x30', &responseA, &captureTimeA);
+        if (gotResponseA)
+        {
+            qDebug() << "Got V4 meter data";
+            bool crcValid = ValidateCRC(((uint8_t *)(responseA.responseV4Generic.fixed02) + 1), 252);
+            if (crcValid)
+            {
+                qDebug() << "responseA crc is valid.";
+                TrackClockSkew(entry, captureTimeA, responseA.responseV4Generic.dateTime);
+            }
+            else
+                qDebug() << "responseA crc is NOT valid.";
+            readings.append(MakeMeterReading(fullMeterId, entry.config.tableBaseName, 'A'
+                                             , responseA.responseV4Generic.fixed02, captureTimeA, crcValid));
+        }
+        if ((entry.config.aToBRatio > 0)
+                && (++entry.aDataCount >= entry.config.aToBRatio)
+                && GetMeterV4Data(serialPort, fullMeterId, '\x31', &responseB, &captureTimeB))
+        {
+            entry.aDataCount = 0;
+            qDebug() << "Got V4 meter data";
+            bool crcValid = ValidateCRC(((uint8_t *)(responseB.responseV4Generic.fixed02) + 1), 252);
+            if (crcValid)
+            {
+                qDebug() << "responseB crc is valid.";
+                TrackClockSkew(entry, captureTimeB, responseB.responseV4Generic.dateTime);
+            }
+            else
+                qDebug() << "responseB crc is NOT valid.";
+            readings.append(MakeMeterReading(fullMeterId, entry.config.tableBaseName, 'B'
+                                             , responseB.responseV4Generic.fixed02, captureTimeB, crcValid));
+        }
+
+        /*! Close the communication with this meter. */
+        WriteSerialMsg(serialPort, (const char *)CloseString, sizeof(CloseString));
+
+        if (gotResponseA)
+            ApplyOutputControls(serialPort, entry, responseA.responseV4Adata);
+    }
+    else
+    {
+        qInfo() << "The meter is a v.3 meter.";
+        ResponseV3Data response;
+        CaptureTime captureTime = CaptureTimeNow();
+        bool gotResponse = GetMeterV3Data(serialPort, fullMeterId, &response, &captureTime);
+        if (gotResponse)
+        {
+            qDebug() << "Got V3 meter data";
+            bool crcValid = ValidateCRC(((uint8_t *)(response.fixed02) + 1), 252);
+            if (crcValid)
+                qDebug() << "response crc is valid.";
+            else
+                qDebug() << "response crc is NOT valid.";
+            readings.append(MakeMeterReading(fullMeterId, entry.config.tableBaseName, '3'
+                                             , response.fixed02, captureTime, crcValid));
+        }
+    }
+    return readings;
+}
+
 /*!
  * \brief main -- The whole tamale.
  * \param argc
@@ -881,8 +1111,7 @@ int main(int argc, char *argv[])
     /*
      * Local variable declarations
      */
-    QSerialPort *serialPort = NULL;
-    int interval = 0, repeatCount = 0, aToBRatio = 10, aDataCount = 0;
+    int interval = 0, repeatCount = 0, aToBRatio = 10;
 
     /*
      * Process command line options
@@ -892,11 +1121,14 @@ int main(int argc, char *argv[])
                                      "     Program to read EKM power meters and store in database.");
     parser.addHelpOption();
 
-    parser.addPositionalArgument("meterId", "Meter serial numbers to read.", "[meter id] ...");
+    parser.addPositionalArgument("meterId", "Meter serial numbers to read.  Ignored if a fleet configuration file is given.", "[meter id] ...");
     QCommandLineOption serialDeviceOption(QStringList() << "s" << "serial-name"
                                           , "The name of the serial device. [cu.usbserial-AH034Y93]"
                                           , "Name"
                                           , "cu.usbserial-AH034Y93");
+    QCommandLineOption serialSettingsOption(QStringList() << "serial-settings", "Serial port settings: [<device>=]<baud>|probe[,<format>[,<flow>]],\n"
+                                                                              "e.g. cu.usbserial-AH034Y93=19200,7E1,none.  May be repeated.\n"
+                                                                              "Without a device, the default for all ports; 9600,7E1,none if not given.", "settings");
     QCommandLineOption intervalOption(QStringList() << "i" << "interval", "Time between successive reads of meters listed.\n"
                                                                           "If zero read only once.", "minutes"
                                       , "1");
@@ -918,7 +1150,67 @@ int main(int argc, char *argv[])
                                                   , "Print diagnostic info to terminal immediately.");
     QCommandLineOption dontWriteDatabaseOption(QStringList() << "W" << "dont-write"
                                                , "If specified, don't actually write to the database.");
+    QCommandLineOption maxClockSkewOption(QStringList() << "k" << "max-clock-skew", "Set meter time when its clock is predicted to be off by more than this.", "seconds"
+                                          , "10");
+    QCommandLineOption archiveDirOption(QStringList() << "a" << "archive-dir", "Directory in which to archive responses in binary form; same as adding raw:<dir> to --sinks.\n"
+                                                                               "Also the archive to read with --scan-archive.", "dir"
+                                        , "");
+    QCommandLineOption sinksOption(QStringList() << "sinks", "Comma separated list of where to store readings:\n"
+                                                             "mysql, mysql:partitioned, sqlite:[packed:]<file>, raw:[packed:]<dir>.", "list"
+                                   , "mysql");
+    QCommandLineOption dbWritersOption(QStringList() << "db-writers", "Number of threads, each with its own connection, writing the database.\n"
+                                                                   "With one, readings are written before the next meter is read.", "count"
+                                       , "1");
+    QCommandLineOption partitionMonthsOption(QStringList() << "partition-months", "With the mysql:partitioned sink, months of readings to keep.\n"
+                                                                                 "Older monthly partitions are dropped.  If zero keep all.", "months"
+                                             , "0");
+    QCommandLineOption changeOnlyOption(QStringList() << "change-only", "Store a reading in the databases only if it differs from the last one stored,\n"
+                                                                     "or this many seconds have passed since.", "seconds");
+    QCommandLineOption publishOption(QStringList() << "publish", "Unix domain socket on which to publish readings as they are read.", "path");
+    QCommandLineOption publishFormatOption(QStringList() << "publish-format", "Format of published readings: json (one object per line) or record (binary archive records).", "format"
+                                           , "json");
+    QCommandLineOption retentionConfigOption(QStringList() << "retention-config", "File of retention policies; old rows are pruned or thinned while idle between reads.", "file");
+    QCommandLineOption logRulesOption(QStringList() << "log-rules", "File of logging category rules (e.g. ekm.frame.debug=true).\n"
+                                                                "Reloaded when modified.", "file");
+    QCommandLineOption captureOption(QStringList() << "capture", "Record every byte sent and received on the serial ports to a trace file.", "file");
+    QCommandLineOption replayOption(QStringList() << "replay", "Play back a trace file recorded with --capture instead of using the serial ports.", "file");
+    QCommandLineOption replaySpeedOption(QStringList() << "replay-speed", "Speed of --replay relative to the capture; 0 for no waiting.", "factor"
+                                         , "1");
+    QCommandLineOption resumeOption(QStringList() << "resume", "Resume from the state left by a restart (see handoff.h); given by the program to itself.", "file");
+    QCommandLineOption scanArchiveOption(QStringList() << "scan-archive", "Scan the archived responses of a meter instead of reading meters.", "meter id");
+    QCommandLineOption fromOption(QStringList() << "from", "Beginning of time range to scan or export (ISO date time).", "time");
+    QCommandLineOption toOption(QStringList() << "to", "End of time range to scan or export (ISO date time).", "time");
+    QCommandLineOption printRecordsOption(QStringList() << "print-records", "Print each record scanned.");
+    QCommandLineOption exportOption(QStringList() << "export", "Export the stored responses of meters as CSV files instead of reading meters.", "meter ids");
+    QCommandLineOption exportSourceOption(QStringList() << "export-source", "Where to read responses to export:\n"
+                                                                            "archive (in --archive-dir), mysql, mysql:partitioned,\n"
+                                                                            "sqlite:<file> or sqlite:packed:<file>.", "source"
+                                          , "archive");
+    QCommandLineOption exportDirOption(QStringList() << "export-dir", "Directory to write exported CSV files in.", "dir", ".");
+    QCommandLineOption exportFieldsOption(QStringList() << "export-fields", "Fields to export, comma separated; all if not given.", "fields");
+    QCommandLineOption exportRowsOption(QStringList() << "export-rows", "Most rows in one exported CSV file.", "rows"
+                                        , QString::number(ExportFileRows));
+    QCommandLineOption exportThreadsOption(QStringList() << "export-threads", "Threads decoding exported responses; 0 for one per core.", "count"
+                                           , "0");
+    QCommandLineOption traceOption(QStringList() << "trace", "Record a timeline of each pass over the meters, written to this directory\n"
+                                                             "when a pass overruns the interval or ~/.TraceReadEKM exists.", "dir");
+    QCommandLineOption traceEventsOption(QStringList() << "trace-events", "Spans kept in memory for --trace.", "count"
+                                         , QString::number(TraceDefaultEvents));
+    QCommandLineOption simulateOption(QStringList() << "simulate", "Simulate reading the meters for this many hours on simulated ports and a virtual clock,\n"
+                                                                   "and report the pass times, bus use and sample jitter, instead of reading meters.", "hours");
+    QCommandLineOption simModelOption(QStringList() << "sim-model", "How simulated meters behave: comma separated turnaround=<msec>, jitter=<msec>,\n"
+                                                                    "noresponse=<rate>, badcrc=<rate>, drift=<sec/day>, seed=<n>.", "model"
+                                      , "");
+    QCommandLineOption gatewayStandInOption(QStringList() << "gateway-standin", "Answer as simulated meters behind a serial to TCP gateway on this local\n"
+                                                                                "TCP port, in real time, with --sim-model, instead of reading meters.", "tcp port");
+    QCommandLineOption benchmarkDecodeOption(QStringList() << "benchmark-decode", "Check and time the batch decoders of numeric fields on this many made up\n"
+                                                                                  "responses of each data type, instead of reading meters.", "count");
+    QCommandLineOption fleetConfigOption(QStringList() << "f" << "fleet-config", "File describing the meters to read.\n"
+                                                                                 "Reloaded when modified or when ~/.ReloadReadEKM exists.\n"
+                                                                                 "With --export, gives the meters' table names.", "file"
+                                         , "");
     parser.addOption(serialDeviceOption);
+    parser.addOption(serialSettingsOption);
     parser.addOption(intervalOption);
     parser.addOption(repeatCountOption);
     parser.addOption(aToBRatioOption);
@@ -928,6 +1220,37 @@ int main(int argc, char *argv[])
     parser.addOption(showDiagnosticsOption);
     parser.addOption(immediateDiagnosticsOption);
     parser.addOption(dontWriteDatabaseOption);
+    parser.addOption(fleetConfigOption);
+    parser.addOption(maxClockSkewOption);
+    parser.addOption(archiveDirOption);
+    parser.addOption(sinksOption);
+    parser.addOption(dbWritersOption);
+    parser.addOption(partitionMonthsOption);
+    parser.addOption(changeOnlyOption);
+    parser.addOption(publishOption);
+    parser.addOption(publishFormatOption);
+    parser.addOption(retentionConfigOption);
+    parser.addOption(logRulesOption);
+    parser.addOption(captureOption);
+    parser.addOption(replayOption);
+    parser.addOption(replaySpeedOption);
+    parser.addOption(resumeOption);
+    parser.addOption(scanArchiveOption);
+    parser.addOption(fromOption);
+    parser.addOption(toOption);
+    parser.addOption(printRecordsOption);
+    parser.addOption(exportOption);
+    parser.addOption(exportSourceOption);
+    parser.addOption(exportDirOption);
+    parser.addOption(exportFieldsOption);
+    parser.addOption(exportRowsOption);
+    parser.addOption(exportThreadsOption);
+    parser.addOption(traceOption);
+    parser.addOption(traceEventsOption);
+    parser.addOption(simulateOption);
+    parser.addOption(simModelOption);
+    parser.addOption(gatewayStandInOption);
+    parser.addOption(benchmarkDecodeOption);
     parser.process(a);
 
     ShowDiagnostics = parser.isSet(showDiagnosticsOption);
@@ -937,35 +1260,248 @@ int main(int argc, char *argv[])
     else
         qInstallMessageHandler(saveMessageOutput);
 
+    if (parser.isSet(scanArchiveOption))
+    {
+        QDateTime from = parser.isSet(fromOption) ? QDateTime::fromString(parser.value(fromOption), Qt::ISODate) : QDateTime::fromMSecsSinceEpoch(0);
+        QDateTime to = parser.isSet(toOption) ? QDateTime::fromString(parser.value(toOption), Qt::ISODate) : QDateTime::currentDateTime().addDays(1);
+        int status = ScanArchive(parser.value(archiveDirOption), parser.value(scanArchiveOption), from, to, parser.isSet(printRecordsOption));
+        FlushDiagnostics();
+        return status;
+    }
+
+    if (parser.isSet(benchmarkDecodeOption))
+    {
+        int frames = parser.value(benchmarkDecodeOption).toInt();
+        int status = BenchmarkBatchDecode((frames > 0) ? frames : BatchDefaultBenchmarkFrames);
+        FlushDiagnostics();
+        return status;
+    }
+
+    if (parser.isSet(exportOption))
+    {
+        ExportOptions options;
+        options.meterIds = parser.value(exportOption).split(',', QString::SkipEmptyParts);
+        options.source = parser.value(exportSourceOption);
+        options.archiveDir = parser.value(archiveDirOption);
+        options.from = parser.isSet(fromOption) ? QDateTime::fromString(parser.value(fromOption), Qt::ISODate) : QDateTime::fromMSecsSinceEpoch(0);
+        options.to = parser.isSet(toOption) ? QDateTime::fromString(parser.value(toOption), Qt::ISODate) : QDateTime::currentDateTime().addDays(1);
+        options.outputDir = parser.value(exportDirOption);
+        options.fields = parser.value(exportFieldsOption).split(',', QString::SkipEmptyParts);
+        options.fileRows = qMax(1, parser.value(exportRowsOption).toInt());
+        options.threads = parser.value(exportThreadsOption).toInt();
+        FleetConfigFileName = parser.value(fleetConfigOption);
+        if (!FleetConfigFileName.isEmpty())
+        {
+            QList<MeterConfig> exportConfig;
+            if (!LoadFleetConfig(FleetConfigFileName, parser.value(serialDeviceOption), aToBRatio, &exportConfig))
+            {
+                qCritical("Unable to load fleet configuration from %s.  Return 1", qUtf8Printable(FleetConfigFileName));
+                FlushDiagnostics();
+                return 1;
+            }
+            foreach (const MeterConfig &config, exportConfig)
+                options.tableBaseNames.insert(config.meterId, config.tableBaseName);
+        }
+        if (options.source.startsWith("mysql"))
+        {
+            QString databaseConnString = parser.value(databaseOption);
+            if (databaseConnString.isEmpty())
+                databaseConnString = QProcessEnvironment::systemEnvironment().value(parser.value(envVarNameOption));
+            if (databaseConnString.isEmpty())
+            {
+                qCritical("No database connection string found.  Return -3");
+                FlushDiagnostics();
+                return -3;
+            }
+            addConnectionFromString(databaseConnString);
+            DbPool = new DatabasePool(ConnectionName);
+        }
+        int status = ExportReadings(options);
+        FlushDiagnostics();
+        return status;
+    }
+
     DontActuallyWriteDatabase = parser.isSet(dontWriteDatabaseOption);
     qDebug() << "DontActuallyWriteDatabase: " << DontActuallyWriteDatabase;
 
     QString serialDevice = parser.value(serialDeviceOption);
+    foreach (QString settings, parser.values(serialSettingsOption))
+    {
+        if (!AddSerialSettings(settings))
+        {
+            qDebug("Return 1");
+            return 1;
+        }
+    }
     qDebug() << "Using serialDevice" << serialDevice;
 
+    if (parser.isSet(gatewayStandInOption))
+    {
+        SimulationModel model;
+        if (!ParseSimulationModel(parser.value(simModelOption), &model))
+        {
+            qDebug("Return 1");
+            return 1;
+        }
+        QList<MeterConfig> standInConfig;
+        FleetConfigFileName = parser.value(fleetConfigOption);
+        if (!FleetConfigFileName.isEmpty())
+        {
+            if (!LoadFleetConfig(FleetConfigFileName, serialDevice, aToBRatio, &standInConfig))
+            {
+                qCritical("Unable to load fleet configuration from %s.", qUtf8Printable(FleetConfigFileName));
+                qDebug("Return 1");
+                return 1;
+            }
+        }
+        else
+            standInConfig = FleetFromArgs(parser.positionalArguments(), serialDevice, aToBRatio);
+        if (standInConfig.isEmpty())
+        {
+            qCritical("You must supply at least one meter id on the command line or in the fleet configuration.");
+            qDebug("Return 1");
+            return 1;
+        }
+        int status = RunGatewayStandIn(standInConfig, parser.value(gatewayStandInOption).toUShort(), model);
+        FlushDiagnostics();
+        return status;
+    }
+
+    if (parser.isSet(simulateOption))
+    {
+        SimulationModel model;
+        if (!ParseSimulationModel(parser.value(simModelOption), &model))
+        {
+            qDebug("Return 1");
+            return 1;
+        }
+        interval = parser.value(intervalOption).toInt();
+        if (interval <= 0)
+        {
+            qCritical("Simulation needs an interval of at least a minute.  Return 1");
+            return 1;
+        }
+        TimeSetIntervalMSecs = interval * 60000ll;
+        aToBRatio = parser.value(aToBRatioOption).toInt();
+        MaxClockSkew = parser.value(maxClockSkewOption).toDouble();
+        QList<MeterConfig> simulatedConfig;
+        FleetConfigFileName = parser.value(fleetConfigOption);
+        if (!FleetConfigFileName.isEmpty())
+        {
+            if (!LoadFleetConfig(FleetConfigFileName, serialDevice, aToBRatio, &simulatedConfig))
+            {
+                qCritical("Unable to load fleet configuration from %s.", qUtf8Printable(FleetConfigFileName));
+                qDebug("Return 1");
+                return 1;
+            }
+        }
+        else
+            simulatedConfig = FleetFromArgs(parser.positionalArguments(), serialDevice, aToBRatio);
+        if (simulatedConfig.isEmpty())
+        {
+            qCritical("You must supply at least one meter id on the command line or in the fleet configuration.");
+            qDebug("Return 1");
+            return 1;
+        }
+        foreach (const MeterConfig &config, simulatedConfig)
+        {
+            MeterEntry entry;
+            entry.config = config;
+            entry.aDataCount = InitialADataCount(interval, config.aToBRatio);
+            entry.timeSetPending = false;
+            Fleet.append(entry);
+        }
+        int status = RunSimulation(Fleet, interval, parser.value(simulateOption).toDouble(), model);
+        FlushDiagnostics();
+        return status;
+    }
+    if (parser.isSet(captureOption) && !WireCap.open(parser.value(captureOption)))
+    {
+        qDebug("Return 1");
+        return 1;
+    }
+    if (parser.isSet(replayOption) && !LoadWireReplay(parser.value(replayOption), parser.value(replaySpeedOption).toDouble()))
+    {
+        qDebug("Return 1");
+        return 1;
+    }
+
+    DatabaseWriters = qMax(1, parser.value(dbWritersOption).toInt());
+    PartitionMonthsKept = qMax(0, parser.value(partitionMonthsOption).toInt());
+    Storage = new SinkChain();
+    foreach (QString sinkSpec, parser.value(sinksOption).split(',', QString::SkipEmptyParts))
+    {
+        StorageSink *sink = CreateSink(sinkSpec);
+        if (sink == NULL)
+        {
+            qDebug("Return 1");
+            return 1;
+        }
+        /* The raw archive is a complete record; only the databases store changes only. */
+        if (parser.isSet(changeOnlyOption) && !sinkSpec.trimmed().startsWith("raw"))
+            sink = new ChangeOnlySink(sink, parser.value(changeOnlyOption).toInt());
+        Storage->addSink(sink);
+    }
+    if (!parser.value(archiveDirOption).isEmpty() && !Storage->contains("raw:" + parser.value(archiveDirOption)))
+        Storage->addSink(new RawFileSink(parser.value(archiveDirOption)));
+    if (Storage->isEmpty())
+    {
+        qCritical("No storage sinks given.  Return 1");
+        return 1;
+    }
+
     QString databaseConnString = parser.value(databaseOption);
-    if (databaseConnString.isEmpty())
+    if (Storage->contains("mysql"))
     {
-        databaseConnString = QProcessEnvironment::systemEnvironment().value(parser.value(envVarNameOption));
         if (databaseConnString.isEmpty())
         {
-            qCritical("No database connection string found.  Return -3");
-            return -3;
+            databaseConnString = QProcessEnvironment::systemEnvironment().value(parser.value(envVarNameOption));
+            if (databaseConnString.isEmpty())
+            {
+                qCritical("No database connection string found.  Return -3");
+                return -3;
+            }
         }
-    }
-    qDebug() << "Using database connection string: " << databaseConnString;
+        qDebug() << "Using database connection string: " << databaseConnString;
 
-    addConnectionFromString(databaseConnString);
+        addConnectionFromString(databaseConnString);
+        DbPool = new DatabasePool(ConnectionName);
+    }
 
     databaseConnString = parser.value(debugDatabaseOption);
+    QString debugConnectionName;
     if (!databaseConnString.isEmpty())
     {
         qDebug() << "Using database connection string for debug info: " << databaseConnString;
+        QStringList connectionsBefore = QSqlDatabase::connectionNames();
         addConnectionFromString(databaseConnString, true);  // Optional last arg flags to create debug connection.
+        foreach (QString name, QSqlDatabase::connectionNames())
+            if (!connectionsBefore.contains(name))
+                debugConnectionName = name;
+    }
+    if (!debugConnectionName.isEmpty())
+    {
+        /* From here on debug info is written to the debug database in batches by the debug log. */
+        DebugLog = new DebugLogWriter(debugConnectionName, LogArchiveTag());
+        DebugLog->start(QThread::LowPriority);
+        qInstallMessageHandler(ImmediateDiagnostics ? DebugLogTerminalOutput : DebugLogOutput);
+    }
+
+    if (parser.isSet(retentionConfigOption))
+    {
+        QList<RetentionPolicy> policies;
+        if (!LoadRetentionPolicies(parser.value(retentionConfigOption), &policies))
+        {
+            qDebug("Return 1");
+            return 1;
+        }
+        if (!policies.isEmpty())
+            Retention = new RetentionManager(policies, debugConnectionName, QDir::homePath() + "/" + RetentionStateFile);
     }
 
     interval = parser.value(intervalOption).toInt();
     qInfo("Interval between successive meter reads is %d minutes.", interval);
+    TimeSetIntervalMSecs = qMax(0, interval) * 60000ll;
     repeatCount = parser.value(repeatCountOption).toInt();
     if (repeatCount <= 0)
         repeatCount = INT32_MAX;
@@ -974,12 +1510,46 @@ int main(int argc, char *argv[])
     else
         qInfo("Number of times to read meters is %d.", repeatCount);
     
+    if (!LoadLogRules(parser.value(logRulesOption)))
+    {
+        qDebug("Return 1");
+        return 1;
+    }
+    if (parser.isSet(traceOption))
+        Tracer.enable(parser.value(traceOption), parser.value(traceEventsOption).toInt());
     aToBRatio = parser.value(aToBRatioOption).toInt();
+    MaxClockSkew = parser.value(maxClockSkewOption).toDouble();
+    qInfo("Meter time is set when clock skew exceeds %.1f sec.", MaxClockSkew);
+    if (parser.isSet(publishOption))
+    {
+        Publisher = new ReadingPublisher(parser.value(publishOption)
+                                         , (parser.value(publishFormatOption) == "record") ? PublishRecord : PublishJson);
+        if (!Publisher->open())
+        {
+            qDebug("Return 1");
+            return 1;
+        }
+    }
 
-    const QStringList args = parser.positionalArguments();
-    if (args.isEmpty())
+    QList<MeterConfig> fleetConfig;
+    FleetConfigFileName = parser.value(fleetConfigOption);
+    if (!FleetConfigFileName.isEmpty())
     {
-        qCritical("You must supply at least one meter id on the command line.");
+        if (!LoadFleetConfig(FleetConfigFileName, serialDevice, aToBRatio, &fleetConfig))
+        {
+            qCritical("Unable to load fleet configuration from %s.", qUtf8Printable(FleetConfigFileName));
+            qDebug("Return 1");
+            return 1;
+        }
+    }
+    else
+    {
+        const QStringList args = parser.positionalArguments();
+        fleetConfig = FleetFromArgs(args, serialDevice, aToBRatio);
+    }
+    if (fleetConfig.isEmpty())
+    {
+        qCritical("You must supply at least one meter id on the command line or in the fleet configuration.");
         qDebug("Return 1");
         return 1;
     }
@@ -988,127 +1558,108 @@ int main(int argc, char *argv[])
     FlushDiagnostics();
     DumpDebugInfo();
 
-    {   // block to isolate temporary variables.
-        qint64 t = QDateTime::currentMSecsSinceEpoch() / 60000;     // number of min since epoch
-        t = t / interval;                                           // number of intervals since epoch
-        t = t % aToBRatio;                              // number of intervals till next B read.
-        aDataCount = t - 1;                     // set count
-        qInfo("interval = %d; aToBRatio = %d; aDataCount = %d", interval, aToBRatio, aDataCount);
+    foreach (const MeterConfig &config, fleetConfig)
+    {
+        MeterEntry entry;
+        entry.config = config;
+        entry.aDataCount = InitialADataCount(interval, config.aToBRatio);
+        entry.timeSetPending = false;
+        qInfo("interval = %d; meter %s aToBRatio = %d; aDataCount = %d"
+              , interval, qUtf8Printable(config.meterId), config.aToBRatio, entry.aDataCount);
+        Fleet.append(entry);
     }
+    bool resumed = parser.isSet(resumeOption) && ResumeState(parser.value(resumeOption), Fleet, &repeatCount);
+
+    /*! Carry on the accumulated counters; a replay starts them afresh and leaves the file alone. */
+    if (!WireReplayActive())
+        Counters.load(QDir::homePath() + "/" + CountersStateFile);
 
-    if (!ConnectSerial(serialDevice, &serialPort))
+    foreach (QString portName, FleetPortNames(Fleet))
     {
-        qFatal("Could not connect serial device.");
+        QSerialPort *serialPort = NULL;
+        if (!ConnectSerial(portName, &serialPort, FirstMeterOnPort(Fleet, portName)))
+        {
+            qFatal("Could not connect serial device %s.", qUtf8Printable(portName));
+        }
+        qDebug() << "Connected to serial device" << portName;
+        qDebug() << "SerialPort is:" << serialPort;
+        SerialPorts.insert(portName, serialPort);
     }
-    qDebug() << "Connected to serial device.";
-    qDebug() << "SerialPort is:" << serialPort;
+    ReleaseHandedOverPorts();
 
-    if (!InitializeMeters(serialPort, args))
+    if (!InitializeMeters(Fleet, resumed))
     {
         qCritical("Unable to initialize meters.");
         return -1;
     }
 
-    QDate today = QDate::currentDate();
+    /*! The program this one replaced has done this interval's read; wait for the next. */
+    if (resumed && (interval > 0))
+    {
+        useconds_t usecToSleep = ((interval * 60000ll) - (QDateTime::currentMSecsSinceEpoch() % (interval*60000ll))) * 1000;
+        qInfo("Resumed; sleeping for %u micro sec till the next read.", usecToSleep);
+        usleep(usecToSleep);
+    }
+    bool handOff = false;
 
     /*! Loop till we have read all meters the number of times in repeatCount. */
     do
     {
-        foreach (QString meterId, args)
+        qint64 cycleStartMSecs = QDateTime::currentMSecsSinceEpoch();
+        qint64 cycleStartUSecs = Tracer.nowUSecs();
+        for (int meterIndex = 0; meterIndex < Fleet.size(); meterIndex++)
         {
-            QString fullMeterId = meterId.rightJustified(sizeof(RequestMsgV4.meterId), '0', true);
+            MeterEntry &entry = Fleet[meterIndex];
+            QString fullMeterId = entry.config.meterId;
+            QSerialPort *serialPort = SerialPorts.value(entry.config.portName);
+            if (serialPort == NULL)
+            {
+                qWarning("Serial device %s for meter %s is not open; meter skipped."
+                         , qUtf8Printable(entry.config.portName), qUtf8Printable(fullMeterId));
+                continue;
+            }
             qInfo() << "Getting data from meter:" << fullMeterId;
-            if (fullMeterId.toLongLong() >= 300000000)
+            TraceSpan meterSpan("meter", fullMeterId);
+            QList<MeterReading> readings = PollMeter(entry, serialPort);
             {
-                qInfo() << "The meter is a v.4 meter.";
-                ResponseV4Generic responseA;
-                ResponseV4Generic responseB;
-                if (GetMeterV4Data(serialPort, fullMeterId, '\x30', &responseA))
-                {
-                    qDebug() << "Got V4 meter data";
-                    if (ValidateCRC(((uint8_t *)(responseA.responseV4Generic.fixed02) + 1), 252))
-                        qDebug() << "responseA crc is valid.";
-                    else
-                        qDebug() << "responseA crc is NOT valid.";
-                    if (!SaveV4ResponseToDatabase('\x30', responseA))
-                    {
-                        qDebug() << "Could not save V4 response to database.";
-                    }
-                    else
-                    {
-                        qDebug() << "Saved V4 response to database.";
-                    }
-                }
-                if ((++aDataCount >= aToBRatio) && GetMeterV4Data(serialPort, fullMeterId, '\x31', &responseB))
-                {
-                    aDataCount = 0;
-                    qDebug() << "Got V4 meter data";
-                    if (ValidateCRC(((uint8_t *)(responseB.responseV4Generic.fixed02) + 1), 252))
-                        qDebug() << "responseB crc is valid.";
-                    else
-                        qDebug() << "responseB crc is NOT valid.";
-                    if (!SaveV4ResponseToDatabase('\x31', responseB))
-                    {
-                        qDebug() << "Could not save V4 response to database.";
-                    }
-                    else
-                    {
-                        qDebug() << "Saved V4 response to database.";
-                    }
-                }
-
-                /*! Close the communication with this meter. */
-                WriteSerialMsg(serialPort, (const char *)CloseString, sizeof(CloseString));
-
-                /*! Set the meter time every day at midnight for each v.4 meter. */
-                if (today != QDate::currentDate())
-                    SetMeterTime(serialPort, fullMeterId);
-
-                /*
-             * Output 2 is assumed connected to a relay that controls the
-             * sprinkler controller "Rain Sensor", such that if the relay
-             * is CLOSED, watering is enabled.  If the relay is OPEN,
-             * watering is disabled.
-             */
-                if (QFileInfo::exists(QDir::homePath() + "/.WeatherWet"))
-                {       // Weather program has determined that it is WET out there
-                    // Disable watering.
-                    qDebug("Make sure watering is DISabled.  Current output state is 0x%02x (-0x31 = 0x%02x)"
-                           , responseA.responseV4Adata.outState[0]
-                            , responseA.responseV4Adata.outState[0] - 0x31);
-                    if (((responseA.responseV4Adata.outState[0] - 0x31) & 1) != 1)  // if off, turn on
-                        SendControl(serialPort, fullMeterId, &Output2OnMsg, sizeof(Output2OnMsg));
-                }
-                else
-                {       // Weather program has determined that it is DRY out there
-                    // Enable watering.
-                    qDebug("Make sure watering is ENabled.  Current output state is 0x%02x (-0x31 = 0x%02x)"
-                           , responseA.responseV4Adata.outState[0]
-                            , responseA.responseV4Adata.outState[0] - 0x31);
-                    if (((responseA.responseV4Adata.outState[0] - 0x31) & 1) == 1)  // if on, turn off
-                        SendControl(serialPort, fullMeterId, &Output2OffMsg, sizeof(Output2OffMsg));
-                }
+                TraceSpan counters("counters", fullMeterId);
+                for (int i = 0; i < readings.size(); i++)
+                    Counters.accumulate(&readings[i]);
+            }
+            /* Subscribers get the readings as soon as they are validated, not after the database write. */
+            if (Publisher != NULL)
+                Publisher->publish(readings);
+            bool stored;
+            {
+                TraceSpan store("store", fullMeterId);
+                stored = Storage->appendBatch(readings);
+            }
+            if (!stored)
+            {
+                qDebug() << "Could not store all responses of meter" << fullMeterId;
             }
             else
             {
-                qInfo() << "The meter is a v.3 meter.";
-                ResponseV3Data response;
-                if (GetMeterV3Data(serialPort, fullMeterId, &response))
-                    qDebug() << "Got V3 meter data";
-                if (ValidateCRC(((uint8_t *)(response.fixed02) + 1), 252))
-                    qDebug() << "response crc is valid.";
-                else
-                    qDebug() << "response crc is NOT valid.";
-                if (!SaveV3ResponseToDatabase(response))
-                {
-                    qDebug() << "Could not save V3 response to database.";
-                }
-                else
-                {
-                    qDebug() << "Saved V3 response to database.";
-                }
+                qDebug() << "Stored" << readings.size() << "responses of meter" << fullMeterId;
             }
         }
+        Storage->flush();
+        if (!WireReplayActive())
+            Counters.save(QDir::homePath() + "/" + CountersStateFile);
+
+        ReloadLogRulesIfChanged();
+        LineStats.reportIfDue();
+        ReportTcpGateways();
+
+        /*! Pick up changes to the fleet configuration without interrupting polling. */
+        if (FleetConfigChanged())
+        {
+            QList<MeterConfig> newFleetConfig;
+            if (LoadFleetConfig(FleetConfigFileName, serialDevice, aToBRatio, &newFleetConfig))
+                ApplyFleetConfig(newFleetConfig, Fleet, interval);
+            else
+                qWarning("Fleet configuration not reloaded; keep reading current fleet.");
+        }
 
         // Check for existence of magic file ".CloseReadEKM" and quit if seen.
 
@@ -1120,8 +1671,43 @@ int main(int argc, char *argv[])
             break;          // break out of while loop that keeps us reading data.
         }
 
-        today = QDate::currentDate();       // Update "today" after all meters read.
+        /* Check for the magic file ".RestartReadEKM" and hand over to a fresh copy of the program if seen. */
+        if (QFile::exists(QDir::homePath() + "/" + HandoffMagicFile) && (repeatCount > 1))
+        {
+            qInfo("Restarting because magic file \"%s\" seen.", HandoffMagicFile);
+            QFile::remove(QDir::homePath() + "/" + HandoffMagicFile);
+            handOff = HandOffState(QDir::homePath() + "/" + HandoffStateFile, Fleet, SerialPorts, repeatCount - 1);
+            if (handOff)
+                break;
+        }
+
+        if (WireReplayFinished())
+        {
+            qInfo("Replay trace used up.");
+            break;
+        }
+
+        /*! Use the time left in this interval to set meter times. */
         if ((interval > 0) && (repeatCount > 1))
+            ServicePendingTimeSets(Fleet, (QDateTime::currentMSecsSinceEpoch() / (interval * 60000ll) + 1) * (interval * 60000ll));
+        else
+            ServicePendingTimeSets(Fleet, 0);
+
+        /*! Use what is left of the interval to prune old rows. */
+        if ((Retention != NULL) && (interval > 0) && (repeatCount > 1))
+            Retention->runUntil((QDateTime::currentMSecsSinceEpoch() / (interval * 60000ll) + 1) * (interval * 60000ll) - RetentionMarginMSecs);
+
+        /*! Keep the timeline of a pass that overran the interval, to see why. */
+        Tracer.add("cycle", QString(), cycleStartUSecs, Tracer.nowUSecs());
+        qint64 cycleMSecs = QDateTime::currentMSecsSinceEpoch() - cycleStartMSecs;
+        if ((interval > 0) && (cycleMSecs > interval * 60000ll))
+        {
+            qWarning("Pass over the meters took %lld msec, more than the %d minute interval.", cycleMSecs, interval);
+            Tracer.dump(QString("a pass took %1 msec").arg(cycleMSecs));
+        }
+        Tracer.dumpIfRequested();
+
+        if ((interval > 0) && (repeatCount > 1) && !WireReplayActive())
         {
             DumpDebugInfo();    // dump debug info so we can monitor progress of program.
             /* interval*60000 is the number of millisec between reads.
@@ -1131,11 +1717,35 @@ int main(int argc, char *argv[])
              */
             useconds_t usecToSleep = ((interval * 60000ll) - (QDateTime::currentMSecsSinceEpoch() % (interval*60000ll))) * 1000;
             qInfo("Sleeping for %u micro sec (almost %d minutes).", usecToSleep, interval);
-            usleep(usecToSleep);
+            TraceSpan sleep("sleep");
+            if (Publisher != NULL)
+                Publisher->serviceFor(usecToSleep / 1000);
+            else
+                usleep(usecToSleep);
         }
     } while (--repeatCount > 0);
 
     qDebug() << "End program";
+    LineStats.reportIfDue(true);
+    ReportTcpGateways(true);
+    ReportWireReplay();
+    WireCap.close();
+    delete Storage;
+    if (Publisher != NULL)
+        delete Publisher;
+    if (Retention != NULL)
+        delete Retention;
+    if (DebugLog != NULL)
+    {
+        qInfo("%s", qUtf8Printable(DebugLog->statistics()));
+        delete DebugLog;        // Writes what is still queued.
+        DebugLog = NULL;
+    }
     DumpDebugInfo();
+    if (handOff)
+    {
+        ExecHandoff(QCoreApplication::arguments(), QDir::homePath() + "/" + HandoffStateFile);
+        return 1;
+    }
     return 0;
 }
@@ -0,0 +1,264 @@
+/*!
+@file
+@brief Decode the fields of meter responses.
+
+@author Thomas A. DeMay
+@date 2015
+@par    Copyright (C) 2015  Thomas A. DeMay
+@par
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    any later version.
+@par
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+@par
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include "meterfields.h"
+#include "clockskew.h"
+#include "counters.h"
+
+static const MeterField V3Fields[] =
+{
+    {"totalKwh",            17, 8, FieldKwh, 0},
+    {"time1Kwh",            25, 8, FieldKwh, 0},
+    {"time2Kwh",            33, 8, FieldKwh, 0},
+    {"time3Kwh",            41, 8, FieldKwh, 0},
+    {"time4Kwh",            49, 8, FieldKwh, 0},
+    {"totalRevKwh",         57, 8, FieldKwh, 0},
+    {"time1RevKwh",         65, 8, FieldKwh, 0},
+    {"time2RevKwh",         73, 8, FieldKwh, 0},
+    {"time3RevKwh",         81, 8, FieldKwh, 0},
+    {"time4RevKwh",         89, 8, FieldKwh, 0},
+    {"volts1",              97, 4, FieldNumber, 1},
+    {"volts2",             101, 4, FieldNumber, 1},
+    {"volts3",             105, 4, FieldNumber, 1},
+    {"amps1",              109, 5, FieldNumber, 1},
+    {"amps2",              114, 5, FieldNumber, 1},
+    {"amps3",              119, 5, FieldNumber, 1},
+    {"watts1",             124, 7, FieldNumber, 0},
+    {"watts2",             131, 7, FieldNumber, 0},
+    {"watts3",             138, 7, FieldNumber, 0},
+    {"wattsTotal",         145, 7, FieldNumber, 0},
+    {"cos1",               152, 4, FieldText, 0},
+    {"cos2",               156, 4, FieldText, 0},
+    {"cos3",               160, 4, FieldText, 0},
+    {"maxDemand",          164, 8, FieldNumber, 1},
+    {"demandPeriod",       172, 1, FieldNumber, 0},
+    {"currentTransformer", 187, 4, FieldNumber, 0},
+    {"pulseCount1",        191, 8, FieldNumber, 0},
+    {"pulseCount2",        199, 8, FieldNumber, 0},
+    {"pulseCount3",        207, 8, FieldNumber, 0},
+    {"pulseRatio1",        215, 4, FieldNumber, 0},
+    {"pulseRatio2",        219, 4, FieldNumber, 0},
+    {"pulseRatio3",        223, 4, FieldNumber, 0},
+    {"pulseState",         227, 3, FieldText, 0}
+};
+
+static const MeterField V4AFields[] =
+{
+    {"totalKwh",            17, 8, FieldKwh, 0},
+    {"totalKVARh",          25, 8, FieldKwh, 0},
+    {"totalRevKwh",         33, 8, FieldKwh, 0},
+    {"totalKwhL1",          41, 8, FieldKwh, 0},
+    {"totalKwhL2",          49, 8, FieldKwh, 0},
+    {"totalKwhL3",          57, 8, FieldKwh, 0},
+    {"reverseKwhL1",        65, 8, FieldKwh, 0},
+    {"reverseKwhL2",        73, 8, FieldKwh, 0},
+    {"reverseKwhL3",        81, 8, FieldKwh, 0},
+    {"resettableTotalKwh",  89, 8, FieldKwh, 0},
+    {"resettableReverseKwh", 97, 8, FieldKwh, 0},
+    {"volts1",             105, 4, FieldNumber, 1},
+    {"volts2",             109, 4, FieldNumber, 1},
+    {"volts3",             113, 4, FieldNumber, 1},
+    {"amps1",              117, 5, FieldNumber, 1},
+    {"amps2",              122, 5, FieldNumber, 1},
+    {"amps3",              127, 5, FieldNumber, 1},
+    {"watts1",             132, 7, FieldNumber, 0},
+    {"watts2",             139, 7, FieldNumber, 0},
+    {"watts3",             146, 7, FieldNumber, 0},
+    {"wattsTotal",         153, 7, FieldNumber, 0},
+    {"cos1",               160, 4, FieldText, 0},
+    {"cos2",               164, 4, FieldText, 0},
+    {"cos3",               168, 4, FieldText, 0},
+    {"varL1",              172, 7, FieldNumber, 0},
+    {"varL2",              179, 7, FieldNumber, 0},
+    {"varL3",              186, 7, FieldNumber, 0},
+    {"varL123",            193, 7, FieldNumber, 0},
+    {"frequency",          200, 4, FieldNumber, 2},
+    {"pulseCount1",        204, 8, FieldNumber, 0},
+    {"pulseCount2",        212, 8, FieldNumber, 0},
+    {"pulseCount3",        220, 8, FieldNumber, 0},
+    {"pulseState",         228, 1, FieldText, 0},
+    {"currentDir123",      229, 1, FieldText, 0},
+    {"outState",           230, 1, FieldText, 0},
+    {"kwhDecimals",        231, 1, FieldNumber, 0}
+};
+
+static const MeterField V4BFields[] =
+{
+    {"time1Kwh",            17, 8, FieldKwh, 0},
+    {"time2Kwh",            25, 8, FieldKwh, 0},
+    {"time3Kwh",            33, 8, FieldKwh, 0},
+    {"time4Kwh",            41, 8, FieldKwh, 0},
+    {"time1RevKwh",         49, 8, FieldKwh, 0},
+    {"time2RevKwh",         57, 8, FieldKwh, 0},
+    {"time3RevKwh",         65, 8, FieldKwh, 0},
+    {"time4RevKwh",         73, 8, FieldKwh, 0},
+    {"volts1",              81, 4, FieldNumber, 1},
+    {"volts2",              85, 4, FieldNumber, 1},
+    {"volts3",              89, 4, FieldNumber, 1},
+    {"amps1",               93, 5, FieldNumber, 1},
+    {"amps2",               98, 5, FieldNumber, 1},
+    {"amps3",              103, 5, FieldNumber, 1},
+    {"watts1",             108, 7, FieldNumber, 0},
+    {"watts2",             115, 7, FieldNumber, 0},
+    {"watts3",             122, 7, FieldNumber, 0},
+    {"wattsTotal",         129, 7, FieldNumber, 0},
+    {"cos1",               136, 4, FieldText, 0},
+    {"cos2",               140, 4, FieldText, 0},
+    {"cos3",               144, 4, FieldText, 0},
+    {"maxDemand",          148, 8, FieldNumber, 1},
+    {"demandPeriod",       156, 1, FieldNumber, 0},
+    {"PRatio1",            157, 4, FieldNumber, 0},
+    {"PRatio2",            161, 4, FieldNumber, 0},
+    {"PRatio3",            165, 4, FieldNumber, 0},
+    {"CTRatio",            169, 4, FieldNumber, 0},
+    {"autoResetMaxDemand", 173, 1, FieldNumber, 0},
+    {"CFRatio",            174, 4, FieldNumber, 0}
+};
+
+/*!
+ * \brief MeterFieldTable -- The fields of a kind of response.
+ * \param dataType      '3' for v.3 response, 'A' or 'B' for v.4 responses.
+ * \param fieldCount    Set to the number of fields in the table.
+ * \return The first entry of the table.
+ */
+const MeterField *MeterFieldTable(const uint8_t dataType, int *fieldCount)
+{
+    switch (dataType)
+    {
+    case 'A':
+        *fieldCount = sizeof(V4AFields) / sizeof(V4AFields[0]);
+        return V4AFields;
+    case 'B':
+        *fieldCount = sizeof(V4BFields) / sizeof(V4BFields[0]);
+        return V4BFields;
+    default:
+        *fieldCount = sizeof(V3Fields) / sizeof(V3Fields[0]);
+        return V3Fields;
+    }
+}
+
+/*!
+ * \brief KwhDecimals -- Number of decimal places in the kWh fields of a response.
+ *
+ * v.4 A responses say how many; v.4 B responses don't, but the meter uses the
+ * same number as in its A responses, which is normally 1.  v.3 meters always use 1.
+ *
+ * \param dataType      '3' for v.3 response, 'A' or 'B' for v.4 responses.
+ * \param frame         The response.
+ * \return Number of decimal places.
+ */
+int KwhDecimals(const uint8_t dataType, const uint8_t *frame)
+{
+    if (dataType == 'A')
+    {
+        int decimals = ((const ResponseV4AData *)frame)->kwhDecimals[0] - '0';
+        if ((decimals >= 0) && (decimals <= 2))
+            return decimals;
+    }
+    return 1;
+}
+
+/*!
+ * \brief MeterFieldNumber -- Value of a numeric field.
+ * \param frame         The response.
+ * \param field         The field.
+ * \param kwhDecimals   Decimal places of FieldKwh fields; see KwhDecimals().
+ * \return The value; NaN if the field has anything but digits.
+ */
+double MeterFieldNumber(const uint8_t *frame, const MeterField &field, const int kwhDecimals)
+{
+    qint64 digits = 0;
+    const uint8_t *p = frame + field.sqlOffset - 1;
+    for (int i = 0; i < field.length; i++)
+    {
+        if ((p[i] < '0') || (p[i] > '9'))
+            return qQNaN();
+        digits = digits * 10 + (p[i] - '0');
+    }
+    static const double scale[] = {1.0, 10.0, 100.0, 1000.0};
+    return digits / scale[(field.kind == FieldKwh) ? kwhDecimals : field.decimals];
+}
+
+/*!
+ * \brief MeterFieldText -- Text of a field.
+ * \param frame         The response.
+ * \param field         The field.
+ * \return The field characters.
+ */
+QString MeterFieldText(const uint8_t *frame, const MeterField &field)
+{
+    return QString::fromLatin1((const char *)frame + field.sqlOffset - 1, field.length);
+}
+
+/*!
+ * \brief ReadingMeterTime -- The meter's date and time in a reading.
+ * \param reading   The reading.
+ * \return The date and time fields of the response.
+ */
+const meterDateTime &ReadingMeterTime(const MeterReading &reading)
+{
+    if (reading.dataType == '3')
+        return ((const ResponseV3Data *)reading.frame)->dateTime;
+    return ((const ResponseV4Generic *)reading.frame)->responseV4Generic.dateTime;
+}
+
+/*!
+ * \brief DecodeReading -- Decode every field of a reading.
+ * \param reading   The reading.
+ * \return Object with the meter id, data type, capture and meter times, one member per field,
+ *         and the accumulated counters, if any (see counters.h).
+ */
+QJsonObject DecodeReading(const MeterReading &reading)
+{
+    QJsonObject decoded;
+    decoded.insert("meterId", reading.meterId);
+    decoded.insert("dataType", DataTypeName(reading.dataType));
+    decoded.insert("captureUSecs", (double)reading.captureTime.wallUSecs);
+    decoded.insert("meterTime", MeterTimeToDateTime(ReadingMeterTime(reading)).toString(Qt::ISODate));
+    decoded.insert("crcValid", reading.crcValid);
+
+    int fieldCount;
+    const MeterField *fields = MeterFieldTable(reading.dataType, &fieldCount);
+    int kwhDecimals = KwhDecimals(reading.dataType, reading.frame);
+    for (int i = 0; i < fieldCount; i++)
+    {
+        if (fields[i].kind == FieldText)
+            decoded.insert(fields[i].name, MeterFieldText(reading.frame, fields[i]));
+        else
+        {
+            double value = MeterFieldNumber(reading.frame, fields[i], kwhDecimals);
+            if (qIsNaN(value))
+                decoded.insert(fields[i].name, QJsonValue());
+            else
+                decoded.insert(fields[i].name, value);
+        }
+    }
+    if (reading.countersValid)
+    {
+        QJsonObject counters;
+        for (int i = 0; i < CounterCount; i++)
+            counters.insert(CounterAccumulator::counterName(i), (double)reading.counters[i]);
+        decoded.insert("counters", counters);
+    }
+    return decoded;
+}
@@ -0,0 +1,57 @@
+/*!
+@file
+@brief Header file describing the fields of meter responses for decoding.
+
+Responses are fixed width ASCII.  Each kind of response has a table of its
+fields, giving where each is in the response and how to turn it into a value.
+Offsets are the "SQL offsets" of messages.h (1 based, as used by MySQL's
+SUBSTRING() in Notes.txt).
+
+@author Thomas A. DeMay
+@date 2015
+@par    Copyright (C) 2015  Thomas A. DeMay
+@par
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    any later version.
+@par
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+@par
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#ifndef METERFIELDS_H
+#define METERFIELDS_H
+#include <QtCore>
+#include "meterreading.h"
+
+typedef enum
+{
+    FieldText,          //!< Kept as text.
+    FieldNumber,        //!< Decimal digits with a fixed number of implied decimal places.
+    FieldKwh            //!< Decimal digits with the meter's kWh decimal places.
+} MeterFieldKind;
+
+typedef struct
+{
+    const char *name;       //!< Name of the field, as in messages.h.
+    int sqlOffset;          //!< 1 based offset of the field in the response.
+    int length;             //!< Number of characters in the field.
+    MeterFieldKind kind;    //!< How to decode the field.
+    int decimals;           //!< Implied decimal places of a FieldNumber.
+} MeterField;
+
+const MeterField *MeterFieldTable(const uint8_t dataType, int *fieldCount);
+int KwhDecimals(const uint8_t dataType, const uint8_t *frame);
+double MeterFieldNumber(const uint8_t *frame, const MeterField &field, const int kwhDecimals);
+QString MeterFieldText(const uint8_t *frame, const MeterField &field);
+const meterDateTime &ReadingMeterTime(const MeterReading &reading);
+QJsonObject DecodeReading(const MeterReading &reading);
+
+#endif // METERFIELDS_H
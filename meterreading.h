@@ -0,0 +1,59 @@
+/*!
+@file
+@brief Header file describing a meter reading as it is passed to storage.
+
+A reading is one response from a meter together with what is known about
+where it came from and when it was captured.
+
+@author Thomas A. DeMay
+@date 2015
+@par    Copyright (C) 2015  Thomas A. DeMay
+@par
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    any later version.
+@par
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+@par
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#ifndef METERREADING_H
+#define METERREADING_H
+#include <QtCore>
+#include "messages.h"
+#include "capturetime.h"
+
+typedef enum
+{
+    CounterTotalKwh,            //!< totalKwh, in hundredths of a kWh.
+    CounterPulseCount1,         //!< pulseCount1, in pulses.
+    CounterPulseCount2,         //!< pulseCount2, in pulses.
+    CounterPulseCount3,         //!< pulseCount3, in pulses.
+    CounterCount                //!< Number of counters.
+} CounterIndex;
+
+typedef struct
+{
+    QString meterId;            //!< Meter serial number expanded to 12 characters.
+    QString tableBaseName;      //!< Prefix of the names of the meter's tables.
+    uint8_t dataType;           //!< '3' for v.3 response, 'A' or 'B' for v.4 responses.
+    bool crcValid;              //!< The response CRC was valid.
+    CaptureTime captureTime;    //!< When the response was captured.
+    uint8_t frame[255];         //!< Exact copy of the response.
+    bool countersValid;         //!< counters is set; see counters.h.
+    qint64 counters[CounterCount];  //!< Accumulated counters, never wrapping, by CounterIndex.
+} MeterReading;
+
+MeterReading MakeMeterReading(const QString &meterId, const QString &tableBaseName, const uint8_t dataType
+                              , const uint8_t *frame, const CaptureTime &captureTime, const bool crcValid);
+QString DataTypeName(const uint8_t dataType);
+QString DataKind(const uint8_t dataType);
+
+#endif // METERREADING_H
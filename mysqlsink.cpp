@@ -0,0 +1,752 @@
+/*!
+@file
+@brief Store meter readings in the MySQL database.
+
+Each meter has a table for each kind of response it gives;
+<tableBaseName>_A_RawMeterData and <tableBaseName>_B_RawMeterData for
+v.4 meters, <tableBaseName>_RawMeterData for v.3 meters.
+
+Alternatively, every reading goes in the one table PartitionedTableName,
+partitioned by month of capture time so that old months can be dropped
+instantly and fleet-wide queries need no UNIONs.  Partitions are named
+pYYYYMM and hold capture times (UTC) before the first of the next month.
+
+@author Thomas A. DeMay
+@date 2015
+@par    Copyright (C) 2015  Thomas A. DeMay
+@par
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    any later version.
+@par
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+@par
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include "storagesink.h"
+#include "meterfields.h"
+#include "dbpool.h"
+#include "tracer.h"
+#include "../SupportRoutines/supportfunctions.h"
+
+static const char CaptureKeyName[] = "RawMeterData_Capture_UNIQUE";    //!< Unique key on the capture of a meter data row.
+
+/*!
+ * \brief MySqlSink::open -- Make sure the database is open and learn what tables it has.
+ * \return true if successful, false otherwise.
+ */
+bool MySqlSink::open()
+{
+    qDebug("Begin");
+    QSqlDatabase dbConn = DbPool->connection();
+
+    if (!dbConn.isOpen())
+    {
+        qCritical() << "Unable to open database for meter data.";
+        qInfo() << "Return false";
+        return false;
+    }
+    QSqlQuery query(dbConn);
+
+    if (!verifyCountersTable(query))
+    {
+        qDebug("Return false");
+        return false;
+    }
+    if (partitioned)
+    {
+        lastPartitionCheckMSecs = QDateTime::currentMSecsSinceEpoch();
+        bool success = verifyPartitionedTable(query) && maintainPartitions(query);
+        qDebug() << "Return" << success;
+        return success;
+    }
+    loadExistingTableNames(query);
+    qDebug("Return true");
+    return true;
+}
+
+/*!
+ * \brief MySqlSink::verifyCountersTable -- Create the accumulated counters table if it doesn't exist.
+ *
+ * The table has a row for each reading with accumulated counters; see counters.h.
+ *
+ * \param query     QSqlQuery opened on the database.
+ * \return true if successful, false otherwise.
+ */
+bool MySqlSink::verifyCountersTable(QSqlQuery &query)
+{
+    qDebug("Begin");
+    QString queryText = QString("CREATE TABLE IF NOT EXISTS `%1` ("
+                                "`MeterId` varchar(12) NOT NULL COMMENT 'Meter ID (Serial number) expanded to 12 characters.',"
+                                "`CaptureTime` datetime(6) NOT NULL COMMENT 'UTC time that response was received from meter.',"
+                                "`DataType` varchar(4) NOT NULL COMMENT 'Either \"V3\" or \"V4A\"',"
+                                "`TotalKwh` bigint NOT NULL COMMENT 'Accumulated totalKwh in hundredths of a kWh; never wraps.',"
+                                "`PulseCount1` bigint NOT NULL COMMENT 'Accumulated pulseCount1; never wraps.',"
+                                "`PulseCount2` bigint NOT NULL COMMENT 'Accumulated pulseCount2; never wraps.',"
+                                "`PulseCount3` bigint NOT NULL COMMENT 'Accumulated pulseCount3; never wraps.',"
+                                "PRIMARY KEY (`MeterId`, `CaptureTime`)"
+                                ") ENGINE=InnoDB DEFAULT CHARSET=utf8")
+            .arg(CountersTableName);
+    if (DontActuallyWriteDatabase)
+    {
+        qInfo() << "Didn't actually create database table.  Command was:";
+        qInfo() << queryText;
+    }
+    else if (!query.exec(queryText))
+    {
+        qCritical("Unable to create counters table %s.", CountersTableName);
+        qInfo("    Query was: %s", qUtf8Printable(query.lastQuery()));
+        qInfo("    Error was: %s", qUtf8Printable(query.lastError().text()));
+        qDebug("Return false");
+        return false;
+    }
+    qDebug("Return true");
+    return true;
+}
+
+/*!
+ * \brief PartitionName -- Name of the partition for a month.
+ * \param month     Any date in the month.
+ * \return pYYYYMM
+ */
+static QString PartitionName(const QDate &month)
+{
+    return month.toString("'p'yyyyMM");
+}
+
+/*!
+ * \brief PartitionDefinition -- Definition of the partition for a month.
+ * \param month     Any date in the month.
+ * \return Text for CREATE TABLE or ALTER TABLE ... ADD PARTITION.
+ */
+static QString PartitionDefinition(const QDate &month)
+{
+    QDate nextMonth = QDate(month.year(), month.month(), 1).addMonths(1);
+    return QString("PARTITION %1 VALUES LESS THAN ('%2')").arg(PartitionName(month)).arg(nextMonth.toString("yyyy-MM-dd"));
+}
+
+/*!
+ * \brief MySqlSink::verifyPartitionedTable -- Create the partitioned table if it doesn't exist.
+ *
+ * The table starts with partitions for this month and the next two.
+ *
+ * \param query     QSqlQuery opened on the database.
+ * \return true if successful, false otherwise.
+ */
+bool MySqlSink::verifyPartitionedTable(QSqlQuery &query)
+{
+    qDebug("Begin");
+    QDate thisMonth = QDateTime::currentDateTimeUtc().date();
+    QString queryText = QString("CREATE TABLE IF NOT EXISTS `%1` ("
+                                "`MeterId` varchar(12) NOT NULL COMMENT 'Meter ID (Serial number) expanded to 12 characters.',"
+                                "`DataType` varchar(4) NOT NULL COMMENT 'Either \"V3\", \"V4A\" or \"V4B\"',"
+                                "`CaptureTime` datetime(6) NOT NULL COMMENT 'UTC time that response was received from meter.',"
+                                "`MeterTime` datetime DEFAULT NULL COMMENT 'Meter time from response message.',"
+                                "`MeterType` varchar(4) DEFAULT NULL,"
+                                "`MeterData` binary(255) NOT NULL COMMENT 'Exact copy of entire response data from meter.',"
+                                "PRIMARY KEY (`MeterId`, `DataType`, `CaptureTime`)"
+                                ") ENGINE=InnoDB DEFAULT CHARSET=utf8"
+                                " PARTITION BY RANGE COLUMNS(`CaptureTime`) (%2, %3, %4)")
+            .arg(PartitionedTableName)
+            .arg(PartitionDefinition(thisMonth))
+            .arg(PartitionDefinition(thisMonth.addMonths(1)))
+            .arg(PartitionDefinition(thisMonth.addMonths(2)));
+    if (DontActuallyWriteDatabase)
+    {
+        qInfo() << "Didn't actually create database table.  Command was:";
+        qInfo() << queryText;
+    }
+    else if (!query.exec(queryText))
+    {
+        qCritical("Unable to create partitioned table %s.", PartitionedTableName);
+        qInfo("    Query was: %s", qUtf8Printable(query.lastQuery()));
+        qInfo("    Error was: %s", qUtf8Printable(query.lastError().text()));
+        qDebug("Return false");
+        return false;
+    }
+    qDebug("Return true");
+    return true;
+}
+
+/*!
+ * \brief MySqlSink::maintainPartitions -- Add partitions ahead of need; drop those past keeping.
+ *
+ * Partitions are kept for two months beyond the current one, so that
+ * readings never arrive for a month without a partition.  If
+ * PartitionMonthsKept is not zero, partitions for months before the last
+ * PartitionMonthsKept months (including this one) are dropped.
+ *
+ * \param query     QSqlQuery opened on the database.
+ * \return true if successful, false otherwise.
+ */
+bool MySqlSink::maintainPartitions(QSqlQuery &query)
+{
+    qDebug("Begin");
+    if (!query.exec(QString("SELECT PARTITION_NAME FROM INFORMATION_SCHEMA.PARTITIONS"
+                            " WHERE TABLE_SCHEMA = DATABASE() AND TABLE_NAME = '%1' AND PARTITION_NAME IS NOT NULL"
+                            " ORDER BY PARTITION_ORDINAL_POSITION").arg(PartitionedTableName)))
+    {
+        qCritical("Unable to list partitions of %s: %s", PartitionedTableName, qUtf8Printable(query.lastError().text()));
+        qDebug("Return false");
+        return false;
+    }
+    QStringList partitions;
+    while (query.next())
+        partitions << query.value(0).toString();
+
+    QStringList alterations;
+    QDate thisMonth = QDateTime::currentDateTimeUtc().date();
+    QString lastPartition = partitions.isEmpty() ? QString() : partitions.last();
+    /* Range partitions can only be added after the last one. */
+    for (int ahead = 0; ahead <= 2; ahead++)
+    {
+        QDate month = thisMonth.addMonths(ahead);
+        if (PartitionName(month) > lastPartition)
+            alterations << QString("ALTER TABLE `%1` ADD PARTITION (%2)").arg(PartitionedTableName).arg(PartitionDefinition(month));
+    }
+    if (PartitionMonthsKept > 0)
+    {
+        QString oldestKept = PartitionName(thisMonth.addMonths(1 - PartitionMonthsKept));
+        foreach (QString partition, partitions)
+        {
+            if (partition < oldestKept)
+                alterations << QString("ALTER TABLE `%1` DROP PARTITION %2").arg(PartitionedTableName).arg(partition);
+        }
+    }
+
+    bool success = true;
+    foreach (QString alteration, alterations)
+    {
+        if (DontActuallyWriteDatabase)
+        {
+            qDebug() << "Did not execute " << alteration;
+            continue;
+        }
+        if (query.exec(alteration))
+            qInfo("%s", qUtf8Printable(alteration));
+        else
+        {
+            qCritical("Unable to maintain partitions of %s: %s", PartitionedTableName, qUtf8Printable(query.lastError().text()));
+            qInfo("    Query was: %s", qUtf8Printable(alteration));
+            success = false;
+        }
+    }
+    qDebug() << "Return" << success;
+    return success;
+}
+
+/*!
+ * \brief MySqlSink::ensureSchema -- Create the tables for a meter if they don't exist.
+ * \param config    The meter.
+ * \return true if successful, false otherwise.
+ */
+bool MySqlSink::ensureSchema(const MeterConfig &config)
+{
+    QSqlDatabase dbConn = DbPool->connection();
+
+    if (!dbConn.isOpen())
+    {
+        qCritical() << "Unable to open database for meter data.";
+        return false;
+    }
+    QSqlQuery query(dbConn);
+
+    if (partitioned)
+        return true;        // One table for all meters; made by open().
+    if (config.protocolVersion == 4)
+    {
+        verifyDatabaseTable(query, config.tableBaseName, "_A");
+        verifyDatabaseTable(query, config.tableBaseName, "_B");
+    }
+    else
+        verifyDatabaseTable(query, config.tableBaseName, "");
+    return true;
+}
+
+/*!
+ * \brief MySqlSink::loadExistingTableNames -- Get the names of all meter data tables with one query.
+ *
+ * The names are remembered so that verifyDatabaseTable() need not query the
+ * INFORMATION_SCHEMA for each table.  If the INFORMATION_SCHEMA cannot be
+ * accessed, verifyDatabaseTable() falls back to a query per table.
+ *
+ * \param query         QSqlQuery opened on the database.
+ * \return true if the table names were loaded, false otherwise.
+ */
+bool MySqlSink::loadExistingTableNames(QSqlQuery &query)
+{
+    qDebug("Begin");
+    existingTablesLoaded = false;
+    existingTables.clear();
+    if (!query.exec("SELECT TABLE_NAME FROM INFORMATION_SCHEMA.TABLES"
+                    " WHERE TABLE_SCHEMA = DATABASE() AND TABLE_NAME LIKE '%\\_RawMeterData'"))
+    {
+        qCritical("Unable to access INFORMATION_SCHEMA for list of data tables.");
+        qInfo("    Query was: %s", qUtf8Printable(query.lastQuery()));
+        qInfo("    Error was: %s", qUtf8Printable(query.lastError().text()));
+        qDebug("Return false");
+        return false;
+    }
+    while (query.next())
+        existingTables.insert(query.value(0).toString());
+    existingTablesLoaded = true;
+    qDebug("Return true; %d data tables exist.", existingTables.size());
+    return true;
+}
+
+/*!
+ * \brief MySqlSink::verifyDatabaseTable -- Create meter data table if it doesn't exist.
+ *
+ * Returns without doing anything if the dataKind is unrecognized.
+ *
+ * If the existing table names have been loaded by loadExistingTableNames(),
+ * they are used to decide whether the table exists.  Otherwise,
+ * query the INFORMATION_SCHEMA for the existence of the desired table.
+ * If errors accessing INFORMATION_SCHEMA, assume the table exists.
+ * If the INFORMATION_SCHEMA query returns a result, the table exists.
+ * Otherwise, try to create the table.  Assume success, we will fail later
+ * if the table could not be created.
+ *
+ * \param query         QSqlQuery opened on the database.
+ * \param tableBaseName Prefix of the table name; normally the meter serial number expanded to 12 characters.
+ * \param dataKind      Kind of table to check.  Must be one of: "_A", "_B" or "".
+ */
+void MySqlSink::verifyDatabaseTable(QSqlQuery &query, const QString tableBaseName, const QString dataKind)
+{
+    /* dataKind must be one of: "_A", "_B" or "". */
+    qDebug("Begin");
+    if ((dataKind != "_A") && (dataKind != "_B") && (dataKind != ""))
+    {
+        qWarning("dataKind argument is not a legal value.  Should be one of \"_A\", \"_B\", or \"\".  Was \"%s\"."
+                 , qUtf8Printable(dataKind));
+       qDebug("Return");
+       return;
+    }
+    QString tableName = QString("%1%2_RawMeterData").arg(tableBaseName).arg(dataKind);
+    bool tableExists = true;
+    if (existingTablesLoaded)
+    {
+        tableExists = existingTables.contains(tableName);
+    }
+    else if (!query.exec(QString("SELECT TABLE_NAME FROM INFORMATION_SCHEMA.TABLES WHERE TABLE_NAME = '%1'")
+                    .arg(tableName)))
+    {
+        qCritical("Unable to access INFORMATION_SCHEMA; assume data tables exist.");
+        qInfo("    Query was: %s", qUtf8Printable(query.lastQuery()));
+        qInfo("    Error was: %s", qUtf8Printable(query.lastError().text()));
+    }
+    else
+    {
+        qDebug("Successfully accessed INFORMATION_SCHEMA for query about existence of data table.");
+        // the query returned no results => table does not exist.
+        tableExists = query.next();
+    }
+    if (!tableExists)
+    {
+        // Table does not exist.  Create it.
+        QString queryText = QString("CREATE TABLE IF NOT EXISTS `%1` ("
+                                    "`idRawMeterData` int(11) NOT NULL AUTO_INCREMENT,"
+                                    "`ComputerTime` timestamp(6) NOT NULL DEFAULT CURRENT_TIMESTAMP(6) COMMENT 'Time that response was received from meter.',"
+                                    "`MeterTime` datetime DEFAULT NULL COMMENT 'Meter time from response message.',"
+                                    "`MeterId` varchar(12) DEFAULT NULL COMMENT 'Meter ID (Serial number) from response.',"
+                                    "`MeterType` varchar(4) DEFAULT NULL,"
+                                    "`DataType` varchar(4) DEFAULT NULL COMMENT 'Either \"V3\", \"V4A\" or \"V4B\"',"
+                                    "`MeterData` binary(255) NOT NULL COMMENT 'Exact copy of entire response data from meter.',"
+                                    "PRIMARY KEY (`idRawMeterData`),"
+                                    "UNIQUE KEY `idRawMeterData_UNIQUE` (`idRawMeterData`),"
+                                    "UNIQUE KEY `%2` (`ComputerTime`, `MeterId`, `DataType`)"
+                                    ") ENGINE=InnoDB AUTO_INCREMENT=8281 DEFAULT CHARSET=utf8")
+                .arg(tableName).arg(CaptureKeyName);
+        if (!DontActuallyWriteDatabase)
+        {
+            if (!query.exec(queryText))
+            {
+                qCritical("Unable to create RawMeterData %s table for %s meter.  Assume table already exists."
+                          , qUtf8Printable(dataKind)
+                          , qUtf8Printable(tableBaseName));
+                qInfo("    Query was: %s", qUtf8Printable(query.lastQuery()));
+                qInfo("    Error was: %s", qUtf8Printable(query.lastError().text()));
+            }
+            else
+            {
+                qInfo("Successfully created Table %s", qUtf8Printable(tableName));
+                existingTables.insert(tableName);
+            }
+        }
+        else
+        {
+            qInfo() << "Didn't actually create database table.  Command was:";
+            qInfo() << queryText;
+        }
+    }
+    else
+        verifyCaptureKey(query, tableName);
+    qDebug("Table %s exists.", qUtf8Printable(tableName));
+    qDebug("Return");
+    return;
+}
+
+/*!
+ * \brief MySqlSink::verifyCaptureKey -- Give a meter data table made before it had one a unique key on the capture.
+ *
+ * A batch whose COMMIT was applied but not acknowledged is written again;
+ * the key on (ComputerTime, MeterId, DataType) makes saveReading() update
+ * the row instead of adding a second.  The key can't be added to a table
+ * already holding duplicates; they must be removed by hand first.
+ *
+ * \param query     QSqlQuery opened on the database.
+ * \param tableName The table.
+ */
+void MySqlSink::verifyCaptureKey(QSqlQuery &query, const QString &tableName)
+{
+    qDebug("Begin");
+    if (DontActuallyWriteDatabase)
+    {
+        qDebug("Return");
+        return;
+    }
+    query.prepare("SELECT COUNT(*) FROM INFORMATION_SCHEMA.STATISTICS"
+                  " WHERE TABLE_SCHEMA = DATABASE() AND TABLE_NAME = ? AND INDEX_NAME = ?");
+    query.bindValue(0, tableName);
+    query.bindValue(1, CaptureKeyName);
+    if (!query.exec() || !query.next())
+    {
+        qWarning("Unable to look for the capture key of %s: %s", qUtf8Printable(tableName), qUtf8Printable(query.lastError().text()));
+        qDebug("Return");
+        return;
+    }
+    if (query.value(0).toInt() == 0)
+    {
+        if (query.exec(QString("ALTER TABLE `%1` ADD UNIQUE KEY `%2` (`ComputerTime`, `MeterId`, `DataType`)")
+                       .arg(tableName).arg(CaptureKeyName)))
+            qInfo("Added capture key to table %s.", qUtf8Printable(tableName));
+        else
+            qWarning("Unable to add capture key to table %s; retried batches may be stored twice: %s"
+                     , qUtf8Printable(tableName), qUtf8Printable(query.lastError().text()));
+    }
+    qDebug("Return");
+}
+
+/*!
+ * \brief The BatchWriter class -- Write a batch of readings on a writer thread.
+ */
+class BatchWriter : public QRunnable
+{
+public:
+    BatchWriter(MySqlSink *mySqlSink, const QList<MeterReading> &batch) : sink(mySqlSink), readings(batch) {}
+    void run() { sink->writeBatch(readings); }
+
+private:
+    MySqlSink *sink;
+    QList<MeterReading> readings;
+};
+
+MySqlSink::MySqlSink(const int writerThreads, const bool partitionedTable)
+    : existingTablesLoaded(false)
+    , writerPool(NULL)
+    , lastStatisticsMSecs(QDateTime::currentMSecsSinceEpoch())
+    , partitioned(partitionedTable)
+    , lastPartitionCheckMSecs(0)
+{
+    if (writerThreads > 1)
+    {
+        writerPool = new QThreadPool();
+        writerPool->setMaxThreadCount(writerThreads);
+        /* Each writer thread has its own connection in DbPool; keep the threads,
+         * so their connections are reused rather than a new one made each pass. */
+        writerPool->setExpiryTimeout(-1);
+    }
+}
+
+MySqlSink::~MySqlSink()
+{
+    if (writerPool != NULL)
+    {
+        writerPool->waitForDone();
+        delete writerPool;
+    }
+    if (!retryQueue.isEmpty())
+        qCritical("%d meter readings could not be stored in the database.", retryQueue.size());
+}
+
+/*!
+ * \brief MySqlSink::appendBatch -- Store a batch of readings.
+ *
+ * With more than one writer thread, the batch is handed to a writer thread
+ * and this returns right away; otherwise the batch is written before returning.
+ *
+ * \param readings  The readings to store.
+ * \return true if the readings were stored or queued, false otherwise.
+ */
+bool MySqlSink::appendBatch(const QList<MeterReading> &readings)
+{
+    if (readings.isEmpty())
+        return true;
+    if (writerPool == NULL)
+        return writeBatch(readings);
+    writerPool->start(new BatchWriter(this, readings));
+    return true;
+}
+
+/*!
+ * \brief MySqlSink::requeue -- Keep readings that could not be written, to try again with the next batch.
+ *
+ * At most MaxRetryReadings are kept; the oldest are discarded first.
+ *
+ * \param readings  The readings.
+ */
+void MySqlSink::requeue(const QList<MeterReading> &readings)
+{
+    QMutexLocker locker(&retryMutex);
+    retryQueue = readings + retryQueue;
+    if (retryQueue.size() > MaxRetryReadings)
+    {
+        qCritical("Database unavailable; %d meter readings discarded.", retryQueue.size() - MaxRetryReadings);
+        retryQueue = retryQueue.mid(retryQueue.size() - MaxRetryReadings);
+    }
+}
+
+/*!
+ * \brief MySqlSink::writeBatch -- Write a batch of readings, and any waiting to be retried, in one transaction.
+ *
+ * If the connection is lost, the transaction is rolled back and the readings
+ * are kept to be retried with the next batch.  A reading the database
+ * rejects for any other reason is discarded.
+ * Called on the main thread or a writer thread.
+ *
+ * \param readings  The readings to store.
+ * \return true if all readings were stored, false otherwise.
+ */
+bool MySqlSink::writeBatch(const QList<MeterReading> &readings)
+{
+    qDebug("Begin");
+    TraceSpan span("db insert");
+    QList<MeterReading> batch;
+    {
+        QMutexLocker locker(&retryMutex);
+        batch = retryQueue + readings;
+        retryQueue.clear();
+    }
+    QSqlDatabase dbConn = DbPool->connection();
+
+    if (!dbConn.isOpen())
+    {
+        qCritical("Unable to open database to save meter data; %d readings kept for retry.", batch.size());
+        requeue(batch);
+        qInfo() << "Return false";
+        return false;
+    }
+    QSqlQuery query(dbConn);
+
+    bool inTransaction = !DontActuallyWriteDatabase && dbConn.transaction();
+    bool success = true;
+    bool connectionLost = false;
+    foreach (const MeterReading &reading, batch)
+    {
+        if (!saveReading(query, reading))
+        {
+            success = false;
+            if (DatabasePool::isConnectionError(query.lastError()))
+            {
+                connectionLost = true;
+                break;
+            }
+        }
+    }
+    if (inTransaction && (connectionLost || !dbConn.commit()))
+    {
+        if (!connectionLost)
+        {
+            qCritical("Unable to commit %d meter readings: %s", batch.size(), qUtf8Printable(dbConn.lastError().text()));
+            DbPool->connectionFailed(dbConn.lastError());
+        }
+        dbConn.rollback();
+        connectionLost = true;
+        success = false;
+    }
+    if (connectionLost)
+    {
+        qWarning("Lost database connection; %d readings kept for retry.", batch.size());
+        requeue(batch);
+    }
+    qInfo() << "Return" << success;
+    return success;
+}
+
+/*!
+ * \brief MySqlSink::flush -- Wait for the writer threads to finish.
+ *
+ * Connection statistics are logged hourly.  Partitions are maintained daily.
+ *
+ * \return true if no readings are waiting to be retried, false otherwise.
+ */
+bool MySqlSink::flush()
+{
+    if (writerPool != NULL)
+        writerPool->waitForDone();
+    if ((QDateTime::currentMSecsSinceEpoch() - lastStatisticsMSecs) >= 3600000)
+    {
+        lastStatisticsMSecs = QDateTime::currentMSecsSinceEpoch();
+        foreach (QString line, DbPool->statistics())
+            qInfo("%s", qUtf8Printable(line));
+    }
+    if (partitioned && ((QDateTime::currentMSecsSinceEpoch() - lastPartitionCheckMSecs) >= 86400000))
+    {
+        QSqlDatabase dbConn = DbPool->connection();
+        if (dbConn.isOpen())
+        {
+            QSqlQuery query(dbConn);
+            if (maintainPartitions(query))
+                lastPartitionCheckMSecs = QDateTime::currentMSecsSinceEpoch();
+        }
+    }
+    QMutexLocker locker(&retryMutex);
+    return retryQueue.isEmpty();
+}
+
+/*!
+ * \brief MySqlSink::saveState -- Hand over the readings waiting to be retried.
+ *
+ * The readings become the restarted program's to store, so they are no
+ * longer kept here.
+ *
+ * \param state     Receives the readings.
+ */
+void MySqlSink::saveState(QJsonObject *state)
+{
+    if (writerPool != NULL)
+        writerPool->waitForDone();
+    QMutexLocker locker(&retryMutex);
+    if (retryQueue.isEmpty())
+        return;
+    QJsonArray readings;
+    foreach (const MeterReading &reading, retryQueue)
+        readings.append(ReadingToJson(reading));
+    state->insert("retry", readings);
+    qInfo("%d readings waiting to be retried handed over.", retryQueue.size());
+    retryQueue.clear();
+}
+
+void MySqlSink::restoreState(const QJsonObject &state)
+{
+    QList<MeterReading> readings;
+    foreach (const QJsonValue &value, state.value("retry").toArray())
+    {
+        MeterReading reading;
+        if (ReadingFromJson(value.toObject(), &reading))
+            readings.append(reading);
+    }
+    if (!readings.isEmpty())
+    {
+        qInfo("%d readings handed over to be retried.", readings.size());
+        requeue(readings);
+    }
+}
+
+/*!
+ * \brief MySqlSink::saveReading -- Store a meter response in its database table.
+ * \param query     QSqlQuery opened on the database.
+ * \param reading   The reading to save; its capture time is saved as ComputerTime.
+ * \return true if successful, false otherwise.
+ */
+bool MySqlSink::saveReading(QSqlQuery &query, const MeterReading &reading)
+{
+    /*
+     *  Assumes reading.frame is a valid response of reading.dataType.
+     */
+    /*! Extract critical pieces of info from response. */
+    const meterDateTime &dateTime = ReadingMeterTime(reading);
+    const ResponseData *header = (const ResponseData *)reading.frame;
+    QVariant meterTime = MeterTimeToDateTime(dateTime);
+    QVariant meterId = QString(QByteArray((char *)header->meterId, sizeof(header->meterId)));
+    QVariant meterType = QString(QByteArray((char *)header->model, 2).toHex());
+    QVariant meterData = QByteArray((char *)reading.frame, sizeof(reading.frame)); //!< Gets the response into a byte array.
+    QVariant dataType = DataTypeName(reading.dataType);
+    QString meterTable = reading.tableBaseName + DataKind(reading.dataType) + "_RawMeterData";
+    qDebug("Response meterTime %s, meterId %s, meterType %s, dataType %s"
+           , qUtf8Printable(meterTime.toString())
+           , qUtf8Printable(meterId.toString())
+           , qUtf8Printable(meterType.toString())
+           , qUtf8Printable(dataType.toString()));
+
+    /* A batch retried after a lost connection may have been committed after all. */
+    if (partitioned)
+    {
+        query.prepare(QString("INSERT INTO %1 (CaptureTime, MeterTime, MeterId, MeterType, DataType, MeterData)"
+                              " VALUES (?, ?, ?, ?, ?, ?) ON DUPLICATE KEY UPDATE MeterData = VALUES(MeterData)").arg(PartitionedTableName));
+        query.bindValue(0, CaptureTimeToUtcText(reading.captureTime));
+        meterId = reading.meterId;
+    }
+    else
+    {
+        query.prepare(QString("INSERT INTO %1 (ComputerTime, MeterTime, MeterId, MeterType, DataType, MeterData)"
+                              " VALUES (FROM_UNIXTIME(CAST(? AS DECIMAL(17,6))), ?, ?, ?, ?, ?)"
+                              " ON DUPLICATE KEY UPDATE MeterData = VALUES(MeterData)").arg(meterTable));
+        query.bindValue(0, CaptureTimeToSql(reading.captureTime));
+    }
+    query.bindValue(1, meterTime);
+    query.bindValue(2, meterId);
+    query.bindValue(3, meterType);
+    query.bindValue(4, dataType);
+    query.bindValue(5, meterData);
+    if (!DontActuallyWriteDatabase)
+    {
+        if (!DbPool->exec(query))
+        {
+            qCritical("Error inserting raw meter %s data record in database: %s\n Query:  %s"
+                      , qUtf8Printable(dataType.toString())
+                      , qUtf8Printable(query.lastError().text())
+                      , qUtf8Printable(query.lastQuery()));
+            return false;
+        }
+        else
+            qDebug("Inserting raw meter %s data was successful.", qUtf8Printable(dataType.toString()));
+    }
+    else
+    {
+        qDebug() << "Did not execute " << query.lastQuery();
+    }
+    return saveCounters(query, reading);
+}
+
+/*!
+ * \brief MySqlSink::saveCounters -- Store the accumulated counters of a reading, if it has them.
+ * \param query     QSqlQuery opened on the database.
+ * \param reading   The reading.
+ * \return true if successful, false otherwise.
+ */
+bool MySqlSink::saveCounters(QSqlQuery &query, const MeterReading &reading)
+{
+    if (!reading.countersValid)
+        return true;
+    /* A batch retried after a lost connection may have been committed after all. */
+    query.prepare(QString("INSERT INTO %1 (MeterId, CaptureTime, DataType, TotalKwh, PulseCount1, PulseCount2, PulseCount3)"
+                          " VALUES (?, ?, ?, ?, ?, ?, ?) ON DUPLICATE KEY UPDATE TotalKwh = VALUES(TotalKwh)"
+                          ", PulseCount1 = VALUES(PulseCount1), PulseCount2 = VALUES(PulseCount2)"
+                          ", PulseCount3 = VALUES(PulseCount3)").arg(CountersTableName));
+    query.bindValue(0, reading.meterId);
+    query.bindValue(1, CaptureTimeToUtcText(reading.captureTime));
+    query.bindValue(2, DataTypeName(reading.dataType));
+    for (int i = 0; i < CounterCount; i++)
+        query.bindValue(3 + i, reading.counters[i]);
+    if (DontActuallyWriteDatabase)
+    {
+        qDebug() << "Did not execute " << query.lastQuery();
+        return true;
+    }
+    if (!DbPool->exec(query))
+    {
+        qCritical("Error inserting counters of meter %s in database: %s"
+                  , qUtf8Printable(reading.meterId)
+                  , qUtf8Printable(query.lastError().text()));
+        return false;
+    }
+    return true;
+}
@@ -0,0 +1,264 @@
+/*!
+@file
+@brief Publish live meter readings on a Unix domain socket.
+
+@author Thomas A. DeMay
+@date 2015
+@par    Copyright (C) 2015  Thomas A. DeMay
+@par
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    any later version.
+@par
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+@par
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include "publisher.h"
+#include "meterfields.h"
+#include "framearchive.h"
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <signal.h>
+#include <limits.h>
+#include <unistd.h>
+
+ReadingPublisher *Publisher = NULL;
+
+ReadingPublisher::ReadingPublisher(const QString &socketPath, const PublishFormat publishFormat)
+    : path(socketPath)
+    , format(publishFormat)
+    , listenFd(-1)
+    , droppedCount(0)
+{
+}
+
+ReadingPublisher::~ReadingPublisher()
+{
+    while (!subscribers.isEmpty())
+        dropSubscriber(0, "publisher closing");
+    if (listenFd >= 0)
+    {
+        ::close(listenFd);
+        ::unlink(QFile::encodeName(path).constData());
+    }
+}
+
+/*!
+ * \brief ReadingPublisher::open -- Create the socket subscribers connect to.
+ *
+ * A socket left behind by an earlier run is removed.
+ *
+ * \return true if successful, false otherwise.
+ */
+bool ReadingPublisher::open()
+{
+    qDebug("Begin");
+    QByteArray encodedPath = QFile::encodeName(path);
+    struct sockaddr_un address;
+    if ((size_t)encodedPath.size() >= sizeof(address.sun_path))
+    {
+        qCritical("Publish socket path %s is too long.", qUtf8Printable(path));
+        qDebug("Return false");
+        return false;
+    }
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    memcpy(address.sun_path, encodedPath.constData(), encodedPath.size());
+
+    /* A subscriber that goes away while we write to it must not kill us. */
+    signal(SIGPIPE, SIG_IGN);
+
+    ::unlink(encodedPath.constData());
+    listenFd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+    if ((listenFd < 0)
+            || (::bind(listenFd, (struct sockaddr *)&address, sizeof(address)) != 0)
+            || (::listen(listenFd, 8) != 0)
+            || (fcntl(listenFd, F_SETFL, O_NONBLOCK) != 0))
+    {
+        qCritical("Unable to open publish socket %s: %s", qUtf8Printable(path), strerror(errno));
+        if (listenFd >= 0)
+            ::close(listenFd);
+        listenFd = -1;
+        qDebug("Return false");
+        return false;
+    }
+    qInfo("Publishing readings on %s as %s.", qUtf8Printable(path), (format == PublishJson) ? "JSON lines" : "archive records");
+    qDebug("Return true");
+    return true;
+}
+
+/*!
+ * \brief ReadingPublisher::acceptSubscribers -- Accept all pending subscriber connections.
+ */
+void ReadingPublisher::acceptSubscribers()
+{
+    if (listenFd < 0)
+        return;
+    int fd;
+    while ((fd = ::accept(listenFd, NULL, NULL)) >= 0)
+    {
+        fcntl(fd, F_SETFL, O_NONBLOCK);
+        Subscriber subscriber;
+        subscriber.fd = fd;
+        subscribers.append(subscriber);
+        qInfo("Subscriber connected to %s; %d subscribers.", qUtf8Printable(path), subscribers.size());
+    }
+}
+
+/*!
+ * \brief ReadingPublisher::dropSubscriber -- Disconnect a subscriber.
+ * \param index     Index of the subscriber.
+ * \param reason    Why it is being dropped.
+ */
+void ReadingPublisher::dropSubscriber(const int index, const char *reason)
+{
+    Subscriber subscriber = subscribers.takeAt(index);
+    ::close(subscriber.fd);
+    qInfo("Subscriber to %s dropped: %s; %d subscribers.", qUtf8Printable(path), reason, subscribers.size());
+}
+
+/*!
+ * \brief ReadingPublisher::drain -- Write as much of a subscriber's backlog as it will take without waiting.
+ * \param subscriber    The subscriber.
+ * \return false if the subscriber's connection failed, true otherwise.
+ */
+bool ReadingPublisher::drain(Subscriber &subscriber)
+{
+    while (!subscriber.backlog.isEmpty())
+    {
+        ssize_t written = ::write(subscriber.fd, subscriber.backlog.constData(), subscriber.backlog.size());
+        if (written < 0)
+            return (errno == EAGAIN) || (errno == EWOULDBLOCK) || (errno == EINTR);
+        subscriber.backlog.remove(0, written);
+    }
+    return true;
+}
+
+/*!
+ * \brief ReadingPublisher::publish -- Send readings with a valid CRC to every subscriber.
+ *
+ * Nothing here waits on a subscriber.  What a subscriber can't take now
+ * is kept in its backlog; a subscriber whose backlog would overflow is dropped.
+ *
+ * \param readings  The readings.
+ */
+void ReadingPublisher::publish(const QList<MeterReading> &readings)
+{
+    acceptSubscribers();
+    if (subscribers.isEmpty())
+        return;
+
+    QByteArray data;
+    foreach (const MeterReading &reading, readings)
+    {
+        if (!reading.crcValid)
+            continue;
+        if (format == PublishJson)
+        {
+            data.append(QJsonDocument(DecodeReading(reading)).toJson(QJsonDocument::Compact));
+            data.append('\n');
+        }
+        else
+        {
+            ArchiveRecord record;
+            memset(&record, 0, sizeof(record));
+            record.captureUSecs = reading.captureTime.wallUSecs;
+            record.dataType = reading.dataType;
+            record.flags = ArchiveFlagCrcValid;
+            memcpy(record.frame, reading.frame, sizeof(record.frame));
+            data.append((const char *)&record, sizeof(record));
+        }
+    }
+    if (data.isEmpty())
+        return;
+
+    for (int i = subscribers.size() - 1; i >= 0; i--)
+    {
+        Subscriber &subscriber = subscribers[i];
+        if ((subscriber.backlog.size() + data.size()) > MaxSubscriberBacklog)
+        {
+            droppedCount++;
+            dropSubscriber(i, "too far behind");
+            continue;
+        }
+        subscriber.backlog.append(data);
+        if (!drain(subscriber))
+            dropSubscriber(i, strerror(errno));
+    }
+}
+
+/*!
+ * \brief ReadingPublisher::serviceFor -- Accept subscribers and write backlogs for a while.
+ *
+ * Used in place of sleeping between meter reads so that new subscribers are
+ * accepted, and backlogs written, promptly.
+ *
+ * \param msecs     How long to service the socket.
+ */
+void ReadingPublisher::serviceFor(const qint64 msecs)
+{
+    QElapsedTimer timer;
+    timer.start();
+    qint64 remaining = msecs;
+    while (remaining > 0)
+    {
+        QVector<struct pollfd> fds(subscribers.size() + 1);
+        fds[0].fd = listenFd;
+        fds[0].events = POLLIN;
+        fds[0].revents = 0;
+        for (int i = 0; i < subscribers.size(); i++)
+        {
+            fds[i + 1].fd = subscribers[i].fd;
+            fds[i + 1].events = POLLIN | (subscribers[i].backlog.isEmpty() ? 0 : POLLOUT);
+            fds[i + 1].revents = 0;
+        }
+        int ready = ::poll(fds.data(), fds.size(), (int)qMin(remaining, (qint64)INT_MAX));
+        if ((ready < 0) && (errno != EINTR))
+        {
+            qWarning("Unable to poll publish socket: %s", strerror(errno));
+            usleep(remaining * 1000);
+            return;
+        }
+        if (ready > 0)
+        {
+            for (int i = subscribers.size() - 1; i >= 0; i--)
+            {
+                short revents = fds[i + 1].revents;
+                if (revents & POLLIN)
+                {
+                    /* Subscribers have nothing to say; a read of zero means they hung up. */
+                    char discard[256];
+                    ssize_t n = ::read(subscribers[i].fd, discard, sizeof(discard));
+                    if ((n == 0) || ((n < 0) && (errno != EAGAIN) && (errno != EWOULDBLOCK) && (errno != EINTR)))
+                    {
+                        dropSubscriber(i, "disconnected");
+                        continue;
+                    }
+                }
+                if (revents & (POLLERR | POLLHUP | POLLNVAL))
+                {
+                    dropSubscriber(i, "disconnected");
+                    continue;
+                }
+                if ((revents & POLLOUT) && !drain(subscribers[i]))
+                    dropSubscriber(i, strerror(errno));
+            }
+            if (fds[0].revents & POLLIN)
+                acceptSubscribers();
+        }
+        remaining = msecs - timer.elapsed();
+    }
+    if (droppedCount > 0)
+        qDebug("%lld subscribers dropped so far for falling behind.", droppedCount);
+}
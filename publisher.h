@@ -0,0 +1,80 @@
+/*!
+@file
+@brief Header file describing the live publishing of meter readings.
+
+Readings whose CRC is valid are published on a Unix domain socket as soon as
+they are read.  Any number of subscribers may connect; each gets every
+reading published while it is connected, either as a line of JSON
+(newline delimited JSON) or as an ArchiveRecord.
+
+Each subscriber has a bounded backlog.  A subscriber that falls so far behind
+that its backlog would overflow is disconnected, so a slow subscriber can
+never hold up reading the meters or the other subscribers.
+
+@author Thomas A. DeMay
+@date 2015
+@par    Copyright (C) 2015  Thomas A. DeMay
+@par
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    any later version.
+@par
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+@par
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#ifndef PUBLISHER_H
+#define PUBLISHER_H
+#include <QtCore>
+#include "meterreading.h"
+
+static const int MaxSubscriberBacklog = 256 * 1024;     //!< Bytes a subscriber may fall behind before it is dropped.
+
+typedef enum
+{
+    PublishJson,        //!< One line of JSON per reading; see DecodeReading().
+    PublishRecord       //!< One ArchiveRecord per reading.
+} PublishFormat;
+
+/*!
+ * \brief The ReadingPublisher class -- Fan out readings to subscribers on a Unix domain socket.
+ */
+class ReadingPublisher
+{
+public:
+    ReadingPublisher(const QString &socketPath, const PublishFormat publishFormat);
+    ~ReadingPublisher();
+
+    bool open();
+    void publish(const QList<MeterReading> &readings);
+    void serviceFor(const qint64 msecs);
+    int subscriberCount() const { return subscribers.size(); }
+
+private:
+    typedef struct
+    {
+        int fd;                 //!< Connected socket.
+        QByteArray backlog;     //!< Published data not yet written.
+    } Subscriber;
+
+    void acceptSubscribers();
+    bool drain(Subscriber &subscriber);
+    void dropSubscriber(const int index, const char *reason);
+
+    QString path;               //!< Path of the socket.
+    PublishFormat format;       //!< Format of published readings.
+    int listenFd;               //!< Listening socket; -1 if not open.
+    QList<Subscriber> subscribers;  //!< Connected subscribers.
+    qint64 droppedCount;        //!< Number of subscribers dropped for falling behind.
+};
+
+extern ReadingPublisher *Publisher;     //!< Publisher of live readings; NULL if not publishing.
+
+#endif // PUBLISHER_H
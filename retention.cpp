@@ -0,0 +1,420 @@
+/*!
+@file
+@brief Prune old rows from database tables, a little at a time.
+
+@author Thomas A. DeMay
+@date 2015
+@par    Copyright (C) 2015  Thomas A. DeMay
+@par
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    any later version.
+@par
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+@par
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include "retention.h"
+#include "dbpool.h"
+#include "publisher.h"
+#include "../SupportRoutines/supportfunctions.h"
+#include <unistd.h>
+
+RetentionManager *Retention = NULL;
+
+/*!
+ * \brief LoadRetentionPolicies -- Read retention policies from a file.
+ *
+ * See retention.h for the file format.
+ *
+ * \param fileName  Name of the file.
+ * \param policies  Set to the policies read.
+ * \return true if successful, false otherwise.
+ */
+bool LoadRetentionPolicies(const QString &fileName, QList<RetentionPolicy> *policies)
+{
+    qDebug("Begin");
+    if (!QFile::exists(fileName))
+    {
+        qCritical("Retention policy file %s does not exist.", qUtf8Printable(fileName));
+        qDebug("Return false");
+        return false;
+    }
+    QSettings settings(fileName, QSettings::IniFormat);
+    if (settings.status() != QSettings::NoError)
+    {
+        qCritical("Unable to read retention policy file %s.", qUtf8Printable(fileName));
+        qDebug("Return false");
+        return false;
+    }
+    policies->clear();
+    foreach (QString group, settings.childGroups())
+    {
+        settings.beginGroup(group);
+        RetentionPolicy policy;
+        policy.tablePattern = group;
+        policy.keepDays = settings.value("keepDays", 0).toInt();
+        policy.thinMinutes = settings.value("thinMinutes", 0).toInt();
+        policy.timeColumn = settings.value("timeColumn", "ComputerTime").toString();
+        policy.utc = settings.value("utc", false).toBool();
+        policy.groupColumns = settings.value("groupColumns").toStringList();
+        policy.debugDatabase = (settings.value("database").toString() == "debug");
+        settings.endGroup();
+        if (policy.keepDays <= 0)
+            continue;
+        qInfo("Retention of %s: keep %d days, then %s."
+              , qUtf8Printable(policy.tablePattern), policy.keepDays
+              , (policy.thinMinutes > 0) ? qUtf8Printable(QString("thin to one row per %1 minutes").arg(policy.thinMinutes)) : "delete");
+        policies->append(policy);
+    }
+    qDebug("Return true; %d policies.", policies->size());
+    return true;
+}
+
+RetentionManager::RetentionManager(const QList<RetentionPolicy> &retentionPolicies, const QString &debugConnectionName, const QString &stateFileName)
+    : policies(retentionPolicies)
+    , debugConnection(debugConnectionName)
+    , stateFile(stateFileName)
+    , progressChanged(false)
+    , passStartMSecs(0)
+    , rowsPruned(0)
+{
+    loadProgress();
+}
+
+/*!
+ * \brief RetentionManager::loadProgress -- Read how far each table was thinned, as saved by saveProgress().
+ *
+ * A missing or unrecognized file is not an error; thinning starts from the
+ * oldest rows.
+ */
+void RetentionManager::loadProgress()
+{
+    qDebug("Begin");
+    QFile file(stateFile);
+    if (!file.exists() || !file.open(QIODevice::ReadOnly))
+    {
+        qInfo("No retention progress in %s; thinning starts from the oldest rows.", qUtf8Printable(stateFile));
+        qDebug("Return");
+        return;
+    }
+    QJsonObject state = QJsonDocument::fromJson(file.readAll()).object();
+    if (state.value("version").toInt() != RetentionStateVersion)
+    {
+        qWarning("Retention progress in %s not recognized; thinning starts from the oldest rows.", qUtf8Printable(stateFile));
+        qDebug("Return");
+        return;
+    }
+    QJsonObject tables = state.value("thinnedTo").toObject();
+    /* Epoch seconds are kept as text, as the counters are. */
+    foreach (QString table, tables.keys())
+        thinnedTo.insert(table, tables.value(table).toString().toLongLong());
+    qDebug("Return; progress of %d tables.", thinnedTo.size());
+}
+
+/*!
+ * \brief RetentionManager::saveProgress -- Write how far each table was thinned, if it changed since last written.
+ * \return true if successful, false otherwise.
+ */
+bool RetentionManager::saveProgress()
+{
+    if (!progressChanged)
+        return true;
+    QJsonObject tables;
+    foreach (QString table, thinnedTo.keys())
+        tables.insert(table, QString::number(thinnedTo.value(table)));
+    QJsonObject state;
+    state.insert("version", RetentionStateVersion);
+    state.insert("thinnedTo", tables);
+
+    QSaveFile file(stateFile);
+    if (!file.open(QIODevice::WriteOnly)
+            || (file.write(QJsonDocument(state).toJson()) < 0)
+            || !file.commit())
+    {
+        qWarning("Unable to write retention progress to %s:  %s", qUtf8Printable(stateFile), qUtf8Printable(file.errorString()));
+        return false;
+    }
+    progressChanged = false;
+    return true;
+}
+
+/*!
+ * \brief RetentionManager::database -- Connection to the database holding a policy's tables.
+ * \param policy    The policy.
+ * \return The connection; not open if the database is unavailable.
+ */
+QSqlDatabase RetentionManager::database(const RetentionPolicy &policy)
+{
+    if (!policy.debugDatabase)
+        return (DbPool != NULL) ? DbPool->connection() : QSqlDatabase();
+    if (debugConnection.isEmpty())
+        return QSqlDatabase();
+    QSqlDatabase db = QSqlDatabase::database(debugConnection, false);
+    if (!db.isOpen())
+        db.open();
+    return db;
+}
+
+/*!
+ * \brief RetentionManager::cutoff -- SQL expression for the time before which rows are pruned.
+ * \param policy    The policy.
+ * \return The expression.
+ */
+QString RetentionManager::cutoff(const RetentionPolicy &policy) const
+{
+    return QString("%1 - INTERVAL %2 DAY").arg(policy.utc ? "UTC_TIMESTAMP()" : "NOW()").arg(policy.keepDays);
+}
+
+/*!
+ * \brief RetentionManager::startPass -- Find the tables each policy applies to.
+ */
+void RetentionManager::startPass()
+{
+    qDebug("Begin");
+    passStartMSecs = QDateTime::currentMSecsSinceEpoch();
+    rowsPruned = 0;
+    tasks.clear();
+    for (int i = 0; i < policies.size(); i++)
+    {
+        QSqlDatabase db = database(policies[i]);
+        if (!db.isOpen())
+            continue;
+        QSqlQuery query(db);
+        QString likePattern = QString(policies[i].tablePattern).replace("_", "\\_").replace("*", "%");
+        query.prepare("SELECT TABLE_NAME FROM INFORMATION_SCHEMA.TABLES WHERE TABLE_SCHEMA = DATABASE() AND TABLE_NAME LIKE ?");
+        query.bindValue(0, likePattern);
+        if (!query.exec())
+        {
+            qWarning("Unable to list tables for retention policy %s: %s"
+                     , qUtf8Printable(policies[i].tablePattern), qUtf8Printable(query.lastError().text()));
+            continue;
+        }
+        while (query.next())
+        {
+            QString table = query.value(0).toString();
+            bool claimed = false;
+            foreach (const TableTask &task, tasks)
+                claimed = claimed || ((task.table == table) && (policies[task.policyIndex].debugDatabase == policies[i].debugDatabase));
+            if (claimed)
+                continue;       // First matching policy wins.
+            TableTask task;
+            task.table = table;
+            task.policyIndex = i;
+            task.partitionsChecked = false;
+            task.thinnedToSecs = thinnedTo.value(table, 0);
+            task.done = false;
+            tasks.append(task);
+        }
+    }
+    qDebug("Return; %d tables to prune.", tasks.size());
+}
+
+/*!
+ * \brief RetentionManager::runUntil -- Prune tables until a deadline.
+ *
+ * Called when ReadEKM would otherwise be idle.  A pass over all the tables
+ * may take many calls; a new pass starts RetentionPassMSecs after the last.
+ *
+ * \param deadlineMSecs     Msec since epoch by which to stop.
+ */
+void RetentionManager::runUntil(const qint64 deadlineMSecs)
+{
+    if ((passStartMSecs == 0) || (QDateTime::currentMSecsSinceEpoch() - passStartMSecs >= RetentionPassMSecs))
+        startPass();
+    for (int i = 0; i < tasks.size(); i++)
+    {
+        while (!tasks[i].done)
+        {
+            if ((QDateTime::currentMSecsSinceEpoch() + RetentionPauseMSecs) >= deadlineMSecs)
+            {
+                saveProgress();
+                return;
+            }
+            if (!step(tasks[i]))
+                tasks[i].done = true;
+            if (thinnedTo.value(tasks[i].table, 0) != tasks[i].thinnedToSecs)
+            {
+                thinnedTo.insert(tasks[i].table, tasks[i].thinnedToSecs);
+                progressChanged = true;
+            }
+            /* Rate limit: give the server a rest between statements. */
+            if (Publisher != NULL)
+                Publisher->serviceFor(RetentionPauseMSecs);
+            else
+                usleep(RetentionPauseMSecs * 1000);
+        }
+    }
+    if (!tasks.isEmpty())
+    {
+        qInfo("Retention pass done; %lld rows pruned from %d tables.", rowsPruned, tasks.size());
+        tasks.clear();
+    }
+    saveProgress();
+}
+
+/*!
+ * \brief RetentionManager::step -- Do one statement's worth of pruning on a table.
+ * \param task  The table.
+ * \return true if there may be more to do, false if the table is done for this pass.
+ */
+bool RetentionManager::step(TableTask &task)
+{
+    const RetentionPolicy &policy = policies[task.policyIndex];
+    QSqlDatabase db = database(policy);
+    if (!db.isOpen())
+        return false;
+    QSqlQuery query(db);
+    if (!task.partitionsChecked && (policy.thinMinutes == 0))
+    {
+        if (dropOldPartition(query, task))
+            return true;
+        task.partitionsChecked = true;
+    }
+    if (policy.thinMinutes > 0)
+        return thinOldRows(query, task);
+    return deleteOldRows(query, task);
+}
+
+/*!
+ * \brief RetentionManager::dropOldPartition -- Drop one range partition holding only rows past keeping.
+ *
+ * Works for tables partitioned by RANGE COLUMNS on a date or time column,
+ * like the partitioned meter table.  The last partition is never dropped.
+ *
+ * \param query     Query on the table's database.
+ * \param task      The table.
+ * \return true if a partition was dropped, false otherwise.
+ */
+bool RetentionManager::dropOldPartition(QSqlQuery &query, TableTask &task)
+{
+    const RetentionPolicy &policy = policies[task.policyIndex];
+    query.prepare("SELECT PARTITION_NAME, PARTITION_DESCRIPTION FROM INFORMATION_SCHEMA.PARTITIONS"
+                  " WHERE TABLE_SCHEMA = DATABASE() AND TABLE_NAME = ? AND PARTITION_NAME IS NOT NULL"
+                  " AND PARTITION_METHOD = 'RANGE COLUMNS' ORDER BY PARTITION_ORDINAL_POSITION");
+    query.bindValue(0, task.table);
+    if (!query.exec())
+        return false;
+    QStringList names;
+    QList<QDateTime> bounds;
+    while (query.next())
+    {
+        names << query.value(0).toString();
+        bounds << QDateTime::fromString(query.value(1).toString().remove('\''), "yyyy-MM-dd");
+    }
+    QDateTime cutoffTime = (policy.utc ? QDateTime::currentDateTimeUtc() : QDateTime::currentDateTime()).addDays(-policy.keepDays);
+    cutoffTime = QDateTime(cutoffTime.date(), cutoffTime.time());     // Compare as plain date and time.
+    for (int i = 0; i < (names.size() - 1); i++)
+    {
+        if (!bounds[i].isValid() || (bounds[i] > cutoffTime))
+            break;
+        QString queryText = QString("ALTER TABLE `%1` DROP PARTITION %2").arg(task.table).arg(names[i]);
+        if (DontActuallyWriteDatabase)
+        {
+            qDebug() << "Did not execute " << queryText;
+            return false;
+        }
+        if (!query.exec(queryText))
+        {
+            qWarning("Unable to drop partition %s of %s: %s", qUtf8Printable(names[i]), qUtf8Printable(task.table), qUtf8Printable(query.lastError().text()));
+            return false;
+        }
+        qInfo("Retention dropped partition %s of %s.", qUtf8Printable(names[i]), qUtf8Printable(task.table));
+        return true;
+    }
+    return false;
+}
+
+/*!
+ * \brief RetentionManager::deleteOldRows -- Delete up to RetentionBatchRows rows past keeping.
+ * \param query     Query on the table's database.
+ * \param task      The table.
+ * \return true if there may be more rows to delete, false otherwise.
+ */
+bool RetentionManager::deleteOldRows(QSqlQuery &query, TableTask &task)
+{
+    const RetentionPolicy &policy = policies[task.policyIndex];
+    QString queryText = QString("DELETE FROM `%1` WHERE `%2` < %3 ORDER BY `%2` LIMIT %4")
+            .arg(task.table).arg(policy.timeColumn).arg(cutoff(policy)).arg(RetentionBatchRows);
+    if (DontActuallyWriteDatabase)
+    {
+        qDebug() << "Did not execute " << queryText;
+        return false;
+    }
+    if (!query.exec(queryText))
+    {
+        qWarning("Unable to prune %s: %s", qUtf8Printable(task.table), qUtf8Printable(query.lastError().text()));
+        qInfo("    Query was: %s", qUtf8Printable(queryText));
+        return false;
+    }
+    int deleted = query.numRowsAffected();
+    rowsPruned += qMax(0, deleted);
+    if (deleted > 0)
+        qDebug("Retention deleted %d rows from %s.", deleted, qUtf8Printable(task.table));
+    return deleted >= RetentionBatchRows;
+}
+
+/*!
+ * \brief RetentionManager::thinOldRows -- Thin the next interval past keeping to its first row (per group).
+ *
+ * Intervals are thinMinutes long, aligned to the epoch.  Only intervals
+ * wholly past keeping are thinned; one that straddles the cutoff waits till
+ * it doesn't.  Progress is remembered, and kept in the state file across
+ * restarts, so each interval is only thinned once.
+ *
+ * \param query     Query on the table's database.
+ * \param task      The table.
+ * \return true if there may be more intervals to thin, false otherwise.
+ */
+bool RetentionManager::thinOldRows(QSqlQuery &query, TableTask &task)
+{
+    const RetentionPolicy &policy = policies[task.policyIndex];
+    const qint64 intervalSecs = policy.thinMinutes * 60ll;
+    QString queryText = QString("SELECT FLOOR(UNIX_TIMESTAMP(MIN(`%2`)) / %4) * %4, UNIX_TIMESTAMP(%5) FROM `%1`"
+                                " WHERE `%2` >= FROM_UNIXTIME(%3) AND `%2` < %5")
+            .arg(task.table).arg(policy.timeColumn).arg(task.thinnedToSecs).arg(intervalSecs).arg(cutoff(policy));
+    if (!query.exec(queryText) || !query.next())
+    {
+        qWarning("Unable to find rows of %s to thin: %s", qUtf8Printable(task.table), qUtf8Printable(query.lastError().text()));
+        return false;
+    }
+    if (query.value(0).isNull())
+        return false;       // Nothing more past keeping.
+    qint64 windowStart = query.value(0).toLongLong();
+    qint64 windowEnd = windowStart + intervalSecs;
+    if (windowEnd > query.value(1).toLongLong())
+        return false;       // Not all of the interval is past keeping yet; thin it on a later pass.
+
+    QString groups;
+    foreach (QString column, policy.groupColumns)
+        groups += QString("`%1`, ").arg(column.trimmed());
+    QString window = QString("`%1` >= FROM_UNIXTIME(%2) AND `%1` < FROM_UNIXTIME(%3)")
+            .arg(policy.timeColumn).arg(windowStart).arg(windowEnd);
+    /* MySQL won't read the table being deleted from in a subquery,
+     * unless the subquery is wrapped in a derived table. */
+    queryText = QString("DELETE FROM `%1` WHERE %2 AND (%3`%4`) NOT IN"
+                        " (SELECT * FROM (SELECT %3MIN(`%4`) FROM `%1` WHERE %2%5) AS keep)")
+            .arg(task.table).arg(window).arg(groups).arg(policy.timeColumn)
+            .arg(groups.isEmpty() ? QString() : QString(" GROUP BY %1").arg(groups.left(groups.size() - 2)));
+    task.thinnedToSecs = windowEnd;
+    if (DontActuallyWriteDatabase)
+    {
+        qDebug() << "Did not execute " << queryText;
+        return true;
+    }
+    if (!query.exec(queryText))
+    {
+        qWarning("Unable to thin %s: %s", qUtf8Printable(task.table), qUtf8Printable(query.lastError().text()));
+        qInfo("    Query was: %s", qUtf8Printable(queryText));
+        return false;
+    }
+    rowsPruned += qMax(0, query.numRowsAffected());
+    return true;
+}
@@ -0,0 +1,122 @@
+/*!
+@file
+@brief Header file describing the pruning of old rows from database tables.
+
+Retention policies are read from a QSettings ini file with one group per
+policy.  The group name is a table name, which may have * wildcards:
+
+    [*_RawMeterData]
+    keepDays=90         ; rows older than this are pruned; 0 keeps all
+    thinMinutes=60      ; pruned rows are thinned to one per 60 minutes, kept forever; 0 deletes them
+    timeColumn=ComputerTime
+
+    [RawMeterReadings]
+    keepDays=365
+    thinMinutes=60
+    timeColumn=CaptureTime
+    utc=true            ; timeColumn holds UTC rather than session time
+    groupColumns=MeterId,DataType   ; thin each meter and data type separately
+
+    [DebugInfo]
+    keepDays=30
+    timeColumn=Time
+    database=debug      ; table is in the debug database (-B)
+
+Pruning is done a little at a time when ReadEKM would otherwise be idle:
+each statement deletes at most RetentionBatchRows rows, or thins one
+interval, and is followed by a pause so the database server is never kept
+busy.  Partitions wholly older than keepDays are dropped rather than
+deleted from.
+
+How far each table has been thinned is kept in RetentionStateFile in the
+home directory, written when it changes, so a restart (or handoff) carries
+on where the last run left off rather than going over the thinned history
+again an interval at a time.
+
+@author Thomas A. DeMay
+@date 2015
+@par    Copyright (C) 2015  Thomas A. DeMay
+@par
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    any later version.
+@par
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+@par
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#ifndef RETENTION_H
+#define RETENTION_H
+#include <QtCore>
+#include <QtSql>
+
+static const int RetentionBatchRows = 1000;         //!< Most rows deleted by one statement.
+static const int RetentionPauseMSecs = 250;         //!< Pause after each statement.
+static const qint64 RetentionPassMSecs = 3600000;   //!< Start a new pass over the tables this often.
+static const qint64 RetentionMarginMSecs = 5000;    //!< Stop pruning this long before the next read.
+static const char RetentionStateFile[] = ".ReadEKMRetention.json";     //!< Thinning progress, in the home directory.
+static const int RetentionStateVersion = 1;         //!< Format of the thinning progress file.
+
+typedef struct
+{
+    QString tablePattern;       //!< Table name; may have * wildcards.
+    int keepDays;               //!< Rows older than this are pruned; 0 keeps all rows.
+    int thinMinutes;            //!< Pruned rows are thinned to one per this many minutes; 0 deletes them.
+    QString timeColumn;         //!< Column with the time of the row.
+    bool utc;                   //!< timeColumn is UTC rather than the session time zone.
+    QStringList groupColumns;   //!< Thin each distinct combination of these columns separately.
+    bool debugDatabase;         //!< Table is in the debug database.
+} RetentionPolicy;
+
+/*!
+ * \brief The RetentionManager class -- Prune tables according to their policies, a little at a time.
+ */
+class RetentionManager
+{
+public:
+    RetentionManager(const QList<RetentionPolicy> &retentionPolicies, const QString &debugConnectionName, const QString &stateFileName);
+
+    void runUntil(const qint64 deadlineMSecs);
+
+private:
+    typedef struct
+    {
+        QString table;              //!< Table being pruned.
+        int policyIndex;            //!< Index of its policy.
+        bool partitionsChecked;     //!< Old partitions have been dropped this pass.
+        qint64 thinnedToSecs;       //!< Thinning is done for times before this (epoch seconds, session time).
+        bool done;                  //!< Nothing more to do this pass.
+    } TableTask;
+
+    QSqlDatabase database(const RetentionPolicy &policy);
+    void startPass();
+    bool step(TableTask &task);
+    bool dropOldPartition(QSqlQuery &query, TableTask &task);
+    bool deleteOldRows(QSqlQuery &query, TableTask &task);
+    bool thinOldRows(QSqlQuery &query, TableTask &task);
+    QString cutoff(const RetentionPolicy &policy) const;
+    void loadProgress();
+    bool saveProgress();
+
+    QList<RetentionPolicy> policies;        //!< The policies.
+    QString debugConnection;                //!< Connection to the debug database; empty if none.
+    QList<TableTask> tasks;                 //!< Tables to prune in this pass.
+    QHash<QString, qint64> thinnedTo;       //!< Thinning progress of each table, carried between passes.
+    QString stateFile;                      //!< Where thinnedTo is kept between runs.
+    bool progressChanged;                   //!< thinnedTo changed since last written.
+    qint64 passStartMSecs;                  //!< When the current pass started; 0 if none yet.
+    qint64 rowsPruned;                      //!< Rows pruned in the current pass.
+};
+
+extern RetentionManager *Retention;         //!< Prunes old rows; NULL if no retention policies.
+
+bool LoadRetentionPolicies(const QString &fileName, QList<RetentionPolicy> *policies);
+
+#endif // RETENTION_H
@@ -0,0 +1,181 @@
+/*!
+@file
+@brief Settings of each serial port.
+
+@author Thomas A. DeMay
+@date 2015
+@par    Copyright (C) 2015  Thomas A. DeMay
+@par
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    any later version.
+@par
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+@par
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include "serialparams.h"
+
+static SerialParameters DefaultParameters = DefaultSerialParameters();  //!< Settings of ports not named in PortParameters.
+static QMap<QString, SerialParameters> PortParameters;                  //!< Settings of ports given by name.
+
+/*!
+ * \brief DefaultSerialParameters -- The EKM settings: 9600 baud, 7E1, no flow control.
+ * \return The settings.
+ */
+SerialParameters DefaultSerialParameters()
+{
+    SerialParameters params;
+    params.baudRate = 9600;
+    params.dataBits = QSerialPort::Data7;
+    params.parity = QSerialPort::EvenParity;
+    params.stopBits = QSerialPort::OneStop;
+    params.flowControl = QSerialPort::NoFlowControl;
+    params.probe = false;
+    return params;
+}
+
+/*!
+ * \brief ParseFormat -- Parse a character format like 7E1.
+ * \param format    The format.
+ * \param params    Settings to receive the data bits, parity and stop bits.
+ * \return true if successful, false otherwise.
+ */
+static bool ParseFormat(const QString &format, SerialParameters *params)
+{
+    const QByteArray f = format.toUpper().toLatin1();
+    if ((f.size() != 3) || (f[0] < '5') || (f[0] > '8'))
+        return false;
+    params->dataBits = (QSerialPort::DataBits)(f[0] - '0');
+    switch (f[1])
+    {
+    case 'N':
+        params->parity = QSerialPort::NoParity;
+        break;
+    case 'E':
+        params->parity = QSerialPort::EvenParity;
+        break;
+    case 'O':
+        params->parity = QSerialPort::OddParity;
+        break;
+    default:
+        return false;
+    }
+    if (f[2] == '1')
+        params->stopBits = QSerialPort::OneStop;
+    else if (f[2] == '2')
+        params->stopBits = QSerialPort::TwoStop;
+    else
+        return false;
+    return true;
+}
+
+/*!
+ * \brief AddSerialSettings -- Add settings given by a --serial-settings option.
+ *
+ * See serialparams.h for the form of the settings.
+ *
+ * \param spec  The settings.
+ * \return true if successful, false otherwise.
+ */
+bool AddSerialSettings(const QString &spec)
+{
+    qDebug("Begin");
+    QString portName;
+    QString settings = spec.trimmed();
+    if (settings.contains('='))
+    {
+        portName = settings.section('=', 0, 0).trimmed();
+        settings = settings.section('=', 1).trimmed();
+    }
+    QStringList fields = settings.split(',');
+    SerialParameters params = DefaultSerialParameters();
+    bool ok = true;
+    if (fields[0].trimmed().toLower() == "probe")
+        params.probe = true;
+    else
+        params.baudRate = fields[0].trimmed().toInt(&ok);
+    if (ok && (fields.size() > 1))
+        ok = ParseFormat(fields[1].trimmed(), &params);
+    if (ok && (fields.size() > 2))
+    {
+        QString flow = fields[2].trimmed().toLower();
+        if (flow == "hardware")
+            params.flowControl = QSerialPort::HardwareControl;
+        else if (flow == "software")
+            params.flowControl = QSerialPort::SoftwareControl;
+        else
+            ok = (flow == "none");
+    }
+    if (!ok || (params.baudRate <= 0) || (fields.size() > 3))
+    {
+        qCritical("Serial settings \"%s\" not recognized.", qUtf8Printable(spec));
+        qDebug("Return false");
+        return false;
+    }
+    if (portName.isEmpty())
+        DefaultParameters = params;
+    else
+        PortParameters.insert(portName, params);
+    qDebug("Return true");
+    return true;
+}
+
+/*!
+ * \brief SerialParametersFor -- Settings to use for a port.
+ * \param portName  Name of the serial device.
+ * \return The settings given for the port, or the default settings.
+ */
+SerialParameters SerialParametersFor(const QString &portName)
+{
+    return PortParameters.value(portName, DefaultParameters);
+}
+
+void ApplySerialParameters(QSerialPort *serialPort, const SerialParameters &params)
+{
+    serialPort->setFlowControl(params.flowControl);
+    serialPort->setBaudRate(params.baudRate);
+    serialPort->setDataBits(params.dataBits);
+    serialPort->setParity(params.parity);
+    serialPort->setStopBits(params.stopBits);
+}
+
+/*!
+ * \brief DescribeSerialPort -- Describe a port's settings, e.g. "9600 baud 7E1".
+ * \param serialPort    The port.
+ * \return The description.
+ */
+QString DescribeSerialPort(const QSerialPort *serialPort)
+{
+    const char parity = (serialPort->parity() == QSerialPort::NoParity) ? 'N'
+                      : (serialPort->parity() == QSerialPort::OddParity) ? 'O' : 'E';
+    return QString("%1 baud %2%3%4").arg(serialPort->baudRate()).arg((int)serialPort->dataBits())
+            .arg(parity).arg((serialPort->stopBits() == QSerialPort::TwoStop) ? 2 : 1);
+}
+
+/*!
+ * \brief SerialCharUSecs -- Time one character takes on the line at a port's settings.
+ *
+ * A character is a start bit, the data bits, a parity bit if any, and the
+ * stop bits: 10 bits for EKM's 7E1, so 1042 usec at 9600 baud.
+ *
+ * \param serialPort    The port.
+ * \return Microseconds per character.
+ */
+qint64 SerialCharUSecs(const QSerialPort *serialPort)
+{
+    int bits = 1 + serialPort->dataBits()
+            + ((serialPort->parity() == QSerialPort::NoParity) ? 0 : 1)
+            + ((serialPort->stopBits() == QSerialPort::OneStop) ? 1 : 2);
+    qint32 baud = serialPort->baudRate();
+    if (baud <= 0)
+        baud = 9600;
+    return (bits * 1000000ll + baud - 1) / baud;
+}
@@ -0,0 +1,66 @@
+/*!
+@file
+@brief Header file describing the settings of each serial port.
+
+EKM meters talk at 9600 baud, 7 data bits, even parity, 1 stop bit, which
+is what every port uses unless told otherwise.  Some converters and newer
+meters can go faster, so the settings can be given per port with
+--serial-settings, as
+
+    [<device>=]<baud>[,<format>[,<flow>]]
+
+where <baud> is a rate or "probe", <format> is e.g. 7E1 or 8N1, and <flow>
+is none, hardware or software.  Without a device the settings are the
+default for all ports.  With "probe" each rate in SerialProbeRates, fastest
+first, is tried against the first meter on the port, and the first rate at
+which SerialProbeReads responses in a row have good CRCs is kept.
+
+Response timing (the time to wait for the rest of a response, what counts
+as a gap) is worked out from the port's settings by SerialCharUSecs().
+
+@author Thomas A. DeMay
+@date 2015
+@par    Copyright (C) 2015  Thomas A. DeMay
+@par
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    any later version.
+@par
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+@par
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#ifndef SERIALPARAMS_H
+#define SERIALPARAMS_H
+#include <QtCore>
+#include <QtSerialPort>
+
+static const qint32 SerialProbeRates[] = {115200, 57600, 38400, 19200, 9600};   //!< Rates tried by a probe, fastest first.
+static const int SerialProbeReads = 3;              //!< Good responses in a row needed to keep a rate.
+static const int SerialProbeTimeoutMSecs = 1000;    //!< Wait this long for a response while probing.
+
+typedef struct
+{
+    qint32 baudRate;                    //!< Bits per second.
+    QSerialPort::DataBits dataBits;     //!< Data bits per character.
+    QSerialPort::Parity parity;         //!< Parity.
+    QSerialPort::StopBits stopBits;     //!< Stop bits.
+    QSerialPort::FlowControl flowControl;   //!< Flow control.
+    bool probe;                         //!< Find the fastest rate that works when the port is opened.
+} SerialParameters;
+
+SerialParameters DefaultSerialParameters();
+bool AddSerialSettings(const QString &spec);
+SerialParameters SerialParametersFor(const QString &portName);
+void ApplySerialParameters(QSerialPort *serialPort, const SerialParameters &params);
+QString DescribeSerialPort(const QSerialPort *serialPort);
+qint64 SerialCharUSecs(const QSerialPort *serialPort);
+
+#endif // SERIALPARAMS_H
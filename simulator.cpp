@@ -0,0 +1,606 @@
+/*!
+@file
+@brief Polling simulator, for capacity planning.
+
+@author Thomas A. DeMay
+@date 2015
+@par    Copyright (C) 2015  Thomas A. DeMay
+@par
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    any later version.
+@par
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+@par
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include "simulator.h"
+#include "virtualclock.h"
+#include "serialparams.h"
+#include "frameparser.h"
+#include "meterreading.h"
+#include "messages.h"
+#include <algorithm>
+
+extern QMap<QString, QSerialPort *> SerialPorts;
+extern QTimeZone LocalStandardTimeZone;
+QList<MeterReading> PollMeter(MeterEntry &entry, QSerialPort *serialPort);
+void ServicePendingTimeSets(QList<MeterEntry> &fleet, const qint64 deadline);
+uint16_t computeEkmCrc(const uint8_t *dat, uint16_t len);
+
+static const int SimMeterIdOffset = 4;          //!< Index of the meter id in a response.
+static const int SimTotalKwhOffset = 16;        //!< Index of totalKwh in a response.
+static const int SimV3DateTimeOffset = 172;     //!< Index of the date and time in a v.3 response.
+static const int SimV4DateTimeOffset = 233;     //!< Index of the date and time in a v.4 response.
+static const int SimOutStateOffset = 229;       //!< Index of the output state in a v.4 A response.
+static const int SimFixedEndOffset = 249;       //!< Index of the fixed end of a response.
+static const int SimCrcOffset = 253;            //!< Index of the CRC of a response.
+
+SimulatedBusPort::SimulatedBusPort(const QString &deviceName, const SimulationModel &meterModel)
+    : model(meterModel)
+    , charUSecs(1042)
+    , pendingStartUSecs(0)
+    , consumed(0)
+    , messages(0)
+    , unanswered(0)
+    , badCrcs(0)
+    , bytesSent(0)
+    , bytesAnswered(0)
+{
+    setPortName(deviceName);
+}
+
+/*!
+ * \brief SimulatedBusPort::addMeter -- Put a meter on the bus.
+ * \param config    The meter.
+ */
+void SimulatedBusPort::addMeter(const MeterConfig &config)
+{
+    Meter meter;
+    meter.protocolVersion = config.protocolVersion;
+    meter.kwh = 0;
+    meter.clockSetUSecs = SimClock.nowUSecs();
+    meter.outBits = 0;
+    meters.insert(config.meterId.toLatin1(), meter);
+}
+
+/*!
+ * \brief SimulatedBusPort::open -- Open the port; no device is opened.
+ *
+ * The time of a character is taken from the settings applied before opening.
+ *
+ * \param mode  Mode to open in.
+ * \return true.
+ */
+bool SimulatedBusPort::open(OpenMode mode)
+{
+    charUSecs = SerialCharUSecs(this);
+    return QIODevice::open(mode | QIODevice::Unbuffered);
+}
+
+void SimulatedBusPort::close()
+{
+    if (isOpen())
+        QIODevice::close();
+}
+
+/*!
+ * \brief SimulatedBusPort::arrived -- Bytes of the answer to the last message that have arrived by now.
+ * \return The count.
+ */
+int SimulatedBusPort::arrived() const
+{
+    if (pending.isEmpty() || (SimClock.nowUSecs() < pendingStartUSecs))
+        return 0;
+    return (int)qMin((qint64)pending.size(), (SimClock.nowUSecs() - pendingStartUSecs) / charUSecs);
+}
+
+qint64 SimulatedBusPort::bytesAvailable() const
+{
+    return (arrived() - consumed) + QIODevice::bytesAvailable();
+}
+
+/*!
+ * \brief SimulatedBusPort::waitForReadyRead -- Move the virtual clock on till a byte arrives, or msecs pass.
+ * \param msecs     Longest time to wait.
+ * \return true if bytes are readable, false otherwise.
+ */
+bool SimulatedBusPort::waitForReadyRead(int msecs)
+{
+    if (arrived() > consumed)
+        return true;
+    const qint64 limit = msecs * 1000ll;
+    if (consumed < pending.size())
+    {
+        const qint64 due = pendingStartUSecs + (consumed + 1) * charUSecs;
+        if ((due - SimClock.nowUSecs()) <= limit)
+        {
+            SimClock.advanceTo(due);
+            return true;
+        }
+    }
+    SimClock.advance(limit);
+    return false;
+}
+
+bool SimulatedBusPort::waitForBytesWritten(int msecs)
+{
+    Q_UNUSED(msecs);
+    return true;
+}
+
+qint64 SimulatedBusPort::readData(char *data, qint64 maxSize)
+{
+    const qint64 count = qMin(maxSize, (qint64)(arrived() - consumed));
+    memcpy(data, pending.constData() + consumed, count);
+    consumed += (int)count;
+    return count;
+}
+
+/*!
+ * \brief SimulatedBusPort::writeData -- Send a message to the meters; the virtual clock moves on by its time on the line.
+ *
+ * Whatever was left of the answer to the last message is dropped, as the
+ * meter stops answering when it hears a new message.
+ *
+ * \param data      The message.
+ * \param maxSize   Its size.
+ * \return The size.
+ */
+qint64 SimulatedBusPort::writeData(const char *data, qint64 maxSize)
+{
+    bytesAnswered += arrived();
+    SimClock.advance(maxSize * charUSecs);
+    bytesSent += maxSize;
+    messages++;
+    pending = answer(QByteArray(data, (int)maxSize));
+    consumed = 0;
+    pendingStartUSecs = SimClock.nowUSecs()
+            + (qint64)((model.turnaroundMSecs + model.jitterMSecs * qrand() / RAND_MAX) * 1000.0);
+    return maxSize;
+}
+
+/*!
+ * \brief SimulatedBusPort::reply -- What the meters answer to a message, for the gateway stand-in.
+ *
+ * The virtual clock is not moved on; the caller waits for real.
+ *
+ * \param message       The message.
+ * \param delayUSecs    Receives the time from the end of the message to the start of the answer.
+ * \return The answer; empty if none.
+ */
+QByteArray SimulatedBusPort::reply(const QByteArray &message, qint64 *delayUSecs)
+{
+    bytesSent += message.size();
+    messages++;
+    QByteArray answered = answer(message);
+    bytesAnswered += answered.size();
+    *delayUSecs = (qint64)((model.turnaroundMSecs + model.jitterMSecs * qrand() / RAND_MAX) * 1000.0);
+    return answered;
+}
+
+/*!
+ * \brief SimulatedBusPort::chance -- Whether something that happens at a rate happens this time.
+ * \param rate  Fraction of the times it happens.
+ * \return true if it happens.
+ */
+bool SimulatedBusPort::chance(const double rate) const
+{
+    return (rate > 0) && (((double)qrand() / RAND_MAX) < rate);
+}
+
+/*!
+ * \brief SimulatedBusPort::answer -- What the meters on the bus answer to a message.
+ *
+ * A data request opens the meter it names, which answers with a response;
+ * the close message closes it.  While a meter is open it acknowledges
+ * anything else, setting its clock to a set time message and its outputs to
+ * an output control message.
+ *
+ * \param message   The message.
+ * \return The answer; empty if none.
+ */
+QByteArray SimulatedBusPort::answer(const QByteArray &message)
+{
+    const uint8_t *bytes = (const uint8_t *)message.constData();
+    uint8_t dataType = 0;
+    if ((message.size() == (int)sizeof(RequestMsgV4Def)) && (memcmp(bytes, RequestMsgV4.fixedBegin, sizeof(RequestMsgV4.fixedBegin)) == 0))
+        dataType = (bytes[offsetof(RequestMsgV4Def, reqType) + 1] == '1') ? 'B' : 'A';
+    else if ((message.size() == (int)sizeof(RequestMsgV3Def)) && (memcmp(bytes, RequestMsgV3.fixedBegin, sizeof(RequestMsgV3.fixedBegin)) == 0))
+        dataType = '3';
+    if (dataType != 0)
+    {
+        QByteArray meterId = message.mid(offsetof(RequestMsgV4Def, meterId), sizeof(RequestMsgV4.meterId));
+        selected.clear();
+        if (!meters.contains(meterId))
+            return QByteArray();
+        selected = meterId;
+        if (chance(model.noResponseRate))
+        {
+            unanswered++;
+            return QByteArray();
+        }
+        return makeFrame(meterId, meters[meterId], dataType);
+    }
+    if ((message.size() == (int)sizeof(CloseString)) && (memcmp(bytes, CloseString, sizeof(CloseString)) == 0))
+    {
+        selected.clear();
+        return QByteArray();
+    }
+    if (selected.isEmpty())
+        return QByteArray();
+    if (chance(model.noResponseRate))
+    {
+        unanswered++;
+        return QByteArray();
+    }
+    Meter &meter = meters[selected];
+    if (message.size() == (int)sizeof(SetTimeMsgDef))
+        meter.clockSetUSecs = SimClock.nowUSecs();
+    else if (message.size() == (int)sizeof(OutputControlDef))
+    {
+        /* Output 1 is bit 1, output 2 bit 0, as in the outState of an A response. */
+        const OutputControlDef *control = (const OutputControlDef *)bytes;
+        int bit = (control->relayNum[0] == '1') ? 2 : 1;
+        if (control->newState[0] == '1')
+            meter.outBits |= bit;
+        else
+            meter.outBits &= ~bit;
+    }
+    return QByteArray((const char *)ResponseAck, sizeof(ResponseAck));
+}
+
+/*!
+ * \brief SimulatedBusPort::makeFrame -- A response of a meter as it is now.
+ *
+ * The fields are zeros but for the meter id, a totalKwh that counts up, the
+ * meter's date and time, which drift from the virtual clock since it was last
+ * set, and the output state.
+ *
+ * \param meterId   Full 12 character serial number of the meter.
+ * \param meter     The meter.
+ * \param dataType  'A', 'B' or '3'.
+ * \return The response; its CRC is bad at the rate given by the model.
+ */
+QByteArray SimulatedBusPort::makeFrame(const QByteArray &meterId, Meter &meter, const uint8_t dataType)
+{
+    QByteArray frame(FrameSize, '0');
+    frame[0] = '\x02';
+    frame.replace(SimMeterIdOffset, meterId.size(), meterId);
+    meter.kwh += qrand() % 10;
+    frame.replace(SimTotalKwhOffset, 8, QString("%1").arg(meter.kwh % 100000000ll, 8, 10, QChar('0')).toLatin1());
+
+    const qint64 now = SimClock.nowUSecs();
+    const qint64 meterUSecs = now + (qint64)((now - meter.clockSetUSecs) * model.driftSecsPerDay / 86400.0);
+    QDateTime meterTime = QDateTime::fromMSecsSinceEpoch(meterUSecs / 1000).toTimeZone(LocalStandardTimeZone);
+    QByteArray dateTime = meterTime.toString("yyMMdd00HHmmss").toLatin1();
+    int dow = (meterTime.date().dayOfWeek() % 7) + 1;  // Convert Qt's week day number to EKM's.
+    dateTime[7] = (char)('0' + dow);
+    frame.replace((dataType == '3') ? SimV3DateTimeOffset : SimV4DateTimeOffset, dateTime.size(), dateTime);
+    if (dataType == 'A')
+        frame[SimOutStateOffset] = (char)('1' + meter.outBits);
+    frame.replace(SimFixedEndOffset, 4, QByteArray("!\r\n\x03", 4));
+
+    uint16_t crc = computeEkmCrc((const uint8_t *)frame.constData() + 1, SimCrcOffset - 1);
+    frame[SimCrcOffset] = (char)(crc >> 8);
+    frame[SimCrcOffset + 1] = (char)(crc & 0xff);
+    if (chance(model.badCrcRate))
+    {
+        badCrcs++;
+        frame[SimTotalKwhOffset] = (frame[SimTotalKwhOffset] == '9') ? '8' : '9';
+    }
+    return frame;
+}
+
+/*!
+ * \brief SimulatedBusPort::lineUSecs -- Time the line has carried bytes.
+ * \return Usec.
+ */
+qint64 SimulatedBusPort::lineUSecs() const
+{
+    return (bytesSent + bytesAnswered + arrived()) * charUSecs;
+}
+
+/*!
+ * \brief SimulatedBusPort::statistics -- Summary of the traffic on the bus.
+ * \param elapsedUSecs  Time simulated.
+ * \param heldUSecs     Time the bus was held by passes over the meters.
+ * \return The summary.
+ */
+QString SimulatedBusPort::statistics(const qint64 elapsedUSecs, const qint64 heldUSecs) const
+{
+    const double elapsed = qMax((qint64)1, elapsedUSecs);
+    return QString("%1: %2 meters, %3 messages, %4 bytes sent, %5 bytes answered, %6 unanswered, %7 bad CRCs;"
+                   " line busy %8%, held by passes %9%")
+            .arg(portName()).arg(meters.size()).arg(messages).arg(bytesSent).arg(bytesAnswered + arrived())
+            .arg(unanswered).arg(badCrcs)
+            .arg(100.0 * lineUSecs() / elapsed, 0, 'f', 2)
+            .arg(100.0 * heldUSecs / elapsed, 0, 'f', 2);
+}
+
+/*!
+ * \brief RunGatewayStandIn -- Answer for simulated meters on a local TCP port, as a serial to TCP gateway would.
+ *
+ * The virtual clock is started and kept at the real time, so the meters'
+ * clocks drift as the model says.  A message is taken to have ended when
+ * nothing more arrives for SimStandInIdleMSecs.
+ *
+ * \param fleet     The meters; the character time is that of the port of the first.
+ * \param tcpPort   TCP port to listen on, on the loopback interface.
+ * \param model     How the meters behave.
+ * \return Program exit status.
+ */
+int RunGatewayStandIn(const QList<MeterConfig> &fleet, const quint16 tcpPort, const SimulationModel &model)
+{
+    qDebug("Begin");
+    qsrand(model.seed);
+    QElapsedTimer realTime;
+    realTime.start();
+    const qint64 startUSecs = QDateTime::currentMSecsSinceEpoch() * 1000ll;
+    SimClock.start(startUSecs);
+
+    SimulatedBusPort bus(fleet.first().portName, model);
+    ApplySerialParameters(&bus, SerialParametersFor(fleet.first().portName));
+    bus.open(QIODevice::ReadWrite);
+    foreach (const MeterConfig &config, fleet)
+        bus.addMeter(config);
+    const qint64 charUSecs = SerialCharUSecs(&bus);
+
+    QTcpServer server;
+    if (!server.listen(QHostAddress::LocalHost, tcpPort))
+    {
+        qCritical("Unable to listen on TCP port %u:  %s.  Return 1", tcpPort, qUtf8Printable(server.errorString()));
+        return 1;
+    }
+    qInfo("Standing in for a gateway to %d meters on TCP port %u.", fleet.size(), tcpPort);
+    while (server.waitForNewConnection(-1))
+    {
+        QTcpSocket *link = server.nextPendingConnection();
+        qInfo("Connection from %s.", qUtf8Printable(link->peerAddress().toString()));
+        while (link->state() == QAbstractSocket::ConnectedState)
+        {
+            if ((link->bytesAvailable() == 0) && !link->waitForReadyRead(1000))
+                continue;
+            QByteArray message = link->readAll();
+            while (link->waitForReadyRead(SimStandInIdleMSecs))
+                message += link->readAll();
+            SimClock.advanceTo(startUSecs + realTime.nsecsElapsed() / 1000);
+            qint64 delayUSecs;
+            QByteArray answer = bus.reply(message, &delayUSecs);
+            if (answer.isEmpty())
+                continue;
+            QThread::usleep(delayUSecs);
+            for (int sent = 0; (sent < answer.size()) && (link->state() == QAbstractSocket::ConnectedState); sent += SimStandInChunkBytes)
+            {
+                const int count = qMin(SimStandInChunkBytes, answer.size() - sent);
+                QThread::usleep(count * charUSecs);
+                link->write(answer.constData() + sent, count);
+                link->waitForBytesWritten(1000);
+            }
+        }
+        qInfo("Connection closed.  %s", qUtf8Printable(bus.statistics(realTime.nsecsElapsed() / 1000, 0)));
+        delete link;
+    }
+    qCritical("Unable to accept a connection:  %s.  Return 1", qUtf8Printable(server.errorString()));
+    return 1;
+}
+
+/*!
+ * \brief ParseSimulationModel -- Read the meter model from --sim-model.
+ * \param spec      Comma separated key=value pairs; see simulator.h.  Keys not given keep their defaults.
+ * \param model     Receives the model.
+ * \return true if successful, false otherwise.
+ */
+bool ParseSimulationModel(const QString &spec, SimulationModel *model)
+{
+    qDebug("Begin");
+    model->turnaroundMSecs = SimDefaultTurnaroundMSecs;
+    model->jitterMSecs = SimDefaultJitterMSecs;
+    model->noResponseRate = SimDefaultNoResponseRate;
+    model->badCrcRate = SimDefaultBadCrcRate;
+    model->driftSecsPerDay = 0;
+    model->seed = 1;
+    bool ok = true;
+    foreach (QString pair, spec.split(',', QString::SkipEmptyParts))
+    {
+        QString key = pair.section('=', 0, 0).trimmed().toLower();
+        QString value = pair.section('=', 1).trimmed();
+        bool valueOk = false;
+        if (key == "turnaround")
+            model->turnaroundMSecs = value.toDouble(&valueOk);
+        else if (key == "jitter")
+            model->jitterMSecs = value.toDouble(&valueOk);
+        else if (key == "noresponse")
+            model->noResponseRate = value.toDouble(&valueOk);
+        else if (key == "badcrc")
+            model->badCrcRate = value.toDouble(&valueOk);
+        else if (key == "drift")
+            model->driftSecsPerDay = value.toDouble(&valueOk);
+        else if (key == "seed")
+            model->seed = value.toUInt(&valueOk);
+        ok = ok && valueOk;
+    }
+    if (!ok || (model->turnaroundMSecs < 0) || (model->jitterMSecs < 0)
+            || (model->noResponseRate < 0) || (model->noResponseRate > 1)
+            || (model->badCrcRate < 0) || (model->badCrcRate > 1))
+    {
+        qCritical("Simulation model \"%s\" not recognized.", qUtf8Printable(spec));
+        qDebug("Return false");
+        return false;
+    }
+    qDebug("Return true");
+    return true;
+}
+
+/*!
+ * \brief Percentile -- A percentile of sorted values.
+ * \param sorted    The values, in ascending order; not empty.
+ * \param percent   Which percentile.
+ * \return The value.
+ */
+static qint64 Percentile(const QVector<qint64> &sorted, const int percent)
+{
+    return sorted[(int)((sorted.size() - 1) * (qint64)percent / 100)];
+}
+
+/*!
+ * \brief Distribution -- Summary of some times.
+ * \param usecs     The times, in usec; sorted in place.
+ * \return min, mean, percentiles and max in msec.
+ */
+static QString Distribution(QVector<qint64> &usecs)
+{
+    if (usecs.isEmpty())
+        return QString("none");
+    std::sort(usecs.begin(), usecs.end());
+    double sum = 0;
+    foreach (qint64 u, usecs)
+        sum += u;
+    return QString("min %1, mean %2, p50 %3, p90 %4, p99 %5, max %6 msec")
+            .arg(usecs.first() / 1000.0, 0, 'f', 1)
+            .arg(sum / usecs.size() / 1000.0, 0, 'f', 1)
+            .arg(Percentile(usecs, 50) / 1000.0, 0, 'f', 1)
+            .arg(Percentile(usecs, 90) / 1000.0, 0, 'f', 1)
+            .arg(Percentile(usecs, 99) / 1000.0, 0, 'f', 1)
+            .arg(usecs.last() / 1000.0, 0, 'f', 1);
+}
+
+typedef struct
+{
+    int polls;                      //!< Times the meter was polled.
+    int samples;                    //!< A (or v.3) responses got.
+    int badCrcs;                    //!< Of them, with a bad CRC.
+    qint64 lastCaptureUSecs;        //!< When the last was captured; 0 if none yet.
+    QVector<qint64> offsetUSecs;    //!< How long after the interval boundary each was captured.
+    QVector<qint64> deviationUSecs; //!< How far each time between samples strayed from the interval.
+} SimMeterStats;
+
+/*!
+ * \brief RunSimulation -- Read the fleet on simulated ports and the virtual clock, and report the timing.
+ *
+ * The fleet is read at each interval boundary with PollMeter(), then meter
+ * times are set in what is left of the interval with ServicePendingTimeSets(),
+ * as when reading meters.  Readings are not stored.  The serial ports are made
+ * here, and put in SerialPorts for the transactions to find.
+ *
+ * \param fleet     The meters.
+ * \param interval  Minutes between reads; must be positive.
+ * \param hours     Simulated time to run for.
+ * \param model     How the meters behave.
+ * \return Program exit status.
+ */
+int RunSimulation(QList<MeterEntry> &fleet, const int interval, const double hours, const SimulationModel &model)
+{
+    qDebug("Begin");
+    QLoggingCategory::setFilterRules("*.debug=false\n*.info=false\n*.warning=false");
+    qsrand(model.seed);
+    const qint64 intervalUSecs = interval * 60000000ll;
+    const qint64 startUSecs = (QDateTime::currentMSecsSinceEpoch() * 1000ll / intervalUSecs + 1) * intervalUSecs;
+    const qint64 endUSecs = startUSecs + (qint64)(hours * 3600e6);
+    SimClock.start(startUSecs);
+
+    QMap<QString, SimulatedBusPort *> ports;
+    foreach (const MeterEntry &entry, fleet)
+    {
+        const QString &portName = entry.config.portName;
+        if (!ports.contains(portName))
+        {
+            SimulatedBusPort *port = new SimulatedBusPort(portName, model);
+            ApplySerialParameters(port, SerialParametersFor(portName));
+            port->open(QIODevice::ReadWrite);
+            ports.insert(portName, port);
+            SerialPorts.insert(portName, port);
+        }
+        ports[portName]->addMeter(entry.config);
+    }
+
+    QVector<qint64> passUSecs;
+    QHash<QString, qint64> heldUSecs;
+    QHash<QString, SimMeterStats> meterStats;
+    int overruns = 0;
+    qint64 missedIntervals = 0;
+    qint64 timeSetUSecs = 0;
+    QElapsedTimer realTime;
+    realTime.start();
+    qint64 boundary = startUSecs;
+    while (boundary < endUSecs)
+    {
+        SimClock.advanceTo(boundary);
+        for (int i = 0; i < fleet.size(); i++)
+        {
+            MeterEntry &entry = fleet[i];
+            const qint64 began = SimClock.nowUSecs();
+            QList<MeterReading> readings = PollMeter(entry, ports[entry.config.portName]);
+            heldUSecs[entry.config.portName] += SimClock.nowUSecs() - began;
+            SimMeterStats &stats = meterStats[entry.config.meterId];
+            stats.polls++;
+            foreach (const MeterReading &reading, readings)
+            {
+                if (reading.dataType == 'B')
+                    continue;
+                const qint64 capture = reading.captureTime.wallUSecs;
+                stats.samples++;
+                if (!reading.crcValid)
+                    stats.badCrcs++;
+                stats.offsetUSecs.append(capture - boundary);
+                if (stats.lastCaptureUSecs > 0)
+                    stats.deviationUSecs.append(qAbs(capture - stats.lastCaptureUSecs - intervalUSecs));
+                stats.lastCaptureUSecs = capture;
+            }
+        }
+        const qint64 passEnd = SimClock.nowUSecs();
+        passUSecs.append(passEnd - boundary);
+        qint64 next = boundary + intervalUSecs;
+        if (passEnd > next)
+        {
+            overruns++;
+            next = (passEnd / intervalUSecs + 1) * intervalUSecs;
+            missedIntervals += (next - boundary) / intervalUSecs - 1;
+        }
+        ServicePendingTimeSets(fleet, next / 1000);
+        timeSetUSecs += SimClock.nowUSecs() - passEnd;
+        boundary = next;
+    }
+    const qint64 elapsedUSecs = SimClock.nowUSecs() - startUSecs;
+    const qint64 realMSecs = realTime.elapsed();
+
+    QTextStream out(stdout);
+    out << QString("Simulated %1 hours of polling %2 meters on %3 ports every %4 minutes in %5 sec.\n")
+           .arg(elapsedUSecs / 3600e6, 0, 'f', 2).arg(fleet.size()).arg(ports.size()).arg(interval)
+           .arg(realMSecs / 1000.0, 0, 'f', 2);
+    out << QString("Meter model: turnaround %1 msec + 0 to %2 msec, %3 unanswered, %4 bad CRCs, drift %5 sec/day, seed %6.\n")
+           .arg(model.turnaroundMSecs).arg(model.jitterMSecs).arg(model.noResponseRate).arg(model.badCrcRate)
+           .arg(model.driftSecsPerDay).arg(model.seed);
+    const int passes = passUSecs.size();
+    out << QString("Passes: %1; %2; %3 overran the interval, %4 intervals missed; %5 sec setting meter times.\n")
+           .arg(passes).arg(Distribution(passUSecs)).arg(overruns).arg(missedIntervals)
+           .arg(timeSetUSecs / 1e6, 0, 'f', 1);
+    foreach (SimulatedBusPort *port, ports)
+        out << port->statistics(elapsedUSecs, heldUSecs.value(port->portName())) << "\n";
+    for (int i = 0; i < fleet.size(); i++)
+    {
+        const MeterEntry &entry = fleet[i];
+        SimMeterStats &stats = meterStats[entry.config.meterId];
+        out << QString("%1: %2 samples of %3 polls, %4 bad CRCs, %5 time sets.\n")
+               .arg(entry.config.meterId).arg(stats.samples).arg(stats.polls).arg(stats.badCrcs)
+               .arg(entry.clockSkew.timeSetCount());
+        out << QString("    captured after boundary: %1\n").arg(Distribution(stats.offsetUSecs));
+        out << QString("    sample interval jitter:  %1\n").arg(Distribution(stats.deviationUSecs));
+    }
+    out.flush();
+
+    foreach (SimulatedBusPort *port, ports)
+    {
+        SerialPorts.remove(port->portName());
+        delete port;
+    }
+    qDebug("Return 0");
+    return 0;
+}
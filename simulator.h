@@ -0,0 +1,157 @@
+/*!
+@file
+@brief Header file describing the polling simulator, for capacity planning.
+
+Before meters are added to a bus it is worth knowing whether a pass over
+them will still fit in the interval.  --simulate <hours> answers that
+without a bus: the fleet (from --fleet-config or the command line, with
+--serial-settings) is read for that many hours of simulated time, and the
+timing of the passes is reported.
+
+The polling is the program's own: PollMeter(), with its requests, retries,
+frame parsing, A to B ratio, closes and output controls, and the time sets
+of ServicePendingTimeSets(), run as they run against real meters.  Only the
+ports and the clock are simulated:
+
+ - each serial port is a SimulatedBusPort, a QSerialPort that answers the
+   meters' requests as the meters on it would.  A character takes the time
+   it takes on the line at the port's settings (1042 usec at 9600 baud 7E1);
+   a meter starts answering a message a turnaround time after it ends, plus
+   a random jitter, and fails to answer, or answers with a bad CRC, at the
+   rates given;
+ - time is the virtual clock (virtualclock.h), moved on by the waits the
+   program makes instead of waiting, so a simulated hour takes milliseconds.
+
+Passes start at the interval boundaries as they do when reading meters; a
+pass that runs past the next boundary makes the program miss it.  At the
+end the report gives:
+
+ - the distribution of pass times and the number of overruns and missed
+   intervals;
+ - for each port, the fraction of the time the line carried bytes, and the
+   fraction it was held by passes;
+ - for each meter, the responses got and missed, and the sample jitter: how
+   far after the interval boundary each A (or v.3) response was captured,
+   and how far the time between samples strayed from the interval.
+
+The meter model is given with --sim-model as comma separated key=value
+pairs:
+
+    turnaround=<msec>   delay before a meter answers (SimDefaultTurnaroundMSecs)
+    jitter=<msec>       random addition to it, 0 to this (SimDefaultJitterMSecs)
+    noresponse=<rate>   fraction of messages not answered (SimDefaultNoResponseRate)
+    badcrc=<rate>       fraction of responses with a bad CRC (SimDefaultBadCrcRate)
+    drift=<sec/day>     meter clock drift, so time sets happen (0)
+    seed=<n>            random seed, so runs can be repeated (1)
+
+Debug, info and warning messages are turned off while simulating; the
+report is written to stdout.
+
+--gateway-standin <tcp port> puts the same simulated meters behind a local
+TCP port instead, in real time, as a serial to TCP gateway would: a
+tcp:localhost:<tcp port> port (tcpgateway.h) can then be read against it.
+Each message that arrives is answered by the meter it names after the
+turnaround time of the model, at the speed of the line given by the port's
+--serial-settings, so a long turnaround leaves late responses in the
+connection.  It runs till interrupted, one connection at a time.
+
+@author Thomas A. DeMay
+@date 2015
+@par    Copyright (C) 2015  Thomas A. DeMay
+@par
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    any later version.
+@par
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+@par
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#ifndef SIMULATOR_H
+#define SIMULATOR_H
+#include <QtCore>
+#include <QtSerialPort>
+#include <QtNetwork>
+#include "fleetconfig.h"
+
+static const double SimDefaultTurnaroundMSecs = 50.0;   //!< Default meter turnaround.
+static const double SimDefaultJitterMSecs = 20.0;       //!< Default turnaround jitter.
+static const double SimDefaultNoResponseRate = 0.01;    //!< Default fraction of messages not answered.
+static const double SimDefaultBadCrcRate = 0.002;       //!< Default fraction of responses with a bad CRC.
+static const int SimStandInIdleMSecs = 20;              //!< Quiet time that ends a message to the gateway stand-in.
+static const int SimStandInChunkBytes = 16;             //!< Bytes of an answer the gateway stand-in sends at a time.
+
+typedef struct
+{
+    double turnaroundMSecs;     //!< Delay from the end of a message to the first byte of the answer.
+    double jitterMSecs;         //!< Random addition to the turnaround, 0 to this.
+    double noResponseRate;      //!< Fraction of messages not answered.
+    double badCrcRate;          //!< Fraction of responses with a bad CRC.
+    double driftSecsPerDay;     //!< Meter clock drift.
+    uint seed;                  //!< Random seed.
+} SimulationModel;
+
+/*!
+ * \brief The SimulatedBusPort class -- A serial port with simulated meters on it, on the virtual clock.
+ */
+class SimulatedBusPort : public QSerialPort
+{
+public:
+    SimulatedBusPort(const QString &deviceName, const SimulationModel &meterModel);
+
+    void addMeter(const MeterConfig &config);
+
+    bool open(OpenMode mode) Q_DECL_OVERRIDE;
+    void close() Q_DECL_OVERRIDE;
+    qint64 bytesAvailable() const Q_DECL_OVERRIDE;
+    bool waitForReadyRead(int msecs) Q_DECL_OVERRIDE;
+    bool waitForBytesWritten(int msecs) Q_DECL_OVERRIDE;
+
+    QByteArray reply(const QByteArray &message, qint64 *delayUSecs);
+    qint64 lineUSecs() const;
+    QString statistics(const qint64 elapsedUSecs, const qint64 heldUSecs) const;
+
+protected:
+    qint64 readData(char *data, qint64 maxSize) Q_DECL_OVERRIDE;
+    qint64 writeData(const char *data, qint64 maxSize) Q_DECL_OVERRIDE;
+
+private:
+    typedef struct
+    {
+        int protocolVersion;    //!< 3 or 4.
+        qint64 kwh;             //!< totalKwh register.
+        qint64 clockSetUSecs;   //!< When the meter clock was last set, on the virtual clock.
+        int outBits;            //!< Output states: bit 1 => output 1 ON, bit 0 => output 2 ON.
+    } Meter;
+
+    QByteArray answer(const QByteArray &message);
+    QByteArray makeFrame(const QByteArray &meterId, Meter &meter, const uint8_t dataType);
+    int arrived() const;
+    bool chance(const double rate) const;
+
+    SimulationModel model;              //!< How the meters behave.
+    QHash<QByteArray, Meter> meters;    //!< Meters on the bus, by 12 character id.
+    QByteArray selected;                //!< Meter a request opened, till closed.
+    qint64 charUSecs;                   //!< Time of a character on the line.
+    QByteArray pending;                 //!< Answer to the last message.
+    qint64 pendingStartUSecs;           //!< When its first byte starts to arrive.
+    int consumed;                       //!< Bytes of it read.
+    qint64 messages;                    //!< Messages written.
+    qint64 unanswered;                  //!< Messages a meter chose not to answer.
+    qint64 badCrcs;                     //!< Responses sent with a bad CRC.
+    qint64 bytesSent;                   //!< Bytes written to the bus.
+    qint64 bytesAnswered;               //!< Bytes meters put on the bus before the last message.
+};
+
+int RunSimulation(QList<MeterEntry> &fleet, const int interval, const double hours, const SimulationModel &model);
+int RunGatewayStandIn(const QList<MeterConfig> &fleet, const quint16 tcpPort, const SimulationModel &model);
+bool ParseSimulationModel(const QString &spec, SimulationModel *model);
+
+#endif // SIMULATOR_H
@@ -0,0 +1,243 @@
+/*!
+@file
+@brief Store meter readings in a local SQLite database.
+
+Tables are named and laid out like the MySQL tables.  ComputerTime is
+stored as UTC text with microseconds ("yyyy-MM-dd HH:mm:ss.uuuuuu"),
+MeterTime as the meter's local standard time ("yyyy-MM-dd HH:mm:ss").
+
+@author Thomas A. DeMay
+@date 2015
+@par    Copyright (C) 2015  Thomas A. DeMay
+@par
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    any later version.
+@par
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+@par
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include "storagesink.h"
+#include "meterfields.h"
+#include "tracer.h"
+#include "../SupportRoutines/supportfunctions.h"
+
+SqliteSink::SqliteSink(const QString &fileName, const bool packedFrames)
+    : databaseFileName(fileName)
+    , connectionName("SqliteSink:" + fileName)
+    , packed(packedFrames)
+{
+}
+
+/*!
+ * \brief SqliteSink::open -- Open the database file, creating it if needed.
+ *
+ * The database is put in WAL mode so that writers do not block readers
+ * and commits need not wait for the whole database to be synced.
+ *
+ * \return true if successful, false otherwise.
+ */
+bool SqliteSink::open()
+{
+    qDebug("Begin");
+    QSqlDatabase dbConn = QSqlDatabase::contains(connectionName)
+            ? QSqlDatabase::database(connectionName)
+            : QSqlDatabase::addDatabase("QSQLITE", connectionName);
+    dbConn.setDatabaseName(databaseFileName);
+    if (!dbConn.isOpen() && !dbConn.open())
+    {
+        qCritical("Unable to open SQLite database %s: %s", qUtf8Printable(databaseFileName), qUtf8Printable(dbConn.lastError().text()));
+        qInfo() << "Return false";
+        return false;
+    }
+    QSqlQuery query(dbConn);
+    if (!query.exec("PRAGMA journal_mode=WAL"))
+        qWarning("Unable to put SQLite database %s in WAL mode: %s", qUtf8Printable(databaseFileName), qUtf8Printable(query.lastError().text()));
+    if (!query.exec("PRAGMA synchronous=NORMAL"))
+        qWarning("Unable to set synchronous mode of SQLite database %s: %s", qUtf8Printable(databaseFileName), qUtf8Printable(query.lastError().text()));
+    if (!DontActuallyWriteDatabase
+            && !query.exec(QString("CREATE TABLE IF NOT EXISTS \"%1\" ("
+                                   "MeterId TEXT NOT NULL,"
+                                   "CaptureTime TEXT NOT NULL,"
+                                   "DataType TEXT NOT NULL,"
+                                   "TotalKwh INTEGER NOT NULL,"
+                                   "PulseCount1 INTEGER NOT NULL,"
+                                   "PulseCount2 INTEGER NOT NULL,"
+                                   "PulseCount3 INTEGER NOT NULL,"
+                                   "PRIMARY KEY (MeterId, CaptureTime))").arg(CountersTableName)))
+    {
+        qCritical("Unable to create SQLite table %s: %s", CountersTableName, qUtf8Printable(query.lastError().text()));
+        qInfo() << "Return false";
+        return false;
+    }
+    qDebug("Return true");
+    return true;
+}
+
+/*!
+ * \brief SqliteSink::ensureSchema -- Create the tables for a meter if they don't exist.
+ * \param config    The meter.
+ * \return true if successful, false otherwise.
+ */
+bool SqliteSink::ensureSchema(const MeterConfig &config)
+{
+    QSqlDatabase dbConn = QSqlDatabase::database(connectionName);
+    if (!dbConn.isOpen())
+    {
+        qCritical("SQLite database %s is not open.", qUtf8Printable(databaseFileName));
+        return false;
+    }
+    QSqlQuery query(dbConn);
+
+    QStringList dataKinds;
+    if (config.protocolVersion == 4)
+        dataKinds << "_A" << "_B";
+    else
+        dataKinds << "";
+    bool success = true;
+    foreach (QString dataKind, dataKinds)
+    {
+        QString tableName = QString("%1%2_%3").arg(config.tableBaseName).arg(dataKind).arg(packed ? "PackedMeterData" : "RawMeterData");
+        QString queryText = QString("CREATE TABLE IF NOT EXISTS \"%1\" ("
+                                    "idRawMeterData INTEGER PRIMARY KEY AUTOINCREMENT,"
+                                    "ComputerTime TEXT NOT NULL,"
+                                    "MeterTime TEXT,"
+                                    "MeterId TEXT,"
+                                    "MeterType TEXT,"
+                                    "DataType TEXT,"
+                                    "%2)")
+                .arg(tableName)
+                .arg(packed ? "KeyFrame INTEGER NOT NULL, PackedData BLOB NOT NULL" : "MeterData BLOB NOT NULL");
+        if (DontActuallyWriteDatabase)
+        {
+            qDebug() << "Did not execute " << queryText;
+            continue;
+        }
+        if (!query.exec(queryText))
+        {
+            qCritical("Unable to create SQLite table %s: %s", qUtf8Printable(tableName), qUtf8Printable(query.lastError().text()));
+            success = false;
+        }
+    }
+    return success;
+}
+
+/*!
+ * \brief SqliteSink::appendBatch -- Store a batch of readings in one transaction.
+ * \param readings  The readings to store.
+ * \return true if all readings were stored, false otherwise.
+ */
+bool SqliteSink::appendBatch(const QList<MeterReading> &readings)
+{
+    qDebug("Begin");
+    if (readings.isEmpty() || DontActuallyWriteDatabase)
+        return true;
+    TraceSpan span("db insert");
+    QSqlDatabase dbConn = QSqlDatabase::database(connectionName);
+    if (!dbConn.isOpen())
+    {
+        qCritical("SQLite database %s is not open.", qUtf8Printable(databaseFileName));
+        qInfo() << "Return false";
+        return false;
+    }
+    QSqlQuery query(dbConn);
+
+    bool inTransaction = dbConn.transaction();
+    if (!inTransaction)
+        qWarning("Unable to begin SQLite transaction: %s", qUtf8Printable(dbConn.lastError().text()));
+    bool success = true;
+    foreach (const MeterReading &reading, readings)
+    {
+        const meterDateTime &dateTime = ReadingMeterTime(reading);
+        const ResponseData *header = (const ResponseData *)reading.frame;
+        if (packed)
+            query.prepare(QString("INSERT INTO \"%1%2_PackedMeterData\" (ComputerTime, MeterTime, MeterId, MeterType, DataType, KeyFrame, PackedData)"
+                                  " VALUES (?, ?, ?, ?, ?, ?, ?)").arg(reading.tableBaseName).arg(DataKind(reading.dataType)));
+        else
+            query.prepare(QString("INSERT INTO \"%1%2_RawMeterData\" (ComputerTime, MeterTime, MeterId, MeterType, DataType, MeterData)"
+                                  " VALUES (?, ?, ?, ?, ?, ?)").arg(reading.tableBaseName).arg(DataKind(reading.dataType)));
+        query.bindValue(0, CaptureTimeToUtcText(reading.captureTime));
+        query.bindValue(1, MeterTimeToDateTime(dateTime).toString("yyyy-MM-dd HH:mm:ss"));
+        query.bindValue(2, QString(QByteArray((char *)header->meterId, sizeof(header->meterId))));
+        query.bindValue(3, QString(QByteArray((char *)header->model, 2).toHex()));
+        query.bindValue(4, DataTypeName(reading.dataType));
+        if (packed)
+        {
+            QByteArray packedFrame = codecs[reading.meterId].pack(reading.dataType, reading.frame);
+            query.bindValue(5, FrameCodec::isKeyframe(packedFrame) ? 1 : 0);
+            query.bindValue(6, packedFrame);
+        }
+        else
+            query.bindValue(5, QByteArray((char *)reading.frame, sizeof(reading.frame)));
+        if (!query.exec())
+        {
+            qCritical("Error inserting %s reading of meter %s in SQLite database: %s"
+                      , qUtf8Printable(DataTypeName(reading.dataType))
+                      , qUtf8Printable(reading.meterId)
+                      , qUtf8Printable(query.lastError().text()));
+            /* The codec has moved on past this response; the meter's next one must not depend on it. */
+            if (packed)
+                codecs[reading.meterId].reset();
+            success = false;
+        }
+        if (!reading.countersValid)
+            continue;
+        query.prepare(QString("INSERT OR REPLACE INTO \"%1\" (MeterId, CaptureTime, DataType, TotalKwh, PulseCount1, PulseCount2, PulseCount3)"
+                              " VALUES (?, ?, ?, ?, ?, ?, ?)").arg(CountersTableName));
+        query.bindValue(0, reading.meterId);
+        query.bindValue(1, CaptureTimeToUtcText(reading.captureTime));
+        query.bindValue(2, DataTypeName(reading.dataType));
+        for (int i = 0; i < CounterCount; i++)
+            query.bindValue(3 + i, reading.counters[i]);
+        if (!query.exec())
+        {
+            qCritical("Error inserting counters of meter %s in SQLite database: %s"
+                      , qUtf8Printable(reading.meterId)
+                      , qUtf8Printable(query.lastError().text()));
+            success = false;
+        }
+    }
+    if (inTransaction && !dbConn.commit())
+    {
+        qCritical("Unable to commit %d readings to SQLite database: %s", readings.size(), qUtf8Printable(dbConn.lastError().text()));
+        dbConn.rollback();
+        success = false;
+    }
+    /* A packed response stored depends on the one before it; after a failure, start again with keyframes. */
+    if (!success)
+        codecs.clear();
+    qDebug() << "Return" << success;
+    return success;
+}
+
+/*!
+ * \brief SqliteSink::flush -- Move the WAL into the database file.
+ *
+ * Committed readings are already durable in the WAL; checkpointing keeps
+ * the WAL from growing without bound.
+ *
+ * \return true if successful, false otherwise.
+ */
+bool SqliteSink::flush()
+{
+    if (DontActuallyWriteDatabase)
+        return true;
+    QSqlDatabase dbConn = QSqlDatabase::database(connectionName);
+    if (!dbConn.isOpen())
+        return false;
+    QSqlQuery query(dbConn);
+    if (!query.exec("PRAGMA wal_checkpoint(PASSIVE)"))
+    {
+        qWarning("Unable to checkpoint SQLite database %s: %s", qUtf8Printable(databaseFileName), qUtf8Printable(query.lastError().text()));
+        return false;
+    }
+    return true;
+}
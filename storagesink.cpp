@@ -0,0 +1,452 @@
+/*!
+@file
+@brief Chain of storage sinks, the raw file sink, and sink creation.
+
+@author Thomas A. DeMay
+@date 2015
+@par    Copyright (C) 2015  Thomas A. DeMay
+@par
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    any later version.
+@par
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+@par
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include "storagesink.h"
+
+SinkChain *Storage = NULL;
+int DatabaseWriters = 1;
+int PartitionMonthsKept = 0;
+const char *PartitionedTableName = "RawMeterReadings";
+const char *CountersTableName = "MeterCounters";
+
+/*!
+ * \brief MakeMeterReading -- Package a meter response for storage.
+ * \param meterId       Meter serial number expanded to 12 characters.
+ * \param tableBaseName Prefix of the names of the meter's tables.
+ * \param dataType      '3' for v.3 response, 'A' or 'B' for v.4 responses.
+ * \param frame         The 255 byte response.
+ * \param captureTime   When the response was captured.
+ * \param crcValid      Whether the response CRC was valid.
+ * \return The reading.
+ */
+MeterReading MakeMeterReading(const QString &meterId, const QString &tableBaseName, const uint8_t dataType
+                              , const uint8_t *frame, const CaptureTime &captureTime, const bool crcValid)
+{
+    MeterReading reading;
+    reading.meterId = meterId;
+    reading.tableBaseName = tableBaseName;
+    reading.dataType = dataType;
+    reading.crcValid = crcValid;
+    reading.captureTime = captureTime;
+    memcpy(reading.frame, frame, sizeof(reading.frame));
+    reading.countersValid = false;
+    memset(reading.counters, 0, sizeof(reading.counters));
+    return reading;
+}
+
+/*!
+ * \brief DataTypeName -- Name of a data type as stored in the DataType column.
+ * \param dataType      '3' for v.3 response, 'A' or 'B' for v.4 responses.
+ * \return "V3", "V4A" or "V4B".
+ */
+QString DataTypeName(const uint8_t dataType)
+{
+    switch (dataType)
+    {
+    case 'A':
+        return "V4A";
+    case 'B':
+        return "V4B";
+    default:
+        return "V3";
+    }
+}
+
+/*!
+ * \brief DataKind -- Part of a table name that depends on the data type.
+ * \param dataType      '3' for v.3 response, 'A' or 'B' for v.4 responses.
+ * \return "_A", "_B" or "".
+ */
+QString DataKind(const uint8_t dataType)
+{
+    switch (dataType)
+    {
+    case 'A':
+        return "_A";
+    case 'B':
+        return "_B";
+    default:
+        return "";
+    }
+}
+
+/*!
+ * \brief CreateSink -- Create a storage sink from its description.
+ *
+ * A sink is described as one of:
+ *  - mysql             The database given by --database or its environment variable.
+ *  - mysql:partitioned The same database, with all readings in one partitioned table.
+ *  - sqlite:<file>     A local SQLite database file.
+ *  - sqlite:packed:<file>  The same, with packed responses (framecodec.h).
+ *  - raw:<dir>         The binary response archive in the directory.
+ *  - raw:packed:<dir>  The same, with packed segments.
+ *
+ * \param sinkSpec  Description of the sink.
+ * \return The new sink, or NULL if the description is not recognized.
+ */
+StorageSink *CreateSink(const QString &sinkSpec)
+{
+    QString kind = sinkSpec.section(':', 0, 0).trimmed().toLower();
+    QString location = sinkSpec.section(':', 1).trimmed();
+    if ((kind == "mysql") && location.isEmpty())
+        return new MySqlSink(DatabaseWriters);
+    if ((kind == "mysql") && (location == "partitioned"))
+        return new MySqlSink(DatabaseWriters, true);
+    bool packed = location.startsWith("packed:");
+    if (packed)
+        location = location.mid(7).trimmed();
+    if ((kind == "sqlite") && !location.isEmpty())
+        return new SqliteSink(location, packed);
+    if ((kind == "raw") && !location.isEmpty())
+        return new RawFileSink(location, packed);
+    qCritical("Storage sink \"%s\" not recognized.", qUtf8Printable(sinkSpec));
+    return NULL;
+}
+
+SinkChain::~SinkChain()
+{
+    foreach (StorageSink *sink, sinks)
+        delete sink;
+}
+
+void SinkChain::addSink(StorageSink *sink)
+{
+    qInfo("Storing readings in %s", qUtf8Printable(sink->name()));
+    sinks.append(sink);
+}
+
+/*!
+ * \brief SinkChain::contains -- Is a kind of sink in the chain?
+ * \param sinkName  Name of the sink, or the kind of sink ("mysql", "sqlite" or "raw").
+ * \return true if a matching sink is in the chain.
+ */
+bool SinkChain::contains(const QString &sinkName) const
+{
+    foreach (StorageSink *sink, sinks)
+    {
+        /* Drop any note a wrapping sink adds, e.g. " (changes only)". */
+        QString baseName = sink->name().section(" (", 0, 0);
+        if ((baseName == sinkName) || (baseName.section(':', 0, 0) == sinkName))
+            return true;
+    }
+    return false;
+}
+
+QString SinkChain::name() const
+{
+    QStringList names;
+    foreach (StorageSink *sink, sinks)
+        names << sink->name();
+    return names.join(",");
+}
+
+/*!
+ * \brief SinkChain::open -- Open each sink in the chain.
+ * \return true if all sinks opened, false otherwise.
+ */
+bool SinkChain::open()
+{
+    bool success = true;
+    foreach (StorageSink *sink, sinks)
+    {
+        if (!sink->open())
+        {
+            qCritical("Unable to open storage %s.", qUtf8Printable(sink->name()));
+            success = false;
+        }
+    }
+    return success;
+}
+
+bool SinkChain::ensureSchema(const MeterConfig &config)
+{
+    bool success = true;
+    foreach (StorageSink *sink, sinks)
+        success = sink->ensureSchema(config) && success;
+    return success;
+}
+
+bool SinkChain::appendBatch(const QList<MeterReading> &readings)
+{
+    bool success = true;
+    foreach (StorageSink *sink, sinks)
+    {
+        if (!sink->appendBatch(readings))
+        {
+            qWarning("Could not store %d readings in %s.", readings.size(), qUtf8Printable(sink->name()));
+            success = false;
+        }
+    }
+    return success;
+}
+
+bool SinkChain::flush()
+{
+    bool success = true;
+    foreach (StorageSink *sink, sinks)
+        success = sink->flush() && success;
+    return success;
+}
+
+/*!
+ * \brief SinkChain::saveState -- Hand over the state of each sink, under the sink's name.
+ * \param state     Receives the state.
+ */
+void SinkChain::saveState(QJsonObject *state)
+{
+    foreach (StorageSink *sink, sinks)
+    {
+        QJsonObject sinkState;
+        sink->saveState(&sinkState);
+        if (!sinkState.isEmpty())
+            state->insert(sink->name(), sinkState);
+    }
+}
+
+void SinkChain::restoreState(const QJsonObject &state)
+{
+    foreach (StorageSink *sink, sinks)
+        if (state.contains(sink->name()))
+            sink->restoreState(state.value(sink->name()).toObject());
+}
+
+RawFileSink::RawFileSink(const QString &archiveDir, const bool packedSegments)
+    : directory(archiveDir)
+    , packed(packedSegments)
+    , writer(NULL)
+{
+}
+
+RawFileSink::~RawFileSink()
+{
+    if (writer != NULL)
+        delete writer;
+}
+
+bool RawFileSink::open()
+{
+    if (writer == NULL)
+        writer = new ArchiveWriter(directory, packed);
+    return QDir().mkpath(directory);
+}
+
+bool RawFileSink::ensureSchema(const MeterConfig &config)
+{
+    return QDir().mkpath(directory + "/" + config.meterId);
+}
+
+bool RawFileSink::appendBatch(const QList<MeterReading> &readings)
+{
+    if (writer == NULL)
+        return false;
+    bool success = true;
+    foreach (const MeterReading &reading, readings)
+        success = writer->append(reading.meterId, reading.dataType, reading.frame, reading.captureTime, reading.crcValid) && success;
+    return success;
+}
+
+/*!
+ * \brief RawFileSink::flush -- Nothing to do; ArchiveWriter flushes each record as it is appended.
+ * \return true
+ */
+bool RawFileSink::flush()
+{
+    return true;
+}
+
+/*!
+ * \brief ReadingPayloadHash -- Hash of the part of a response that reflects what the meter measured.
+ *
+ * The meter time and the CRC change with every response, so they are left out.
+ * The hash is 64 bit FNV-1a.
+ *
+ * \param reading   The reading.
+ * \return The hash.
+ */
+quint64 ReadingPayloadHash(const MeterReading &reading)
+{
+    /* 0 based offsets; SQL offsets in messages.h less one. */
+    const int dateTimeBegin = (reading.dataType == '3') ? 172 : 233;
+    const int dateTimeEnd = dateTimeBegin + sizeof(meterDateTime);
+    const int crcBegin = sizeof(reading.frame) - 2;
+    quint64 hash = 14695981039346656037ull;
+    for (int i = 0; i < crcBegin; i++)
+    {
+        if ((i >= dateTimeBegin) && (i < dateTimeEnd))
+            continue;
+        hash ^= reading.frame[i];
+        hash *= 1099511628211ull;
+    }
+    return hash;
+}
+
+/*!
+ * \brief ReadingToJson -- A reading as a JSON object, for the restart state file.
+ * \param reading   The reading.
+ * \return The object.
+ */
+QJsonObject ReadingToJson(const MeterReading &reading)
+{
+    QJsonObject object;
+    object.insert("meterId", reading.meterId);
+    object.insert("tableBaseName", reading.tableBaseName);
+    object.insert("dataType", QString(QChar(reading.dataType)));
+    object.insert("crcValid", reading.crcValid);
+    object.insert("monotonicNSecs", QString::number(reading.captureTime.monotonicNSecs));
+    object.insert("wallUSecs", QString::number(reading.captureTime.wallUSecs));
+    object.insert("frame", QString::fromLatin1(QByteArray((const char *)reading.frame, sizeof(reading.frame)).toBase64()));
+    if (reading.countersValid)
+    {
+        QJsonArray counters;
+        for (int i = 0; i < CounterCount; i++)
+            counters << QString::number(reading.counters[i]);
+        object.insert("counters", counters);
+    }
+    return object;
+}
+
+/*!
+ * \brief ReadingFromJson -- A reading from an object made by ReadingToJson().
+ * \param object    The object.
+ * \param reading   Receives the reading.
+ * \return true if successful, false otherwise.
+ */
+bool ReadingFromJson(const QJsonObject &object, MeterReading *reading)
+{
+    QByteArray frame = QByteArray::fromBase64(object.value("frame").toString().toLatin1());
+    QString dataType = object.value("dataType").toString();
+    if ((frame.size() != sizeof(reading->frame)) || (dataType.size() != 1))
+        return false;
+    reading->meterId = object.value("meterId").toString();
+    reading->tableBaseName = object.value("tableBaseName").toString();
+    reading->dataType = (uint8_t)dataType.toLatin1()[0];
+    reading->crcValid = object.value("crcValid").toBool();
+    /* 64 bit times are kept as text; a JSON number is a double. */
+    reading->captureTime.monotonicNSecs = object.value("monotonicNSecs").toString().toLongLong();
+    reading->captureTime.wallUSecs = object.value("wallUSecs").toString().toLongLong();
+    memcpy(reading->frame, frame.constData(), sizeof(reading->frame));
+    QJsonArray counters = object.value("counters").toArray();
+    reading->countersValid = (counters.size() == CounterCount);
+    for (int i = 0; i < CounterCount; i++)
+        reading->counters[i] = reading->countersValid ? counters.at(i).toString().toLongLong() : 0;
+    return true;
+}
+
+ChangeOnlySink::ChangeOnlySink(StorageSink *sink, const int heartbeatSeconds)
+    : inner(sink)
+    , heartbeatUSecs(heartbeatSeconds * 1000000ll)
+    , skippedCount(0)
+{
+}
+
+ChangeOnlySink::~ChangeOnlySink()
+{
+    qInfo("%lld unchanged readings not stored in %s.", skippedCount, qUtf8Printable(inner->name()));
+    delete inner;
+}
+
+/*!
+ * \brief ChangeOnlySink::appendBatch -- Pass on the readings that changed, or are due for a heartbeat.
+ *
+ * The readings passed on are remembered as the last stored only once the
+ * inner sink has stored them, so a reading that failed to store is passed on
+ * again the next time, even if unchanged.
+ *
+ * \param readings  The readings.
+ * \return true if the readings passed on were stored, false otherwise.
+ */
+bool ChangeOnlySink::appendBatch(const QList<MeterReading> &readings)
+{
+    QList<MeterReading> changed;
+    QHash<QString, LastStored> passedOn;
+    foreach (const MeterReading &reading, readings)
+    {
+        if (!reading.crcValid)
+        {
+            changed.append(reading);
+            continue;
+        }
+        QString key = reading.meterId + DataKind(reading.dataType);
+        quint64 hash = ReadingPayloadHash(reading);
+        if (passedOn.contains(key) || last.contains(key))
+        {
+            const LastStored previous = passedOn.contains(key) ? passedOn.value(key) : last.value(key);
+            if ((previous.payloadHash == hash)
+                    && ((reading.captureTime.wallUSecs - previous.storedUSecs) < heartbeatUSecs))
+            {
+                qDebug("%s reading of meter %s unchanged; not stored."
+                       , qUtf8Printable(DataTypeName(reading.dataType)), qUtf8Printable(reading.meterId));
+                skippedCount++;
+                continue;
+            }
+        }
+        LastStored stored;
+        stored.payloadHash = hash;
+        stored.storedUSecs = reading.captureTime.wallUSecs;
+        passedOn.insert(key, stored);
+        changed.append(reading);
+    }
+    if (changed.isEmpty())
+        return true;
+    if (!inner->appendBatch(changed))
+        return false;
+    for (QHash<QString, LastStored>::const_iterator it = passedOn.constBegin(); it != passedOn.constEnd(); ++it)
+        last.insert(it.key(), it.value());
+    return true;
+}
+
+/*!
+ * \brief ChangeOnlySink::saveState -- Hand over the last reading passed on for each meter and data type.
+ * \param state     Receives the state.
+ */
+void ChangeOnlySink::saveState(QJsonObject *state)
+{
+    QJsonObject lastStored;
+    foreach (QString key, last.keys())
+    {
+        QJsonArray stored;
+        stored.append(QString::number(last[key].payloadHash));
+        stored.append(QString::number(last[key].storedUSecs));
+        lastStored.insert(key, stored);
+    }
+    state->insert("last", lastStored);
+    QJsonObject innerState;
+    inner->saveState(&innerState);
+    if (!innerState.isEmpty())
+        state->insert("inner", innerState);
+}
+
+void ChangeOnlySink::restoreState(const QJsonObject &state)
+{
+    QJsonObject lastStored = state.value("last").toObject();
+    foreach (QString key, lastStored.keys())
+    {
+        QJsonArray stored = lastStored.value(key).toArray();
+        LastStored entry;
+        entry.payloadHash = stored.at(0).toString().toULongLong();
+        entry.storedUSecs = stored.at(1).toString().toLongLong();
+        last.insert(key, entry);
+    }
+    inner->restoreState(state.value("inner").toObject());
+    qInfo("Last readings of %d meters and data types restored for %s.", last.size(), qUtf8Printable(name()));
+}
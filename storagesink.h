@@ -0,0 +1,231 @@
+/*!
+@file
+@brief Header file describing where meter readings are stored.
+
+Each kind of storage is a StorageSink.  Sinks are selected on the command
+line and chained together so that every reading goes to each of them.
+
+@author Thomas A. DeMay
+@date 2015
+@par    Copyright (C) 2015  Thomas A. DeMay
+@par
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    any later version.
+@par
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+@par
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#ifndef STORAGESINK_H
+#define STORAGESINK_H
+#include <QtCore>
+#include <QtSql>
+#include "meterreading.h"
+#include "fleetconfig.h"
+#include "framearchive.h"
+
+/*!
+ * \brief The StorageSink class -- Somewhere to store meter readings.
+ */
+class StorageSink
+{
+public:
+    virtual ~StorageSink() {}
+
+    //! Name of the sink for messages.
+    virtual QString name() const = 0;
+    //! Prepare the sink for use.
+    virtual bool open() = 0;
+    //! Make sure there is a place to store readings from a meter.
+    virtual bool ensureSchema(const MeterConfig &config) = 0;
+    //! Store a batch of readings.
+    virtual bool appendBatch(const QList<MeterReading> &readings) = 0;
+    //! Make sure all readings appended are in permanent storage.
+    virtual bool flush() = 0;
+    //! Hand over what must survive a restart (see handoff.h); nothing by default.
+    virtual void saveState(QJsonObject *state) { Q_UNUSED(state); }
+    //! Take back what saveState() handed over.
+    virtual void restoreState(const QJsonObject &state) { Q_UNUSED(state); }
+};
+
+/*!
+ * \brief The SinkChain class -- Pass readings on to each of a list of sinks.
+ *
+ * A failure of one sink does not keep the others from getting the readings.
+ */
+class SinkChain : public StorageSink
+{
+public:
+    ~SinkChain();
+
+    void addSink(StorageSink *sink);
+    bool isEmpty() const { return sinks.isEmpty(); }
+    bool contains(const QString &sinkName) const;
+
+    QString name() const;
+    bool open();
+    bool ensureSchema(const MeterConfig &config);
+    bool appendBatch(const QList<MeterReading> &readings);
+    bool flush();
+    void saveState(QJsonObject *state);
+    void restoreState(const QJsonObject &state);
+
+private:
+    QList<StorageSink *> sinks;     //!< The sinks in the chain; owned by the chain.
+};
+
+/*!
+ * \brief The MySqlSink class -- Store readings in the MySQL database.
+ *
+ * Normally there is one table per meter and data type.  Partitioned, all
+ * readings go in the one table PartitionedTableName, keyed by meter id,
+ * data type and capture time, with a range partition for each month.
+ * Partitions are added ahead of need and, if PartitionMonthsKept is set,
+ * old ones are dropped.
+ */
+class MySqlSink : public StorageSink
+{
+public:
+    MySqlSink(const int writerThreads = 1, const bool partitionedTable = false);
+    ~MySqlSink();
+
+    QString name() const { return partitioned ? "mysql:partitioned" : "mysql"; }
+    bool open();
+    bool ensureSchema(const MeterConfig &config);
+    bool appendBatch(const QList<MeterReading> &readings);
+    bool flush();
+    void saveState(QJsonObject *state);
+    void restoreState(const QJsonObject &state);
+
+    bool writeBatch(const QList<MeterReading> &readings);
+
+private:
+    bool loadExistingTableNames(QSqlQuery &query);
+    void verifyDatabaseTable(QSqlQuery &query, const QString tableBaseName, const QString dataKind);
+    void verifyCaptureKey(QSqlQuery &query, const QString &tableName);
+    bool saveReading(QSqlQuery &query, const MeterReading &reading);
+    void requeue(const QList<MeterReading> &readings);
+    bool verifyPartitionedTable(QSqlQuery &query);
+    bool maintainPartitions(QSqlQuery &query);
+    bool verifyCountersTable(QSqlQuery &query);
+    bool saveCounters(QSqlQuery &query, const MeterReading &reading);
+
+    static const int MaxRetryReadings = 10000;  //!< Most readings kept while the database is unavailable.
+
+    QSet<QString> existingTables;       //!< Names of meter data tables known to exist.
+    bool existingTablesLoaded;          //!< existingTables has been loaded from the INFORMATION_SCHEMA.
+    QThreadPool *writerPool;            //!< Writer threads; NULL if batches are written on the calling thread.
+    QMutex retryMutex;                  //!< Guards retryQueue.
+    QList<MeterReading> retryQueue;     //!< Readings to retry with the next batch.
+    qint64 lastStatisticsMSecs;         //!< When connection statistics were last logged.
+    bool partitioned;                   //!< All readings go in one partitioned table.
+    qint64 lastPartitionCheckMSecs;     //!< When partitions were last maintained.
+};
+
+/*!
+ * \brief The SqliteSink class -- Store readings in a local SQLite database.
+ *
+ * The database is run in WAL mode, and each batch is written in one
+ * transaction, so that readings can be stored at full speed on
+ * modest hardware.  Tables are laid out like the MySQL tables so that
+ * their contents can be shipped upstream later.
+ *
+ * With packed frames, each response is packed by a FrameCodec (framecodec.h)
+ * into the PackedData column of _PackedMeterData tables instead, with
+ * KeyFrame set on the rows that can be unpacked without the ones before.
+ */
+class SqliteSink : public StorageSink
+{
+public:
+    SqliteSink(const QString &fileName, const bool packedFrames = false);
+
+    QString name() const { return (packed ? "sqlite:packed:" : "sqlite:") + databaseFileName; }
+    bool open();
+    bool ensureSchema(const MeterConfig &config);
+    bool appendBatch(const QList<MeterReading> &readings);
+    bool flush();
+
+private:
+    QString databaseFileName;       //!< SQLite database file.
+    QString connectionName;         //!< Name of the Qt database connection.
+    bool packed;                    //!< Store packed responses.
+    QHash<QString, FrameCodec> codecs;  //!< Packs the responses of each meter, by meter id.
+};
+
+/*!
+ * \brief The RawFileSink class -- Store readings in the binary response archive.
+ */
+class RawFileSink : public StorageSink
+{
+public:
+    RawFileSink(const QString &archiveDir, const bool packedSegments = false);
+    ~RawFileSink();
+
+    QString name() const { return (packed ? "raw:packed:" : "raw:") + directory; }
+    bool open();
+    bool ensureSchema(const MeterConfig &config);
+    bool appendBatch(const QList<MeterReading> &readings);
+    bool flush();
+
+private:
+    QString directory;              //!< Archive directory.
+    bool packed;                    //!< Write packed segments.
+    ArchiveWriter *writer;          //!< Writes the archive segments.
+};
+
+/*!
+ * \brief The ChangeOnlySink class -- Pass on only readings that differ from the last one passed on.
+ *
+ * Readings are compared by a hash of the response excluding the meter time
+ * and CRC, separately for each meter and data type.  An unchanged reading is
+ * still passed on if heartbeatSecs have passed since the last one, so that a
+ * gap in the stored readings always means the meter was not read.
+ * Readings with a bad CRC are always passed on.
+ */
+class ChangeOnlySink : public StorageSink
+{
+public:
+    ChangeOnlySink(StorageSink *sink, const int heartbeatSeconds);
+    ~ChangeOnlySink();
+
+    QString name() const { return inner->name() + " (changes only)"; }
+    bool open() { return inner->open(); }
+    bool ensureSchema(const MeterConfig &config) { return inner->ensureSchema(config); }
+    bool appendBatch(const QList<MeterReading> &readings);
+    bool flush() { return inner->flush(); }
+    void saveState(QJsonObject *state);
+    void restoreState(const QJsonObject &state);
+
+private:
+    typedef struct
+    {
+        quint64 payloadHash;    //!< Hash of the last reading passed on.
+        qint64 storedUSecs;     //!< Capture time of the last reading passed on.
+    } LastStored;
+
+    StorageSink *inner;                 //!< Sink readings are passed on to; owned.
+    qint64 heartbeatUSecs;              //!< Pass on unchanged readings this often.
+    QHash<QString, LastStored> last;    //!< Last reading stored, by meter id and data type.
+    qint64 skippedCount;                //!< Number of unchanged readings not passed on.
+};
+
+extern SinkChain *Storage;          //!< All the places readings are stored.
+extern int DatabaseWriters;         //!< Number of threads writing the MySQL database.
+extern int PartitionMonthsKept;     //!< Months of partitions kept in the partitioned table; zero keeps all.
+extern const char *PartitionedTableName;    //!< Name of the table holding all readings when partitioned.
+extern const char *CountersTableName;       //!< Name of the table holding the accumulated counters of all meters.
+
+StorageSink *CreateSink(const QString &sinkSpec);
+quint64 ReadingPayloadHash(const MeterReading &reading);
+QJsonObject ReadingToJson(const MeterReading &reading);
+bool ReadingFromJson(const QJsonObject &object, MeterReading *reading);
+
+#endif // STORAGESINK_H
@@ -0,0 +1,301 @@
+/*!
+@file
+@brief Meters reached through a serial to TCP gateway.
+
+@author Thomas A. DeMay
+@date 2015
+@par    Copyright (C) 2015  Thomas A. DeMay
+@par
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    any later version.
+@par
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+@par
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include "tcpgateway.h"
+#include "linestats.h"
+
+static QList<TcpGatewayPort *> Gateways;    //!< Every port reached over TCP.
+
+TcpGatewayPort::TcpGatewayPort(const QString &deviceName)
+    : socket(NULL)
+    , tcpPort(0)
+    , retryAtMSecs(0)
+    , retryMSecs(TcpReconnectMSecs)
+    , connects(0)
+    , connectFailures(0)
+    , drops(0)
+    , awaitingResponse(false)
+    , sentNSecs(0)
+    , responses(0)
+    , latencySumNSecs(0)
+    , latencyMinNSecs(0)
+    , latencyMaxNSecs(0)
+    , bytesSent(0)
+    , bytesReceived(0)
+{
+    setPortName(deviceName);
+    QString address = deviceName.mid(sizeof(TcpGatewayPrefix) - 1);
+    host = address.section(':', 0, -2);
+    tcpPort = address.section(':', -1).toUShort();
+    clock.start();
+    Gateways.append(this);
+}
+
+TcpGatewayPort::~TcpGatewayPort()
+{
+    Gateways.removeAll(this);
+    close();
+    delete socket;
+}
+
+/*!
+ * \brief TcpGatewayPort::open -- Open the port and connect to the gateway.
+ *
+ * The port is open even if the connection can't be made; it is tried again
+ * when a message is written.
+ *
+ * \param mode  Mode to open in.
+ * \return true.
+ */
+bool TcpGatewayPort::open(OpenMode mode)
+{
+    QIODevice::open(mode | QIODevice::Unbuffered);
+    connectLink();
+    return true;
+}
+
+void TcpGatewayPort::close()
+{
+    if ((socket != NULL) && (socket->state() != QAbstractSocket::UnconnectedState))
+    {
+        socket->disconnectFromHost();
+        if (socket->state() != QAbstractSocket::UnconnectedState)
+            socket->waitForDisconnected(1000);
+    }
+    if (isOpen())
+        QIODevice::close();
+}
+
+/*!
+ * \brief TcpGatewayPort::connectLink -- Connect to the gateway if not connected.
+ *
+ * Not tried till the wait after the last failure has passed.
+ *
+ * \return true if connected, false otherwise.
+ */
+bool TcpGatewayPort::connectLink()
+{
+    if (isConnected())
+        return true;
+    if (clock.elapsed() < retryAtMSecs)
+        return false;
+    if (socket == NULL)
+        socket = new QTcpSocket();
+    socket->abort();
+    socket->connectToHost(host, tcpPort);
+    if (!socket->waitForConnected(TcpConnectTimeoutMSecs))
+    {
+        connectFailures++;
+        qWarning("Unable to connect to %s:  %s; trying again in %d msec."
+                 , qUtf8Printable(portName()), qUtf8Printable(socket->errorString()), retryMSecs);
+        retryAtMSecs = clock.elapsed() + retryMSecs;
+        retryMSecs = qMin(retryMSecs * 2, TcpReconnectMaxMSecs);
+        return false;
+    }
+    /* Messages are small and a response is waited for after each; don't hold them back. */
+    socket->setSocketOption(QAbstractSocket::LowDelayOption, 1);
+    socket->setSocketOption(QAbstractSocket::KeepAliveOption, 1);
+    connects++;
+    retryMSecs = TcpReconnectMSecs;
+    qInfo("Connected to %s.", qUtf8Printable(portName()));
+    return true;
+}
+
+/*!
+ * \brief TcpGatewayPort::linkLost -- Drop a connection that failed; it is made again with the next message.
+ * \param why   What went wrong.
+ */
+void TcpGatewayPort::linkLost(const QString &why)
+{
+    drops++;
+    awaitingResponse = false;
+    qWarning("Lost connection to %s:  %s", qUtf8Printable(portName()), qUtf8Printable(why));
+    socket->abort();
+}
+
+/*!
+ * \brief TcpGatewayPort::noteFirstByte -- Time the response to the last message, if not yet timed.
+ */
+void TcpGatewayPort::noteFirstByte()
+{
+    if (!awaitingResponse)
+        return;
+    awaitingResponse = false;
+    qint64 latency = clock.nsecsElapsed() - sentNSecs;
+    if ((responses == 0) || (latency < latencyMinNSecs))
+        latencyMinNSecs = latency;
+    if (latency > latencyMaxNSecs)
+        latencyMaxNSecs = latency;
+    latencySumNSecs += latency;
+    responses++;
+}
+
+bool TcpGatewayPort::isConnected() const
+{
+    return (socket != NULL) && (socket->state() == QAbstractSocket::ConnectedState);
+}
+
+qint64 TcpGatewayPort::bytesAvailable() const
+{
+    return (isConnected() ? socket->bytesAvailable() : 0) + QIODevice::bytesAvailable();
+}
+
+/*!
+ * \brief TcpGatewayPort::waitForReadyRead -- Wait for bytes from the gateway.
+ *
+ * The first wait after a message is written is TcpLatencyAllowanceMSecs longer,
+ * for the round trip over the network.
+ *
+ * \param msecs     Longest time to wait.
+ * \return true if bytes are readable, false otherwise.
+ */
+bool TcpGatewayPort::waitForReadyRead(int msecs)
+{
+    if (!isConnected())
+        return false;
+    if (socket->bytesAvailable() > 0)
+    {
+        noteFirstByte();
+        return true;
+    }
+    if (socket->waitForReadyRead(msecs + (awaitingResponse ? TcpLatencyAllowanceMSecs : 0)))
+    {
+        noteFirstByte();
+        return true;
+    }
+    if (socket->state() != QAbstractSocket::ConnectedState)
+        linkLost(socket->errorString());
+    return false;
+}
+
+bool TcpGatewayPort::waitForBytesWritten(int msecs)
+{
+    if (!isConnected())
+        return false;
+    if ((socket->bytesToWrite() == 0) || socket->waitForBytesWritten(msecs))
+        return true;
+    linkLost(socket->errorString());
+    return false;
+}
+
+qint64 TcpGatewayPort::readData(char *data, qint64 maxSize)
+{
+    if (!isConnected())
+        return 0;
+    qint64 count = socket->read(data, maxSize);
+    if (count <= 0)
+        return 0;
+    noteFirstByte();
+    bytesReceived += count;
+    return count;
+}
+
+/*!
+ * \brief TcpGatewayPort::writeData -- Send a message to the bus, connecting first if need be.
+ *
+ * QSerialPort::clear() can't reach the connection, so bytes still waiting in
+ * it, such as a response that came too late, are read and discarded here;
+ * otherwise they would be taken for the start of the answer to this message.
+ *
+ * \param data      The message.
+ * \param maxSize   Its size.
+ * \return Bytes written, or -1 if not connected.
+ */
+qint64 TcpGatewayPort::writeData(const char *data, qint64 maxSize)
+{
+    if (!connectLink())
+        return -1;
+    QByteArray stale = socket->readAll();
+    if (!stale.isEmpty())
+    {
+        qDebug("Discarded %d stale bytes from %s.", stale.size(), qUtf8Printable(portName()));
+        bytesReceived += stale.size();
+        LineStats.noteDiscarded(portName(), stale.size());
+    }
+    qint64 count = socket->write(data, maxSize);
+    if (count < 0)
+    {
+        linkLost(socket->errorString());
+        return -1;
+    }
+    bytesSent += count;
+    awaitingResponse = true;
+    sentNSecs = clock.nsecsElapsed();
+    return count;
+}
+
+QString TcpGatewayPort::statistics() const
+{
+    QString latency = (responses > 0)
+            ? QString("%1/%2/%3").arg(latencyMinNSecs / 1000000.0, 0, 'f', 1)
+              .arg(latencySumNSecs / responses / 1000000.0, 0, 'f', 1).arg(latencyMaxNSecs / 1000000.0, 0, 'f', 1)
+            : QString("-");
+    return QString("Link %1 is %2: %3 connections, %4 failed, %5 lost; %6 responses, latency min/avg/max %7 msec;"
+                   " %8 bytes sent, %9 received.")
+            .arg(portName()).arg(isConnected() ? "up" : "down").arg(connects).arg(connectFailures).arg(drops)
+            .arg(responses).arg(latency).arg(bytesSent).arg(bytesReceived);
+}
+
+/*!
+ * \brief IsTcpGatewayName -- Whether a port is reached over TCP.
+ * \param deviceName    Name of the port.
+ * \return true if the name starts with TcpGatewayPrefix.
+ */
+bool IsTcpGatewayName(const QString &deviceName)
+{
+    return deviceName.startsWith(TcpGatewayPrefix);
+}
+
+/*!
+ * \brief NewTcpGatewayPort -- A port for a tcp:<host>:<port> name.
+ * \param deviceName    Name of the port.
+ * \return The port, not yet open; NULL if the name isn't a host and port.
+ */
+TcpGatewayPort *NewTcpGatewayPort(const QString &deviceName)
+{
+    QString address = deviceName.mid(sizeof(TcpGatewayPrefix) - 1);
+    bool ok = false;
+    quint16 port = address.section(':', -1).toUShort(&ok);
+    if (!IsTcpGatewayName(deviceName) || !ok || (port == 0) || address.section(':', 0, -2).isEmpty())
+    {
+        qCritical("\"%s\" is not tcp:<host>:<port>.", qUtf8Printable(deviceName));
+        return NULL;
+    }
+    return new TcpGatewayPort(deviceName);
+}
+
+/*!
+ * \brief ReportTcpGateways -- Log the statistics of each link if TcpReportMSecs have passed since last logged.
+ * \param now   Log them regardless.
+ */
+void ReportTcpGateways(const bool now)
+{
+    static QElapsedTimer sinceReport;
+    if (!sinceReport.isValid())
+        sinceReport.start();
+    if (!now && (sinceReport.elapsed() < TcpReportMSecs))
+        return;
+    sinceReport.restart();
+    foreach (TcpGatewayPort *gateway, Gateways)
+        qInfo("%s", qUtf8Printable(gateway->statistics()));
+}
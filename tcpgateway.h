@@ -0,0 +1,112 @@
+/*!
+@file
+@brief Header file describing meters reached through a serial to TCP gateway.
+
+A port named tcp:<host>:<port> in place of a serial device is an RS-485 bus
+behind a serial to Ethernet converter (or ser2net, socat, ...) that passes
+the bytes of a raw TCP connection to and from the bus.  It is a
+TcpGatewayPort: a QSerialPort whose reads and writes go over the
+connection, so messages, response framing and parsing, and the response
+timing worked out from the port's serial settings are the same as for a
+local device.  --serial-settings for the port must give the bus settings
+the converter uses; they can't be probed.
+
+The connection is made when the port is opened.  If it can't be made, or
+drops, the port stays open and the connection is made again before the next
+message is written, waiting TcpReconnectMSecs after a failure, doubled after
+each further failure up to TcpReconnectMaxMSecs, so a building that is off
+the network costs a timeout per meter and nothing more.
+
+QSerialPort::clear() doesn't reach the connection, so bytes still waiting in
+it when a message is written (a response that came too late, say) are read
+and counted as discarded in the line statistics, rather than being taken for
+the start of the next response.
+
+The first wait for a response after a message is written is lengthened by
+TcpLatencyAllowanceMSecs for the round trip over the network.  The time from
+writing a message to the first byte of its response is kept for each link,
+with the connection counts, and logged hourly and at exit.
+
+@author Thomas A. DeMay
+@date 2015
+@par    Copyright (C) 2015  Thomas A. DeMay
+@par
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    any later version.
+@par
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+@par
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#ifndef TCPGATEWAY_H
+#define TCPGATEWAY_H
+#include <QtCore>
+#include <QtNetwork>
+#include <QtSerialPort>
+
+static const char TcpGatewayPrefix[] = "tcp:";      //!< Start of the name of a port reached over TCP.
+static const int TcpConnectTimeoutMSecs = 5000;     //!< Longest wait for a connection to be made.
+static const int TcpReconnectMSecs = 1000;          //!< Wait after a failed connection before trying again ...
+static const int TcpReconnectMaxMSecs = 300000;     //!< ... doubled after each failure up to this.
+static const int TcpLatencyAllowanceMSecs = 500;    //!< Added to the first wait for a response.
+static const qint64 TcpReportMSecs = 3600000;       //!< Log link statistics this often.
+
+/*!
+ * \brief The TcpGatewayPort class -- A serial port reached over a raw TCP connection.
+ */
+class TcpGatewayPort : public QSerialPort
+{
+public:
+    TcpGatewayPort(const QString &deviceName);
+    ~TcpGatewayPort();
+
+    bool open(OpenMode mode) Q_DECL_OVERRIDE;
+    void close() Q_DECL_OVERRIDE;
+    qint64 bytesAvailable() const Q_DECL_OVERRIDE;
+    bool waitForReadyRead(int msecs) Q_DECL_OVERRIDE;
+    bool waitForBytesWritten(int msecs) Q_DECL_OVERRIDE;
+
+    bool isConnected() const;
+    QString statistics() const;
+
+protected:
+    qint64 readData(char *data, qint64 maxSize) Q_DECL_OVERRIDE;
+    qint64 writeData(const char *data, qint64 maxSize) Q_DECL_OVERRIDE;
+
+private:
+    bool connectLink();
+    void linkLost(const QString &why);
+    void noteFirstByte();
+
+    QTcpSocket *socket;             //!< The connection; NULL till first made.
+    QString host;                   //!< Gateway host.
+    quint16 tcpPort;                //!< Gateway TCP port.
+    QElapsedTimer clock;            //!< Started when the port is made.
+    qint64 retryAtMSecs;            //!< Don't try to connect before this, on clock.
+    int retryMSecs;                 //!< Wait after the next failure to connect.
+    qint64 connects;                //!< Connections made.
+    qint64 connectFailures;         //!< Connections that couldn't be made.
+    qint64 drops;                   //!< Connections lost.
+    bool awaitingResponse;          //!< A message was written and no byte has come back.
+    qint64 sentNSecs;               //!< When the last message was written, on clock.
+    qint64 responses;               //!< Messages answered.
+    qint64 latencySumNSecs;         //!< Total time from message to first byte of the response.
+    qint64 latencyMinNSecs;         //!< Shortest of those times.
+    qint64 latencyMaxNSecs;         //!< Longest of those times.
+    qint64 bytesSent;               //!< Bytes written.
+    qint64 bytesReceived;           //!< Bytes read.
+};
+
+bool IsTcpGatewayName(const QString &deviceName);
+TcpGatewayPort *NewTcpGatewayPort(const QString &deviceName);
+void ReportTcpGateways(const bool now = false);
+
+#endif // TCPGATEWAY_H
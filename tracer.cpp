@@ -0,0 +1,202 @@
+/*!
+@file
+@brief Timeline of what the program spends its time on.
+
+@author Thomas A. DeMay
+@date 2015
+@par    Copyright (C) 2015  Thomas A. DeMay
+@par
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    any later version.
+@par
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+@par
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include "tracer.h"
+
+TraceRecorder Tracer;
+
+TraceRecorder::TraceRecorder()
+    : enabled(false)
+    , startWallUSecs(0)
+    , next(0)
+    , wrapped(false)
+{
+}
+
+/*!
+ * \brief TraceRecorder::enable -- Start recording spans.
+ * \param traceDir  Directory to write the trace files in.
+ * \param events    Spans to keep.
+ */
+void TraceRecorder::enable(const QString &traceDir, const int events)
+{
+    QMutexLocker locker(&mutex);
+    directory = traceDir;
+    spans.resize(qMax(1, events));
+    next = 0;
+    wrapped = false;
+    clock.start();
+    startWallUSecs = QDateTime::currentMSecsSinceEpoch() * 1000ll;
+    threads.insert(QThread::currentThreadId(), 0);
+    enabled = true;
+    qInfo("Tracing up to %d spans to %s.", spans.size(), qUtf8Printable(directory));
+}
+
+/*!
+ * \brief TraceRecorder::nowUSecs -- Time for a span.
+ * \return usec since tracing was enabled.
+ */
+qint64 TraceRecorder::nowUSecs() const
+{
+    return clock.nsecsElapsed() / 1000;
+}
+
+/*!
+ * \brief TraceRecorder::threadNumber -- Number of the calling thread; 0 for the thread that enabled tracing.
+ *
+ * Called with the mutex locked.
+ *
+ * \return The number.
+ */
+int TraceRecorder::threadNumber()
+{
+    Qt::HANDLE id = QThread::currentThreadId();
+    QHash<Qt::HANDLE, int>::const_iterator found = threads.constFind(id);
+    if (found != threads.constEnd())
+        return found.value();
+    int number = threads.size();
+    threads.insert(id, number);
+    return number;
+}
+
+/*!
+ * \brief TraceRecorder::add -- Record a span, overwriting the oldest if the buffer is full.
+ * \param name          What the span is of; truncated to 31 characters.
+ * \param meterId       Meter, or empty.
+ * \param startUSecs    When it started, from nowUSecs().
+ * \param endUSecs      When it ended, from nowUSecs().
+ */
+void TraceRecorder::add(const char *name, const QString &meterId, const qint64 startUSecs, const qint64 endUSecs)
+{
+    if (!enabled)
+        return;
+    QByteArray meter = meterId.toLatin1();
+    QMutexLocker locker(&mutex);
+    Span &span = spans[next];
+    qstrncpy(span.name, name, sizeof(span.name));
+    qstrncpy(span.meterId, meter.constData(), sizeof(span.meterId));
+    span.thread = threadNumber();
+    span.startUSecs = startUSecs;
+    span.durationUSecs = endUSecs - startUSecs;
+    if (++next >= spans.size())
+    {
+        next = 0;
+        wrapped = true;
+    }
+}
+
+/*!
+ * \brief JsonText -- Quote text for a JSON string.
+ * \param text  The text.
+ * \return The text with quotes, backslashes and control characters escaped.
+ */
+static QByteArray JsonText(const char *text)
+{
+    QByteArray quoted;
+    for (const char *p = text; *p != '\0'; p++)
+    {
+        if ((*p == '"') || (*p == '\\'))
+            quoted.append('\\').append(*p);
+        else if ((uint8_t)*p < 0x20)
+            quoted.append(QString("\\u%1").arg((int)(uint8_t)*p, 4, 16, QChar('0')).toLatin1());
+        else
+            quoted.append(*p);
+    }
+    return quoted;
+}
+
+/*!
+ * \brief TraceRecorder::dump -- Write the spans in the buffer as a Chrome trace event file.
+ *
+ * The spans are copied out under the lock and written without it, so the
+ * other threads are held up only for the copy.
+ *
+ * \param why   Why the trace is written, for the log.
+ * \return true if successful, false otherwise.
+ */
+bool TraceRecorder::dump(const QString &why)
+{
+    if (!enabled)
+        return true;
+    QVector<Span> copy;
+    int threadCount;
+    {
+        QMutexLocker locker(&mutex);
+        int count = wrapped ? spans.size() : next;
+        int first = wrapped ? next : 0;
+        copy.reserve(count);
+        for (int i = 0; i < count; i++)
+            copy.append(spans[(first + i) % spans.size()]);
+        threadCount = threads.size();
+    }
+    QString fileName = QDir(directory).filePath(QString("ReadEKM-trace-%1.json")
+                                                .arg(QDateTime::currentDateTime().toString("yyyyMMdd-HHmmss")));
+    QSaveFile file(fileName);
+    if (!QDir().mkpath(directory) || !file.open(QIODevice::WriteOnly))
+    {
+        qWarning("Unable to write trace %s: %s", qUtf8Printable(fileName), qUtf8Printable(file.errorString()));
+        return false;
+    }
+    qint64 pid = QCoreApplication::applicationPid();
+    QByteArray out;
+    out.reserve(copy.size() * 120 + 1024);
+    out.append("{\"displayTimeUnit\":\"ms\",\"otherData\":{\"reason\":\"").append(JsonText(why.toUtf8().constData()))
+            .append("\",\"startWallUSecs\":").append(QByteArray::number(startWallUSecs)).append("},\n\"traceEvents\":[\n");
+    out.append(QString("{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%1,\"tid\":0,\"args\":{\"name\":\"ReadEKM\"}}").arg(pid).toLatin1());
+    for (int t = 0; t < threadCount; t++)
+        out.append(QString(",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%1,\"tid\":%2,\"args\":{\"name\":\"%3\"}}")
+                   .arg(pid).arg(t).arg((t == 0) ? QString("main") : QString("thread %1").arg(t)).toLatin1());
+    foreach (const Span &span, copy)
+    {
+        out.append(",\n{\"name\":\"").append(JsonText(span.name))
+                .append("\",\"cat\":\"ReadEKM\",\"ph\":\"X\",\"pid\":").append(QByteArray::number(pid))
+                .append(",\"tid\":").append(QByteArray::number(span.thread))
+                .append(",\"ts\":").append(QByteArray::number(span.startUSecs))
+                .append(",\"dur\":").append(QByteArray::number(span.durationUSecs));
+        if (span.meterId[0] != '\0')
+            out.append(",\"args\":{\"meter\":\"").append(JsonText(span.meterId)).append("\"}");
+        out.append('}');
+    }
+    out.append("\n]}\n");
+    if ((file.write(out) != out.size()) || !file.commit())
+    {
+        qWarning("Unable to write trace %s: %s", qUtf8Printable(fileName), qUtf8Printable(file.errorString()));
+        return false;
+    }
+    qInfo("Wrote %d spans to %s because %s.", copy.size(), qUtf8Printable(fileName), qUtf8Printable(why));
+    return true;
+}
+
+/*!
+ * \brief TraceRecorder::dumpIfRequested -- Write the trace if the magic file TraceMagicFile is in the home directory.
+ */
+void TraceRecorder::dumpIfRequested()
+{
+    if (!enabled)
+        return;
+    QString magicFile = QDir::homePath() + "/" + TraceMagicFile;
+    if (!QFile::exists(magicFile))
+        return;
+    QFile::remove(magicFile);
+    dump(QString("magic file \"%1\" seen").arg(TraceMagicFile));
+}
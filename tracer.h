@@ -0,0 +1,121 @@
+/*!
+@file
+@brief Header file describing the timeline of what the program spends its time on.
+
+When a pass over the meters takes longer than the interval, the log says
+so but not why: a slow first byte, the waits that pace reading a response,
+retries, a meter time set, an output control or the database can each be
+the cause.  With --trace, the phases of each pass are recorded as spans, each
+with its name, the meter if any, the thread it ran on, and when it started
+and ended:
+
+    cycle           a pass over the meters
+    meter           reading one meter; args give the meter id
+    write           writing a message (WriteSerialMsg())
+    first byte      waiting for the first byte of a response
+    wait bytes      waiting for more bytes of a response
+    pace            sleeping while the rest of a response arrives
+    receive         reading a response (ReadResponse())
+    crc             checking a CRC
+    counters        accumulating the counters of the readings
+    store           handing the readings to the storage sinks
+    db insert       writing a batch to the database, on whatever thread does it
+    <transaction>   a meter transaction (transaction.h): "output control", "set time", ...
+    sleep           waiting for the next interval
+
+Spans go in a ring buffer of --trace-events spans in memory, so tracing
+costs no I/O while the meters are read; the oldest spans are overwritten.
+The buffer is written to <trace dir>/ReadEKM-trace-<yyyyMMdd-HHmmss>.json
+when a pass overruns its interval, and when the magic file TraceMagicFile
+appears in the home directory.  The file is in the Chrome trace event
+format (an object with a "traceEvents" array of complete, "X", events with
+times in usec); open it in chrome://tracing or Perfetto to see the passes
+on a timeline, one row per thread.
+
+Without --trace a span costs one test of a flag.
+
+@author Thomas A. DeMay
+@date 2015
+@par    Copyright (C) 2015  Thomas A. DeMay
+@par
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    any later version.
+@par
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+@par
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#ifndef TRACER_H
+#define TRACER_H
+#include <QtCore>
+
+static const int TraceDefaultEvents = 100000;               //!< Default spans kept.
+static const char TraceMagicFile[] = ".TraceReadEKM";       //!< Write the trace when this appears in the home directory.
+
+/*!
+ * \brief The TraceRecorder class -- A ring buffer of timed spans, written as Chrome trace event JSON.
+ */
+class TraceRecorder
+{
+public:
+    TraceRecorder();
+
+    void enable(const QString &traceDir, const int events);
+    bool isEnabled() const { return enabled; }
+    qint64 nowUSecs() const;
+    void add(const char *name, const QString &meterId, const qint64 startUSecs, const qint64 endUSecs);
+    bool dump(const QString &why);
+    void dumpIfRequested();
+
+private:
+    typedef struct
+    {
+        char name[32];          //!< What the span is of.
+        char meterId[13];       //!< Meter, or empty.
+        int thread;             //!< Number of the thread it ran on.
+        qint64 startUSecs;      //!< When it started, on clock.
+        qint64 durationUSecs;   //!< How long it took.
+    } Span;
+
+    int threadNumber();
+
+    bool enabled;                           //!< Spans are recorded.
+    QString directory;                      //!< Where the trace files go.
+    QElapsedTimer clock;                    //!< Started when enabled.
+    qint64 startWallUSecs;                  //!< Wall clock time (usec since epoch) clock started.
+    QMutex mutex;                           //!< Guards what follows.
+    QVector<Span> spans;                    //!< The ring buffer.
+    int next;                               //!< Where the next span goes.
+    bool wrapped;                           //!< The buffer has been filled, and spans overwritten.
+    QHash<Qt::HANDLE, int> threads;         //!< Number of each thread seen, by its id.
+};
+
+extern TraceRecorder Tracer;        //!< The program's timeline.
+
+/*!
+ * \brief The TraceSpan class -- Record a span from construction to destruction.
+ *
+ * The name must outlive the span; a string literal normally.
+ */
+class TraceSpan
+{
+public:
+    TraceSpan(const char *spanName, const QString &spanMeterId = QString())
+        : name(spanName), meterId(spanMeterId), startUSecs(Tracer.isEnabled() ? Tracer.nowUSecs() : -1) {}
+    ~TraceSpan() { if (startUSecs >= 0) Tracer.add(name, meterId, startUSecs, Tracer.nowUSecs()); }
+
+private:
+    const char *name;       //!< What the span is of.
+    QString meterId;        //!< Meter, or empty.
+    qint64 startUSecs;      //!< When it started; -1 if not tracing.
+};
+
+#endif // TRACER_H
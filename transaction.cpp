@@ -0,0 +1,503 @@
+/*!
+@file
+@brief Meter transactions: the exchanges that write to a meter.
+
+@author Thomas A. DeMay
+@date 2015
+@par    Copyright (C) 2015  Thomas A. DeMay
+@par
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    any later version.
+@par
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+@par
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include "transaction.h"
+#include "capturetime.h"
+#include "linestats.h"
+#include "debuglog.h"
+#include "tracer.h"
+#include "virtualclock.h"
+
+/* Serial port routines in main.cpp. */
+extern int ResponseTimeoutMSecs;
+bool WriteSerialMsg(QSerialPort *serialPort, const char *msg, const qint64 msgSize);
+bool ReadFrame(QSerialPort *serialPort, const QString &meterId, qint8 *msg, const qint64 msgSize, CaptureTime *captureTime);
+bool ReadResponse(QSerialPort *serialPort, qint8 *msg, const qint64 msgSize, CaptureTime *captureTime);
+
+/*!
+ * \brief MessageBytes -- Copy a message structure from messages.h.
+ * \param message   The message.
+ * \param size      Its size.
+ * \return The copy.
+ */
+QByteArray MessageBytes(const void *message, const int size)
+{
+    return QByteArray((const char *)message, size);
+}
+
+/*!
+ * \brief RequestV4Message -- A data request to a v.4 meter, leaving RequestMsgV4 as it was.
+ * \param meterId       Full 12 character serial number of meter.
+ * \param requestType   Either x30 for "A" data or x31 for "B" data.
+ * \return The request.
+ */
+QByteArray RequestV4Message(const QString &meterId, const uint8_t requestType)
+{
+    RequestMsgV4Def request = RequestMsgV4;
+    memcpy(request.meterId, qPrintable(meterId), sizeof(request.meterId));
+    request.reqType[1] = requestType;
+    return MessageBytes(request.fixedBegin, sizeof(request));
+}
+
+/*!
+ * \brief RequestV3Message -- A data request to a v.3 meter, leaving RequestMsgV3 as it was.
+ * \param meterId   Full 12 character serial number of meter.
+ * \return The request.
+ */
+QByteArray RequestV3Message(const QString &meterId)
+{
+    RequestMsgV3Def request = RequestMsgV3;
+    memcpy(request.meterId, qPrintable(meterId), sizeof(request.meterId));
+    return MessageBytes(request.fixedBegin, sizeof(request));
+}
+
+/*!
+ * \brief NewWriteTransaction -- A transaction to a v.4 meter that has opened the meter for writing.
+ *
+ * The transaction requests A data to get the meter's attention, sends the
+ * password and checks the ACK, and closes the meter at the end.  The caller
+ * adds the payload, e.g.
+ *
+ *     t->send(message, "control message").expectAck("control");
+ *
+ * \param name          Description for the log.
+ * \param meterId       Full 12 character serial number of meter.
+ * \param portName      Serial device of the meter.
+ * \param priority      Priority in a TransactionQueue.
+ * \param timeoutMSecs  Time limit.
+ * \return The transaction; the caller owns it.
+ */
+MeterTransaction *NewWriteTransaction(const QString &name, const QString &meterId, const QString &portName
+                                      , const TransactionPriority priority, const qint64 timeoutMSecs)
+{
+    MeterTransaction *transaction = new MeterTransaction(name, meterId, portName, priority, timeoutMSecs);
+    transaction->send(RequestV4Message(meterId, '\x30'), "RequestMsgV4")
+            .readFrame()
+            .send(MessageBytes(PasswordMsg, sizeof(PasswordMsg)), "password message")
+            .expectAck("password")
+            .finish(MessageBytes(CloseString, sizeof(CloseString)));
+    return transaction;
+}
+
+MeterTransaction::MeterTransaction(const QString &name, const QString &meterId, const QString &portName
+                                   , const TransactionPriority priority, const qint64 timeoutMSecs)
+    : transactionName(name)
+    , meter(meterId)
+    , port(portName)
+    , level(priority)
+    , limitMSecs(timeoutMSecs)
+    , deadlineMSecs(0)
+    , cancelled(0)
+    , result(TransactionPending)
+{
+    memset(response, 0, sizeof(response));
+}
+
+/*!
+ * \brief MeterTransaction::send -- Add a step sending a message.
+ * \param message   The message.
+ * \param what      Description for the log.
+ * \return The transaction, to add more steps.
+ */
+MeterTransaction &MeterTransaction::send(const QByteArray &message, const QString &what)
+{
+    Step step;
+    step.kind = StepSend;
+    step.message = message;
+    step.tries = 0;
+    step.what = what;
+    steps.append(step);
+    return *this;
+}
+
+/*!
+ * \brief MeterTransaction::send -- Add a step sending a message made when the step is reached.
+ * \param build     Makes the message.
+ * \param what      Description for the log.
+ * \return The transaction, to add more steps.
+ */
+MeterTransaction &MeterTransaction::send(MessageBuilder build, const QString &what)
+{
+    Step step;
+    step.kind = StepSend;
+    step.build = build;
+    step.tries = 0;
+    step.what = what;
+    steps.append(step);
+    return *this;
+}
+
+/*!
+ * \brief MeterTransaction::readFrame -- Add a step reading a data response.
+ *
+ * If the response is not read, the message sent before it is sent again,
+ * up to tries attempts in all.
+ *
+ * \param tries     Attempts.
+ * \return The transaction, to add more steps.
+ */
+MeterTransaction &MeterTransaction::readFrame(const int tries)
+{
+    Step step;
+    step.kind = StepReadFrame;
+    step.tries = tries;
+    step.what = "data response";
+    steps.append(step);
+    return *this;
+}
+
+/*!
+ * \brief MeterTransaction::expectAck -- Add a step reading an ACK.
+ * \param what      What is acknowledged, for the log.
+ * \return The transaction, to add more steps.
+ */
+MeterTransaction &MeterTransaction::expectAck(const QString &what)
+{
+    Step step;
+    step.kind = StepExpectAck;
+    step.tries = 1;
+    step.what = what;
+    steps.append(step);
+    return *this;
+}
+
+/*!
+ * \brief MeterTransaction::finish -- Set the message sent however the transaction ends.
+ * \param message   The message; usually CloseString.
+ * \return The transaction, to add more steps.
+ */
+MeterTransaction &MeterTransaction::finish(const QByteArray &message)
+{
+    closeMessage = message;
+    return *this;
+}
+
+MeterTransaction &MeterTransaction::onDone(DoneCallback callback)
+{
+    done = callback;
+    return *this;
+}
+
+/*!
+ * \brief MeterTransaction::cancel -- Stop the transaction before its next step.
+ *
+ * A transaction cancelled before it runs ends at once when run.
+ */
+void MeterTransaction::cancel()
+{
+    cancelled.store(1);
+}
+
+/*!
+ * \brief MeterTransaction::isCancelled -- Whether cancel() has been called.
+ *
+ * \return true if the transaction is cancelled, false otherwise.
+ */
+bool MeterTransaction::isCancelled() const
+{
+    return cancelled.load() != 0;
+}
+
+/*!
+ * \brief MeterTransaction::stopping -- Whether the transaction is cancelled or out of time.
+ *
+ * Sets the result if so.
+ *
+ * \return true if the transaction must stop, false otherwise.
+ */
+bool MeterTransaction::stopping()
+{
+    if (cancelled.load())
+        result = TransactionCancelled;
+    else if (ClockMSecs() >= deadlineMSecs)
+        result = TransactionTimedOut;
+    else
+        return false;
+    return true;
+}
+
+/*!
+ * \brief MeterTransaction::run -- Run the steps in turn until one fails, then send the close message.
+ * \param serialPort    Serial port the meter is connected to.
+ * \return The outcome.
+ */
+TransactionState MeterTransaction::run(QSerialPort *serialPort)
+{
+    qInfo("Begin %s for meter %s.", qUtf8Printable(transactionName), qUtf8Printable(meter));
+    QByteArray spanName = transactionName.toLatin1();
+    TraceSpan span(spanName.constData(), meter);
+    deadlineMSecs = ClockMSecs() + limitMSecs;
+    LineStats.setMeter(meter);
+    const int savedTimeout = ResponseTimeoutMSecs;
+    result = TransactionPending;
+    lastSent.clear();
+    int stepsRun = 0;
+    for (int i = 0; (result == TransactionPending) && (i < steps.size()); i++)
+    {
+        if (stopping())
+            break;
+        stepsRun++;
+        if (!runStep(serialPort, steps[i]) && (result == TransactionPending))
+            result = TransactionFailed;
+    }
+    if (result == TransactionPending)
+        result = TransactionSucceeded;
+    ResponseTimeoutMSecs = savedTimeout;
+    /* Nothing to close if the meter was never talked to. */
+    if ((stepsRun > 0) && !closeMessage.isEmpty())
+        WriteSerialMsg(serialPort, closeMessage.constData(), closeMessage.size());
+    qInfo("Return %s of %s for meter %s.", stateName(result), qUtf8Printable(transactionName), qUtf8Printable(meter));
+    if (done)
+        done(*this);
+    return result;
+}
+
+/*!
+ * \brief MeterTransaction::runStep -- Run one step.
+ * \param serialPort    Serial port the meter is connected to.
+ * \param step          The step.
+ * \return true if successful, false otherwise.
+ */
+bool MeterTransaction::runStep(QSerialPort *serialPort, const Step &step)
+{
+    /* Don't wait for a response past the time limit. */
+    qint64 remaining = deadlineMSecs - ClockMSecs();
+    ResponseTimeoutMSecs = (int)qMax((qint64)1, qMin((qint64)ResponseTimeoutMSecs, remaining));
+    switch (step.kind)
+    {
+    case StepSend:
+    {
+        lastSent = step.build ? step.build() : step.message;
+        qCInfo(FrameLog, "%s is: %s", qUtf8Printable(step.what), qUtf8Printable(lastSent.toHex()));
+        if (WriteSerialMsg(serialPort, lastSent.constData(), lastSent.size()))
+            return true;
+        qDebug("Failed to write %s.", qUtf8Printable(step.what));
+        return false;
+    }
+    case StepReadFrame:
+        for (int tryCount = 0; tryCount < step.tries; tryCount++)
+        {
+            if ((tryCount > 0) && (stopping() || !WriteSerialMsg(serialPort, lastSent.constData(), lastSent.size())))
+                return false;
+            if (ReadFrame(serialPort, meter, (qint8 *)response, sizeof(response), NULL))
+                return true;
+        }
+        qDebug("Could not get %s from meter %s.", qUtf8Printable(step.what), qUtf8Printable(meter));
+        return false;
+    case StepExpectAck:
+    {
+        qint8 ack[1];
+        if (!ReadResponse(serialPort, ack, sizeof(ack), NULL))
+        {
+            qDebug("Could not get ack response to %s.", qUtf8Printable(step.what));
+            return false;
+        }
+        if ((uint8_t)ack[0] != ResponseAck[0])
+        {
+            qDebug("Response to %s wasn't ACK.", qUtf8Printable(step.what));
+            return false;
+        }
+        qDebug("Got ACK from %s.", qUtf8Printable(step.what));
+        return true;
+    }
+    }
+    return false;
+}
+
+const QString &MeterTransaction::name() const
+{
+    return transactionName;
+}
+
+const QString &MeterTransaction::meterId() const
+{
+    return meter;
+}
+
+const QString &MeterTransaction::portName() const
+{
+    return port;
+}
+
+TransactionPriority MeterTransaction::priority() const
+{
+    return level;
+}
+
+qint64 MeterTransaction::timeoutMSecs() const
+{
+    return limitMSecs;
+}
+
+TransactionState MeterTransaction::state() const
+{
+    return result;
+}
+
+/*!
+ * \brief MeterTransaction::frame -- The last data response read by a readFrame() step.
+ * \return The response; FrameSize bytes.
+ */
+const uint8_t *MeterTransaction::frame() const
+{
+    return response;
+}
+
+const char *MeterTransaction::stateName(const TransactionState state)
+{
+    static const char *names[] = {"pending", "success", "failure", "timeout", "cancellation"};
+    return names[state];
+}
+
+TransactionQueue::TransactionQueue()
+{
+}
+
+TransactionQueue::~TransactionQueue()
+{
+    qDeleteAll(waiting);
+}
+
+/*!
+ * \brief TransactionQueue::submit -- Queue a transaction to be run.
+ * \param transaction   The transaction; the queue deletes it once run.
+ */
+void TransactionQueue::submit(MeterTransaction *transaction)
+{
+    qDebug("Queued %s for meter %s.", qUtf8Printable(transaction->name()), qUtf8Printable(transaction->meterId()));
+    waiting.append(transaction);
+}
+
+/*!
+ * \brief TransactionQueue::contains -- Whether a transaction is already waiting.
+ * \param meterId   The meter.
+ * \param name      Name of the transaction.
+ * \return true if one is waiting, false otherwise.
+ */
+bool TransactionQueue::contains(const QString &meterId, const QString &name) const
+{
+    foreach (const MeterTransaction *transaction, waiting)
+        if ((transaction->meterId() == meterId) && (transaction->name() == name))
+            return true;
+    return false;
+}
+
+/*!
+ * \brief TransactionQueue::cancelMeter -- Cancel the waiting transactions of a meter.
+ *
+ * They stay queued and end at once as cancelled when next taken, so their
+ * callbacks are told.
+ *
+ * \param meterId   The meter.
+ */
+void TransactionQueue::cancelMeter(const QString &meterId)
+{
+    foreach (MeterTransaction *transaction, waiting)
+        if (transaction->meterId() == meterId)
+            transaction->cancel();
+}
+
+int TransactionQueue::pending() const
+{
+    return waiting.size();
+}
+
+/*!
+ * \brief TransactionQueue::takeNext -- Take the next transaction to run.
+ *
+ * Starting with the port after the one used last, the first port with a
+ * transaction that fits before the deadline gives its highest priority,
+ * oldest, such transaction.  Cancelled transactions take no time so always fit.
+ *
+ * \param portNames     Ports with transactions waiting, in a fixed order.
+ * \param deadlineMSecs Msec since epoch by which the transaction must end; zero for no limit.
+ * \return The transaction, or NULL if none fits.
+ */
+MeterTransaction *TransactionQueue::takeNext(const QStringList &portNames, const qint64 deadlineMSecs)
+{
+    const qint64 now = ClockMSecs();
+    const int start = portNames.indexOf(lastPort) + 1;
+    for (int p = 0; p < portNames.size(); p++)
+    {
+        const QString &portName = portNames[(start + p) % portNames.size()];
+        int best = -1;
+        for (int i = 0; i < waiting.size(); i++)
+        {
+            MeterTransaction *transaction = waiting[i];
+            if (transaction->portName() != portName)
+                continue;
+            if ((deadlineMSecs > 0) && !transaction->isCancelled()
+                    && ((now + transaction->timeoutMSecs()) > deadlineMSecs))
+                continue;
+            if ((best < 0) || (transaction->priority() < waiting[best]->priority()))
+                best = i;
+        }
+        if (best >= 0)
+        {
+            lastPort = portName;
+            return waiting.takeAt(best);
+        }
+    }
+    return NULL;
+}
+
+/*!
+ * \brief TransactionQueue::runUntil -- Run waiting transactions that fit before a deadline.
+ *
+ * Transactions for a port that is not open fail without being run.
+ *
+ * \param serialPorts   Open serial ports indexed by device name.
+ * \param deadlineMSecs Msec since epoch by which transactions must end; zero for no limit.
+ * \return Number of transactions run.
+ */
+int TransactionQueue::runUntil(const QMap<QString, QSerialPort *> &serialPorts, const qint64 deadlineMSecs)
+{
+    qDebug("Begin with %d transactions waiting.", waiting.size());
+    int ran = 0;
+    while (!waiting.isEmpty())
+    {
+        QStringList portNames;
+        foreach (const MeterTransaction *transaction, waiting)
+            if (!portNames.contains(transaction->portName()))
+                portNames << transaction->portName();
+        portNames.sort();
+        MeterTransaction *transaction = takeNext(portNames, deadlineMSecs);
+        if (transaction == NULL)
+        {
+            qDebug("No time left for the %d transactions waiting.", waiting.size());
+            break;
+        }
+        QSerialPort *serialPort = serialPorts.value(transaction->portName());
+        if (serialPort == NULL)
+            qWarning("Serial device %s not open; %s for meter %s dropped.", qUtf8Printable(transaction->portName())
+                     , qUtf8Printable(transaction->name()), qUtf8Printable(transaction->meterId()));
+        else
+        {
+            transaction->run(serialPort);
+            ran++;
+        }
+        delete transaction;
+    }
+    qDebug("Return %d", ran);
+    return ran;
+}
@@ -0,0 +1,173 @@
+/*!
+@file
+@brief Header file describing meter transactions: the exchanges that write to a meter.
+
+Every write to a v.4 meter is the same conversation:
+
+    request A data (with retries) -> password -> ACK -> payload -> ACK -> close
+
+A MeterTransaction is that conversation written down as a list of steps,
+built with send(), readFrame(), expectAck() and finish(), and run later by
+run().  Each transaction owns its messages, built from the templates in
+messages.h, so the global templates are never modified.  A message that must
+be made at the moment it is sent (e.g. the time of a time set) is given as a
+function which run() calls when the step is reached.
+
+NewWriteTransaction() makes a transaction with the opening steps (request,
+data response, password, ACK) and the close message in place; a write adds
+its payload and the ACK of it.
+
+A transaction has a priority, a time limit and can be cancelled; the time
+limit and cancellation are checked before each step, and the wait for each
+response is cut short so it does not run past the time limit.  Once the
+meter has been talked to, the close message is sent however the transaction
+ends.
+
+A TransactionQueue holds transactions waiting to run.  runUntil() takes them
+highest priority first, oldest first within a priority, going round the
+serial ports in turn so one busy port cannot starve the others, and only
+starts a transaction if its time limit ends before the deadline given.
+
+The serial port calls block, so a transaction runs to its end once started;
+interleaving happens between transactions, at the points where the program
+is not waiting on a meter.
+
+@author Thomas A. DeMay
+@date 2015
+@par    Copyright (C) 2015  Thomas A. DeMay
+@par
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    any later version.
+@par
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+@par
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#ifndef TRANSACTION_H
+#define TRANSACTION_H
+#include <QtCore>
+#include <QtSerialPort>
+#include <functional>
+#include "messages.h"
+#include "frameparser.h"
+
+static const int TransactionFrameTries = 10;                //!< Times to request the A data that opens a transaction.
+static const qint64 TransactionDefaultTimeoutMSecs = 30000; //!< Time limit of a transaction unless given.
+
+typedef enum
+{
+    TransactionHigh,        //!< E.g. output controls; run first.
+    TransactionNormal,      //!< Ordinary writes.
+    TransactionLow          //!< E.g. time sets; run when nothing else is waiting.
+} TransactionPriority;
+
+typedef enum
+{
+    TransactionPending,     //!< Not yet run.
+    TransactionSucceeded,   //!< Every step succeeded.
+    TransactionFailed,      //!< A step failed.
+    TransactionTimedOut,    //!< The time limit passed before the last step.
+    TransactionCancelled    //!< Cancelled before the last step.
+} TransactionState;
+
+/*!
+ * \brief The MeterTransaction class -- One conversation with a meter, as a list of steps.
+ */
+class MeterTransaction
+{
+public:
+    typedef std::function<QByteArray()> MessageBuilder;                     //!< Makes a message when its step is reached.
+    typedef std::function<void(const MeterTransaction &)> DoneCallback;     //!< Told of the end of a transaction.
+
+    MeterTransaction(const QString &name, const QString &meterId, const QString &portName
+                     , const TransactionPriority priority = TransactionNormal
+                     , const qint64 timeoutMSecs = TransactionDefaultTimeoutMSecs);
+
+    MeterTransaction &send(const QByteArray &message, const QString &what);
+    MeterTransaction &send(MessageBuilder build, const QString &what);
+    MeterTransaction &readFrame(const int tries = TransactionFrameTries);
+    MeterTransaction &expectAck(const QString &what);
+    MeterTransaction &finish(const QByteArray &message);
+    MeterTransaction &onDone(DoneCallback callback);
+
+    void cancel();
+    bool isCancelled() const;
+    TransactionState run(QSerialPort *serialPort);
+
+    const QString &name() const;
+    const QString &meterId() const;
+    const QString &portName() const;
+    TransactionPriority priority() const;
+    qint64 timeoutMSecs() const;
+    TransactionState state() const;
+    const uint8_t *frame() const;
+
+    static const char *stateName(const TransactionState state);
+
+private:
+    typedef enum { StepSend, StepReadFrame, StepExpectAck } StepKind;
+    typedef struct
+    {
+        StepKind kind;              //!< What the step does.
+        QByteArray message;         //!< Message to send, if not built.
+        MessageBuilder build;       //!< Makes the message to send, if set.
+        int tries;                  //!< Attempts at reading a frame.
+        QString what;               //!< Description for the log.
+    } Step;
+
+    bool runStep(QSerialPort *serialPort, const Step &step);
+    bool stopping();
+
+    QString transactionName;        //!< Description for the log.
+    QString meter;                  //!< Meter talked to.
+    QString port;                   //!< Serial device of the meter.
+    TransactionPriority level;      //!< Priority.
+    qint64 limitMSecs;              //!< Time limit, from the start of run().
+    qint64 deadlineMSecs;           //!< When the time limit passes; set by run().
+    QList<Step> steps;              //!< The conversation.
+    QByteArray closeMessage;        //!< Sent however the transaction ends.
+    QByteArray lastSent;            //!< Last message sent; sent again to retry a frame.
+    DoneCallback done;              //!< Told of the end.
+    QAtomicInt cancelled;           //!< Set by cancel().
+    TransactionState result;        //!< Outcome.
+    uint8_t response[FrameSize];    //!< Last frame read.
+};
+
+/*!
+ * \brief The TransactionQueue class -- Transactions waiting to run, by priority and port.
+ */
+class TransactionQueue
+{
+public:
+    TransactionQueue();
+    ~TransactionQueue();
+
+    void submit(MeterTransaction *transaction);
+    bool contains(const QString &meterId, const QString &name) const;
+    void cancelMeter(const QString &meterId);
+    int pending() const;
+    int runUntil(const QMap<QString, QSerialPort *> &serialPorts, const qint64 deadlineMSecs);
+
+private:
+    MeterTransaction *takeNext(const QStringList &portNames, const qint64 deadlineMSecs);
+
+    QList<MeterTransaction *> waiting;  //!< In the order submitted.
+    QString lastPort;                   //!< Port of the transaction run last.
+};
+
+MeterTransaction *NewWriteTransaction(const QString &name, const QString &meterId, const QString &portName
+                                      , const TransactionPriority priority = TransactionNormal
+                                      , const qint64 timeoutMSecs = TransactionDefaultTimeoutMSecs);
+QByteArray RequestV4Message(const QString &meterId, const uint8_t requestType);
+QByteArray RequestV3Message(const QString &meterId);
+QByteArray MessageBytes(const void *message, const int size);
+
+#endif // TRANSACTION_H
@@ -0,0 +1,100 @@
+/*!
+@file
+@brief The clock the program runs on: the real one, or a virtual one for simulation.
+
+@author Thomas A. DeMay
+@date 2015
+@par    Copyright (C) 2015  Thomas A. DeMay
+@par
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    any later version.
+@par
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+@par
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include "virtualclock.h"
+#include <unistd.h>
+
+VirtualClock SimClock;
+
+VirtualClock::VirtualClock()
+    : active(false)
+    , startUSecs(0)
+    , wallUSecs(0)
+{
+}
+
+/*!
+ * \brief VirtualClock::start -- Run the program on the virtual clock from now on.
+ * \param startWallUSecs    Wall clock time (usec since epoch) to start at.
+ */
+void VirtualClock::start(const qint64 startWallUSecs)
+{
+    startUSecs = startWallUSecs;
+    wallUSecs = startWallUSecs;
+    active = true;
+}
+
+/*!
+ * \brief VirtualClock::advance -- Let time pass.
+ * \param usecs     Time to pass; nothing if not positive.
+ */
+void VirtualClock::advance(const qint64 usecs)
+{
+    if (usecs > 0)
+        wallUSecs += usecs;
+}
+
+/*!
+ * \brief VirtualClock::advanceTo -- Let time pass till a given time; nothing if it is already past.
+ * \param toWallUSecs   Wall clock time (usec since epoch).
+ */
+void VirtualClock::advanceTo(const qint64 toWallUSecs)
+{
+    if (toWallUSecs > wallUSecs)
+        wallUSecs = toWallUSecs;
+}
+
+/*!
+ * \brief VirtualClock::captureTime -- The time now as a time stamp.
+ * \return The time; the monotonic clock counts from when the virtual clock started.
+ */
+CaptureTime VirtualClock::captureTime() const
+{
+    CaptureTime captureTime;
+    captureTime.monotonicNSecs = (wallUSecs - startUSecs) * 1000ll;
+    captureTime.wallUSecs = wallUSecs;
+    return captureTime;
+}
+
+/*!
+ * \brief ClockMSecs -- The time the program runs on.
+ * \return Msec since the epoch, on the virtual clock if it is active.
+ */
+qint64 ClockMSecs()
+{
+    if (SimClock.isActive())
+        return SimClock.nowUSecs() / 1000;
+    return QDateTime::currentMSecsSinceEpoch();
+}
+
+/*!
+ * \brief PauseUSecs -- Wait, or move the virtual clock on if it is active.
+ * \param usecs     Time to wait.
+ */
+void PauseUSecs(const qint64 usecs)
+{
+    if (SimClock.isActive())
+        SimClock.advance(usecs);
+    else if (usecs > 0)
+        usleep((useconds_t)usecs);
+}
@@ -0,0 +1,70 @@
+/*!
+@file
+@brief Header file describing the clock the program runs on: the real one, or a virtual one for simulation.
+
+Reading meters waits: for responses, for the rest of a response, for the
+next interval.  Under --simulate (simulator.h) the simulated serial ports
+don't wait; they move a virtual clock on by the time the wait would have
+taken, so hours of polling run in a fraction of a second.  For that to
+work, the code that reads the time or waits for the sake of the meters asks
+this module instead of the system:
+
+ - ClockMSecs() is the time in msec since the epoch;
+ - PauseUSecs() waits, or moves the virtual clock on;
+ - CaptureTimeNow() (capturetime.h) takes its time stamps from the virtual
+   clock while it runs.
+
+The virtual clock is off unless a simulation starts it, and then both
+clocks of a CaptureTime run from it.
+
+@author Thomas A. DeMay
+@date 2015
+@par    Copyright (C) 2015  Thomas A. DeMay
+@par
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    any later version.
+@par
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+@par
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#ifndef VIRTUALCLOCK_H
+#define VIRTUALCLOCK_H
+#include <QtCore>
+#include "capturetime.h"
+
+/*!
+ * \brief The VirtualClock class -- Simulated time, moved on only when told.
+ */
+class VirtualClock
+{
+public:
+    VirtualClock();
+
+    void start(const qint64 startWallUSecs);
+    bool isActive() const { return active; }
+    qint64 nowUSecs() const { return wallUSecs; }
+    void advance(const qint64 usecs);
+    void advanceTo(const qint64 toWallUSecs);
+    CaptureTime captureTime() const;
+
+private:
+    bool active;            //!< The program runs on this clock.
+    qint64 startUSecs;      //!< Wall clock time (usec since epoch) it started at.
+    qint64 wallUSecs;       //!< Wall clock time (usec since epoch) now.
+};
+
+extern VirtualClock SimClock;       //!< The virtual clock; not active unless simulating.
+
+qint64 ClockMSecs();
+void PauseUSecs(const qint64 usecs);
+
+#endif // VIRTUALCLOCK_H
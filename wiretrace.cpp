@@ -0,0 +1,460 @@
+/*!
+@file
+@brief Capture of serial line traffic, and its replay.
+
+@author Thomas A. DeMay
+@date 2015
+@par    Copyright (C) 2015  Thomas A. DeMay
+@par
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    any later version.
+@par
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+@par
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include "wiretrace.h"
+#include "virtualclock.h"
+
+WireCapture WireCap;
+
+static QHash<QString, QList<WireEvent> > ReplayTraces;  //!< Trace of each port, by port name.
+static double ReplaySpeed = 1.0;                        //!< Trace time per real time; 0 for no delays.
+static bool ReplayLoaded = false;                       //!< A trace was loaded with LoadWireReplay().
+static QList<ReplaySerialPort *> ReplayPorts;           //!< Ports playing back a trace.
+
+WireCapture::WireCapture()
+    : records(0)
+{
+}
+
+WireCapture::~WireCapture()
+{
+    close();
+}
+
+/*!
+ * \brief WireCapture::open -- Begin capturing to a trace file.
+ * \param fileName  The trace file; replaced if it exists.
+ * \return true if successful, false otherwise.
+ */
+bool WireCapture::open(const QString &fileName)
+{
+    qDebug("Begin");
+    file.setFileName(fileName);
+    if (!file.open(QIODevice::WriteOnly | QIODevice::Truncate))
+    {
+        qCritical("Unable to open capture file %s:  %s", qUtf8Printable(fileName), qUtf8Printable(file.errorString()));
+        qDebug("Return false");
+        return false;
+    }
+    stream.setDevice(&file);
+    stream.setVersion(QDataStream::Qt_5_0);
+    stream.writeRawData(WireTraceMagic, sizeof(WireTraceMagic));
+    stream << WireTraceVersion << (qint64)QDateTime::currentMSecsSinceEpoch();
+    clock.start();
+    qInfo("Capturing serial line traffic to %s.", qUtf8Printable(fileName));
+    qDebug("Return true");
+    return true;
+}
+
+bool WireCapture::isOpen() const
+{
+    return file.isOpen();
+}
+
+/*!
+ * \brief WireCapture::record -- Add bytes sent or received to the trace.
+ *
+ * The file is flushed after each message sent, so a trace cut short by a
+ * crash ends at the beginning of an exchange.
+ *
+ * \param type      WireSent or WireReceived.
+ * \param portName  The port.
+ * \param data      The bytes.
+ * \param size      Number of bytes.
+ */
+void WireCapture::record(const WireRecordType type, const QString &portName, const char *data, const qint64 size)
+{
+    if (!file.isOpen() || (size <= 0))
+        return;
+    const qint64 nsecs = clock.nsecsElapsed();
+    if (!portNumbers.contains(portName))
+    {
+        quint8 number = (quint8)portNumbers.size();
+        portNumbers.insert(portName, number);
+        stream << (quint8)WirePort << number << nsecs << portName.toUtf8();
+    }
+    stream << (quint8)type << portNumbers.value(portName) << nsecs << QByteArray(data, (int)size);
+    records++;
+    if (type == WireSent)
+        file.flush();
+}
+
+void WireCapture::close()
+{
+    if (!file.isOpen())
+        return;
+    file.close();
+    qInfo("Captured %lld records of serial line traffic to %s.", records, qUtf8Printable(file.fileName()));
+}
+
+ReplaySerialPort::ReplaySerialPort(const QString &deviceName, const double speed)
+    : next(0)
+    , replaySpeed(speed)
+    , anchorTraceNSecs(0)
+    , anchorRealNSecs(0)
+    , skippedNSecs(0)
+    , messagesSent(0)
+    , mismatches(0)
+    , bytesDelivered(0)
+    , bytesPassedOver(0)
+{
+    setPortName(deviceName);
+    realClock.start();
+    ReplayPorts.append(this);
+}
+
+ReplaySerialPort::~ReplaySerialPort()
+{
+    ReplayPorts.removeAll(this);
+    close();
+}
+
+void ReplaySerialPort::setTrace(const QList<WireEvent> &events)
+{
+    trace = events;
+    next = 0;
+    available.clear();
+}
+
+/*!
+ * \brief ReplaySerialPort::open -- Open the port for reading and writing; no device is opened.
+ * \param mode  Mode to open in.
+ * \return true.
+ */
+bool ReplaySerialPort::open(OpenMode mode)
+{
+    realClock.start();
+    anchorRealNSecs = 0;
+    return QIODevice::open(mode | QIODevice::Unbuffered);
+}
+
+void ReplaySerialPort::close()
+{
+    if (isOpen())
+        QIODevice::close();
+}
+
+/*!
+ * \brief ReplaySerialPort::traceNow -- The time in the trace that corresponds to now.
+ *
+ * Trace time runs from the last message sent, at replaySpeed times real time
+ * (at real time when waits are skipped), plus the waits skipped.
+ *
+ * \return Nsec since the capture began.
+ */
+qint64 ReplaySerialPort::traceNow() const
+{
+    const double rate = (replaySpeed > 0) ? replaySpeed : 1.0;
+    return anchorTraceNSecs + (qint64)((realClock.nsecsElapsed() - anchorRealNSecs) * rate) + skippedNSecs;
+}
+
+/*!
+ * \brief ReplaySerialPort::deliverDue -- Make readable the bytes received by now in trace time.
+ */
+void ReplaySerialPort::deliverDue() const
+{
+    const qint64 now = traceNow();
+    while ((next < trace.size()) && (trace[next].type == WireReceived) && (trace[next].nsecs <= now))
+    {
+        available.append(trace[next].data);
+        bytesDelivered += trace[next].data.size();
+        next++;
+    }
+}
+
+/*!
+ * \brief ReplaySerialPort::nextReceiveNSecs -- When the next bytes are received.
+ * \return Nsec since the capture began, or -1 if the meter sent nothing more before the next message sent.
+ */
+qint64 ReplaySerialPort::nextReceiveNSecs() const
+{
+    if ((next < trace.size()) && (trace[next].type == WireReceived))
+        return trace[next].nsecs;
+    return -1;
+}
+
+/*!
+ * \brief ReplaySerialPort::sleepTrace -- Let some trace time pass.
+ * \param nsecs     Trace time to pass.
+ */
+void ReplaySerialPort::sleepTrace(const qint64 nsecs)
+{
+    if (nsecs <= 0)
+        return;
+    if (replaySpeed > 0)
+        QThread::usleep((unsigned long)(nsecs / replaySpeed / 1000));
+    else
+        skippedNSecs += nsecs;
+}
+
+/*!
+ * \brief ReplaySerialPort::pause -- Pause the program for some trace time; none if waits are skipped.
+ * \param usecs     Trace time to pause.
+ */
+void ReplaySerialPort::pause(const qint64 usecs)
+{
+    sleepTrace(usecs * 1000ll);
+}
+
+qint64 ReplaySerialPort::bytesAvailable() const
+{
+    deliverDue();
+    return available.size() + QIODevice::bytesAvailable();
+}
+
+/*!
+ * \brief ReplaySerialPort::waitForReadyRead -- Wait for bytes as the captured port did.
+ *
+ * If the trace shows bytes arriving within msecs of now, waits till then and
+ * makes them readable; otherwise waits msecs and times out.
+ *
+ * \param msecs     Longest time to wait, in trace time.
+ * \return true if bytes are readable, false otherwise.
+ */
+bool ReplaySerialPort::waitForReadyRead(int msecs)
+{
+    deliverDue();
+    if (!available.isEmpty())
+        return true;
+    const qint64 due = nextReceiveNSecs();
+    const qint64 limit = msecs * 1000000ll;
+    if ((due >= 0) && ((due - traceNow()) <= limit))
+    {
+        sleepTrace(due - traceNow());
+        /* The sleep may end a little early; the bytes are due regardless. */
+        available.append(trace[next].data);
+        bytesDelivered += trace[next].data.size();
+        next++;
+        deliverDue();
+        return true;
+    }
+    sleepTrace(limit);
+    return false;
+}
+
+bool ReplaySerialPort::waitForBytesWritten(int msecs)
+{
+    Q_UNUSED(msecs);
+    return true;
+}
+
+qint64 ReplaySerialPort::readData(char *data, qint64 maxSize)
+{
+    deliverDue();
+    const qint64 count = qMin(maxSize, (qint64)available.size());
+    memcpy(data, available.constData(), count);
+    available.remove(0, (int)count);
+    return count;
+}
+
+/*!
+ * \brief ReplaySerialPort::writeData -- Take the place of the next message sent in the trace.
+ *
+ * Bytes the trace shows received before that message, which the program
+ * did not wait for this time, are passed over.
+ *
+ * \param data      The message.
+ * \param maxSize   Its size.
+ * \return maxSize.
+ */
+qint64 ReplaySerialPort::writeData(const char *data, qint64 maxSize)
+{
+    messagesSent++;
+    while ((next < trace.size()) && (trace[next].type != WireSent))
+        bytesPassedOver += trace[next++].data.size();
+    if (next >= trace.size())
+    {
+        qDebug("Trace of %s used up; message not answered.", qUtf8Printable(portName()));
+        return maxSize;
+    }
+    const WireEvent &sent = trace[next++];
+    if (sent.data != QByteArray(data, (int)maxSize))
+    {
+        mismatches++;
+        qWarning("Message to %s differs from the trace: %s instead of %s.", qUtf8Printable(portName())
+                 , qUtf8Printable(QByteArray(data, (int)maxSize).toHex()), qUtf8Printable(sent.data.toHex()));
+    }
+    anchorTraceNSecs = sent.nsecs;
+    anchorRealNSecs = realClock.nsecsElapsed();
+    skippedNSecs = 0;
+    return maxSize;
+}
+
+/*!
+ * \brief ReplaySerialPort::finished -- Whether the trace is used up.
+ * \return true if every byte of the trace has been replayed, false otherwise.
+ */
+bool ReplaySerialPort::finished() const
+{
+    return (next >= trace.size()) && available.isEmpty();
+}
+
+QString ReplaySerialPort::statistics() const
+{
+    return QString("Replay of %1: %2 of %3 events, %4 messages sent (%5 differ from the trace), %6 bytes received, %7 passed over.")
+            .arg(portName()).arg(next).arg(trace.size()).arg(messagesSent).arg(mismatches)
+            .arg(bytesDelivered).arg(bytesPassedOver);
+}
+
+/*!
+ * \brief LoadWireReplay -- Read a trace file to replay in place of the serial ports.
+ * \param fileName  The trace file.
+ * \param speed     Trace time per real time; 0 for no delays.
+ * \return true if successful, false otherwise.
+ */
+bool LoadWireReplay(const QString &fileName, const double speed)
+{
+    qDebug("Begin");
+    QFile file(fileName);
+    if (!file.open(QIODevice::ReadOnly))
+    {
+        qCritical("Unable to open replay file %s:  %s", qUtf8Printable(fileName), qUtf8Printable(file.errorString()));
+        qDebug("Return false");
+        return false;
+    }
+    QDataStream stream(&file);
+    stream.setVersion(QDataStream::Qt_5_0);
+    char magic[sizeof(WireTraceMagic)];
+    quint8 version = 0;
+    qint64 startMSecs = 0;
+    if ((stream.readRawData(magic, sizeof(magic)) != sizeof(magic)) || (memcmp(magic, WireTraceMagic, sizeof(magic)) != 0))
+    {
+        qCritical("%s is not a serial line trace.", qUtf8Printable(fileName));
+        qDebug("Return false");
+        return false;
+    }
+    stream >> version >> startMSecs;
+    if (version != WireTraceVersion)
+    {
+        qCritical("Trace %s is version %d; only version %d is understood.", qUtf8Printable(fileName), version, WireTraceVersion);
+        qDebug("Return false");
+        return false;
+    }
+    QHash<quint8, QString> portNames;
+    int events = 0;
+    while (!stream.atEnd())
+    {
+        quint8 type, number;
+        WireEvent event;
+        stream >> type >> number >> event.nsecs >> event.data;
+        if (stream.status() != QDataStream::Ok)
+        {
+            qWarning("Trace %s is cut short after %d events.", qUtf8Printable(fileName), events);
+            break;
+        }
+        if (type == WirePort)
+        {
+            portNames.insert(number, QString::fromUtf8(event.data));
+            continue;
+        }
+        event.type = (WireRecordType)type;
+        ReplayTraces[portNames.value(number)].append(event);
+        events++;
+    }
+    ReplaySpeed = speed;
+    ReplayLoaded = true;
+    qInfo("Replaying %d events on %d ports captured %s, at %s."
+          , events, ReplayTraces.size()
+          , qUtf8Printable(QDateTime::fromMSecsSinceEpoch(startMSecs).toString(Qt::ISODate))
+          , (speed > 0) ? qUtf8Printable(QString("%1 times real time").arg(speed)) : "full speed");
+    qDebug("Return true");
+    return true;
+}
+
+bool WireReplayActive()
+{
+    return ReplayLoaded;
+}
+
+/*!
+ * \brief NewReplayPort -- A port playing back the trace of a serial device.
+ * \param deviceName    Name of the serial device.
+ * \return The port, not yet open; NULL if the trace has nothing for the device.
+ */
+ReplaySerialPort *NewReplayPort(const QString &deviceName)
+{
+    ReplaySerialPort *port = new ReplaySerialPort(deviceName, ReplaySpeed);
+    if (!ReplayTraces.contains(port->portName()))
+    {
+        qCritical("The replay trace has no traffic for %s.", qUtf8Printable(deviceName));
+        delete port;
+        return NULL;
+    }
+    port->setTrace(ReplayTraces.value(port->portName()));
+    return port;
+}
+
+/*!
+ * \brief WireReplayFinished -- Whether every port being replayed has used up its trace.
+ * \return true if so, false otherwise or if nothing is being replayed.
+ */
+bool WireReplayFinished()
+{
+    if (ReplayPorts.isEmpty())
+        return false;
+    foreach (const ReplaySerialPort *port, ReplayPorts)
+        if (!port->finished())
+            return false;
+    return true;
+}
+
+void ReportWireReplay()
+{
+    foreach (const ReplaySerialPort *port, ReplayPorts)
+        qInfo("%s", qUtf8Printable(port->statistics()));
+}
+
+/*!
+ * \brief IsReplayPort -- Whether a port plays back a trace.
+ *
+ * Such a port has no device, so QSerialPort::clear() fails on it; bytes not
+ * read are passed over when the next message is written instead.
+ *
+ * \param serialPort    The port.
+ * \return true if it is a ReplaySerialPort, false otherwise.
+ */
+bool IsReplayPort(const QSerialPort *serialPort)
+{
+    foreach (const ReplaySerialPort *replay, ReplayPorts)
+        if (replay == serialPort)
+            return true;
+    return false;
+}
+
+/*!
+ * \brief PauseSerialUSecs -- Pause while reading a port; scaled by --replay-speed if the port is replayed.
+ * \param serialPort    The port.
+ * \param usecs         Time to pause.
+ */
+void PauseSerialUSecs(QSerialPort *serialPort, const qint64 usecs)
+{
+    foreach (ReplaySerialPort *replay, ReplayPorts)
+    {
+        if (replay == serialPort)
+        {
+            replay->pause(usecs);
+            return;
+        }
+    }
+    PauseUSecs(usecs);
+}
@@ -0,0 +1,151 @@
+/*!
+@file
+@brief Header file describing capture of serial line traffic, and its replay.
+
+With --capture <file> every byte sent and received on each serial port is
+written to a trace file with the time, in nanoseconds since the capture
+began, at which it was written or read.  The file is a QDataStream:
+
+    "EKMWIRE" '\0'   magic, 8 bytes
+    quint8           WireTraceVersion
+    qint64           wall clock time the capture began, msec since the epoch
+
+followed by records of
+
+    quint8           WirePort, WireSent or WireReceived
+    quint8           port number, assigned in order of first use
+    qint64           nsec since the capture began
+    QByteArray       the port name (WirePort) or the bytes
+
+With --replay <file> the serial ports are not opened; each is a
+ReplaySerialPort that plays back the trace of the port of the same name.
+A message written to it takes the place of the next message sent in the
+trace, and the bytes received after that one become readable at the same
+delays as they were read when captured, divided by --replay-speed (0 to
+skip the waits altogether).  The program's own pauses while reading a
+response from a replayed port (PauseSerialUSecs()) are scaled the same way.
+A wait for bytes that the trace shows arriving later than the wait would
+last times out as it did when captured, so timeouts, partial reads and slow
+meters are reproduced.  Messages that differ from the trace are counted.
+
+The program stops reading meters when every replayed trace is used up.
+
+@author Thomas A. DeMay
+@date 2015
+@par    Copyright (C) 2015  Thomas A. DeMay
+@par
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    any later version.
+@par
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+@par
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#ifndef WIRETRACE_H
+#define WIRETRACE_H
+#include <QtCore>
+#include <QtSerialPort>
+
+static const char WireTraceMagic[8] = {'E', 'K', 'M', 'W', 'I', 'R', 'E', '\0'};   //!< First bytes of a trace file.
+static const quint8 WireTraceVersion = 1;           //!< Format of trace files written.
+
+typedef enum
+{
+    WirePort,               //!< Names a port number.
+    WireSent,               //!< Bytes written to the port.
+    WireReceived            //!< Bytes read from the port.
+} WireRecordType;
+
+typedef struct
+{
+    WireRecordType type;    //!< WireSent or WireReceived.
+    qint64 nsecs;           //!< Time since the capture began.
+    QByteArray data;        //!< The bytes.
+} WireEvent;
+
+/*!
+ * \brief The WireCapture class -- Writes the traffic on the serial ports to a trace file.
+ */
+class WireCapture
+{
+public:
+    WireCapture();
+    ~WireCapture();
+
+    bool open(const QString &fileName);
+    bool isOpen() const;
+    void record(const WireRecordType type, const QString &portName, const char *data, const qint64 size);
+    void close();
+
+private:
+    QFile file;                         //!< The trace file.
+    QDataStream stream;                 //!< Writes the trace file.
+    QElapsedTimer clock;                //!< Started when the capture began.
+    QHash<QString, quint8> portNumbers; //!< Number of each port named so far.
+    qint64 records;                     //!< Records written.
+};
+
+/*!
+ * \brief The ReplaySerialPort class -- A serial port that plays back a captured trace.
+ */
+class ReplaySerialPort : public QSerialPort
+{
+public:
+    ReplaySerialPort(const QString &deviceName, const double speed);
+    ~ReplaySerialPort();
+
+    void setTrace(const QList<WireEvent> &events);
+
+    bool open(OpenMode mode) Q_DECL_OVERRIDE;
+    void close() Q_DECL_OVERRIDE;
+    qint64 bytesAvailable() const Q_DECL_OVERRIDE;
+    bool waitForReadyRead(int msecs) Q_DECL_OVERRIDE;
+    bool waitForBytesWritten(int msecs) Q_DECL_OVERRIDE;
+
+    void pause(const qint64 usecs);
+    bool finished() const;
+    QString statistics() const;
+
+protected:
+    qint64 readData(char *data, qint64 maxSize) Q_DECL_OVERRIDE;
+    qint64 writeData(const char *data, qint64 maxSize) Q_DECL_OVERRIDE;
+
+private:
+    qint64 traceNow() const;
+    void deliverDue() const;
+    qint64 nextReceiveNSecs() const;
+    void sleepTrace(const qint64 nsecs);
+
+    QList<WireEvent> trace;             //!< Traffic of this port.
+    mutable int next;                   //!< Next event of the trace.
+    mutable QByteArray available;       //!< Bytes received and not yet read.
+    double replaySpeed;                 //!< Trace time per real time; 0 for no delays.
+    QElapsedTimer realClock;            //!< Started when the port is opened.
+    qint64 anchorTraceNSecs;            //!< Trace time of the last message sent ...
+    qint64 anchorRealNSecs;             //!< ... and the real time it was written.
+    qint64 skippedNSecs;                //!< Trace time waited without delay since then.
+    qint64 messagesSent;                //!< Messages written.
+    qint64 mismatches;                  //!< Messages written that differ from the trace.
+    mutable qint64 bytesDelivered;      //!< Bytes made readable.
+    qint64 bytesPassedOver;             //!< Bytes in the trace never made readable.
+};
+
+extern WireCapture WireCap;             //!< Capture of the serial line traffic, if open.
+
+bool LoadWireReplay(const QString &fileName, const double speed);
+bool WireReplayActive();
+ReplaySerialPort *NewReplayPort(const QString &deviceName);
+bool WireReplayFinished();
+void ReportWireReplay();
+bool IsReplayPort(const QSerialPort *serialPort);
+void PauseSerialUSecs(QSerialPort *serialPort, const qint64 usecs);
+
+#endif // WIRETRACE_H